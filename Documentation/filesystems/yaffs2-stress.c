@@ -0,0 +1,567 @@
+/*
+ * yaffs2-stress.c - multi-threaded stress test for yaffs2
+ *
+ * Runs large writers, readers, lookup/stat threads and namespace changes
+ * (create, link, rename, unlink) at the same time in a directory on a
+ * mounted yaffs2 file system. All data read back is checked, and the worst
+ * read and lookup latencies are reported: with the per object and shared
+ * locks these should not grow to the length of a large write.
+ *
+ * With -l it times name lookups instead, in directories of 10, 1000 and
+ * 10000 entries. The dentry cache is dropped before each pass, so every
+ * stat() goes down to yaffs_lookup(); with the directory name index the
+ * cost per lookup should hardly change with the directory size. This
+ * needs root for /proc/sys/vm/drop_caches.
+ *
+ * Build: gcc -O2 -Wall -pthread -o yaffs2-stress yaffs2-stress.c
+ * Usage: yaffs2-stress <dir> [seconds] [threads of each kind]
+ *        yaffs2-stress -l <dir>
+ *
+ * Returns 0 if no errors were seen.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define NSTABLE		64	/* more than the name hash threshold */
+#define STABLE_MAX	(96 * 1024)
+#define BIG_SIZE	(4 * 1024 * 1024)
+#define IO_SIZE		(64 * 1024)
+#define MAX_THREADS	16
+
+static char top[1024];
+static volatile int stop;
+static volatile int errors;
+
+enum { WRITER, READER, LOOKUP, NAMES, NKINDS };
+
+static const char *kind_name[NKINDS] = {
+	"writer", "reader", "lookup", "names"
+};
+
+struct worker {
+	pthread_t thread;
+	int kind;
+	int id;
+	unsigned seed;
+	unsigned long ops;
+	double max_ms;
+};
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void note(struct worker *w, double start)
+{
+	double ms = now_ms() - start;
+
+	w->ops++;
+	if (ms > w->max_ms)
+		w->max_ms = ms;
+}
+
+static void fail(const char *what, const char *path)
+{
+	fprintf(stderr, "yaffs2-stress: %s %s: %s\n", what, path,
+		errno ? strerror(errno) : "bad data");
+	errors++;
+	stop = 1;
+}
+
+static unsigned char pattern(unsigned key, long off)
+{
+	return (unsigned char)(off * 7 + key * 131 + (off >> 12));
+}
+
+static void fill(unsigned char *buf, unsigned key, long off, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		buf[i] = pattern(key, off + i);
+}
+
+static int check(const unsigned char *buf, unsigned key, long off, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (buf[i] != pattern(key, off + i))
+			return -1;
+	}
+	return 0;
+}
+
+static long stable_size(int i)
+{
+	return (i * 1531L) % STABLE_MAX;
+}
+
+static int write_file(const char *path, unsigned key, long size, int flags)
+{
+	unsigned char *buf = malloc(IO_SIZE);
+	long off;
+	int fd;
+	int n;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | flags, 0644);
+	if (fd < 0 || !buf) {
+		free(buf);
+		return -1;
+	}
+
+	for (off = 0; off < size && !stop; off += n) {
+		n = size - off > IO_SIZE ? IO_SIZE : size - off;
+		fill(buf, key, off, n);
+		if (write(fd, buf, n) != n)
+			break;
+	}
+	free(buf);
+
+	if (off < size && !stop) {
+		close(fd);
+		return -1;
+	}
+	if (fsync(fd) < 0) {
+		close(fd);
+		return -1;
+	}
+	return close(fd);
+}
+
+/* Reads a file back through the file system, not the page cache */
+static int verify_file(const char *path, unsigned key, long size)
+{
+	unsigned char *buf = malloc(IO_SIZE);
+	struct stat st;
+	long off;
+	int fd;
+	int n;
+
+	errno = 0;
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || !buf || fstat(fd, &st) < 0) {
+		free(buf);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+	for (off = 0; off < size; off += n) {
+		n = read(fd, buf, IO_SIZE);
+		if (n <= 0 || check(buf, key, off, n))
+			break;
+	}
+	free(buf);
+	close(fd);
+
+	if (st.st_size != size || off != size) {
+		errno = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/* Writes one big file over and over, checking it after each pass */
+static void *writer(void *arg)
+{
+	struct worker *w = arg;
+	char path[1100];
+	unsigned gen = w->id * 1000;
+
+	snprintf(path, sizeof(path), "%s/big%d", top, w->id);
+	while (!stop) {
+		gen++;
+		if (write_file(path, gen, BIG_SIZE, 0) < 0) {
+			if (!stop)
+				fail("write", path);
+			break;
+		}
+		if (!stop && verify_file(path, gen, BIG_SIZE) < 0) {
+			fail("verify", path);
+			break;
+		}
+		w->ops++;
+	}
+	return NULL;
+}
+
+static void *reader(void *arg)
+{
+	struct worker *w = arg;
+	char path[1100];
+	double start;
+	int i;
+
+	while (!stop) {
+		i = rand_r(&w->seed) % NSTABLE;
+		snprintf(path, sizeof(path), "%s/stable/s%03d", top, i);
+		start = now_ms();
+		if (verify_file(path, i, stable_size(i)) < 0) {
+			fail("read", path);
+			break;
+		}
+		note(w, start);
+	}
+	return NULL;
+}
+
+/* Looks up and stats names that exist and names that don't, and lists the
+ * directory now and then.
+ */
+static void *lookup(void *arg)
+{
+	struct worker *w = arg;
+	char path[1100];
+	struct stat st;
+	struct dirent *de;
+	double start;
+	DIR *d;
+	int n;
+	int i;
+
+	while (!stop) {
+		i = rand_r(&w->seed) % NSTABLE;
+		snprintf(path, sizeof(path), "%s/stable/s%03d", top, i);
+		start = now_ms();
+		if (stat(path, &st) < 0 || st.st_size != stable_size(i)) {
+			fail("stat", path);
+			break;
+		}
+		note(w, start);
+
+		snprintf(path, sizeof(path), "%s/stable/missing%03d", top, i);
+		start = now_ms();
+		errno = 0;
+		if (stat(path, &st) == 0 || errno != ENOENT) {
+			fail("negative lookup", path);
+			break;
+		}
+		note(w, start);
+
+		if (rand_r(&w->seed) % 64)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/stable", top);
+		d = opendir(path);
+		if (!d) {
+			fail("opendir", path);
+			break;
+		}
+		n = 0;
+		while ((de = readdir(d)) != NULL)
+			n += (de->d_name[0] == 's');
+		closedir(d);
+		if (n != NSTABLE) {
+			errno = 0;
+			fail("readdir", path);
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Creates, hard links, renames and removes small files */
+static void *names(void *arg)
+{
+	struct worker *w = arg;
+	char made[1100];
+	char linked[1100];
+	char renamed[1100];
+	unsigned key;
+	long size;
+	double start;
+
+	snprintf(made, sizeof(made), "%s/churn/c%d", top, w->id);
+	snprintf(linked, sizeof(linked), "%s/churn/l%d", top, w->id);
+	snprintf(renamed, sizeof(renamed), "%s/churn/r%d", top, w->id);
+
+	while (!stop) {
+		key = rand_r(&w->seed);
+		size = key % 20000;
+		start = now_ms();
+		if (write_file(made, key, size, O_EXCL) < 0) {
+			fail("create", made);
+			break;
+		}
+		if (link(made, linked) < 0) {
+			fail("link", linked);
+			break;
+		}
+		if (rename(made, renamed) < 0) {
+			fail("rename", renamed);
+			break;
+		}
+		if (verify_file(linked, key, size) < 0 ||
+		    verify_file(renamed, key, size) < 0) {
+			fail("verify", renamed);
+			break;
+		}
+		if (unlink(renamed) < 0 || unlink(linked) < 0) {
+			fail("unlink", linked);
+			break;
+		}
+		note(w, start);
+	}
+	return NULL;
+}
+
+static int drop_caches(void)
+{
+	int fd;
+
+	sync();
+	fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (fd < 0)
+		return -1;
+	if (write(fd, "2", 1) != 1) {
+		close(fd);
+		return -1;
+	}
+	return close(fd);
+}
+
+/* Times one uncached stat() of each entry of a directory of n entries,
+ * plus as many lookups of names that are not there.
+ */
+static int lookup_bench(int n)
+{
+	char dir[1100];
+	char path[1200];
+	struct stat st;
+	double start, hit_us, miss_us;
+	int fd;
+	int i;
+
+	snprintf(dir, sizeof(dir), "%s/lookup%d", top, n);
+	if (mkdir(dir, 0755) < 0) {
+		fail("mkdir", dir);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/entry%05d", dir, i);
+		fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd < 0) {
+			fail("create", path);
+			return -1;
+		}
+		close(fd);
+	}
+
+	if (drop_caches() < 0) {
+		fail("drop caches", dir);
+		return -1;
+	}
+	start = now_ms();
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/entry%05d", dir, i);
+		if (stat(path, &st) < 0) {
+			fail("stat", path);
+			return -1;
+		}
+	}
+	hit_us = (now_ms() - start) * 1000.0 / n;
+
+	if (drop_caches() < 0) {
+		fail("drop caches", dir);
+		return -1;
+	}
+	start = now_ms();
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/missing%05d", dir, i);
+		errno = 0;
+		if (stat(path, &st) == 0 || errno != ENOENT) {
+			fail("negative lookup", path);
+			return -1;
+		}
+	}
+	miss_us = (now_ms() - start) * 1000.0 / n;
+
+	printf("%6d entries: %8.1f us per lookup, %8.1f us per miss\n",
+	       n, hit_us, miss_us);
+
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/entry%05d", dir, i);
+		unlink(path);
+	}
+	rmdir(dir);
+	return 0;
+}
+
+static int lookup_main(const char *where)
+{
+	static const int sizes[] = { 10, 1000, 10000 };
+	unsigned i;
+
+	snprintf(top, sizeof(top), "%s/yaffs2-lookup.%d", where,
+		 (int)getpid());
+	if (mkdir(top, 0755) < 0) {
+		fail("mkdir", top);
+		return 1;
+	}
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && !errors; i++)
+		lookup_bench(sizes[i]);
+	rmdir(top);
+
+	printf("%s\n", errors ? "FAILED" : "passed");
+	return errors ? 1 : 0;
+}
+
+static void *(*kind_fn[NKINDS])(void *) = {
+	writer, reader, lookup, names
+};
+
+static int make_dir(const char *name)
+{
+	char path[1100];
+
+	snprintf(path, sizeof(path), "%s/%s", top, name);
+	if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+		fail("mkdir", path);
+		return -1;
+	}
+	return 0;
+}
+
+static void clean_up(void)
+{
+	char path[1100];
+	int i;
+
+	for (i = 0; i < NSTABLE; i++) {
+		snprintf(path, sizeof(path), "%s/stable/s%03d", top, i);
+		unlink(path);
+	}
+	for (i = 0; i < MAX_THREADS; i++) {
+		snprintf(path, sizeof(path), "%s/big%d", top, i);
+		unlink(path);
+		snprintf(path, sizeof(path), "%s/churn/c%d", top, i);
+		unlink(path);
+		snprintf(path, sizeof(path), "%s/churn/l%d", top, i);
+		unlink(path);
+		snprintf(path, sizeof(path), "%s/churn/r%d", top, i);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/stable", top);
+	rmdir(path);
+	snprintf(path, sizeof(path), "%s/churn", top);
+	rmdir(path);
+	rmdir(top);
+}
+
+int main(int argc, char **argv)
+{
+	static struct worker workers[NKINDS * MAX_THREADS];
+	char path[1100];
+	int seconds = 60;
+	int nthreads = 2;
+	int nworkers = 0;
+	unsigned long ops;
+	double max_ms;
+	int i;
+	int k;
+
+	if (argc == 3 && !strcmp(argv[1], "-l"))
+		return lookup_main(argv[2]);
+	if (argc < 2 || argv[1][0] == '-') {
+		fprintf(stderr,
+			"usage: %s <dir> [seconds] [threads of each kind]\n"
+			"       %s -l <dir>\n", argv[0], argv[0]);
+		return 2;
+	}
+	if (argc > 2)
+		seconds = atoi(argv[2]);
+	if (argc > 3)
+		nthreads = atoi(argv[3]);
+	if (nthreads < 1 || nthreads > MAX_THREADS) {
+		fprintf(stderr, "threads must be 1 to %d\n", MAX_THREADS);
+		return 2;
+	}
+
+	snprintf(top, sizeof(top), "%s/yaffs2-stress.%d", argv[1],
+		 (int)getpid());
+	if (mkdir(top, 0755) < 0) {
+		fail("mkdir", top);
+		return 1;
+	}
+	if (make_dir("stable") < 0 || make_dir("churn") < 0)
+		goto out;
+
+	for (i = 0; i < NSTABLE; i++) {
+		snprintf(path, sizeof(path), "%s/stable/s%03d", top, i);
+		if (write_file(path, i, stable_size(i), 0) < 0) {
+			fail("create", path);
+			goto out;
+		}
+	}
+
+	for (k = 0; k < NKINDS; k++) {
+		for (i = 0; i < nthreads; i++) {
+			struct worker *w = &workers[nworkers];
+
+			w->kind = k;
+			w->id = i;
+			w->seed = (k + 1) * 7919 + i;
+			if (pthread_create(&w->thread, NULL, kind_fn[k], w)) {
+				fprintf(stderr, "pthread_create failed\n");
+				stop = 1;
+				errors++;
+				break;
+			}
+			nworkers++;
+		}
+	}
+
+	for (i = 0; i < seconds * 10 && !stop; i++)
+		usleep(100000);
+	stop = 1;
+
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	for (k = 0; k < NKINDS; k++) {
+		ops = 0;
+		max_ms = 0;
+		for (i = 0; i < nworkers; i++) {
+			if (workers[i].kind != k)
+				continue;
+			ops += workers[i].ops;
+			if (workers[i].max_ms > max_ms)
+				max_ms = workers[i].max_ms;
+		}
+		if (k == WRITER)
+			printf("%-8s %8lu passes of %d KiB\n", kind_name[k],
+			       ops, BIG_SIZE / 1024);
+		else
+			printf("%-8s %8lu ops, worst %.1f ms\n", kind_name[k],
+			       ops, max_ms);
+	}
+
+	/* Everything that was only read must still be intact */
+	for (i = 0; i < NSTABLE && !errors; i++) {
+		snprintf(path, sizeof(path), "%s/stable/s%03d", top, i);
+		if (verify_file(path, i, stable_size(i)) < 0)
+			fail("final verify", path);
+	}
+
+out:
+	clean_up();
+	printf("%s\n", errors ? "FAILED" : "passed");
+	return errors ? 1 : 0;
+}
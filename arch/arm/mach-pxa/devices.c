@@ -116,6 +116,7 @@ struct platform_device pxa27x_device_udc = {
 	.dev		=  {
 		.platform_data	= &pxa_udc_info,
 		.dma_mask	= &udc_dma_mask,
+		.coherent_dma_mask = 0xffffffff,
 	}
 };
 
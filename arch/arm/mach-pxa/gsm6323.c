@@ -14,6 +14,7 @@
 
 #include <linux/kernel.h>
 #include <linux/init.h>
+#include <linux/moduleparam.h>
 #include <linux/version.h>
 #include <linux/platform_device.h>
 #include <linux/delay.h>
@@ -152,6 +153,8 @@ static unsigned long gsm6323_pin_config[] __initdata = {
 	GPIO30_AC97_SDATA_OUT,
 	GPIO31_AC97_SYNC,
 	GPIO98_AC97_SYSCLK,
+	/* held high in sleep so the codec keeps call audio paths */
+	MFP_CFG_OUT(GPIO113, AF2, DRIVE_HIGH),	/* AC97 nRESET */
 
 	/* LCD */
 	GPIO58_LCD_LDD_0,
@@ -323,7 +326,11 @@ static void gsm6323_lcd_write_cmd(struct ssp_device *ssp_lcd, u32 cmd) {
 	} while (tmp);
 }
 
+/* read by the battery load model */
+static int gsm6323_lcd_on;
+
 static void gsm6323_lcd_power(int on, struct fb_var_screeninfo *si) {
+	gsm6323_lcd_on = on;
 	if (on) {
 #if 0
 		gpio_set_value(GPIO89_GSM6323_LCD_EN, 0);
@@ -507,6 +514,32 @@ static void gsm6323_battery_critical(void)
 #endif
 }
 
+/*
+ * Load the fuel gauge cannot see by itself: the panel with its
+ * backlight, and the GSM modem, which stays powered and registered
+ * with no state visible to the kernel.
+ */
+static int gsm6323_battery_load(void)
+{
+	return (gsm6323_lcd_on ? 90 : 0) + 8;
+}
+
+/* typical Li-ion open circuit voltage curve */
+static struct da9030_ocv gsm6323_ocv_table[] = {
+	{ 4180, 100 },
+	{ 4080, 90 },
+	{ 3990, 80 },
+	{ 3920, 70 },
+	{ 3860, 60 },
+	{ 3810, 50 },
+	{ 3780, 40 },
+	{ 3760, 30 },
+	{ 3730, 20 },
+	{ 3690, 10 },
+	{ 3610, 5 },
+	{ 3400, 0 },
+};
+
 static struct power_supply_info gsm6323_psy_info = {
 	.name = "battery",
 	.technology = POWER_SUPPLY_TECHNOLOGY_LION,
@@ -535,6 +568,18 @@ static struct da9030_battery_info gsm6323_batterty_info = {
 	.tbat_restart = 100,
 
 	.batmon_interval = 0,
+	.event_driven = 1,
+	.batmon_idle_interval = 60,
+
+	.capacity_mAh = 1200,
+	.internal_mohm = 200,
+	.ocv_table = gsm6323_ocv_table,
+	.ocv_table_size = ARRAY_SIZE(gsm6323_ocv_table),
+
+	.load_base_mA = 25,
+	.load_cpu_uA_per_MHz = 300,
+	.load_sleep_mA = 4,
+	.load_extra_mA = gsm6323_battery_load,
 
 	.battery_low = gsm6323_battery_low,
 	.battery_critical = gsm6323_battery_critical,
@@ -576,6 +621,7 @@ static struct da903x_subdev_info gsm6323_da9030_subdevs[] = {
 static struct da903x_platform_data gsm6323_da9030_info = {
 	.num_subdevs = ARRAY_SIZE(gsm6323_da9030_subdevs),
 	.subdevs = gsm6323_da9030_subdevs,
+	.irq_base = IRQ_BOARD_START,
 };
 
 static struct i2c_board_info gsm6323_pwr_i2c_board_info[] __initdata = {
@@ -603,9 +649,22 @@ static int gsm6323_mci_init(struct device *dev,
 	}
 	return 0;
 }
+
+/*
+ * Sampled across suspend: while it is unchanged the card is kept and
+ * only powered up again on first use.
+ */
+static int gsm6323_mci_get_cd_state(struct device *dev)
+{
+	return gpio_get_value(GPIO99_GSM6323_MMC_DETECT);
+}
+
 static struct pxamci_platform_data gsm6323_mci_platform_data = {
 	.ocr_mask		= MMC_VDD_32_33 | MMC_VDD_33_34,
 	.init			= gsm6323_mci_init,
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 32)
+	.get_cd_state		= gsm6323_mci_get_cd_state,
+#endif
 #define DETECT_DELAY 200
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 32)
 	.detect_delay_ms	= DETECT_DELAY,
@@ -671,6 +730,11 @@ static struct platform_device gsm6323_card = {
 	.id = -1,
 };
 
+/* long periods for music playback with the screen off */
+static pxa2xx_audio_ops_t gsm6323_ac97_info = {
+	.playback_buffer_kb = 256,
+};
+
 static void wm97xx_irq_enable(struct wm97xx *wm, int enable)
 {
 	if (enable)
@@ -679,7 +743,113 @@ static void wm97xx_irq_enable(struct wm97xx *wm, int enable)
 		disable_irq_nosync(wm->pen_irq);
 }
 
+/*
+ * Continuous touch mode: the WM9713 streams X, Y and, if enabled,
+ * pressure through AC97 slot 5 into the modem-in FIFO, so a sample
+ * costs a few MODR reads rather than several codec register accesses.
+ */
+static const struct {
+	u8 code;	/* WM97XX_RATE() value */
+	u16 speed;	/* coordinates per second */
+} gsm6323_ts_rates[] = {
+	{0, 94},
+	{1, 120},
+	{2, 154},
+	{3, 188},
+};
+
+static int ts_rate = 188;
+module_param(ts_rate, int, 0444);
+MODULE_PARM_DESC(ts_rate, "Touchscreen sample rate in continuous mode (Hz)");
+
+static int ts_reads;
+static int ts_tries;
+static u16 ts_last;
+
+static void gsm6323_acc_pen_up(struct wm97xx *wm)
+{
+	schedule_timeout_uninterruptible(1);
+
+	while (MISR & MISR_FSR)
+		MODR;
+}
+
+static int gsm6323_acc_pen_down(struct wm97xx *wm)
+{
+	struct wm97xx_data data;
+	u16 x, y, p = 0x100 | WM97XX_ADCSEL_PRES;
+	int pressure = wm->dig[0] & WM9713_ADCSEL_PRES;
+	int reads = 0;
+
+	/* Let the FIFO fill up a bit, it has no useful level interrupt.
+	 * The pen irq thread already calls us once every sample period,
+	 * only the workqueue poller calls again at once on RC_AGAIN. */
+	if (!wm->pen_irq)
+		schedule_timeout_uninterruptible(1);
+
+	if (ts_tries > 5) {
+		ts_tries = 0;
+		return RC_PENUP;
+	}
+
+	x = MODR;
+	if (x == ts_last) {
+		ts_tries++;
+		return RC_AGAIN;
+	}
+	ts_last = x;
+
+	do {
+		if (reads)
+			x = MODR;
+		y = MODR;
+		if (pressure)
+			p = MODR;
+
+		/* drop out of step samples, the next call resyncs */
+		if ((x & WM97XX_ADCSRC_MASK) != WM97XX_ADCSEL_X ||
+		    (y & WM97XX_ADCSRC_MASK) != WM97XX_ADCSEL_Y ||
+		    (p & WM97XX_ADCSRC_MASK) != WM97XX_ADCSEL_PRES)
+			break;
+
+		ts_tries = 0;
+		data.x = x;
+		data.y = y;
+		data.p = p;
+		wm97xx_report_sample(wm, &data);
+		reads++;
+	} while (reads < ts_reads && (MISR & MISR_FSR));
+
+	return RC_PENDOWN | RC_AGAIN;
+}
+
+static int gsm6323_acc_startup(struct wm97xx *wm)
+{
+	int idx;
+
+	if (wm->id != WM9713_ID2)
+		return -ENODEV;
+
+	for (idx = 0; idx < ARRAY_SIZE(gsm6323_ts_rates) - 1; idx++)
+		if (ts_rate <= gsm6323_ts_rates[idx].speed)
+			break;
+
+	wm->acc_rate = gsm6323_ts_rates[idx].code;
+	wm->acc_slot = 5;
+	ts_reads = gsm6323_ts_rates[idx].speed / HZ + 1;
+	ts_tries = 0;
+	ts_last = 0;
+
+	dev_info(wm->dev, "continuous touch mode, %d samples/sec\n",
+		 gsm6323_ts_rates[idx].speed);
+	return 0;
+}
+
 static struct wm97xx_mach_ops gsm6323_wm9713_mach_ops = {
+	.acc_enabled = 1,
+	.acc_pen_up = gsm6323_acc_pen_up,
+	.acc_pen_down = gsm6323_acc_pen_down,
+	.acc_startup = gsm6323_acc_startup,
 	.irq_enable = wm97xx_irq_enable,
 	.irq_gpio = WM97XX_GPIO_2,
 };
@@ -889,7 +1059,7 @@ static void __init gsm6323_init(void)
 	pxa_set_keypad_info(&gsm6323_keypad_info);
 	pxa_set_mci_info(&gsm6323_mci_platform_data);
 	// pxa_set_ohci_info(&gsm6323_ohci_info);
-	pxa_set_ac97_info(NULL);
+	pxa_set_ac97_info(&gsm6323_ac97_info);
 	pxa_set_udc_info(&gsm6323_udc_info);
 }
 
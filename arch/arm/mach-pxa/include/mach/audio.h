@@ -9,6 +9,8 @@
  * @reset_gpio: AC97 reset gpio (normally gpio113 or gpio95)
  *              a -1 value means no gpio will be used for reset
  * @codec_pdata: AC97 codec platform_data
+ * @playback_buffer_kb: playback DMA buffer size in KiB, for deep-buffer
+ *                      periods; 0 keeps the default 128 KiB
 
  * reset_gpio should only be specified for pxa27x CPUs where a silicon
  * bug prevents correct operation of the reset line. If not specified,
@@ -23,6 +25,7 @@ typedef struct {
 	void *priv;
 	int reset_gpio;
 	void *codec_pdata[AC97_BUS_MAX_DEVICES];
+	int playback_buffer_kb;
 } pxa2xx_audio_ops_t;
 
 extern void pxa_set_ac97_info(pxa2xx_audio_ops_t *ops);
@@ -131,6 +131,8 @@
 #define IRQ_BOARD_END		(IRQ_BOARD_START + 32)
 #elif defined(CONFIG_PXA_EZX)
 #define IRQ_BOARD_END		(IRQ_BOARD_START + 23)
+#elif defined(CONFIG_MACH_GSM6323)
+#define IRQ_BOARD_END		(IRQ_BOARD_START + 24)
 #else
 #define IRQ_BOARD_END		(IRQ_BOARD_START + 16)
 #endif
@@ -12,6 +12,7 @@ struct pxamci_platform_data {
 	unsigned long detect_delay;		/* delay in jiffies before detecting cards after interrupt */
 	int (*init)(struct device *, irq_handler_t , void *);
 	int (*get_ro)(struct device *);
+	int (*get_cd_state)(struct device *);	/* card detect state, without gpio_card_detect */
 	void (*setpower)(struct device *, unsigned int);
 	void (*exit)(struct device *, void *);
 	int gpio_card_detect;			/* gpio detecting card insertion */
@@ -14,15 +14,28 @@
 #include <linux/module.h>
 #include <linux/suspend.h>
 #include <linux/errno.h>
+#include <linux/suspend_timeline.h>
 
+#include <mach/hardware.h>
 #include <mach/pm.h>
+#include <mach/regs-ost.h>
 
 struct pxa_cpu_pm_fns *pxa_cpu_pm_fns;
 static unsigned long *sleep_save;
 
+#ifdef CONFIG_SUSPEND_TIMELINE
+static u32 oscr_to_us(unsigned long ticks)
+{
+	return div_u64((u64)ticks * USEC_PER_SEC, get_clock_tick_rate());
+}
+#endif
+
 int pxa_pm_enter(suspend_state_t state)
 {
 	unsigned long sleep_save_checksum = 0, checksum = 0;
+#ifdef CONFIG_SUSPEND_TIMELINE
+	unsigned long enter_oscr = OSCR, wake_oscr;
+#endif
 	int i;
 
 #ifdef CONFIG_IWMMXT
@@ -39,10 +52,28 @@ int pxa_pm_enter(suspend_state_t state)
 			sleep_save_checksum += sleep_save[i];
 	}
 
+#ifdef CONFIG_SUSPEND_TIMELINE
+	suspend_timeline_add(STL_PLATFORM_SAVE, oscr_to_us(OSCR - enter_oscr),
+			     NULL);
+#endif
+
 	/* *** go zzz *** */
 	pxa_cpu_pm_fns->enter(state);
 	cpu_init();
 
+#ifdef CONFIG_SUSPEND_TIMELINE
+	/*
+	 * OSCR0 is reset by sleep mode and starts counting again when the
+	 * core comes out of reset, so it holds the time spent in the boot
+	 * ROM, the bootloader and the sleep.S resume path. Standby does not
+	 * reset the counter.
+	 */
+	wake_oscr = OSCR;
+	if (state != PM_SUSPEND_STANDBY)
+		suspend_timeline_add(STL_FIRMWARE_RESUME,
+				     oscr_to_us(wake_oscr), NULL);
+#endif
+
 	if (state != PM_SUSPEND_STANDBY) {
 		/* after sleeping, validate the checksum */
 		for (i = 0; i < pxa_cpu_pm_fns->save_count - 1; i++)
@@ -59,6 +90,11 @@ int pxa_pm_enter(suspend_state_t state)
 		pxa_cpu_pm_fns->restore(sleep_save);
 	}
 
+#ifdef CONFIG_SUSPEND_TIMELINE
+	suspend_timeline_add(STL_PLATFORM_RESTORE,
+			     oscr_to_us(OSCR - wake_oscr), NULL);
+#endif
+
 	pr_debug("*** made it back from resume\n");
 
 	return 0;
@@ -24,6 +24,7 @@
 #include <linux/pm_runtime.h>
 #include <linux/resume-trace.h>
 #include <linux/rwsem.h>
+#include <linux/suspend_timeline.h>
 #include <linux/interrupt.h>
 #include <linux/timer.h>
 
@@ -372,10 +373,13 @@ void dpm_resume_noirq(pm_message_t state)
 	transition_started = false;
 	list_for_each_entry(dev, &dpm_list, power.entry)
 		if (dev->power.status > DPM_OFF) {
+			ktime_t start = suspend_timeline_start();
 			int error;
 
 			dev->power.status = DPM_OFF;
 			error = device_resume_noirq(dev, state);
+			suspend_timeline_end(STL_DEV_RESUME_NOIRQ, start,
+					     dev->driver, error);
 			if (error)
 				pm_dev_err(dev, state, " early", error);
 		}
@@ -492,12 +496,16 @@ static void dpm_resume(pm_message_t state)
 
 		get_device(dev);
 		if (dev->power.status >= DPM_OFF) {
+			ktime_t start;
 			int error;
 
 			dev->power.status = DPM_RESUMING;
 			mutex_unlock(&dpm_list_mtx);
 
+			start = suspend_timeline_start();
 			error = device_resume(dev, state);
+			suspend_timeline_end(STL_DEV_RESUME, start,
+					     dev->driver, error);
 
 			mutex_lock(&dpm_list_mtx);
 			if (error)
@@ -652,7 +660,11 @@ int dpm_suspend_noirq(pm_message_t state)
 	suspend_device_irqs();
 	mutex_lock(&dpm_list_mtx);
 	list_for_each_entry_reverse(dev, &dpm_list, power.entry) {
+		ktime_t start = suspend_timeline_start();
+
 		error = device_suspend_noirq(dev, state);
+		suspend_timeline_end(STL_DEV_SUSPEND_NOIRQ, start,
+				     dev->driver, error);
 		if (error) {
 			pm_dev_err(dev, state, " late", error);
 			break;
@@ -728,13 +740,16 @@ static int dpm_suspend(pm_message_t state)
 	mutex_lock(&dpm_list_mtx);
 	while (!list_empty(&dpm_list)) {
 		struct device *dev = to_device(dpm_list.prev);
+		ktime_t start;
 
 		get_device(dev);
 		mutex_unlock(&dpm_list_mtx);
 
+		start = suspend_timeline_start();
 		dpm_drv_wdset(dev);
 		error = device_suspend(dev, state);
 		dpm_drv_wdclr(dev);
+		suspend_timeline_end(STL_DEV_SUSPEND, start, dev->driver, error);
 
 		mutex_lock(&dpm_list_mtx);
 		if (error) {
@@ -45,6 +45,8 @@
 #include <linux/interrupt.h>
 #include <linux/bitops.h>
 #include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/sched.h>
 #include <linux/wm97xx.h>
 #include <linux/uaccess.h>
 #include <linux/io.h>
@@ -83,6 +85,33 @@ static int abs_p[3] = {0, 150, 4};
 module_param_array(abs_p, int, NULL, 0);
 MODULE_PARM_DESC(abs_p, "Touchscreen absolute Pressure min, max, fuzz");
 
+/*
+ * Sample period while the pen is down. Sampling is driven from the pen
+ * interrupt thread and paced by an hrtimer, nothing runs while the pen
+ * is up.
+ */
+static int sample_us = 10000;
+
+/* anything shorter would keep the irq thread busy while the pen is down */
+#define WM97XX_SAMPLE_US_MIN	1000
+
+static int wm97xx_set_sample_us(const char *val, struct kernel_param *kp)
+{
+	long us;
+
+	if (strict_strtol(val, 0, &us) || us < WM97XX_SAMPLE_US_MIN ||
+	    us > INT_MAX)
+		return -EINVAL;
+
+	sample_us = us;
+	return 0;
+}
+
+module_param_call(sample_us, wm97xx_set_sample_us, param_get_int,
+		  &sample_us, 0644);
+MODULE_PARM_DESC(sample_us, "Touchscreen sample period while pen is down "
+		 "(us, at least 1000)");
+
 /*
  * wm97xx IO access, all IO locking done by AC97 layer
  */
@@ -278,12 +307,39 @@ void wm97xx_set_suspend_mode(struct wm97xx *wm, u16 mode)
 }
 EXPORT_SYMBOL_GPL(wm97xx_set_suspend_mode);
 
+static int wm97xx_read_samples(struct wm97xx *wm);
+
+/*
+ * Sample the touchscreen until the pen goes up, one read every sample_us.
+ * RC_AGAIN only tells the workqueue poller to call again at once, here
+ * the next call is always paced by the hrtimer: the continuous mode
+ * readers return it for as long as the pen is down.
+ */
+static void wm97xx_pen_down_reader(struct wm97xx *wm)
+{
+	ktime_t next = ktime_get();
+
+	do {
+		/* Data is not available immediately on pen down */
+		next = ktime_add_us(next, sample_us);
+		if (ktime_to_ns(ktime_sub(next, ktime_get())) < 0)
+			next = ktime_add_us(ktime_get(), sample_us);
+
+		set_current_state(TASK_UNINTERRUPTIBLE);
+		schedule_hrtimeout(&next, HRTIMER_MODE_ABS);
+
+		wm97xx_read_samples(wm);
+	} while (wm->pen_is_down);
+}
+
 /*
- * Handle a pen down interrupt.
+ * Handle a pen down interrupt. This runs in the pen irq thread. The line
+ * is not masked meanwhile: the pen GPIOs are edge triggered, and an edge
+ * that comes in while we run has the thread run again after we return.
  */
-static void wm97xx_pen_irq_worker(struct work_struct *work)
+static irqreturn_t wm97xx_pen_irq_thread(int irq, void *dev_id)
 {
-	struct wm97xx *wm = container_of(work, struct wm97xx, pen_event_work);
+	struct wm97xx *wm = dev_id;
 	int pen_was_down = wm->pen_is_down;
 
 	/* do we need to enable the touch panel reader */
@@ -320,61 +376,50 @@ static void wm97xx_pen_irq_worker(struct work_struct *work)
 	}
 
 	/* If the system is not using continuous mode or it provides a
-	 * pen down operation then we need to schedule polls while the
-	 * pen is down.  Otherwise the machine driver is responsible
-	 * for scheduling reads.
+	 * pen down operation then we sample here until the pen is up.
+	 * Otherwise the machine driver is responsible for scheduling
+	 * reads.
 	 */
 	if (!wm->mach_ops->acc_enabled || wm->mach_ops->acc_pen_down) {
-		if (wm->pen_is_down && !pen_was_down) {
-			/* Data is not availiable immediately on pen down */
-			queue_delayed_work(wm->ts_workq, &wm->ts_reader, 1);
-		}
-
-		/* Let ts_reader report the pen up for debounce. */
-		if (!wm->pen_is_down && pen_was_down)
-			wm->pen_is_down = 1;
+		if (wm->pen_is_down && !pen_was_down)
+			wm97xx_pen_down_reader(wm);
 	}
 
 	if (!wm->pen_is_down && wm->mach_ops->acc_enabled)
 		wm->mach_ops->acc_pen_up(wm);
 
-	wm->mach_ops->irq_enable(wm, 1);
+	return IRQ_HANDLED;
 }
 
 /*
  * Codec PENDOWN irq handler
  *
- * We have to disable the codec interrupt in the handler because it
- * can take upto 1ms to clear the interrupt source. We schedule a task
- * in a work queue to do the actual interaction with the chip.  The
- * interrupt is then enabled again in the slow handler when the source
- * has been cleared.
+ * It can take upto 1ms to clear the interrupt source, so the interaction
+ * with the chip is done in the irq thread. We only note the time of the
+ * pen down here for the latency statistics.
  */
 static irqreturn_t wm97xx_pen_interrupt(int irq, void *dev_id)
 {
 	struct wm97xx *wm = dev_id;
 
-	if (!work_pending(&wm->pen_event_work)) {
-		wm->mach_ops->irq_enable(wm, 0);
-		queue_work(wm->ts_workq, &wm->pen_event_work);
+	if (!wm->pen_is_down) {
+		wm->pen_irq_time = ktime_get();
+		wm->latency_pending = 1;
 	}
 
-	return IRQ_HANDLED;
+	return IRQ_WAKE_THREAD;
 }
 
 /*
- * initialise pen IRQ handler and workqueue
+ * initialise pen IRQ handler and thread
  */
 static int wm97xx_init_pen_irq(struct wm97xx *wm)
 {
 	u16 reg;
 
-	/* If an interrupt is supplied an IRQ enable operation must also be
-	 * provided. */
-	BUG_ON(!wm->mach_ops->irq_enable);
-
-	if (request_irq(wm->pen_irq, wm97xx_pen_interrupt, IRQF_SHARED,
-			"wm97xx-pen", wm)) {
+	if (request_threaded_irq(wm->pen_irq, wm97xx_pen_interrupt,
+				 wm97xx_pen_irq_thread, IRQF_SHARED,
+				 "wm97xx-pen", wm)) {
 		dev_err(wm->dev,
 			"Failed to register pen down interrupt, polling");
 		wm->pen_irq = 0;
@@ -394,6 +439,229 @@ static int wm97xx_init_pen_irq(struct wm97xx *wm)
 	return 0;
 }
 
+/*
+ * Touch to input event latency, measured from the pen down interrupt to
+ * the first reported sample. Called with codec_mutex held.
+ */
+static void wm97xx_record_latency(struct wm97xx *wm)
+{
+	u32 us = (u32)ktime_to_us(ktime_sub(ktime_get(), wm->pen_irq_time));
+
+	wm->latency_pending = 0;
+	wm->latency_last_us = us;
+	if (us > wm->latency_max_us)
+		wm->latency_max_us = us;
+	wm->latency_total_us += us;
+	wm->latency_count++;
+}
+
+static ssize_t wm97xx_latency_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct wm97xx *wm = dev_get_drvdata(dev);
+	u64 avg;
+	u32 last, max, count;
+
+	mutex_lock(&wm->codec_mutex);
+	last = wm->latency_last_us;
+	max = wm->latency_max_us;
+	count = wm->latency_count;
+	avg = wm->latency_total_us;
+	mutex_unlock(&wm->codec_mutex);
+
+	if (count)
+		do_div(avg, count);
+
+	return sprintf(buf, "last: %u us\nmax: %u us\naverage: %u us\n"
+		       "touches: %u\n", last, max, (u32)avg, count);
+}
+
+/* Writing anything resets the statistics */
+static ssize_t wm97xx_latency_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct wm97xx *wm = dev_get_drvdata(dev);
+
+	mutex_lock(&wm->codec_mutex);
+	wm->latency_last_us = 0;
+	wm->latency_max_us = 0;
+	wm->latency_total_us = 0;
+	wm->latency_count = 0;
+	mutex_unlock(&wm->codec_mutex);
+
+	return count;
+}
+
+static DEVICE_ATTR(touch_latency, 0644, wm97xx_latency_show,
+		   wm97xx_latency_store);
+
+/*
+ * Touch sample filter
+ *
+ * Samples pass through a pressure threshold, a median filter over the
+ * last few positions, a first order IIR low pass and a dejitter stage
+ * that holds the position until it moves by more than a few ADC counts.
+ * All arithmetic is integer, the IIR state is kept in 28.4 fixed point.
+ */
+static void wm97xx_filter_reset(struct wm97xx *wm)
+{
+	struct wm97xx_filter *f = &wm->filter;
+
+	f->hist_len = 0;
+	f->hist_head = 0;
+	f->iir_valid = 0;
+	f->last_valid = 0;
+}
+
+static int wm97xx_median(const u16 *hist, int n)
+{
+	u16 v[WM97XX_MEDIAN_MAX];
+	int i, j;
+
+	/* insertion sort, n is at most WM97XX_MEDIAN_MAX */
+	for (i = 0; i < n; i++) {
+		for (j = i; j > 0 && v[j - 1] > hist[i]; j--)
+			v[j] = v[j - 1];
+		v[j] = hist[i];
+	}
+
+	return v[n / 2];
+}
+
+/*
+ * Returns 0 if the sample is to be dropped, otherwise x and y are
+ * replaced by the filtered position.
+ */
+static int wm97xx_filter_sample(struct wm97xx *wm, int *x, int *y, int p)
+{
+	struct wm97xx_filter *f = &wm->filter;
+
+	if (f->pressure && p < f->pressure)
+		return 0;
+
+	if (f->median > 1) {
+		/* start the window full of the first sample, so that the
+		 * pen down is reported at once */
+		for (; f->hist_len < f->median; f->hist_len++) {
+			f->hist_x[f->hist_len] = *x;
+			f->hist_y[f->hist_len] = *y;
+		}
+		f->hist_x[f->hist_head] = *x;
+		f->hist_y[f->hist_head] = *y;
+		f->hist_head = (f->hist_head + 1) % f->median;
+
+		*x = wm97xx_median(f->hist_x, f->median);
+		*y = wm97xx_median(f->hist_y, f->median);
+	}
+
+	if (f->iir < 16) {
+		if (!f->iir_valid) {
+			f->iir_x = *x << 4;
+			f->iir_y = *y << 4;
+			f->iir_valid = 1;
+		} else {
+			f->iir_x += ((*x << 4) - f->iir_x) * f->iir >> 4;
+			f->iir_y += ((*y << 4) - f->iir_y) * f->iir >> 4;
+		}
+		*x = (f->iir_x + 8) >> 4;
+		*y = (f->iir_y + 8) >> 4;
+	}
+
+	if (f->dejitter && f->last_valid &&
+	    abs(*x - f->last_x) < f->dejitter &&
+	    abs(*y - f->last_y) < f->dejitter) {
+		*x = f->last_x;
+		*y = f->last_y;
+	}
+	f->last_x = *x;
+	f->last_y = *y;
+	f->last_valid = 1;
+
+	return 1;
+}
+
+/**
+ * wm97xx_report_sample - filter and report a touch sample
+ * @wm: wm97xx device
+ * @data: raw sample as read from the codec
+ *
+ * Used for polled samples and by machine drivers reporting samples
+ * from continuous mode. Must be called with codec_mutex held, as it
+ * is from the acc_pen_down() machine operation.
+ */
+void wm97xx_report_sample(struct wm97xx *wm, struct wm97xx_data *data)
+{
+	int x = data->x & 0xfff;
+	int y = data->y & 0xfff;
+	int p = data->p & 0xfff;
+
+	if (!wm97xx_filter_sample(wm, &x, &y, p))
+		return;
+
+#ifdef ANDROID_INV
+	x = abs_x[0] + abs_x[1] - x;
+	y = abs_y[0] + abs_y[1] - y;
+#endif
+	input_report_abs(wm->input_dev, ABS_X, x);
+	input_report_abs(wm->input_dev, ABS_Y, y);
+	input_report_abs(wm->input_dev, ABS_PRESSURE, p);
+	input_report_key(wm->input_dev, BTN_TOUCH, 1);
+	input_sync(wm->input_dev);
+
+	if (wm->latency_pending)
+		wm97xx_record_latency(wm);
+}
+EXPORT_SYMBOL_GPL(wm97xx_report_sample);
+
+#define WM97XX_FILTER_ATTR(_name, _min, _max)				\
+static ssize_t wm97xx_filter_##_name##_show(struct device *dev,	\
+		struct device_attribute *attr, char *buf)		\
+{									\
+	struct wm97xx *wm = dev_get_drvdata(dev);			\
+									\
+	return sprintf(buf, "%d\n", wm->filter._name);			\
+}									\
+									\
+static ssize_t wm97xx_filter_##_name##_store(struct device *dev,	\
+		struct device_attribute *attr, const char *buf,		\
+		size_t count)						\
+{									\
+	struct wm97xx *wm = dev_get_drvdata(dev);			\
+	unsigned long val;						\
+									\
+	if (strict_strtoul(buf, 10, &val) || val < (_min) || val > (_max)) \
+		return -EINVAL;						\
+									\
+	mutex_lock(&wm->codec_mutex);					\
+	wm->filter._name = val;						\
+	wm97xx_filter_reset(wm);					\
+	mutex_unlock(&wm->codec_mutex);					\
+									\
+	return count;							\
+}									\
+									\
+static DEVICE_ATTR(filter_##_name, 0644, wm97xx_filter_##_name##_show,	\
+		   wm97xx_filter_##_name##_store)
+
+WM97XX_FILTER_ATTR(median, 1, WM97XX_MEDIAN_MAX);
+WM97XX_FILTER_ATTR(pressure, 0, 0xfff);
+WM97XX_FILTER_ATTR(iir, 1, 16);
+WM97XX_FILTER_ATTR(dejitter, 0, 0xfff);
+
+static struct attribute *wm97xx_attrs[] = {
+	&dev_attr_touch_latency.attr,
+	&dev_attr_filter_median.attr,
+	&dev_attr_filter_pressure.attr,
+	&dev_attr_filter_iir.attr,
+	&dev_attr_filter_dejitter.attr,
+	NULL
+};
+
+static const struct attribute_group wm97xx_attr_group = {
+	.attrs = wm97xx_attrs,
+};
+
 static int wm97xx_read_samples(struct wm97xx *wm)
 {
 	struct wm97xx_data data;
@@ -401,7 +669,10 @@ static int wm97xx_read_samples(struct wm97xx *wm)
 
 	mutex_lock(&wm->codec_mutex);
 
-	if (wm->mach_ops && wm->mach_ops->acc_enabled)
+	/* Stopping or suspending, keep off the codec */
+	if (wm->ts_stop)
+		rc = RC_PENUP;
+	else if (wm->mach_ops && wm->mach_ops->acc_enabled)
 		rc = wm->mach_ops->acc_pen_down(wm);
 	else
 		rc = wm->codec->poll_touch(wm, &data);
@@ -409,6 +680,7 @@ static int wm97xx_read_samples(struct wm97xx *wm)
 	if (rc & RC_PENUP) {
 		if (wm->pen_is_down) {
 			wm->pen_is_down = 0;
+			wm97xx_filter_reset(wm);
 			dev_dbg(wm->dev, "pen up\n");
 			input_report_abs(wm->input_dev, ABS_PRESSURE, 0);
 			input_report_key(wm->input_dev, BTN_TOUCH, 0);
@@ -433,22 +705,17 @@ static int wm97xx_read_samples(struct wm97xx *wm)
 			"pen down: x=%x:%d, y=%x:%d, pressure=%x:%d\n",
 			data.x >> 12, data.x & 0xfff, data.y >> 12,
 			data.y & 0xfff, data.p >> 12, data.p & 0xfff);
-#ifdef ANDROID_INV
-		input_report_abs(wm->input_dev, ABS_X, abs_x[0] + abs_x[1] - (data.x & 0xfff));
-		input_report_abs(wm->input_dev, ABS_Y, abs_y[0] + abs_y[1] - (data.y & 0xfff));
-#else
-		input_report_abs(wm->input_dev, ABS_X, data.x & 0xfff);
-		input_report_abs(wm->input_dev, ABS_Y, data.y & 0xfff);
-#endif
-		input_report_abs(wm->input_dev, ABS_PRESSURE, data.p & 0xfff);
-		input_report_key(wm->input_dev, BTN_TOUCH, 1);
-		input_sync(wm->input_dev);
+		wm97xx_report_sample(wm, &data);
 		wm->pen_is_down = 1;
 		wm->ts_reader_interval = wm->ts_reader_min_interval;
 	} else if (rc & RC_PENDOWN) {
 		dev_dbg(wm->dev, "pen down\n");
 		wm->pen_is_down = 1;
 		wm->ts_reader_interval = wm->ts_reader_min_interval;
+		/* continuous mode reports from acc_pen_down() */
+		if (wm->latency_pending && wm->mach_ops &&
+		    wm->mach_ops->acc_enabled)
+			wm97xx_record_latency(wm);
 	}
 
 	mutex_unlock(&wm->codec_mutex);
@@ -456,7 +723,8 @@ static int wm97xx_read_samples(struct wm97xx *wm)
 }
 
 /*
-* The touchscreen sample reader.
+* The touchscreen sample reader, only used when there is no pen down
+* interrupt.
 */
 static void wm97xx_ts_reader(struct work_struct *work)
 {
@@ -469,9 +737,7 @@ static void wm97xx_ts_reader(struct work_struct *work)
 		rc = wm97xx_read_samples(wm);
 	} while (rc & RC_AGAIN);
 
-	if (wm->pen_is_down || !wm->pen_irq)
-		queue_delayed_work(wm->ts_workq, &wm->ts_reader,
-				   wm->ts_reader_interval);
+	schedule_delayed_work(&wm->ts_reader, wm->ts_reader_interval);
 }
 
 /**
@@ -479,18 +745,14 @@ static void wm97xx_ts_reader(struct work_struct *work)
  * @idev:	Input device to be opened.
  *
  * Called by the input sub system to open a wm97xx touchscreen device.
- * Starts the touchscreen thread and touch digitiser.
+ * Starts the pen down interrupt thread and touch digitiser.
  */
 static int wm97xx_ts_input_open(struct input_dev *idev)
 {
 	struct wm97xx *wm = input_get_drvdata(idev);
 
-	wm->ts_workq = create_singlethread_workqueue("kwm97xx");
-	if (wm->ts_workq == NULL) {
-		dev_err(wm->dev,
-			"Failed to create workqueue\n");
-		return -EINVAL;
-	}
+	wm->ts_stop = 0;
+	wm97xx_filter_reset(wm);
 
 	/* start digitiser */
 	if (wm->mach_ops && wm->mach_ops->acc_enabled)
@@ -498,7 +760,6 @@ static int wm97xx_ts_input_open(struct input_dev *idev)
 	wm->codec->dig_enable(wm, 1);
 
 	INIT_DELAYED_WORK(&wm->ts_reader, wm97xx_ts_reader);
-	INIT_WORK(&wm->pen_event_work, wm97xx_pen_irq_worker);
 
 	wm->ts_reader_min_interval = HZ >= 100 ? HZ / 100 : 1;
 	if (wm->ts_reader_min_interval < 1)
@@ -515,8 +776,7 @@ static int wm97xx_ts_input_open(struct input_dev *idev)
 	 * failed to acquire it then we need to poll.
 	 */
 	if (wm->pen_irq == 0)
-		queue_delayed_work(wm->ts_workq, &wm->ts_reader,
-				   wm->ts_reader_interval);
+		schedule_delayed_work(&wm->ts_reader, wm->ts_reader_interval);
 
 	return 0;
 }
@@ -535,6 +795,9 @@ static void wm97xx_ts_input_close(struct input_dev *idev)
 	struct wm97xx *wm = input_get_drvdata(idev);
 	u16 reg;
 
+	/* make a pen down reader in the irq thread finish */
+	wm->ts_stop = 1;
+
 	if (wm->pen_irq) {
 		/* Return the interrupt to GPIO usage (disabling it) */
 		if (wm->id != WM9705_ID2) {
@@ -549,16 +812,9 @@ static void wm97xx_ts_input_close(struct input_dev *idev)
 
 	wm->pen_is_down = 0;
 
-	/* Balance out interrupt disables/enables */
-	if (cancel_work_sync(&wm->pen_event_work))
-		wm->mach_ops->irq_enable(wm, 1);
-
-	/* ts_reader rearms itself so we need to explicitly stop it
-	 * before we destroy the workqueue.
-	 */
-	cancel_delayed_work_sync(&wm->ts_reader);
-
-	destroy_workqueue(wm->ts_workq);
+	/* ts_reader rearms itself when polling */
+	if (!wm->pen_irq)
+		cancel_delayed_work_sync(&wm->ts_reader);
 
 	/* stop digitiser */
 	wm->codec->dig_enable(wm, 0);
@@ -581,6 +837,11 @@ static int wm97xx_probe(struct device *dev)
 	dev_set_drvdata(dev, wm);
 	wm->ac97 = to_ac97_t(dev);
 
+	/* default filter, see wm97xx_filter_sample() */
+	wm->filter.median = 3;
+	wm->filter.iir = 8;
+	wm->filter.dejitter = 4;
+
 	/* check that we have a supported codec */
 	id = wm97xx_reg_read(wm, AC97_VENDOR_ID1);
 	if (id != WM97XX_ID1) {
@@ -686,6 +947,9 @@ static int wm97xx_probe(struct device *dev)
 	if (ret < 0)
 		goto touch_reg_err;
 
+	if (sysfs_create_group(&dev->kobj, &wm97xx_attr_group))
+		dev_warn(dev, "failed to create sysfs attributes\n");
+
 	return ret;
 
  touch_reg_err:
@@ -710,6 +974,7 @@ static int wm97xx_remove(struct device *dev)
 {
 	struct wm97xx *wm = dev_get_drvdata(dev);
 
+	sysfs_remove_group(&dev->kobj, &wm97xx_attr_group);
 	platform_device_unregister(wm->battery_dev);
 	platform_device_unregister(wm->touch_dev);
 	input_unregister_device(wm->input_dev);
@@ -730,8 +995,18 @@ static int wm97xx_suspend(struct device *dev, pm_message_t state)
 	else
 		suspend_mode = 0;
 
-	if (wm->input_dev->users)
-		cancel_delayed_work_sync(&wm->ts_reader);
+	if (wm->input_dev->users) {
+		if (wm->pen_irq) {
+			/* Any reader running in the irq thread sees
+			 * ts_stop on its next sample and keeps off the
+			 * codec from then on.
+			 */
+			mutex_lock(&wm->codec_mutex);
+			wm->ts_stop = 1;
+			mutex_unlock(&wm->codec_mutex);
+		} else
+			cancel_delayed_work_sync(&wm->ts_reader);
+	}
 
 	/* Power down the digitiser (bypassing the cache for resume) */
 	reg = wm97xx_reg_read(wm, AC97_WM97XX_DIGITISER2);
@@ -776,10 +1051,10 @@ static int wm97xx_resume(struct device *dev)
 	wm97xx_reg_write(wm, AC97_GPIO_STATUS, wm->gpio[4]);
 	wm97xx_reg_write(wm, AC97_MISC_AFE, wm->gpio[5]);
 
+	wm->ts_stop = 0;
 	if (wm->input_dev->users && !wm->pen_irq) {
 		wm->ts_reader_interval = wm->ts_reader_min_interval;
-		queue_delayed_work(wm->ts_workq, &wm->ts_reader,
-				   wm->ts_reader_interval);
+		schedule_delayed_work(&wm->ts_reader, wm->ts_reader_interval);
 	}
 
 	return 0;
@@ -89,6 +89,7 @@ static void wm97xx_acc_pen_up(struct wm97xx *wm)
 
 static int wm97xx_acc_pen_down(struct wm97xx *wm)
 {
+	struct wm97xx_data data;
 	u16 x, y, p = 0x100 | WM97XX_ADCSEL_PRES;
 	int reads = 0;
 	static u16 last, tries;
@@ -126,11 +127,10 @@ static int wm97xx_acc_pen_down(struct wm97xx *wm)
 
 		/* coordinate is good */
 		tries = 0;
-		input_report_abs(wm->input_dev, ABS_X, x & 0xfff);
-		input_report_abs(wm->input_dev, ABS_Y, y & 0xfff);
-		input_report_abs(wm->input_dev, ABS_PRESSURE, p & 0xfff);
-		input_report_key(wm->input_dev, BTN_TOUCH, (p != 0));
-		input_sync(wm->input_dev);
+		data.x = x;
+		data.y = y;
+		data.p = p;
+		wm97xx_report_sample(wm, &data);
 		reads++;
 	} while (reads < cinfo[sp_idx].reads);
 up:
@@ -15,6 +15,7 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/interrupt.h>
+#include <linux/irq.h>
 #include <linux/platform_device.h>
 #include <linux/i2c.h>
 #include <linux/mfd/da903x.h>
@@ -49,6 +50,7 @@
 struct da903x_chip;
 
 struct da903x_chip_ops {
+	int	num_events;
 	int	(*init_chip)(struct da903x_chip *);
 	int	(*unmask_events)(struct da903x_chip *, unsigned int events);
 	int	(*mask_events)(struct da903x_chip *, unsigned int events);
@@ -62,10 +64,20 @@ struct da903x_chip {
 	struct da903x_chip_ops	*ops;
 
 	int			type;
-	uint32_t		events_mask;
+	uint32_t		events_mask;	/* masked for notifiers */
 
 	struct mutex		lock;
-	struct work_struct	irq_work;
+
+	/* status is read along with the events; valid while they are
+	 * being dispatched */
+	unsigned int		status;
+	int			status_valid;
+
+	/* nested IRQs for the events, irq_base == 0 when not used */
+	unsigned int		irq_base;
+	uint32_t		irq_masked;
+	uint32_t		irq_masked_hw;
+	struct mutex		irq_lock;
 
 	struct blocking_notifier_head notifier_list;
 };
@@ -240,11 +252,32 @@ int da903x_query_status(struct device *dev, unsigned int sbits)
 	struct da903x_chip *chip = dev_get_drvdata(dev);
 	unsigned int status = 0;
 
-	chip->ops->read_status(chip, &status);
+	/* notifiers and nested handlers get the status read with the
+	 * events instead of another I2C transfer */
+	if (chip->status_valid)
+		status = chip->status;
+	else
+		chip->ops->read_status(chip, &status);
 	return ((status & sbits) == sbits);
 }
 EXPORT_SYMBOL(da903x_query_status);
 
+/*
+ * Returns the nested IRQ for a single event bit, -ENXIO when the board
+ * did not give the chip an irq_base.
+ */
+int da903x_event_irq(struct device *dev, unsigned int event)
+{
+	struct da903x_chip *chip = dev_get_drvdata(dev);
+
+	if (!chip->irq_base || !event || (event & (event - 1)) ||
+	    __ffs(event) >= chip->ops->num_events)
+		return -ENXIO;
+
+	return chip->irq_base + __ffs(event);
+}
+EXPORT_SYMBOL_GPL(da903x_event_irq);
+
 static int __devinit da9030_init_chip(struct da903x_chip *chip)
 {
 	uint8_t chip_id;
@@ -265,12 +298,14 @@ static int __devinit da9030_init_chip(struct da903x_chip *chip)
 static int da9030_unmask_events(struct da903x_chip *chip, unsigned int events)
 {
 	uint8_t v[3];
+	uint32_t mask;
 
 	chip->events_mask &= ~events;
+	mask = chip->events_mask & chip->irq_masked;
 
-	v[0] = (chip->events_mask & 0xff);
-	v[1] = (chip->events_mask >> 8) & 0xff;
-	v[2] = (chip->events_mask >> 16) & 0xff;
+	v[0] = (mask & 0xff);
+	v[1] = (mask >> 8) & 0xff;
+	v[2] = (mask >> 16) & 0xff;
 
 	return __da903x_writes(chip->client, DA9030_IRQ_MASK_A, 3, v);
 }
@@ -278,26 +313,30 @@ static int da9030_unmask_events(struct da903x_chip *chip, unsigned int events)
 static int da9030_mask_events(struct da903x_chip *chip, unsigned int events)
 {
 	uint8_t v[3];
+	uint32_t mask;
 
 	chip->events_mask |= events;
+	mask = chip->events_mask & chip->irq_masked;
 
-	v[0] = (chip->events_mask & 0xff);
-	v[1] = (chip->events_mask >> 8) & 0xff;
-	v[2] = (chip->events_mask >> 16) & 0xff;
+	v[0] = (mask & 0xff);
+	v[1] = (mask >> 8) & 0xff;
+	v[2] = (mask >> 16) & 0xff;
 
 	return __da903x_writes(chip->client, DA9030_IRQ_MASK_A, 3, v);
 }
 
+/* EVENT_A..EVENT_C and STATUS are contiguous: one transfer for all */
 static int da9030_read_events(struct da903x_chip *chip, unsigned int *events)
 {
-	uint8_t v[3] = {0, 0, 0};
+	uint8_t v[4] = {0, 0, 0, 0};
 	int ret;
 
-	ret = __da903x_reads(chip->client, DA9030_EVENT_A, 3, v);
+	ret = __da903x_reads(chip->client, DA9030_EVENT_A, 4, v);
 	if (ret < 0)
 		return ret;
 
 	*events = (v[2] << 16) | (v[1] << 8) | v[0];
+	chip->status = v[3];
 	return 0;
 }
 
@@ -342,13 +381,15 @@ static int da9034_init_chip(struct da903x_chip *chip)
 static int da9034_unmask_events(struct da903x_chip *chip, unsigned int events)
 {
 	uint8_t v[4];
+	uint32_t mask;
 
 	chip->events_mask &= ~events;
+	mask = chip->events_mask & chip->irq_masked;
 
-	v[0] = (chip->events_mask & 0xff);
-	v[1] = (chip->events_mask >> 8) & 0xff;
-	v[2] = (chip->events_mask >> 16) & 0xff;
-	v[3] = (chip->events_mask >> 24) & 0xff;
+	v[0] = (mask & 0xff);
+	v[1] = (mask >> 8) & 0xff;
+	v[2] = (mask >> 16) & 0xff;
+	v[3] = (mask >> 24) & 0xff;
 
 	return __da903x_writes(chip->client, DA9034_IRQ_MASK_A, 4, v);
 }
@@ -356,27 +397,31 @@ static int da9034_unmask_events(struct da903x_chip *chip, unsigned int events)
 static int da9034_mask_events(struct da903x_chip *chip, unsigned int events)
 {
 	uint8_t v[4];
+	uint32_t mask;
 
 	chip->events_mask |= events;
+	mask = chip->events_mask & chip->irq_masked;
 
-	v[0] = (chip->events_mask & 0xff);
-	v[1] = (chip->events_mask >> 8) & 0xff;
-	v[2] = (chip->events_mask >> 16) & 0xff;
-	v[3] = (chip->events_mask >> 24) & 0xff;
+	v[0] = (mask & 0xff);
+	v[1] = (mask >> 8) & 0xff;
+	v[2] = (mask >> 16) & 0xff;
+	v[3] = (mask >> 24) & 0xff;
 
 	return __da903x_writes(chip->client, DA9034_IRQ_MASK_A, 4, v);
 }
 
+/* EVENT_A..EVENT_D and STATUS_A..STATUS_B are contiguous */
 static int da9034_read_events(struct da903x_chip *chip, unsigned int *events)
 {
-	uint8_t v[4] = {0, 0, 0, 0};
+	uint8_t v[6] = {0, 0, 0, 0, 0, 0};
 	int ret;
 
-	ret = __da903x_reads(chip->client, DA9034_EVENT_A, 4, v);
+	ret = __da903x_reads(chip->client, DA9034_EVENT_A, 6, v);
 	if (ret < 0)
 		return ret;
 
 	*events = (v[3] << 24) | (v[2] << 16) | (v[1] << 8) | v[0];
+	chip->status = (v[5] << 8) | v[4];
 	return 0;
 }
 
@@ -393,38 +438,133 @@ static int da9034_read_status(struct da903x_chip *chip, unsigned int *status)
 	return 0;
 }
 
-static void da903x_irq_work(struct work_struct *work)
+/*
+ * The PMIC line is edge triggered on the host side: keep reading until
+ * no unmasked event is left, or an event raised while we were busy
+ * would never be seen.
+ */
+static irqreturn_t da903x_irq_thread(int irq, void *data)
 {
-	struct da903x_chip *chip =
-		container_of(work, struct da903x_chip, irq_work);
-	unsigned int events = 0;
+	struct da903x_chip *chip = data;
+	unsigned int events = 0, pending;
+	int i;
 
 	while (1) {
 		if (chip->ops->read_events(chip, &events))
 			break;
+		chip->status_valid = 1;
 
-		events &= ~chip->events_mask;
+		events &= ~(chip->events_mask & chip->irq_masked);
 		if (events == 0)
 			break;
 
-		blocking_notifier_call_chain(
-				&chip->notifier_list, events, NULL);
+		if (events & ~chip->events_mask)
+			blocking_notifier_call_chain(&chip->notifier_list,
+					events & ~chip->events_mask, NULL);
+
+		pending = events & ~chip->irq_masked;
+		for (i = 0; pending; i++, pending >>= 1)
+			if (pending & 1)
+				handle_nested_irq(chip->irq_base + i);
 	}
-	enable_irq(chip->client->irq);
+	chip->status_valid = 0;
+
+	return IRQ_HANDLED;
 }
 
-static irqreturn_t da903x_irq_handler(int irq, void *data)
+static void da903x_irq_bus_lock(unsigned int irq)
 {
-	struct da903x_chip *chip = data;
+	struct da903x_chip *chip = get_irq_chip_data(irq);
 
-	disable_irq_nosync(irq);
-	(void)schedule_work(&chip->irq_work);
+	mutex_lock(&chip->irq_lock);
+}
 
-	return IRQ_HANDLED;
+/* mask and unmask run under the descriptor lock, the I2C write is here */
+static void da903x_irq_bus_sync_unlock(unsigned int irq)
+{
+	struct da903x_chip *chip = get_irq_chip_data(irq);
+
+	if (chip->irq_masked != chip->irq_masked_hw) {
+		mutex_lock(&chip->lock);
+		chip->ops->mask_events(chip, 0);
+		mutex_unlock(&chip->lock);
+		chip->irq_masked_hw = chip->irq_masked;
+	}
+	mutex_unlock(&chip->irq_lock);
+}
+
+static void da903x_irq_mask(unsigned int irq)
+{
+	struct da903x_chip *chip = get_irq_chip_data(irq);
+
+	chip->irq_masked |= 1 << (irq - chip->irq_base);
+}
+
+static void da903x_irq_unmask(unsigned int irq)
+{
+	struct da903x_chip *chip = get_irq_chip_data(irq);
+
+	chip->irq_masked &= ~(1 << (irq - chip->irq_base));
+}
+
+static int da903x_irq_set_wake(unsigned int irq, unsigned int on)
+{
+	struct da903x_chip *chip = get_irq_chip_data(irq);
+
+	return set_irq_wake(chip->client->irq, on);
+}
+
+static struct irq_chip da903x_irq_chip = {
+	.name		= "da903x",
+	.bus_lock	= da903x_irq_bus_lock,
+	.bus_sync_unlock = da903x_irq_bus_sync_unlock,
+	.mask		= da903x_irq_mask,
+	.unmask		= da903x_irq_unmask,
+	.set_wake	= da903x_irq_set_wake,
+};
+
+static void __devinit da903x_irq_init(struct da903x_chip *chip,
+				      unsigned int irq_base)
+{
+	unsigned int irq;
+
+	chip->irq_base = irq_base;
+	if (!irq_base)
+		return;
+
+	for (irq = irq_base; irq < irq_base + chip->ops->num_events; irq++) {
+		set_irq_chip_data(irq, chip);
+		set_irq_chip_and_handler(irq, &da903x_irq_chip,
+					 handle_edge_irq);
+		set_irq_nested_thread(irq, 1);
+#ifdef CONFIG_ARM
+		set_irq_flags(irq, IRQF_VALID);
+#else
+		set_irq_noprobe(irq);
+#endif
+	}
+}
+
+static void da903x_irq_exit(struct da903x_chip *chip)
+{
+	unsigned int irq;
+
+	if (!chip->irq_base)
+		return;
+
+	for (irq = chip->irq_base;
+	     irq < chip->irq_base + chip->ops->num_events; irq++) {
+#ifdef CONFIG_ARM
+		set_irq_flags(irq, 0);
+#endif
+		set_irq_chip_and_handler(irq, NULL, NULL);
+		set_irq_chip_data(irq, NULL);
+	}
 }
 
 static struct da903x_chip_ops da903x_ops[] = {
 	[0] = {
+		.num_events	= 24,
 		.init_chip	= da9030_init_chip,
 		.unmask_events	= da9030_unmask_events,
 		.mask_events	= da9030_mask_events,
@@ -432,6 +572,7 @@ static struct da903x_chip_ops da903x_ops[] = {
 		.read_status	= da9030_read_status,
 	},
 	[1] = {
+		.num_events	= 32,
 		.init_chip	= da9034_init_chip,
 		.unmask_events	= da9034_unmask_events,
 		.mask_events	= da9034_mask_events,
@@ -501,7 +642,7 @@ static int __devinit da903x_probe(struct i2c_client *client,
 	chip->ops = &da903x_ops[id->driver_data];
 
 	mutex_init(&chip->lock);
-	INIT_WORK(&chip->irq_work, da903x_irq_work);
+	mutex_init(&chip->irq_lock);
 	BLOCKING_INIT_NOTIFIER_HEAD(&chip->notifier_list);
 
 	i2c_set_clientdata(client, chip);
@@ -512,16 +653,19 @@ static int __devinit da903x_probe(struct i2c_client *client,
 
 	/* mask and clear all IRQs */
 	chip->events_mask = 0xffffffff;
+	chip->irq_masked = chip->irq_masked_hw = 0xffffffff;
 	chip->ops->mask_events(chip, chip->events_mask);
 	chip->ops->read_events(chip, &tmp);
 
-	ret = request_irq(client->irq, da903x_irq_handler,
-			IRQF_DISABLED | IRQF_TRIGGER_FALLING,
+	da903x_irq_init(chip, pdata->irq_base);
+
+	ret = request_threaded_irq(client->irq, NULL, da903x_irq_thread,
+			IRQF_TRIGGER_FALLING | IRQF_ONESHOT,
 			"da903x", chip);
 	if (ret) {
 		dev_err(&client->dev, "failed to request irq %d\n",
 				client->irq);
-		goto out_free_chip;
+		goto out_irq_exit;
 	}
 
 	ret = da903x_add_subdevs(chip, pdata);
@@ -532,6 +676,8 @@ static int __devinit da903x_probe(struct i2c_client *client,
 
 out_free_irq:
 	free_irq(client->irq, chip);
+out_irq_exit:
+	da903x_irq_exit(chip);
 out_free_chip:
 	i2c_set_clientdata(client, NULL);
 	kfree(chip);
@@ -543,6 +689,8 @@ static int __devexit da903x_remove(struct i2c_client *client)
 	struct da903x_chip *chip = i2c_get_clientdata(client);
 
 	da903x_remove_subdevs(chip);
+	free_irq(client->irq, chip);
+	da903x_irq_exit(chip);
 	kfree(chip);
 	return 0;
 }
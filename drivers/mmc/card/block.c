@@ -269,6 +269,58 @@ mmc_blk_set_blksize(struct mmc_blk_data *md, struct mmc_card *card)
 	return 0;
 }
 
+/*
+ * Adjust the sg list so it is the same size as the request.
+ */
+static void mmc_blk_trim_sg(struct mmc_data *data, struct request *req)
+{
+	if (data->blocks != blk_rq_sectors(req)) {
+		int i, data_size = data->blocks << 9;
+		struct scatterlist *sg;
+
+		for_each_sg(data->sg, sg, data->sg_len, i) {
+			data_size -= sg->length;
+			if (data_size <= 0) {
+				sg->length += data_size;
+				i++;
+				break;
+			}
+		}
+		data->sg_len = i;
+	}
+}
+
+/*
+ * Called while a transfer is in progress: map the request that will be
+ * issued next and let the host prepare its DMA, so the card does not
+ * sit idle while that is done.
+ */
+static void mmc_blk_prep_next(void *arg)
+{
+	struct mmc_queue *mq = arg;
+	struct mmc_card *card = mq->card;
+	struct mmc_data *data = &mq->data_next;
+	struct request *req;
+
+	req = mmc_queue_peek_next(mq);
+	if (!req)
+		return;
+
+	memset(data, 0, sizeof(struct mmc_data));
+	memset(&mq->mrq_next, 0, sizeof(struct mmc_request));
+	mq->mrq_next.data = data;
+
+	data->blksz = 512;
+	data->blocks = min(blk_rq_sectors(req), card->host->max_blk_count);
+	data->flags = rq_data_dir(req) == READ ? MMC_DATA_READ : MMC_DATA_WRITE;
+	data->sg = mq->sg_next;
+	data->sg_len = mmc_queue_map_sg_next(mq, req);
+	mmc_blk_trim_sg(data, req);
+
+	mmc_pre_req(card->host, &mq->mrq_next);
+	if (data->host_cookie)
+		mq->req_next = req;
+}
 
 static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 {
@@ -276,6 +328,11 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 	struct mmc_card *card = md->queue.card;
 	struct mmc_blk_request brq;
 	int ret = 1, disable_multi = 0;
+	int prepared = mq->req_next == req;
+
+	/* a request other than the prepared one got to the head */
+	if (!prepared)
+		mmc_queue_drop_next(mq);
 
 #ifdef CONFIG_MMC_BLOCK_DEFERRED_RESUME
 	if (mmc_bus_needs_resume(card->host)) {
@@ -345,31 +402,28 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 
 		mmc_set_data_timeout(&brq.data, card);
 
-		brq.data.sg = mq->sg;
-		brq.data.sg_len = mmc_queue_map_sg(mq);
-
-		/*
-		 * Adjust the sg list so it is the same size as the
-		 * request.
-		 */
-		if (brq.data.blocks != blk_rq_sectors(req)) {
-			int i, data_size = brq.data.blocks << 9;
-			struct scatterlist *sg;
-
-			for_each_sg(brq.data.sg, sg, brq.data.sg_len, i) {
-				data_size -= sg->length;
-				if (data_size <= 0) {
-					sg->length += data_size;
-					i++;
-					break;
-				}
-			}
-			brq.data.sg_len = i;
+		if (prepared) {
+			/* mapped during the previous transfer */
+			mmc_queue_use_next(mq);
+			brq.data.sg = mq->sg;
+			brq.data.sg_len = mq->data_next.sg_len;
+			brq.data.host_cookie = mq->data_next.host_cookie;
+			prepared = 0;
+		} else {
+			brq.data.sg = mq->sg;
+			brq.data.sg_len = mmc_queue_map_sg(mq);
+			mmc_blk_trim_sg(&brq.data, req);
 		}
 
 		mmc_queue_bounce_pre(mq);
 
-		mmc_wait_for_req(card->host, &brq.mrq);
+		if (mq->sg_next)
+			mmc_wait_for_req_overlap(card->host, &brq.mrq,
+						 mmc_blk_prep_next, mq);
+		else
+			mmc_wait_for_req(card->host, &brq.mrq);
+
+		mmc_post_req(card->host, &brq.mrq, 0);
 
 		mmc_queue_bounce_post(mq);
 
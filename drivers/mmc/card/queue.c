@@ -193,6 +193,20 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card, spinlock_t *lock
 			goto cleanup_queue;
 		}
 		sg_init_table(mq->sg, host->max_phys_segs);
+
+		/*
+		 * Hosts that can prepare a request ahead of time get a
+		 * second sg list for the next request.
+		 */
+		if (host->ops->pre_req) {
+			mq->sg_next = kmalloc(sizeof(struct scatterlist) *
+				host->max_phys_segs, GFP_KERNEL);
+			if (!mq->sg_next) {
+				ret = -ENOMEM;
+				goto cleanup_queue;
+			}
+			sg_init_table(mq->sg_next, host->max_phys_segs);
+		}
 	}
 
 	init_MUTEX(&mq->thread_sem);
@@ -212,6 +226,8 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card, spinlock_t *lock
  	if (mq->sg)
 		kfree(mq->sg);
 	mq->sg = NULL;
+	kfree(mq->sg_next);
+	mq->sg_next = NULL;
 	if (mq->bounce_buf)
 		kfree(mq->bounce_buf);
 	mq->bounce_buf = NULL;
@@ -230,6 +246,9 @@ void mmc_cleanup_queue(struct mmc_queue *mq)
 	/* Then terminate our worker thread */
 	kthread_stop(mq->thread);
 
+	/* Release a request prepared for the host but never issued */
+	mmc_queue_drop_next(mq);
+
 	/* Empty the queue */
 	spin_lock_irqsave(q->queue_lock, flags);
 	q->queuedata = NULL;
@@ -242,6 +261,8 @@ void mmc_cleanup_queue(struct mmc_queue *mq)
 
 	kfree(mq->sg);
 	mq->sg = NULL;
+	kfree(mq->sg_next);
+	mq->sg_next = NULL;
 
 	if (mq->bounce_buf)
 		kfree(mq->bounce_buf);
@@ -323,6 +344,63 @@ unsigned int mmc_queue_map_sg(struct mmc_queue *mq)
 	return 1;
 }
 
+/*
+ * Return the request the queue thread will fetch next, if the host can
+ * prepare it now. The request is left on the queue.
+ */
+struct request *mmc_queue_peek_next(struct mmc_queue *mq)
+{
+	struct request_queue *q = mq->queue;
+	struct request *req = NULL;
+
+	if (!mq->sg_next || mq->req_next)
+		return NULL;
+
+	spin_lock_irq(q->queue_lock);
+	if (!blk_queue_plugged(q) && !blk_queue_stopped(q))
+		req = blk_peek_request(q);
+	spin_unlock_irq(q->queue_lock);
+
+	if (req && !blk_fs_request(req))
+		req = NULL;
+
+	return req;
+}
+
+/*
+ * Map a request returned by mmc_queue_peek_next() into the second sg list
+ */
+unsigned int mmc_queue_map_sg_next(struct mmc_queue *mq, struct request *req)
+{
+	return blk_rq_map_sg(mq->queue, req, mq->sg_next);
+}
+
+/*
+ * The prepared request is being issued: its sg list becomes the current
+ * one and the old current list is free for the next preparation.
+ */
+void mmc_queue_use_next(struct mmc_queue *mq)
+{
+	struct scatterlist *sg = mq->sg;
+
+	mq->sg = mq->sg_next;
+	mq->sg_next = sg;
+	mq->req_next = NULL;
+}
+
+/*
+ * Undo the host preparation of a request that is not going to be issued
+ * as prepared.
+ */
+void mmc_queue_drop_next(struct mmc_queue *mq)
+{
+	if (!mq->req_next)
+		return;
+
+	mmc_post_req(mq->card->host, &mq->mrq_next, -EAGAIN);
+	mq->req_next = NULL;
+}
+
 /*
  * If writing, bounce the data to the buffer before the request
  * is sent to the host driver
@@ -1,6 +1,8 @@
 #ifndef MMC_QUEUE_H
 #define MMC_QUEUE_H
 
+#include <linux/mmc/core.h>
+
 struct request;
 struct task_struct;
 
@@ -17,6 +19,11 @@ struct mmc_queue {
 	char			*bounce_buf;
 	struct scatterlist	*bounce_sg;
 	unsigned int		bounce_sg_len;
+	/* next request, prepared while the current one is in progress */
+	struct request		*req_next;
+	struct scatterlist	*sg_next;
+	struct mmc_data		data_next;
+	struct mmc_request	mrq_next;
 };
 
 extern int mmc_init_queue(struct mmc_queue *, struct mmc_card *, spinlock_t *);
@@ -25,6 +32,11 @@ extern void mmc_queue_suspend(struct mmc_queue *);
 extern void mmc_queue_resume(struct mmc_queue *);
 
 extern unsigned int mmc_queue_map_sg(struct mmc_queue *);
+extern struct request *mmc_queue_peek_next(struct mmc_queue *);
+extern unsigned int mmc_queue_map_sg_next(struct mmc_queue *,
+					  struct request *);
+extern void mmc_queue_use_next(struct mmc_queue *);
+extern void mmc_queue_drop_next(struct mmc_queue *);
 extern void mmc_queue_bounce_pre(struct mmc_queue *);
 extern void mmc_queue_bounce_post(struct mmc_queue *);
 
@@ -207,6 +207,65 @@ void mmc_wait_for_req(struct mmc_host *host, struct mmc_request *mrq)
 
 EXPORT_SYMBOL(mmc_wait_for_req);
 
+/**
+ *	mmc_wait_for_req_overlap - start a request, do other work, then wait
+ *	@host: MMC host to start command
+ *	@mrq: MMC request to start
+ *	@fn: work to do while the request is in progress
+ *	@data: argument to @fn
+ *
+ *	As mmc_wait_for_req(), but calls @fn once the request has been
+ *	started so the caller can prepare its next request (see
+ *	mmc_pre_req()) while this one is on the wire.
+ */
+void mmc_wait_for_req_overlap(struct mmc_host *host, struct mmc_request *mrq,
+	void (*fn)(void *), void *data)
+{
+	DECLARE_COMPLETION_ONSTACK(complete);
+
+	mrq->done_data = &complete;
+	mrq->done = mmc_wait_done;
+
+	mmc_start_request(host, mrq);
+
+	fn(data);
+
+	wait_for_completion(&complete);
+}
+
+EXPORT_SYMBOL(mmc_wait_for_req_overlap);
+
+/**
+ *	mmc_pre_req - prepare the data of a request ahead of time
+ *	@host: MMC host the request will be sent to
+ *	@mrq: MMC request to prepare
+ *
+ *	Lets the host map and set up the data of @mrq while the host is
+ *	busy with another request. Does nothing if the host does not
+ *	support it, in which case mrq->data->host_cookie stays 0.
+ */
+void mmc_pre_req(struct mmc_host *host, struct mmc_request *mrq)
+{
+	if (host->ops->pre_req && mrq->data)
+		host->ops->pre_req(host, mrq);
+}
+
+EXPORT_SYMBOL(mmc_pre_req);
+
+/**
+ *	mmc_post_req - release a prepared request
+ *	@host: MMC host the request was prepared for
+ *	@mrq: MMC request prepared with mmc_pre_req()
+ *	@err: non zero if the request was dropped rather than completed
+ */
+void mmc_post_req(struct mmc_host *host, struct mmc_request *mrq, int err)
+{
+	if (host->ops->post_req && mrq->data && mrq->data->host_cookie)
+		host->ops->post_req(host, mrq, err);
+}
+
+EXPORT_SYMBOL(mmc_post_req);
+
 /**
  *	mmc_wait_for_cmd - start a command and wait for completion
  *	@host: MMC host to start command
@@ -962,6 +1021,16 @@ static inline void mmc_bus_put(struct mmc_host *host)
 	spin_unlock_irqrestore(&host->lock, flags);
 }
 
+/*
+ * Record how long it took from resume until the card could be used.
+ */
+static void mmc_resume_done(struct mmc_host *host)
+{
+	u32 us = (u32)ktime_to_us(ktime_sub(ktime_get(), host->resume_start));
+
+	host->resume_usable_ms = us / 1000;
+}
+
 int mmc_resume_bus(struct mmc_host *host)
 {
 	if (!mmc_bus_needs_resume(host))
@@ -979,6 +1048,8 @@ int mmc_resume_bus(struct mmc_host *host)
 	if (host->bus_ops->detect && !host->bus_dead)
 		host->bus_ops->detect(host);
 
+	host->resumes_late++;
+	mmc_resume_done(host);
 	mmc_bus_put(host);
 	printk("%s: Deferred resume completed\n", mmc_hostname(host));
 	return 0;
@@ -1047,12 +1118,14 @@ void mmc_detach_bus(struct mmc_host *host)
  */
 void mmc_detect_change(struct mmc_host *host, unsigned long delay)
 {
-#ifdef CONFIG_MMC_DEBUG
 	unsigned long flags;
+
 	spin_lock_irqsave(&host->lock, flags);
+#ifdef CONFIG_MMC_DEBUG
 	WARN_ON(host->removed);
-	spin_unlock_irqrestore(&host->lock, flags);
 #endif
+	host->detect_events++;
+	spin_unlock_irqrestore(&host->lock, flags);
 
 	mmc_schedule_delayed_work(&host->detect, delay);
 }
@@ -1081,9 +1154,18 @@ void mmc_rescan(struct work_struct *work)
 
 	mmc_bus_get(host);
 
-	/* if there is a card registered, check whether it is still present */
-	if ((host->bus_ops != NULL) && host->bus_ops->detect && !host->bus_dead)
-		host->bus_ops->detect(host);
+	/*
+	 * if there is a card registered, check whether it is still present.
+	 * A card left powered down on resume is only woken up for that if
+	 * its slot changed, otherwise the check waits for its first use.
+	 */
+	if ((host->bus_ops != NULL) && host->bus_ops->detect && !host->bus_dead) {
+		if (!mmc_bus_needs_resume(host))
+			host->bus_ops->detect(host);
+		else if (host->ops->get_cd_state &&
+			 host->ops->get_cd_state(host) != host->suspend_cd_state)
+			mmc_resume_bus(host);
+	}
 
 	/* If the card was removed the bus will be marked
 	 * as dead - extend the wakelock so userspace
@@ -1304,14 +1386,39 @@ int mmc_suspend_host(struct mmc_host *host, pm_message_t state)
 	}
 	mmc_bus_put(host);
 
-	if (!err)
+	if (!err) {
 		mmc_power_off(host);
 
+		host->suspend_detect_events = host->detect_events;
+		if (host->ops->get_cd_state)
+			host->suspend_cd_state = host->ops->get_cd_state(host);
+	}
+
 	return err;
 }
 
 EXPORT_SYMBOL(mmc_suspend_host);
 
+/*
+ * Whether the card detect line says the card may have been removed or
+ * replaced since mmc_suspend_host(). Hosts that cannot tell are trusted
+ * to keep the card.
+ */
+static int mmc_card_may_have_changed(struct mmc_host *host)
+{
+	int state;
+
+	if (!host->ops->get_cd_state)
+		return 0;
+
+	state = host->ops->get_cd_state(host);
+	if (state < 0)
+		return 0;
+
+	return state != host->suspend_cd_state ||
+	       host->detect_events != host->suspend_detect_events;
+}
+
 /**
  *	mmc_resume_host - resume a previously suspended host
  *	@host: mmc host
@@ -1320,13 +1427,20 @@ int mmc_resume_host(struct mmc_host *host)
 {
 	int err = 0;
 
+	host->resume_start = ktime_get();
+
 	mmc_bus_get(host);
-	if (host->bus_resume_flags & MMC_BUSRESUME_MANUAL_RESUME) {
+	if (host->bus_resume_flags & MMC_BUSRESUME_MANUAL_RESUME &&
+	    !mmc_card_may_have_changed(host)) {
 		host->bus_resume_flags |= MMC_BUSRESUME_NEEDS_RESUME;
+		host->resumes_deferred++;
 		mmc_bus_put(host);
 		return 0;
 	}
 
+	/* possibly still left off from an earlier resume */
+	host->bus_resume_flags &= ~MMC_BUSRESUME_NEEDS_RESUME;
+
 	if (host->bus_ops && !host->bus_dead) {
 		mmc_power_up(host);
 		mmc_select_voltage(host, host->ocr);
@@ -1338,6 +1452,8 @@ int mmc_resume_host(struct mmc_host *host)
 					    mmc_hostname(host), err);
 			err = 0;
 		}
+		host->resumes_full++;
+		mmc_resume_done(host);
 	}
 	mmc_bus_put(host);
 
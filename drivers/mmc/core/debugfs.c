@@ -133,6 +133,30 @@ static const struct file_operations mmc_ios_fops = {
 	.release	= single_release,
 };
 
+static int mmc_resume_show(struct seq_file *s, void *data)
+{
+	struct mmc_host	*host = s->private;
+
+	seq_printf(s, "deferred:\t%u\n", host->resumes_deferred);
+	seq_printf(s, "resumed later:\t%u\n", host->resumes_late);
+	seq_printf(s, "full:\t\t%u\n", host->resumes_full);
+	seq_printf(s, "last usable:\t%u ms\n", host->resume_usable_ms);
+
+	return 0;
+}
+
+static int mmc_resume_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mmc_resume_show, inode->i_private);
+}
+
+static const struct file_operations mmc_resume_fops = {
+	.open		= mmc_resume_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 void mmc_add_host_debugfs(struct mmc_host *host)
 {
 	struct dentry *root;
@@ -151,6 +175,10 @@ void mmc_add_host_debugfs(struct mmc_host *host)
 	if (!debugfs_create_file("ios", S_IRUSR, root, host, &mmc_ios_fops))
 		goto err_ios;
 
+	if (!debugfs_create_file("resume", S_IRUSR, root, host,
+				 &mmc_resume_fops))
+		goto err_ios;
+
 	return;
 
 err_ios:
@@ -700,7 +700,12 @@ static void mmc_sd_attach_bus_ops(struct mmc_host *host)
 {
 	const struct mmc_bus_ops *bus_ops;
 
-	if (host->caps & MMC_CAP_NONREMOVABLE)
+	/*
+	 * A card can also be kept over suspend if the host can tell from
+	 * its card detect line whether it was changed meanwhile.
+	 */
+	if (host->caps & MMC_CAP_NONREMOVABLE ||
+	    (host->ops->get_cd_state && host->ops->get_cd_state(host) >= 0))
 		bus_ops = &mmc_sd_ops_unsafe;
 	else
 		bus_ops = &mmc_sd_ops;
@@ -40,7 +40,24 @@
 
 #define DRIVER_NAME	"pxa2xx-mci"
 
-#define NR_SG	1
+/*
+ * The descriptor chain lives in one coherent page. A descriptor moves at
+ * most PXAMCI_DESC_LEN bytes (the DCMD length field is 13 bits), so
+ * longer segments are split. Limiting a request to NR_DESC / 2 full
+ * descriptors leaves one extra descriptor for the partial tail of each
+ * of the NR_SG segments, so a request always fits in the page.
+ */
+#define NR_DESC		(PAGE_SIZE / sizeof(struct pxa_dma_desc))
+#define NR_SG		(NR_DESC / 2)
+#define PXAMCI_DESC_LEN	4096U
+#define PXAMCI_MAX_REQ	(NR_DESC / 2 * PXAMCI_DESC_LEN)
+
+/*
+ * One descriptor page for the transfer in progress and one for the next
+ * request, prepared by pxamci_pre_req while the current one runs.
+ */
+#define PXAMCI_DESC_SETS	2
+
 #define CLKRT_OFF	(~0)
 
 struct pxamci_host {
@@ -63,8 +80,10 @@ struct pxamci_host {
 	struct mmc_data		*data;
 
 	dma_addr_t		sg_dma;
-	struct pxa_dma_desc	*sg_cpu;
-	unsigned int		dma_len;
+	struct pxa_dma_desc	*sg_cpu;	/* PXAMCI_DESC_SETS pages */
+	int			desc_set;	/* page used by current transfer */
+	int			prep_set;	/* page of prepared chain, or -1 */
+	bool			set_dalgn[PXAMCI_DESC_SETS];
 
 	unsigned int		dma_dir;
 	unsigned int		dma_drcmrrx;
@@ -153,14 +172,83 @@ static void pxamci_disable_irq(struct pxamci_host *host, unsigned int mask)
 	spin_unlock_irqrestore(&host->lock, flags);
 }
 
+static inline enum dma_data_direction pxamci_dma_dir(struct mmc_data *data)
+{
+	return data->flags & MMC_DATA_READ ? DMA_FROM_DEVICE : DMA_TO_DEVICE;
+}
+
+/*
+ * Map the data of a request and build its descriptor chain in descriptor
+ * page 'set'. Returns true if the chain needs byte alignment mode.
+ */
+static bool pxamci_build_chain(struct pxamci_host *host, struct mmc_data *data,
+			       int set)
+{
+	struct pxa_dma_desc *desc = host->sg_cpu + set * NR_DESC;
+	dma_addr_t desc_dma = host->sg_dma + set * PAGE_SIZE;
+	unsigned int dma_len;
+	bool dalgn = 0;
+	u32 dcmd;
+	int i, n = 0;
+
+	if (data->flags & MMC_DATA_READ)
+		dcmd = DCMD_INCTRGADDR | DCMD_FLOWSRC;
+	else
+		dcmd = DCMD_INCSRCADDR | DCMD_FLOWTRG;
+
+	dcmd |= DCMD_BURST32 | DCMD_WIDTH1;
+
+	dma_len = dma_map_sg(mmc_dev(host->mmc), data->sg, data->sg_len,
+			     pxamci_dma_dir(data));
+
+	for (i = 0; i < dma_len; i++) {
+		dma_addr_t addr = sg_dma_address(&data->sg[i]);
+		unsigned int left = sg_dma_len(&data->sg[i]);
+
+		/* Not aligned to 8-byte boundary? */
+		if (addr & 0x7)
+			dalgn = 1;
+
+		while (left) {
+			unsigned int length = min(left, PXAMCI_DESC_LEN);
+
+			BUG_ON(n >= NR_DESC);
+			desc[n].dcmd = dcmd | length;
+			if (data->flags & MMC_DATA_READ) {
+				desc[n].dsadr = host->res->start + MMC_RXFIFO;
+				desc[n].dtadr = addr;
+			} else {
+				desc[n].dsadr = addr;
+				desc[n].dtadr = host->res->start + MMC_TXFIFO;
+			}
+			desc[n].ddadr = desc_dma + (n + 1) *
+					sizeof(struct pxa_dma_desc);
+			addr += length;
+			left -= length;
+			n++;
+		}
+	}
+	desc[n - 1].ddadr = DDADR_STOP;
+
+	/*
+	 * A write that does not end on a full FIFO needs the partial buffer
+	 * flushed once the whole chain has been sent.
+	 */
+	if (!(data->flags & MMC_DATA_READ) &&
+	    (data->blocks * data->blksz) & 31)
+		desc[n - 1].dcmd |= DCMD_ENDIRQEN;
+	wmb();
+
+	return dalgn;
+}
+
 static void pxamci_setup_data(struct pxamci_host *host, struct mmc_data *data)
 {
 	unsigned int nob = data->blocks;
 	unsigned long long clks;
 	unsigned int timeout;
-	bool dalgn = 0;
-	u32 dcmd;
-	int i;
+	bool dalgn;
+	int set;
 
 	host->data = data;
 
@@ -175,43 +263,26 @@ static void pxamci_setup_data(struct pxamci_host *host, struct mmc_data *data)
 	timeout = (unsigned int)clks + (data->timeout_clks << host->clkrt);
 	writel((timeout + 255) / 256, host->base + MMC_RDTO);
 
+	host->dma_dir = pxamci_dma_dir(data);
 	if (data->flags & MMC_DATA_READ) {
-		host->dma_dir = DMA_FROM_DEVICE;
-		dcmd = DCMD_INCTRGADDR | DCMD_FLOWSRC;
 		DRCMR(host->dma_drcmrtx) = 0;
 		DRCMR(host->dma_drcmrrx) = host->dma | DRCMR_MAPVLD;
 	} else {
-		host->dma_dir = DMA_TO_DEVICE;
-		dcmd = DCMD_INCSRCADDR | DCMD_FLOWTRG;
 		DRCMR(host->dma_drcmrrx) = 0;
 		DRCMR(host->dma_drcmrtx) = host->dma | DRCMR_MAPVLD;
 	}
 
-	dcmd |= DCMD_BURST32 | DCMD_WIDTH1;
-
-	host->dma_len = dma_map_sg(mmc_dev(host->mmc), data->sg, data->sg_len,
-				   host->dma_dir);
-
-	for (i = 0; i < host->dma_len; i++) {
-		unsigned int length = sg_dma_len(&data->sg[i]);
-		host->sg_cpu[i].dcmd = dcmd | length;
-		if (length & 31 && !(data->flags & MMC_DATA_READ))
-			host->sg_cpu[i].dcmd |= DCMD_ENDIRQEN;
-		/* Not aligned to 8-byte boundary? */
-		if (sg_dma_address(&data->sg[i]) & 0x7)
-			dalgn = 1;
-		if (data->flags & MMC_DATA_READ) {
-			host->sg_cpu[i].dsadr = host->res->start + MMC_RXFIFO;
-			host->sg_cpu[i].dtadr = sg_dma_address(&data->sg[i]);
-		} else {
-			host->sg_cpu[i].dsadr = sg_dma_address(&data->sg[i]);
-			host->sg_cpu[i].dtadr = host->res->start + MMC_TXFIFO;
-		}
-		host->sg_cpu[i].ddadr = host->sg_dma + (i + 1) *
-					sizeof(struct pxa_dma_desc);
+	if (data->host_cookie) {
+		/* mapped and built by pxamci_pre_req */
+		set = data->host_cookie - 1;
+		dalgn = host->set_dalgn[set];
+		host->prep_set = -1;
+	} else {
+		/* keep off a chain prepared for the next request */
+		set = host->prep_set == 0 ? 1 : 0;
+		dalgn = pxamci_build_chain(host, data, set);
 	}
-	host->sg_cpu[host->dma_len - 1].ddadr = DDADR_STOP;
-	wmb();
+	host->desc_set = set;
 
 	/*
 	 * The PXA27x DMA controller encounters overhead when working with
@@ -222,7 +293,7 @@ static void pxamci_setup_data(struct pxamci_host *host, struct mmc_data *data)
 		DALGN |= (1 << host->dma);
 	else
 		DALGN &= ~(1 << host->dma);
-	DDADR(host->dma) = host->sg_dma;
+	DDADR(host->dma) = host->sg_dma + set * PAGE_SIZE;
 
 	/*
 	 * workaround for erratum #91:
@@ -339,8 +410,10 @@ static int pxamci_data_done(struct pxamci_host *host, unsigned int stat)
 		return 0;
 
 	DCSR(host->dma) = 0;
-	dma_unmap_sg(mmc_dev(host->mmc), data->sg, data->sg_len,
-		     host->dma_dir);
+	/* prepared requests are unmapped in pxamci_post_req */
+	if (!data->host_cookie)
+		dma_unmap_sg(mmc_dev(host->mmc), data->sg, data->sg_len,
+			     host->dma_dir);
 
 	if (stat & STAT_READ_TIME_OUT)
 		data->error = -ETIMEDOUT;
@@ -445,6 +518,18 @@ static int pxamci_get_ro(struct mmc_host *mmc)
 	return -ENOSYS;
 }
 
+static int pxamci_get_cd_state(struct mmc_host *mmc)
+{
+	struct pxamci_host *host = mmc_priv(mmc);
+
+	if (host->pdata && gpio_is_valid(host->pdata->gpio_card_detect))
+		return !!gpio_get_value(host->pdata->gpio_card_detect);
+	if (host->pdata && host->pdata->get_cd_state)
+		return !!host->pdata->get_cd_state(mmc_dev(mmc));
+	/* no card detect line to compare over suspend */
+	return -ENOSYS;
+}
+
 static void pxamci_set_ios(struct mmc_host *mmc, struct mmc_ios *ios)
 {
 	struct pxamci_host *host = mmc_priv(mmc);
@@ -513,9 +598,47 @@ static void pxamci_enable_sdio_irq(struct mmc_host *host, int enable)
 		pxamci_disable_irq(pxa_host, SDIO_INT);
 }
 
+/*
+ * Map and build the descriptor chain of the next request while the
+ * current one is on the wire, in the descriptor page it does not use.
+ */
+static void pxamci_pre_req(struct mmc_host *mmc, struct mmc_request *mrq)
+{
+	struct pxamci_host *host = mmc_priv(mmc);
+	struct mmc_data *data = mrq->data;
+	int set;
+
+	if (data->host_cookie || host->prep_set >= 0 ||
+	    data->flags & MMC_DATA_STREAM)
+		return;
+
+	set = !host->desc_set;
+	host->set_dalgn[set] = pxamci_build_chain(host, data, set);
+	host->prep_set = set;
+	data->host_cookie = set + 1;
+}
+
+static void pxamci_post_req(struct mmc_host *mmc, struct mmc_request *mrq,
+			    int err)
+{
+	struct pxamci_host *host = mmc_priv(mmc);
+	struct mmc_data *data = mrq->data;
+
+	dma_unmap_sg(mmc_dev(mmc), data->sg, data->sg_len,
+		     pxamci_dma_dir(data));
+
+	/* dropped without being issued */
+	if (host->prep_set == data->host_cookie - 1)
+		host->prep_set = -1;
+	data->host_cookie = 0;
+}
+
 static const struct mmc_host_ops pxamci_ops = {
 	.request		= pxamci_request,
+	.pre_req		= pxamci_pre_req,
+	.post_req		= pxamci_post_req,
 	.get_ro			= pxamci_get_ro,
+	.get_cd_state		= pxamci_get_cd_state,
 	.set_ios		= pxamci_set_ios,
 	.enable_sdio_irq	= pxamci_enable_sdio_irq,
 };
@@ -569,15 +692,19 @@ static int pxamci_probe(struct platform_device *pdev)
 	mmc->ops = &pxamci_ops;
 
 	/*
-	 * We can do SG-DMA, but we don't because we never know how much
-	 * data we successfully wrote to the card.
+	 * We never know how much data we successfully wrote to the card,
+	 * so a failed request is reported as failed in full (see
+	 * pxamci_data_done) and the block layer retries it.
 	 */
+	mmc->max_hw_segs = NR_SG;
 	mmc->max_phys_segs = NR_SG;
 
 	/*
-	 * Our hardware DMA can handle a maximum of one page per SG entry.
+	 * Segments longer than one descriptor are split over several, see
+	 * pxamci_setup_data.
 	 */
-	mmc->max_seg_size = PAGE_SIZE;
+	mmc->max_req_size = PXAMCI_MAX_REQ;
+	mmc->max_seg_size = PXAMCI_MAX_REQ;
 
 	/*
 	 * Block length register is only 10 bits before PXA27x.
@@ -592,6 +719,7 @@ static int pxamci_probe(struct platform_device *pdev)
 	host = mmc_priv(mmc);
 	host->mmc = mmc;
 	host->dma = -1;
+	host->prep_set = -1;
 	host->pdata = pdev->dev.platform_data;
 	host->clkrt = CLKRT_OFF;
 
@@ -623,7 +751,9 @@ static int pxamci_probe(struct platform_device *pdev)
 				     MMC_CAP_SD_HIGHSPEED;
 	}
 
-	host->sg_cpu = dma_alloc_coherent(&pdev->dev, PAGE_SIZE, &host->sg_dma, GFP_KERNEL);
+	host->sg_cpu = dma_alloc_coherent(&pdev->dev,
+					  PXAMCI_DESC_SETS * PAGE_SIZE,
+					  &host->sg_dma, GFP_KERNEL);
 	if (!host->sg_cpu) {
 		ret = -ENOMEM;
 		goto out;
@@ -740,7 +870,9 @@ err_gpio_ro:
 		if (host->base)
 			iounmap(host->base);
 		if (host->sg_cpu)
-			dma_free_coherent(&pdev->dev, PAGE_SIZE, host->sg_cpu, host->sg_dma);
+			dma_free_coherent(&pdev->dev,
+					  PXAMCI_DESC_SETS * PAGE_SIZE,
+					  host->sg_cpu, host->sg_dma);
 		if (host->clk)
 			clk_put(host->clk);
 	}
@@ -792,7 +924,8 @@ static int pxamci_remove(struct platform_device *pdev)
 		free_irq(host->irq, host);
 		pxa_free_dma(host->dma);
 		iounmap(host->base);
-		dma_free_coherent(&pdev->dev, PAGE_SIZE, host->sg_cpu, host->sg_dma);
+		dma_free_coherent(&pdev->dev, PXAMCI_DESC_SETS * PAGE_SIZE,
+				  host->sg_cpu, host->sg_dma);
 
 		clk_put(host->clk);
 
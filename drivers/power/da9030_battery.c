@@ -18,6 +18,10 @@
 #include <linux/platform_device.h>
 #include <linux/power_supply.h>
 #include <linux/mfd/da903x.h>
+#include <linux/math64.h>
+#include <linux/cpufreq.h>
+#include <linux/mutex.h>
+#include <linux/rtc.h>
 
 #include <linux/debugfs.h>
 #include <linux/seq_file.h>
@@ -71,6 +75,12 @@ struct da9030_adc_res {
 	uint8_t adc_in5_res;
 };
 
+/* capacity change, in percent, worth a power_supply_changed() */
+#define DA9030_CAPACITY_DELTA	2
+
+/* each OCV reading moves the fuel gauge 1/16 of the way to it */
+#define DA9030_GAUGE_OCV_SHIFT	4
+
 struct da9030_battery_thresholds {
 	int tbat_low;
 	int tbat_high;
@@ -93,8 +103,18 @@ struct da9030_charger {
 
 	struct da9030_adc_res adc;
 	struct delayed_work work;
+	/* the monitor and the PMIC event thread both update the state and
+	 * the activity counters */
+	struct mutex lock;
 	unsigned int interval;
 
+	/* event driven mode: the monitor above runs only with external
+	 * power, otherwise a deferrable refresh every idle_interval */
+	int event_driven;
+	struct delayed_work idle_work;
+	unsigned int idle_interval;
+	unsigned long last_update;
+
 	struct power_supply_info *battery_info;
 
 	struct da9030_battery_thresholds thresholds;
@@ -111,6 +131,27 @@ struct da9030_charger {
 
 	struct notifier_block nb;
 
+	/* software fuel gauge, enabled by info->capacity_mAh */
+	struct da9030_battery_info *info;
+	int gauge;
+	s64 charge_uAh;
+	s64 full_uAh;
+	int current_mA;		/* into the battery, negative discharging */
+	int avg_load_mA;
+	unsigned long gauge_stamp;
+	unsigned long suspend_stamp;
+
+	/* last state reported through power_supply_changed() */
+	int last_status;
+	int last_health;
+	int last_capacity;
+
+	/* activity counters, exported through debugfs */
+	unsigned long stats_start;
+	unsigned int monitor_runs;
+	unsigned int pmic_events;
+	unsigned int i2c_xfers;
+
 	/* platform callbacks for battery low and critical events */
 	void (*battery_low)(void);
 	void (*battery_critical)(void);
@@ -134,6 +175,18 @@ static inline int da9030_reg_to_mA(int reg)
 }
 
 #ifdef CONFIG_DEBUG_FS
+static unsigned long da9030_per_hour(struct da9030_charger *charger,
+				     unsigned int count)
+{
+	unsigned int secs = jiffies_to_msecs(jiffies - charger->stats_start)
+				/ 1000;
+
+	if (!secs)
+		return 0;
+
+	return div_u64((u64)count * 3600, secs);
+}
+
 static int bat_debug_show(struct seq_file *s, void *data)
 {
 	struct da9030_charger *charger = s->private;
@@ -169,6 +222,23 @@ static int bat_debug_show(struct seq_file *s, void *data)
 		   charger->adc.vchmin_res,
 		   da9030_reg_to_mV(charger->adc.vchmin_res));
 
+	if (charger->gauge) {
+		seq_printf(s, "charge = %lldmAh of %lldmAh\n",
+			   div_s64(charger->charge_uAh, 1000),
+			   div_s64(charger->full_uAh, 1000));
+		seq_printf(s, "current = %dmA, average load = %dmA\n",
+			   charger->current_mA, charger->avg_load_mA);
+	}
+
+	seq_printf(s, "mode = %s\n",
+		   charger->event_driven ? "event driven" : "polling");
+	seq_printf(s, "monitor runs = %u (%lu/h)\n", charger->monitor_runs,
+		   da9030_per_hour(charger, charger->monitor_runs));
+	seq_printf(s, "pmic events = %u (%lu/h)\n", charger->pmic_events,
+		   da9030_per_hour(charger, charger->pmic_events));
+	seq_printf(s, "i2c transfers = %u (%lu/h)\n", charger->i2c_xfers,
+		   da9030_per_hour(charger, charger->i2c_xfers));
+
 	return 0;
 }
 
@@ -205,9 +275,34 @@ static inline void da9030_bat_remove_debugfs(struct da9030_charger *charger)
 }
 #endif
 
+/* register accessors counting the I2C transfers they cost */
+static inline int da9030_bat_read(struct da9030_charger *charger,
+				  int reg, uint8_t *val)
+{
+	charger->i2c_xfers++;
+	return da903x_read(charger->master, reg, val);
+}
+
+static inline int da9030_bat_write(struct da9030_charger *charger,
+				   int reg, uint8_t val)
+{
+	charger->i2c_xfers++;
+	return da903x_write(charger->master, reg, val);
+}
+
+/* only the monitor work asks, outside of the event dispatch the status
+ * read cached with the events is not there and costs a transfer */
+static inline int da9030_bat_query_status(struct da9030_charger *charger,
+					  unsigned int sbits)
+{
+	charger->i2c_xfers++;
+	return da903x_query_status(charger->master, sbits);
+}
+
 static inline void da9030_read_adc(struct da9030_charger *charger,
 				   struct da9030_adc_res *adc)
 {
+	charger->i2c_xfers++;
 	da903x_reads(charger->master, DA9030_VBAT_RES,
 		     sizeof(*adc), (uint8_t *)adc);
 }
@@ -216,17 +311,18 @@ static void da9030_charger_update_state(struct da9030_charger *charger)
 {
 	uint8_t val;
 
-	da903x_read(charger->master, DA9030_CHARGE_CONTROL, &val);
+	da9030_bat_read(charger, DA9030_CHARGE_CONTROL, &val);
 	charger->is_on = (val & DA9030_CHRG_CHARGER_ENABLE) ? 1 : 0;
 	charger->mA = ((val >> 3) & 0xf) * 100;
 	charger->mV = (val & 0x7) * 50 + 4000;
 
 	da9030_read_adc(charger, &charger->adc);
-	da903x_read(charger->master, DA9030_FAULT_LOG, &charger->fault);
-	charger->chdet = da903x_query_status(charger->master,
-						     DA9030_STATUS_CHDET);
+	da9030_bat_read(charger, DA9030_FAULT_LOG, &charger->fault);
+	charger->chdet = da9030_bat_query_status(charger, DA9030_STATUS_CHDET);
 }
 
+static void da9030_battery_notify(struct da9030_charger *charger);
+
 static void da9030_set_charge(struct da9030_charger *charger, int on)
 {
 	uint8_t val;
@@ -241,9 +337,9 @@ static void da9030_set_charge(struct da9030_charger *charger, int on)
 		charger->is_on = 0;
 	}
 
-	da903x_write(charger->master, DA9030_CHARGE_CONTROL, val);
+	da9030_bat_write(charger, DA9030_CHARGE_CONTROL, val);
 
-	power_supply_changed(&charger->psy);
+	da9030_battery_notify(charger);
 }
 
 static void da9030_charger_check_state(struct da9030_charger *charger)
@@ -266,15 +362,16 @@ static void da9030_charger_check_state(struct da9030_charger *charger)
 
 		if (charger->adc.vbat_res >=
 		    charger->thresholds.vbat_charge_stop) {
+			charger->charge_uAh = charger->full_uAh;
 			da9030_set_charge(charger, 0);
-			da903x_write(charger->master, DA9030_VBATMON,
+			da9030_bat_write(charger, DA9030_VBATMON,
 				       charger->thresholds.vbat_charge_restart);
 		} else if (charger->adc.vbat_res >
 			   charger->thresholds.vbat_low) {
 			/* we are charging and passed LOW_THRESH,
 			   so upate DA9030 VBAT threshold
 			 */
-			da903x_write(charger->master, DA9030_VBATMON,
+			da9030_bat_write(charger, DA9030_VBATMON,
 				     charger->thresholds.vbat_low);
 		}
 		if (charger->adc.vchmax_res > charger->thresholds.vcharge_max ||
@@ -288,16 +385,150 @@ static void da9030_charger_check_state(struct da9030_charger *charger)
 	}
 }
 
+/* modeled discharge current of the whole system */
+static int da9030_gauge_load(struct da9030_charger *charger)
+{
+	struct da9030_battery_info *info = charger->info;
+	int mA = info->load_base_mA;
+
+	mA += cpufreq_quick_get(0) / 1000 * info->load_cpu_uA_per_MHz / 1000;
+	if (info->load_extra_mA)
+		mA += info->load_extra_mA();
+
+	return mA;
+}
+
+/* state of charge in percent for an open circuit voltage */
+static int da9030_gauge_ocv_capacity(struct da9030_charger *charger, int mV)
+{
+	struct da9030_ocv *ocv = charger->info->ocv_table;
+	int i;
+
+	if (mV >= ocv[0].mV)
+		return ocv[0].capacity;
+
+	for (i = 1; i < charger->info->ocv_table_size; i++) {
+		if (mV >= ocv[i].mV)
+			return ocv[i].capacity +
+				(mV - ocv[i].mV) *
+				(ocv[i - 1].capacity - ocv[i].capacity) /
+				(ocv[i - 1].mV - ocv[i].mV);
+	}
+
+	return ocv[i - 1].capacity;
+}
+
+/*
+ * Integrate the battery current since the last update: the averaged
+ * charge current while charging, the modeled load otherwise. Only
+ * values already read by the monitor are used, no ADC access here.
+ * Without external power the battery voltage, corrected for the load,
+ * pulls the estimate towards the OCV curve.
+ */
+static void da9030_gauge_update(struct da9030_charger *charger)
+{
+	int load, mA, ocv_mV;
+	unsigned long now = jiffies;
+	s64 target;
+
+	if (!charger->gauge)
+		return;
+
+	load = da9030_gauge_load(charger);
+	if (charger->is_on)
+		mA = da9030_reg_to_mA(charger->adc.ichaverage_res) - load;
+	else
+		mA = -load;
+
+	ocv_mV = da9030_reg_to_mV(charger->adc.vbat_res) +
+		 load * charger->info->internal_mohm / 1000;
+	target = div_s64(charger->full_uAh *
+			 da9030_gauge_ocv_capacity(charger, ocv_mV), 100);
+
+	if (charger->charge_uAh < 0) {
+		/* first estimate comes from the OCV alone */
+		charger->charge_uAh = target;
+		charger->avg_load_mA = load;
+	} else {
+		/* mA * ms / 3600 = uAh, trapezoid over the interval */
+		charger->charge_uAh += div_s64((s64)(charger->current_mA + mA) *
+				jiffies_to_msecs(now - charger->gauge_stamp),
+				2 * 3600);
+		if (!charger->chdet)
+			charger->charge_uAh += (target - charger->charge_uAh) >>
+					       DA9030_GAUGE_OCV_SHIFT;
+		charger->avg_load_mA = (3 * charger->avg_load_mA + load) / 4;
+	}
+
+	if (charger->charge_uAh > charger->full_uAh)
+		charger->charge_uAh = charger->full_uAh;
+	else if (charger->charge_uAh < 0)
+		charger->charge_uAh = 0;
+
+	charger->current_mA = mA;
+	charger->gauge_stamp = now;
+}
+
+static int da9030_gauge_time_to_empty(struct da9030_charger *charger)
+{
+	if (!charger->gauge || charger->chdet || charger->avg_load_mA <= 0)
+		return -ENODEV;
+
+	/* seconds = uAh * 3.6 / mA */
+	return div_s64(charger->charge_uAh * 18, charger->avg_load_mA * 5);
+}
+
+/*
+ * Queue the next monitor run, counted from the last one so that a
+ * resume does not restart the interval.
+ */
+static void da9030_battery_schedule(struct da9030_charger *charger)
+{
+	struct delayed_work *work = &charger->work;
+	unsigned long interval = charger->interval;
+	unsigned long next;
+
+	if (charger->event_driven && !charger->chdet) {
+		if (!charger->idle_interval)
+			return;
+		work = &charger->idle_work;
+		interval = charger->idle_interval;
+	}
+
+	next = charger->last_update + interval;
+	schedule_delayed_work(work, time_after(next, jiffies) ?
+			      next - jiffies : 0);
+}
+
+static void da9030_battery_update(struct da9030_charger *charger)
+{
+	mutex_lock(&charger->lock);
+	charger->monitor_runs++;
+	charger->last_update = jiffies;
+
+	da9030_charger_check_state(charger);
+	da9030_gauge_update(charger);
+	da9030_battery_notify(charger);
+
+	/* reschedule for the next time */
+	da9030_battery_schedule(charger);
+	mutex_unlock(&charger->lock);
+}
+
 static void da9030_charging_monitor(struct work_struct *work)
 {
 	struct da9030_charger *charger;
 
 	charger = container_of(work, struct da9030_charger, work.work);
+	da9030_battery_update(charger);
+}
 
-	da9030_charger_check_state(charger);
+static void da9030_idle_monitor(struct work_struct *work)
+{
+	struct da9030_charger *charger;
 
-	/* reschedule for the next time */
-	schedule_delayed_work(&charger->work, charger->interval);
+	charger = container_of(work, struct da9030_charger, idle_work.work);
+	da9030_battery_update(charger);
 }
 
 static enum power_supply_property da9030_battery_props[] = {
@@ -310,6 +541,7 @@ static enum power_supply_property da9030_battery_props[] = {
 	POWER_SUPPLY_PROP_VOLTAGE_NOW,
 	POWER_SUPPLY_PROP_CURRENT_AVG,
 	POWER_SUPPLY_PROP_CAPACITY,
+	POWER_SUPPLY_PROP_TIME_TO_EMPTY_AVG,
 };
 
 static void da9030_battery_check_status(struct da9030_charger *charger,
@@ -338,7 +570,13 @@ static void da9030_battery_check_health(struct da9030_charger *charger,
 
 static int da9030_battery_get_capacity(struct da9030_charger *charger)
 {
-	int capacity = 	((da9030_reg_to_mV(charger->adc.vbat_res) * 1000 -
+	int capacity;
+
+	if (charger->gauge && charger->charge_uAh >= 0)
+		return div_s64(charger->charge_uAh * 100 +
+			       charger->full_uAh / 2, charger->full_uAh);
+
+	capacity = ((da9030_reg_to_mV(charger->adc.vbat_res) * 1000 -
 			charger->battery_info->voltage_min_design) * 100L) /
 			(charger->battery_info->voltage_max_design -
 			 charger->battery_info->voltage_min_design);
@@ -351,13 +589,41 @@ static int da9030_battery_get_capacity(struct da9030_charger *charger)
 	return capacity;
 }
 
+/*
+ * Report a change only when status or health moved or the capacity
+ * drifted by DA9030_CAPACITY_DELTA, so that ADC noise does not wake
+ * up userspace.
+ */
+static void da9030_battery_notify(struct da9030_charger *charger)
+{
+	union power_supply_propval status, health;
+	int capacity;
+
+	da9030_battery_check_status(charger, &status);
+	da9030_battery_check_health(charger, &health);
+	capacity = da9030_battery_get_capacity(charger);
+
+	if (status.intval == charger->last_status &&
+	    health.intval == charger->last_health &&
+	    abs(capacity - charger->last_capacity) < DA9030_CAPACITY_DELTA)
+		return;
+
+	charger->last_status = status.intval;
+	charger->last_health = health.intval;
+	charger->last_capacity = capacity;
+	power_supply_changed(&charger->psy);
+}
+
 static int da9030_battery_get_property(struct power_supply *psy,
 				   enum power_supply_property psp,
 				   union power_supply_propval *val)
 {
 	struct da9030_charger *charger;
+	int ret = 0;
+
 	charger = container_of(psy, struct da9030_charger, psy);
 
+	mutex_lock(&charger->lock);
 	switch (psp) {
 	case POWER_SUPPLY_PROP_STATUS:
 		da9030_battery_check_status(charger, val);
@@ -387,23 +653,31 @@ static int da9030_battery_get_property(struct power_supply *psy,
 	case POWER_SUPPLY_PROP_CAPACITY:
 		val->intval = da9030_battery_get_capacity(charger);
 		break;
+	case POWER_SUPPLY_PROP_TIME_TO_EMPTY_AVG:
+		val->intval = da9030_gauge_time_to_empty(charger);
+		if (val->intval < 0)
+			ret = val->intval;
+		break;
 	default:
-		return -EINVAL;
+		ret = -EINVAL;
+		break;
 	}
+	mutex_unlock(&charger->lock);
 
-	return 0;
+	return ret;
 }
 
 static void da9030_battery_vbat_event(struct da9030_charger *charger)
 {
+	mutex_lock(&charger->lock);
 	da9030_read_adc(charger, &charger->adc);
 
 	if (charger->is_on)
-		return;
+		goto out;
 
 	if (charger->adc.vbat_res < charger->thresholds.vbat_low) {
 		/* set VBAT threshold for critical */
-		da903x_write(charger->master, DA9030_VBATMON,
+		da9030_bat_write(charger, DA9030_VBATMON,
 			     charger->thresholds.vbat_crit);
 		if (charger->battery_low)
 			charger->battery_low();
@@ -413,6 +687,11 @@ static void da9030_battery_vbat_event(struct da9030_charger *charger)
 		if (charger->battery_critical)
 			charger->battery_critical();
 	}
+
+	da9030_gauge_update(charger);
+	da9030_battery_notify(charger);
+out:
+	mutex_unlock(&charger->lock);
 }
 
 static int da9030_battery_event(struct notifier_block *nb, unsigned long event,
@@ -421,9 +700,14 @@ static int da9030_battery_event(struct notifier_block *nb, unsigned long event,
 	struct da9030_charger *charger =
 		container_of(nb, struct da9030_charger, nb);
 
+	mutex_lock(&charger->lock);
+	charger->pmic_events++;
+	mutex_unlock(&charger->lock);
+
 	switch (event) {
 	case DA9030_EVENT_CHDET:
 		cancel_delayed_work_sync(&charger->work);
+		cancel_delayed_work_sync(&charger->idle_work);
 		schedule_work(&charger->work.work);
 		break;
 	case DA9030_EVENT_VBATMON:
@@ -431,7 +715,9 @@ static int da9030_battery_event(struct notifier_block *nb, unsigned long event,
 		break;
 	case DA9030_EVENT_CHIOVER:
 	case DA9030_EVENT_TBAT:
+		mutex_lock(&charger->lock);
 		da9030_set_charge(charger, 0);
+		mutex_unlock(&charger->lock);
 		break;
 	}
 
@@ -567,11 +853,18 @@ static int da9030_battery_probe(struct platform_device *pdev)
 		return -ENOMEM;
 
 	charger->master = pdev->dev.parent;
+	mutex_init(&charger->lock);
 
 	/* 10 seconds between monotor runs unless platfrom defines other
 	   interval */
 	charger->interval = msecs_to_jiffies(
 		(pdata->batmon_interval ? : 10) * 1000);
+	charger->event_driven = pdata->event_driven;
+	charger->idle_interval = msecs_to_jiffies(
+		pdata->batmon_idle_interval * 1000);
+	charger->last_status = charger->last_health = -1;
+	charger->last_capacity = -DA9030_CAPACITY_DELTA;
+	charger->stats_start = charger->last_update = jiffies;
 
 	charger->charge_milliamp = pdata->charge_milliamp;
 	charger->charge_millivolt = pdata->charge_millivolt;
@@ -579,6 +872,11 @@ static int da9030_battery_probe(struct platform_device *pdev)
 	charger->battery_low = pdata->battery_low;
 	charger->battery_critical = pdata->battery_critical;
 
+	charger->info = pdata;
+	charger->gauge = pdata->capacity_mAh && pdata->ocv_table_size;
+	charger->full_uAh = pdata->capacity_mAh * 1000;
+	charger->charge_uAh = -1;
+
 	da9030_battery_convert_thresholds(charger, pdata);
 
 	ret = da9030_battery_charger_init(charger);
@@ -586,6 +884,8 @@ static int da9030_battery_probe(struct platform_device *pdev)
 		goto err_charger_init;
 
 	INIT_DELAYED_WORK(&charger->work, da9030_charging_monitor);
+	INIT_DELAYED_WORK_DEFERRABLE(&charger->idle_work, da9030_idle_monitor);
+	/* the first run decides between the two */
 	schedule_delayed_work(&charger->work, charger->interval);
 
 	charger->nb.notifier_call = da9030_battery_event;
@@ -623,7 +923,8 @@ err_ps_register:
 				   DA9030_EVENT_CHDET | DA9030_EVENT_VBATMON |
 				   DA9030_EVENT_CHIOVER | DA9030_EVENT_TBAT);
 err_notifier:
-	cancel_delayed_work(&charger->work);
+	cancel_delayed_work_sync(&charger->work);
+	cancel_delayed_work_sync(&charger->idle_work);
 
 err_charger_init:
 	kfree(charger);
@@ -641,6 +942,7 @@ static int da9030_battery_remove(struct platform_device *dev)
 				   DA9030_EVENT_CHDET | DA9030_EVENT_VBATMON |
 				   DA9030_EVENT_CHIOVER | DA9030_EVENT_TBAT);
 	cancel_delayed_work_sync(&charger->work);
+	cancel_delayed_work_sync(&charger->idle_work);
 	da9030_set_charge(charger, 0);
 	power_supply_unregister(&charger->psy);
 
@@ -649,6 +951,80 @@ static int da9030_battery_remove(struct platform_device *dev)
 	return 0;
 }
 
+#ifdef CONFIG_PM
+/*
+ * Seconds from the RTC itself: ARM has no persistent clock, the wall
+ * clock only catches up with the sleep in the resume of rtc0, which is
+ * registered, and so resumed, after us.
+ */
+static int da9030_battery_rtc_seconds(unsigned long *secs)
+{
+#ifdef CONFIG_RTC_CLASS
+	struct rtc_device *rtc = rtc_class_open("rtc0");
+	struct rtc_time tm;
+	int ret;
+
+	if (!rtc)
+		return -ENODEV;
+
+	ret = rtc_read_time(rtc, &tm);
+	rtc_class_close(rtc);
+	if (ret == 0)
+		ret = rtc_tm_to_time(&tm, secs);
+	return ret;
+#else
+	return -ENODEV;
+#endif
+}
+
+/* keep the monitor off the I2C bus while it is suspended */
+static int da9030_battery_suspend(struct platform_device *dev,
+				  pm_message_t state)
+{
+	struct da9030_charger *charger = platform_get_drvdata(dev);
+
+	cancel_delayed_work_sync(&charger->work);
+	cancel_delayed_work_sync(&charger->idle_work);
+
+	mutex_lock(&charger->lock);
+	charger->suspend_stamp = 0;
+	if (charger->gauge && charger->charge_uAh >= 0) {
+		da9030_gauge_update(charger);
+		if (da9030_battery_rtc_seconds(&charger->suspend_stamp))
+			charger->suspend_stamp = 0;
+	}
+	mutex_unlock(&charger->lock);
+	return 0;
+}
+
+static int da9030_battery_resume(struct platform_device *dev)
+{
+	struct da9030_charger *charger = platform_get_drvdata(dev);
+	unsigned long now;
+
+	/* jiffies stood still, account the sleep at the sleep current */
+	mutex_lock(&charger->lock);
+	if (charger->gauge && charger->charge_uAh >= 0) {
+		if (!charger->chdet && charger->suspend_stamp &&
+		    !da9030_battery_rtc_seconds(&now) &&
+		    now > charger->suspend_stamp)
+			charger->charge_uAh -= div_s64(
+				(s64)charger->info->load_sleep_mA * 1000 *
+				(now - charger->suspend_stamp), 3600);
+		if (charger->charge_uAh < 0)
+			charger->charge_uAh = 0;
+		charger->gauge_stamp = jiffies;
+	}
+
+	da9030_battery_schedule(charger);
+	mutex_unlock(&charger->lock);
+	return 0;
+}
+#else
+#define da9030_battery_suspend	NULL
+#define da9030_battery_resume	NULL
+#endif
+
 static struct platform_driver da903x_battery_driver = {
 	.driver	= {
 		.name	= "da903x-battery",
@@ -656,6 +1032,8 @@ static struct platform_driver da903x_battery_driver = {
 	},
 	.probe = da9030_battery_probe,
 	.remove = da9030_battery_remove,
+	.suspend = da9030_battery_suspend,
+	.resume = da9030_battery_resume,
 };
 
 static int da903x_battery_init(void)
@@ -31,6 +31,7 @@
 #include <linux/clk.h>
 #include <linux/irq.h>
 #include <linux/gpio.h>
+#include <linux/dma-mapping.h>
 
 #include <asm/byteorder.h>
 #include <mach/hardware.h>
@@ -70,13 +71,21 @@
  *  - file storage gadget
  *  - ether gadget
  *
- * The driver doesn't use DMA, only IO access and IRQ callbacks. No use is
- * made of UDC's double buffering either. USB "On-The-Go" is not implemented.
+ * Bulk endpoints use DMA for the full packets of a request, everything else
+ * is IO access and IRQ callbacks. No use is made of UDC's double buffering.
+ * USB "On-The-Go" is not implemented.
  *
  * All the requests are handled the same way :
- *  - the drivers tries to handle the request directly to the IO
+ *  - if the endpoint has a DMA channel, the request buffer is suitably
+ *    aligned and holds at least one full packet, the full packets are
+ *    transfered by DMA, at most UDC_DMA_DESCS * UDC_DMA_CHUNK bytes a run
+ *  - the drivers tries to handle the rest directly to the IO
  *  - if the IO fifo is not big enough, the remaining is send/received in
  *    interrupt handling.
+ *
+ * The UDC only requests DMA for full packets: a short OUT packet stops the
+ * OUT DMA early and is read by IO, as are short IN tails and zero length
+ * packets.
  */
 
 #define	DRIVER_VERSION	"2008-04-18"
@@ -85,6 +94,10 @@
 static const char driver_name[] = "pxa27x_udc";
 static struct pxa_udc *the_controller;
 
+static int use_dma = 1;
+module_param(use_dma, bool, 0444);
+MODULE_PARM_DESC(use_dma, "use DMA for bulk endpoints (default true)");
+
 static void handle_ep(struct pxa_ep *ep);
 
 /*
@@ -161,7 +174,8 @@ static int queues_dbg_show(struct seq_file *s, void *p)
 		ep = &udc->pxa_ep[i];
 		maxpkt = ep->fifo_size;
 		pos += seq_printf(s,  "%-12s max_pkt=%d %s\n",
-				EPNAME(ep), maxpkt, "pio");
+				EPNAME(ep), maxpkt,
+				ep->dma_ch >= 0 ? "dma" : "pio");
 
 		if (list_empty(&ep->queue)) {
 			pos += seq_printf(s, "\t(nothing queued)\n");
@@ -206,12 +220,14 @@ static int eps_dbg_show(struct seq_file *s, void *p)
 		tmp = i? udc_ep_readl(ep, UDCCR) : udc_readl(udc, UDCCR);
 		pos += seq_printf(s, "%-12s: "
 				"IN %lu(%lu reqs), OUT %lu(%lu reqs), "
-				"irqs=%lu, udccr=0x%08x, udccsr=0x%03x, "
+				"irqs=%lu, dma %lu(%lu irqs), "
+				"udccr=0x%08x, udccsr=0x%03x, "
 				"udcbcr=%d\n",
 				EPNAME(ep),
 				ep->stats.in_bytes, ep->stats.in_ops,
 				ep->stats.out_bytes, ep->stats.out_ops,
 				ep->stats.irqs,
+				ep->stats.dma_bytes, ep->stats.dma_irqs,
 				tmp, udc_ep_readl(ep, UDCCSR),
 				udc_ep_readl(ep, UDCBCR));
 	}
@@ -486,6 +502,8 @@ static inline void ep_write_UDCCSR(struct pxa_ep *ep, int mask)
 {
 	if (is_ep0(ep))
 		mask |= UDCCSR0_ACM;
+	else if (ep->dma_req)
+		mask |= UDCCSR_DME;
 	udc_ep_writel(ep, UDCCSR, mask);
 }
 
@@ -737,6 +755,109 @@ static void ep_del_request(struct pxa_ep *ep, struct pxa27x_request *req)
 		pio_irq_disable(ep);
 }
 
+/**
+ * pxa_ep_dma_stop - Stops the DMA of an endpoint
+ * @ep: pxa physical endpoint
+ * @done: bytes transfered, -1 to read them from the DMA channel
+ *
+ * Context: ep->lock held
+ *
+ * Accounts the transfered bytes in the request, unmaps its buffer and gives
+ * the endpoint back to IO accesses.
+ */
+static void pxa_ep_dma_stop(struct pxa_ep *ep, int done)
+{
+	struct pxa27x_request *req = ep->dma_req;
+	int ch = ep->dma_ch, timeout = 1000;
+
+	if (done < 0) {
+		DCSR(ch) = 0;
+		while (!(DCSR(ch) & DCSR_STOPSTATE) && --timeout)
+			udelay(1);
+		if (ep->dir_in)
+			done = DSADR(ch) - ep->dma_buf;
+		else
+			done = DTADR(ch) - ep->dma_buf;
+		done = min_t(unsigned, done, ep->dma_len);
+	}
+
+	dma_unmap_single(ep->dev->dev, ep->dma_buf, ep->dma_len,
+			 ep->dir_in ? DMA_TO_DEVICE : DMA_FROM_DEVICE);
+	req->req.actual += done;
+	ep->stats.dma_bytes += done;
+	inc_ep_stats_bytes(ep, done, ep->dir_in);
+
+	ep->dma_req = NULL;
+	ep_write_UDCCSR(ep, 0);
+	if (ep->dir_in)
+		pio_irq_enable(ep);
+}
+
+/**
+ * pxa_ep_dma_start - Starts the DMA of the full packets of a request
+ * @ep: pxa physical endpoint
+ * @req: pxa usb request, head of the endpoint queue
+ * @udccsr: current value of the endpoint UDCCSR
+ *
+ * Context: ep->lock held
+ *
+ * Returns 1 if the DMA was started, 0 if the request is left to IO accesses
+ */
+static int pxa_ep_dma_start(struct pxa_ep *ep, struct pxa27x_request *req,
+			    u32 udccsr)
+{
+	unsigned len, off, n;
+	void *buf = req->req.buf + req->req.actual;
+	dma_addr_t fifo = ep->dev->phys + ofs_UDCDR(ep);
+	pxa_dma_desc *desc = ep->dma_desc;
+	u32 dcmd;
+	int i;
+
+	if (ep->dma_ch < 0 || ((unsigned long)buf & 7))
+		return 0;
+	/* a short packet waiting in the fifo is not requested by the UDC */
+	if (!ep->dir_in && (udccsr & UDCCSR_SP))
+		return 0;
+
+	len = (req->req.length - req->req.actual) & ~(ep->fifo_size - 1);
+	len = min_t(unsigned, len, UDC_DMA_DESCS * UDC_DMA_CHUNK);
+	if (!len)
+		return 0;
+
+	ep->dma_buf = dma_map_single(ep->dev->dev, buf, len,
+			ep->dir_in ? DMA_TO_DEVICE : DMA_FROM_DEVICE);
+	ep->dma_len = len;
+
+	if (ep->dir_in)
+		dcmd = DCMD_INCSRCADDR | DCMD_FLOWTRG;
+	else
+		dcmd = DCMD_INCTRGADDR | DCMD_FLOWSRC;
+	dcmd |= DCMD_BURST32 | DCMD_WIDTH4;
+
+	for (i = 0, off = 0; off < len; i++, off += n) {
+		n = min_t(unsigned, len - off, UDC_DMA_CHUNK);
+		desc[i].ddadr = ep->dma_desc_phys + (i + 1) * sizeof(*desc);
+		desc[i].dsadr = ep->dir_in ? ep->dma_buf + off : fifo;
+		desc[i].dtadr = ep->dir_in ? fifo : ep->dma_buf + off;
+		desc[i].dcmd = dcmd | n;
+	}
+	desc[i - 1].ddadr = DDADR_STOP;
+	desc[i - 1].dcmd |= DCMD_ENDIRQEN;
+
+	ep_vdbg(ep, "req:%p, dma %u bytes at %u/%u\n", req, len,
+		req->req.actual, req->req.length);
+
+	/* IN fifo refills are the DMA's business, OUT irqs catch short pkts */
+	if (ep->dir_in)
+		pio_irq_disable(ep);
+	ep->dma_req = req;
+	ep_write_UDCCSR(ep, 0);
+
+	DDADR(ep->dma_ch) = ep->dma_desc_phys;
+	DCSR(ep->dma_ch) = DCSR_RUN;
+	return 1;
+}
+
 /**
  * req_done - Complete an usb request
  * @ep: pxa physical endpoint
@@ -749,6 +870,8 @@ static void ep_del_request(struct pxa_ep *ep, struct pxa27x_request *req)
  */
 static void req_done(struct pxa_ep *ep, struct pxa27x_request *req, int status)
 {
+	if (unlikely(req == ep->dma_req))
+		pxa_ep_dma_stop(ep, -1);
 	ep_del_request(ep, req);
 	if (likely(req->req.status == -EINPROGRESS))
 		req->req.status = status;
@@ -846,6 +969,97 @@ static void nuke(struct pxa_ep *ep, int status)
 	}
 }
 
+/**
+ * pxa_ep_dma_irq - Handles the end of a DMA run
+ * @dma: DMA channel
+ * @data: pxa physical endpoint
+ *
+ * Completes the request if the DMA transfered all of it, else hands the
+ * rest over to the next DMA run or to IO accesses.
+ */
+static void pxa_ep_dma_irq(int dma, void *data)
+{
+	struct pxa_ep *ep = data;
+	struct pxa27x_request *req;
+	unsigned long flags;
+	u32 dcsr;
+
+	spin_lock_irqsave(&ep->lock, flags);
+
+	dcsr = DCSR(dma);
+	DCSR(dma) = DCSR_STARTINTR | DCSR_ENDINTR | DCSR_BUSERR;
+	ep->stats.dma_irqs++;
+
+	req = ep->dma_req;
+	if (!req)
+		goto out;
+
+	if (unlikely(dcsr & DCSR_BUSERR)) {
+		ep_err(ep, "dma bus error, dcsr=0x%08x\n", dcsr);
+		pxa_ep_dma_stop(ep, -1);
+		req_done(ep, req, -EIO);
+		goto out;
+	}
+	if (!(dcsr & DCSR_ENDINTR))
+		goto out;
+
+	pxa_ep_dma_stop(ep, ep->dma_len);
+	if (req->req.actual == req->req.length
+			&& !(ep->dir_in && req->req.zero)) {
+		if (ep->dir_in)
+			ep_end_in_req(ep, req);
+		else
+			ep_end_out_req(ep, req);
+	}
+	handle_ep(ep);
+out:
+	spin_unlock_irqrestore(&ep->lock, flags);
+}
+
+/**
+ * pxa_ep_dma_request - Gets a DMA channel for a bulk endpoint
+ * @ep: pxa physical endpoint
+ *
+ * The endpoint silently stays in PIO if no channel is available.
+ */
+static void pxa_ep_dma_request(struct pxa_ep *ep)
+{
+	struct pxa_udc *udc = ep->dev;
+	int ch;
+
+	if (!use_dma || !udc->dma_desc || ep->dma_ch >= 0
+			|| ep->type != USB_ENDPOINT_XFER_BULK)
+		return;
+
+	ch = pxa_request_dma(ep->name, DMA_PRIO_LOW, pxa_ep_dma_irq, ep);
+	if (ch < 0) {
+		ep_dbg(ep, "no dma channel, using pio\n");
+		return;
+	}
+
+	ep->dma_ch = ch;
+	ep->dma_desc = udc->dma_desc + EPIDX(ep) * UDC_DMA_DESCS;
+	ep->dma_desc_phys = udc->dma_desc_phys
+		+ EPIDX(ep) * UDC_DMA_DESCS * sizeof(pxa_dma_desc);
+	DRCMR(UDC_DRCMR(ep)) = DRCMR_MAPVLD | ch;
+}
+
+/**
+ * pxa_ep_dma_release - Gives back the DMA channel of an endpoint
+ * @ep: pxa physical endpoint
+ *
+ * Context: no request queued on the endpoint
+ */
+static void pxa_ep_dma_release(struct pxa_ep *ep)
+{
+	if (ep->dma_ch < 0)
+		return;
+
+	DRCMR(UDC_DRCMR(ep)) = 0;
+	pxa_free_dma(ep->dma_ch);
+	ep->dma_ch = -1;
+}
+
 /**
  * read_packet - transfer 1 packet from an OUT endpoint into request
  * @ep: pxa physical endpoint
@@ -1425,6 +1639,7 @@ static int pxa_ep_enable(struct usb_ep *_ep,
 	}
 
 	ep->enabled = 1;
+	pxa_ep_dma_request(ep);
 
 	/* flush fifo (mostly for OUT buffers) */
 	pxa_ep_fifo_flush(_ep);
@@ -1458,6 +1673,7 @@ static int pxa_ep_disable(struct usb_ep *_ep)
 	spin_lock_irqsave(&ep->lock, flags);
 	ep->enabled = 0;
 	nuke(ep, -ESHUTDOWN);
+	pxa_ep_dma_release(ep);
 	spin_unlock_irqrestore(&ep->lock, flags);
 
 	pxa_ep_fifo_flush(_ep);
@@ -1711,6 +1927,7 @@ static __init void udc_init_data(struct pxa_udc *dev)
 		ep = &dev->pxa_ep[i];
 
 		ep->enabled = is_ep0(ep);
+		ep->dma_ch = -1;
 		INIT_LIST_HEAD(&ep->queue);
 		spin_lock_init(&ep->lock);
 	}
@@ -2091,7 +2308,11 @@ static void handle_ep0(struct pxa_udc *udc, int fifo_irq, int opc_irq)
  * Tries to transfer all pending request data into the endpoint and/or
  * transfer all pending data in the endpoint into usb requests.
  *
- * Is always called when in_interrupt() or with ep->lock held.
+ * Context: ep->lock held
+ *
+ * The UDC irq runs with irqs enabled, so the DMA irq of the same endpoint
+ * can come in at any point: the lock keeps both from stopping the DMA or
+ * completing the request behind each other's back.
  */
 static void handle_ep(struct pxa_ep *ep)
 {
@@ -2114,11 +2335,19 @@ static void handle_ep(struct pxa_ep *ep)
 				req, udccsr, loop++);
 
 		if (unlikely(udccsr & (UDCCSR_SST | UDCCSR_TRN)))
-			udc_ep_writel(ep, UDCCSR,
-					udccsr & (UDCCSR_SST | UDCCSR_TRN));
+			ep_write_UDCCSR(ep, udccsr & (UDCCSR_SST | UDCCSR_TRN));
 		if (!req)
 			break;
 
+		if (ep->dma_req) {
+			/* only a short OUT packet needs us during DMA */
+			if (is_in || !(udccsr & UDCCSR_SP))
+				break;
+			pxa_ep_dma_stop(ep, -1);
+		} else if (pxa_ep_dma_start(ep, req, udccsr)) {
+			break;
+		}
+
 		if (unlikely(is_in)) {
 			if (likely(!ep_is_full(ep)))
 				completed = write_fifo(ep, req);
@@ -2202,6 +2431,7 @@ static void irq_handle_data(int irq, struct pxa_udc *udc)
 {
 	int i;
 	struct pxa_ep *ep;
+	unsigned long flags;
 	u32 udcisr0 = udc_readl(udc, UDCISR0) & UDCCISR0_EP_MASK;
 	u32 udcisr1 = udc_readl(udc, UDCISR1) & UDCCISR1_EP_MASK;
 
@@ -2219,8 +2449,10 @@ static void irq_handle_data(int irq, struct pxa_udc *udc)
 
 		udc_writel(udc, UDCISR0, UDCISR_INT(i, UDCISR_INT_MASK));
 		ep = &udc->pxa_ep[i];
+		spin_lock_irqsave(&ep->lock, flags);
 		ep->stats.irqs++;
 		handle_ep(ep);
+		spin_unlock_irqrestore(&ep->lock, flags);
 	}
 
 	for (i = 16; udcisr1 != 0 && i < 24; udcisr1 >>= 2, i++) {
@@ -2229,8 +2461,10 @@ static void irq_handle_data(int irq, struct pxa_udc *udc)
 			continue;
 
 		ep = &udc->pxa_ep[i];
+		spin_lock_irqsave(&ep->lock, flags);
 		ep->stats.irqs++;
 		handle_ep(ep);
+		spin_unlock_irqrestore(&ep->lock, flags);
 	}
 
 }
@@ -2400,6 +2634,21 @@ static struct pxa_udc memory = {
 	}
 };
 
+/**
+ * pxa_udc_free_dma_desc - frees the DMA descriptors of all endpoints
+ * @udc: udc device
+ */
+static void pxa_udc_free_dma_desc(struct pxa_udc *udc)
+{
+	if (!udc->dma_desc)
+		return;
+
+	dma_free_coherent(udc->dev,
+			NR_PXA_ENDPOINTS * UDC_DMA_DESCS * sizeof(pxa_dma_desc),
+			udc->dma_desc, udc->dma_desc_phys);
+	udc->dma_desc = NULL;
+}
+
 /**
  * pxa_udc_probe - probes the udc device
  * @_dev: platform device
@@ -2454,6 +2703,12 @@ static int __init pxa_udc_probe(struct platform_device *pdev)
 	udc->gadget.dev.parent = &pdev->dev;
 	udc->gadget.dev.dma_mask = NULL;
 	udc->vbus_sensed = 0;
+	udc->phys = regs->start;
+
+	/* without descriptors every endpoint stays in PIO */
+	udc->dma_desc = dma_alloc_coherent(&pdev->dev,
+			NR_PXA_ENDPOINTS * UDC_DMA_DESCS * sizeof(pxa_dma_desc),
+			&udc->dma_desc_phys, GFP_KERNEL);
 
 	the_controller = udc;
 	platform_set_drvdata(pdev, udc);
@@ -2472,6 +2727,7 @@ static int __init pxa_udc_probe(struct platform_device *pdev)
 	pxa_init_debugfs(udc);
 	return 0;
 err_irq:
+	pxa_udc_free_dma_desc(udc);
 	iounmap(udc->regs);
 err_map:
 	clk_put(udc->clk);
@@ -2501,6 +2757,7 @@ static int __exit pxa_udc_remove(struct platform_device *_dev)
 	platform_set_drvdata(_dev, NULL);
 	the_controller = NULL;
 	clk_put(udc->clk);
+	pxa_udc_free_dma_desc(udc);
 	iounmap(udc->regs);
 
 	return 0;
@@ -27,6 +27,7 @@
 #include <linux/spinlock.h>
 #include <linux/io.h>
 #include <linux/usb/otg.h>
+#include <mach/dma.h>
 
 /*
  * Register definitions
@@ -189,6 +190,16 @@
 #define ofs_UDCBCR(ep)	(UDCBCRn(ep->idx))
 #define ofs_UDCDR(ep)	(UDCDRn(ep->idx))
 
+/*
+ * DMA for bulk endpoints
+ * UDC_DRCMR: DMA request line of an endpoint (DRCMR24 is ep0, then epA..)
+ * UDC_DMA_CHUNK: bytes per descriptor, a multiple of every bulk maxpacket
+ * UDC_DMA_DESCS: descriptors per endpoint, ie. at most 32kB per DMA run
+ */
+#define UDC_DRCMR(ep)	(24 + EPIDX(ep))
+#define UDC_DMA_CHUNK	4096
+#define UDC_DMA_DESCS	8
+
 /* Register access macros */
 #define udc_ep_readl(ep, reg)	\
 	__raw_readl((ep)->dev->regs + ofs_##reg(ep))
@@ -296,6 +307,8 @@ struct stats {
 	unsigned long in_bytes;
 	unsigned long out_bytes;
 	unsigned long irqs;
+	unsigned long dma_bytes;
+	unsigned long dma_irqs;
 };
 
 /**
@@ -329,6 +342,12 @@ struct udc_usb_ep {
  * @type: endpoint type (bulk, iso, int, ...)
  * @udccsr_value: save register of UDCCSR0 for suspend/resume
  * @udccr_value: save register of UDCCR for suspend/resume
+ * @dma_ch: DMA channel, -1 if the endpoint works in PIO
+ * @dma_desc: DMA descriptors of this endpoint
+ * @dma_desc_phys: bus address of dma_desc
+ * @dma_req: request being transfered by DMA, NULL if none
+ * @dma_buf: bus address of the mapped part of dma_req
+ * @dma_len: length of the mapped part of dma_req
  * @stats: endpoint statistics
  *
  * The *PROBLEM* is that pxa's endpoint configuration scheme is both misdesigned
@@ -365,6 +384,13 @@ struct pxa_ep {
 	u32			udccsr_value;
 	u32			udccr_value;
 #endif
+	int			dma_ch;
+	pxa_dma_desc		*dma_desc;
+	dma_addr_t		dma_desc_phys;
+	struct pxa27x_request	*dma_req;
+	dma_addr_t		dma_buf;
+	unsigned		dma_len;
+
 	struct stats		stats;
 };
 
@@ -418,6 +444,7 @@ struct udc_stats {
 /**
  * struct pxa_udc - udc structure
  * @regs: mapped IO space
+ * @phys: bus address of the IO space, for DMA
  * @irq: udc irq
  * @clk: udc clock
  * @usb_gadget: udc gadget structure
@@ -436,6 +463,8 @@ struct udc_stats {
  * @last_interface: UDC interface of the last SET_INTERFACE host request
  * @last_alternate: UDC altsetting of the last SET_INTERFACE host request
  * @udccsr0: save of udccsr0 in case of suspend
+ * @dma_desc: DMA descriptors of all endpoints, NULL if DMA is not used
+ * @dma_desc_phys: bus address of dma_desc
  * @debugfs_root: root entry of debug filesystem
  * @debugfs_state: debugfs entry for "udcstate"
  * @debugfs_queues: debugfs entry for "queues"
@@ -443,6 +472,7 @@ struct udc_stats {
  */
 struct pxa_udc {
 	void __iomem				*regs;
+	unsigned long				phys;
 	int					irq;
 	struct clk				*clk;
 
@@ -469,6 +499,8 @@ struct pxa_udc {
 #ifdef CONFIG_PM
 	unsigned				udccsr0;
 #endif
+	pxa_dma_desc				*dma_desc;
+	dma_addr_t				dma_desc_phys;
 #ifdef CONFIG_USB_GADGET_DEBUG_FS
 	struct dentry				*debugfs_root;
 	struct dentry				*debugfs_state;
@@ -13,6 +13,8 @@
 #include <linux/pagemap.h>
 #include <linux/quotaops.h>
 #include <linux/buffer_head.h>
+#include <linux/backing-dev.h>
+#include <linux/vmstat.h>
 #include "internal.h"
 
 #define VALID_FLAGS (SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE| \
@@ -135,6 +137,46 @@ SYSCALL_DEFINE0(sync)
 	return 0;
 }
 
+/*
+ * Tell how much work sys_sync() would find without doing any of it:
+ * SYNC_DIRTY_DATA if there are dirty or in-flight pages or dirty inodes,
+ * SYNC_DIRTY_SUPERS if only writable superblocks are marked dirty and
+ * SYNC_CLEAN otherwise. Opportunistic suspend uses this to avoid a full
+ * sync on every attempt.
+ */
+int sync_dirty_state(void)
+{
+	struct backing_dev_info *bdi;
+	struct super_block *sb;
+	int ret = SYNC_CLEAN;
+
+	if (global_page_state(NR_FILE_DIRTY) ||
+	    global_page_state(NR_WRITEBACK) ||
+	    global_page_state(NR_UNSTABLE_NFS))
+		return SYNC_DIRTY_DATA;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(bdi, &bdi_list, bdi_list) {
+		if (bdi_has_dirty_io(bdi)) {
+			ret = SYNC_DIRTY_DATA;
+			break;
+		}
+	}
+	rcu_read_unlock();
+	if (ret != SYNC_CLEAN)
+		return ret;
+
+	spin_lock(&sb_lock);
+	list_for_each_entry(sb, &super_blocks, s_list) {
+		if (sb->s_dirt && !(sb->s_flags & MS_RDONLY) && sb->s_root) {
+			ret = SYNC_DIRTY_SUPERS;
+			break;
+		}
+	}
+	spin_unlock(&sb_lock);
+	return ret;
+}
+
 static void do_sync_work(struct work_struct *work)
 {
 	/*
@@ -20,7 +20,9 @@ const char *yaffs_checkptrw_c_version =
 
 static int yaffs_CheckpointSpaceOk(yaffs_Device *dev)
 {
-	int blocksAvailable = dev->nErasedBlocks - dev->nReservedBlocks;
+	/* The blocks of the previous checkpoint are erased before writing */
+	int blocksAvailable = dev->nErasedBlocks + dev->blocksInCheckpoint -
+				dev->nReservedBlocks;
 
 	T(YAFFS_TRACE_CHECKPOINT,
 		(TSTR("checkpt blocks available = %d" TENDSTR),
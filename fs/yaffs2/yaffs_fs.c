@@ -51,6 +51,10 @@ extern const char *yaffs_guts_c_version;
 #include <linux/interrupt.h>
 #include <linux/string.h>
 #include <linux/ctype.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/power_supply.h>
+#include <linux/hrtimer.h>
 
 #include "asm/div64.h"
 
@@ -121,16 +125,28 @@ static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 unsigned int yaffs_traceMask = YAFFS_TRACE_BAD_BLOCKS;
 unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
+unsigned int yaffs_bg_checkpoint_interval = 300;
+unsigned int yaffs_bg_checkpoint_blocks = 16;
+unsigned int yaffs_bg_gc_level = 1;
+unsigned int yaffs_hot_cold = 1;
 
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 module_param(yaffs_traceMask, uint, 0644);
 module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
+module_param(yaffs_bg_checkpoint_interval, uint, 0644);
+module_param(yaffs_bg_checkpoint_blocks, uint, 0644);
+module_param(yaffs_bg_gc_level, uint, 0644);
+module_param(yaffs_hot_cold, uint, 0644);
 #else
 MODULE_PARM(yaffs_traceMask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
 MODULE_PARM(yaffs_auto_checkpoint, "i");
+MODULE_PARM(yaffs_bg_checkpoint_interval, "i");
+MODULE_PARM(yaffs_bg_checkpoint_blocks, "i");
+MODULE_PARM(yaffs_bg_gc_level, "i");
+MODULE_PARM(yaffs_hot_cold, "i");
 #endif
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
@@ -174,6 +190,7 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 				loff_t *pos);
 static ssize_t yaffs_hold_space(struct file *f);
 static void yaffs_release_space(struct file *f);
+static void yaffs_KickBackgroundThread(yaffs_Device *dev);
 
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
 static int yaffs_file_flush(struct file *file, fl_owner_t id);
@@ -212,6 +229,8 @@ static int yaffs_mknod(struct inode *dir, struct dentry *dentry, int mode,
 static int yaffs_rename(struct inode *old_dir, struct dentry *old_dentry,
 			struct inode *new_dir, struct dentry *new_dentry);
 static int yaffs_setattr(struct dentry *dentry, struct iattr *attr);
+static int yaffs_getattr(struct vfsmount *mnt, struct dentry *dentry,
+			struct kstat *stat);
 
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
 static int yaffs_sync_fs(struct super_block *sb, int wait);
@@ -237,6 +256,10 @@ static void yaffs_delete_inode(struct inode *);
 static void yaffs_clear_inode(struct inode *);
 
 static int yaffs_readpage(struct file *file, struct page *page);
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
+static int yaffs_readpages(struct file *file, struct address_space *mapping,
+			   struct list_head *pages, unsigned nr_pages);
+#endif
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 static int yaffs_writepage(struct page *page, struct writeback_control *wbc);
 #else
@@ -269,6 +292,9 @@ static int yaffs_follow_link(struct dentry *dentry, struct nameidata *nd);
 
 static struct address_space_operations yaffs_file_address_operations = {
 	.readpage = yaffs_readpage,
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
+	.readpages = yaffs_readpages,
+#endif
 	.writepage = yaffs_writepage,
 #if (YAFFS_USE_WRITE_BEGIN_END > 0)
 	.write_begin = yaffs_write_begin,
@@ -322,12 +348,14 @@ static const struct file_operations yaffs_file_operations = {
 
 static const struct inode_operations yaffs_file_inode_operations = {
 	.setattr = yaffs_setattr,
+	.getattr = yaffs_getattr,
 };
 
 static const struct inode_operations yaffs_symlink_inode_operations = {
 	.readlink = yaffs_readlink,
 	.follow_link = yaffs_follow_link,
 	.setattr = yaffs_setattr,
+	.getattr = yaffs_getattr,
 };
 
 static const struct inode_operations yaffs_dir_inode_operations = {
@@ -341,6 +369,7 @@ static const struct inode_operations yaffs_dir_inode_operations = {
 	.mknod = yaffs_mknod,
 	.rename = yaffs_rename,
 	.setattr = yaffs_setattr,
+	.getattr = yaffs_getattr,
 };
 
 static const struct file_operations yaffs_dir_operations = {
@@ -378,6 +407,23 @@ static void yaffs_GrossUnlock(yaffs_Device *dev)
 	up(&dev->grossLock);
 }
 
+/* Calls that change the directory tree take dirLock for writing as well,
+ * before the gross lock, so that yaffs_lookup() can do most lookups with
+ * just dirLock held for reading. Reads and getattr use the object's mapLock
+ * instead. The order is dirLock, grossLock, mapLock.
+ */
+static void yaffs_DirLock(yaffs_Device *dev)
+{
+	down_write(&dev->dirLock);
+	yaffs_GrossLock(dev);
+}
+
+static void yaffs_DirUnlock(yaffs_Device *dev)
+{
+	yaffs_GrossUnlock(dev);
+	up_write(&dev->dirLock);
+}
+
 
 /*-----------------------------------------------------------------*/
 /* Directory search context allows us to unlock access to yaffs during
@@ -563,22 +609,39 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry)
 {
 	yaffs_Object *obj;
 	struct inode *inode = NULL;	/* NCB 2.5/2.6 needs NULL here */
+	int erasures;
+	int retry;
 
 	yaffs_Device *dev = yaffs_InodeToObject(dir)->myDev;
 
-	yaffs_GrossLock(dev);
-
 	T(YAFFS_TRACE_OS,
 		("yaffs_lookup for %d:%s\n",
 		yaffs_InodeToObject(dir)->objectId, dentry->d_name.name));
 
-	obj = yaffs_FindObjectByName(yaffs_InodeToObject(dir),
-					dentry->d_name.name);
+	/* Most lookups only need the directory tree to hold still, so that
+	 * they don't wait behind writers and gc for the gross lock.
+	 */
+	down_read(&dev->dirLock);
+	erasures = dev->nBlockErasures;
+	smp_rmb();
+	obj = yaffs_FindObjectByNameUnlocked(yaffs_InodeToObject(dir),
+					dentry->d_name.name, &retry);
+	smp_rmb();
+	if (dev->nBlockErasures != erasures)
+		retry = 1;
+	up_read(&dev->dirLock);
+
+	if (retry) {
+		yaffs_GrossLock(dev);
 
-	obj = yaffs_GetEquivalentObject(obj);	/* in case it was a hardlink */
+		obj = yaffs_FindObjectByName(yaffs_InodeToObject(dir),
+						dentry->d_name.name);
 
-	/* Can't hold gross lock when calling yaffs_get_inode() */
-	yaffs_GrossUnlock(dev);
+		obj = yaffs_GetEquivalentObject(obj);	/* in case it was a hardlink */
+
+		/* Can't hold gross lock when calling yaffs_get_inode() */
+		yaffs_GrossUnlock(dev);
+	}
 
 	if (obj) {
 		T(YAFFS_TRACE_OS,
@@ -712,41 +775,102 @@ static int yaffs_file_flush(struct file *file)
 	return 0;
 }
 
-static int yaffs_readpage_nolock(struct file *f, struct page *pg)
-{
-	/* Lifted from jffs2 */
+/* Reads a run of consecutive pages without the gross lock, so that a reader
+ * does not wait for writers and gc, nor hold them up while it waits for the
+ * flash. Only the object's mapLock is held, shared, to look up where the
+ * data of the whole run is. done[] tells which pages were read;
+ * the others have to be read the usual way: data in the short op cache, a
+ * read error (the locked read does the error handling) or a block erased
+ * under us.
+ * Pages that are not made of whole chunks, and all of them with inband
+ * tags, are read through a bounce buffer of the chunks of about a page.
+ */
+#define YAFFS_READPAGES_BATCH	8
+/* Inband tags take a little off 512 byte chunks */
+#define YAFFS_PAGE_CHUNKS_MAX	(PAGE_CACHE_SIZE / 256)
 
-	yaffs_Object *obj;
+static void yaffs_readpages_unlocked(yaffs_Object *obj, struct page **pgs,
+				     int nPages, int *done)
+{
+	yaffs_Device *dev = obj->myDev;
+	int chunkMap[YAFFS_READPAGES_BATCH * YAFFS_PAGE_CHUNKS_MAX];
 	unsigned char *pg_buf;
-	int ret;
+	__u8 *bounce = NULL;
+	int nBounce = 0;
+	int nChunks = 0;
+	__u32 start;
+	int skip;
+	int erasures = 0;
+	int i;
 
-	yaffs_Device *dev;
+	if (dev->inbandTags || PAGE_CACHE_SIZE % dev->nDataBytesPerChunk) {
+		nBounce = PAGE_CACHE_SIZE / dev->nDataBytesPerChunk + 1;
+		bounce = YMALLOC_DMA(nBounce * dev->totalBytesPerChunk);
+	}
 
-	T(YAFFS_TRACE_OS, ("yaffs_readpage at %08x, size %08x\n",
-			(unsigned)(pg->index << PAGE_CACHE_SHIFT),
-			(unsigned)PAGE_CACHE_SIZE));
+	if (bounce || !nBounce) {
+		down_read(&obj->mapLock);
+		nChunks = yaffs_MapFileChunks(obj,
+				(loff_t)pgs[0]->index << PAGE_CACHE_SHIFT,
+				nPages * PAGE_CACHE_SIZE,
+				chunkMap, ARRAY_SIZE(chunkMap), &start);
+		erasures = dev->nBlockErasures;
+		up_read(&obj->mapLock);
+	}
 
-	obj = yaffs_DentryToObject(f->f_dentry);
+	for (i = 0; i < nPages; i++) {
+		done[i] = 0;
+		if (nChunks <= 0)
+			continue;
+		skip = start + i * PAGE_CACHE_SIZE;
+		pg_buf = kmap(pgs[i]);
+		done[i] = (yaffs_ReadChunksUnlocked(dev,
+					&chunkMap[skip / dev->nDataBytesPerChunk],
+					skip % dev->nDataBytesPerChunk,
+					PAGE_CACHE_SIZE, pg_buf,
+					bounce, nBounce) == YAFFS_OK);
+		kunmap(pgs[i]);
+	}
 
-	dev = obj->myDev;
+	if (bounce)
+		YFREE(bounce);
 
-#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
-	BUG_ON(!PageLocked(pg));
-#else
-	if (!PageLocked(pg))
-		PAGE_BUG(pg);
-#endif
+	if (nChunks <= 0)
+		return;
+
+	/* Erases are counted before they start, and the mtd layer orders
+	 * them against our reads.
+	 */
+	smp_rmb();
+	for (i = 0; i < nPages; i++) {
+		if (dev->nBlockErasures != erasures)
+			done[i] = 0;
+		if (done[i])
+			atomic_inc(&dev->nUnlockedReads);
+	}
+}
+
+/* Finishes reading a locked page, reading it under the gross lock unless
+ * yaffs_readpages_unlocked() already did.
+ */
+static int yaffs_readpage_fill(yaffs_Object *obj, struct page *pg, int done)
+{
+	yaffs_Device *dev = obj->myDev;
+	unsigned char *pg_buf;
+	int ret = 0;
 
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_GrossLock(dev);
+	if (!done) {
+		yaffs_GrossLock(dev);
 
-	ret = yaffs_ReadDataFromFile(obj, pg_buf,
-				pg->index << PAGE_CACHE_SHIFT,
-				PAGE_CACHE_SIZE);
+		ret = yaffs_ReadDataFromFile(obj, pg_buf,
+					pg->index << PAGE_CACHE_SHIFT,
+					PAGE_CACHE_SIZE);
 
-	yaffs_GrossUnlock(dev);
+		yaffs_GrossUnlock(dev);
+	}
 
 	if (ret >= 0)
 		ret = 0;
@@ -762,6 +886,33 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	flush_dcache_page(pg);
 	kunmap(pg);
 
+	return ret;
+}
+
+static int yaffs_readpage_nolock(struct file *f, struct page *pg)
+{
+	/* Lifted from jffs2 */
+
+	yaffs_Object *obj;
+	int done;
+	int ret;
+
+	T(YAFFS_TRACE_OS, ("yaffs_readpage at %08x, size %08x\n",
+			(unsigned)(pg->index << PAGE_CACHE_SHIFT),
+			(unsigned)PAGE_CACHE_SIZE));
+
+	obj = yaffs_DentryToObject(f->f_dentry);
+
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
+	BUG_ON(!PageLocked(pg));
+#else
+	if (!PageLocked(pg))
+		PAGE_BUG(pg);
+#endif
+
+	yaffs_readpages_unlocked(obj, &pg, 1, &done);
+	ret = yaffs_readpage_fill(obj, pg, done);
+
 	T(YAFFS_TRACE_OS, ("yaffs_readpage done\n"));
 	return ret;
 }
@@ -778,6 +929,59 @@ static int yaffs_readpage(struct file *f, struct page *pg)
 	return yaffs_readpage_unlock(f, pg);
 }
 
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
+static void yaffs_readpages_batch(yaffs_Object *obj, struct page **pgs,
+				  int nPages)
+{
+	int done[YAFFS_READPAGES_BATCH];
+	int i;
+
+	yaffs_readpages_unlocked(obj, pgs, nPages, done);
+
+	for (i = 0; i < nPages; i++) {
+		yaffs_readpage_fill(obj, pgs[i], done[i]);
+		unlock_page(pgs[i]);
+		page_cache_release(pgs[i]);
+	}
+}
+
+/* Readahead: the pages come in ascending order from the tail of the list
+ * and runs of consecutive pages are read as one batch.
+ */
+static int yaffs_readpages(struct file *f, struct address_space *mapping,
+			   struct list_head *pages, unsigned nr_pages)
+{
+	yaffs_Object *obj = yaffs_DentryToObject(f->f_dentry);
+	struct page *batch[YAFFS_READPAGES_BATCH];
+	struct page *pg;
+	int n = 0;
+
+	T(YAFFS_TRACE_OS, ("yaffs_readpages %u pages\n", nr_pages));
+
+	while (!list_empty(pages)) {
+		pg = list_entry(pages->prev, struct page, lru);
+		list_del(&pg->lru);
+
+		if (add_to_page_cache_lru(pg, mapping, pg->index, GFP_KERNEL)) {
+			page_cache_release(pg);
+			continue;
+		}
+
+		if (n == YAFFS_READPAGES_BATCH ||
+		    (n && pg->index != batch[n - 1]->index + 1)) {
+			yaffs_readpages_batch(obj, batch, n);
+			n = 0;
+		}
+		batch[n++] = pg;
+	}
+
+	if (n)
+		yaffs_readpages_batch(obj, batch, n);
+
+	return 0;
+}
+#endif
+
 /* writepage inspired by/stolen from smbfs */
 
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
@@ -1149,16 +1353,20 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 				loff_t *pos)
 {
 	yaffs_Object *obj;
-	int nWritten, ipos;
+	int nWritten = 0;
+	int ipos;
+	int nThis;
+	int written;
+	int done;
 	struct inode *inode;
 	yaffs_Device *dev;
+	ktime_t start = ktime_get();
+	int bucket;
 
 	obj = yaffs_DentryToObject(f->f_dentry);
 
 	dev = obj->myDev;
 
-	yaffs_GrossLock(dev);
-
 	inode = f->f_dentry->d_inode;
 
 	if (!S_ISBLK(inode->i_mode) && f->f_flags & O_APPEND)
@@ -1175,7 +1383,36 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 			"to object %d at %d\n",
 			n, obj->objectId, ipos));
 
-	nWritten = yaffs_WriteDataToFile(obj, buf, ipos, n, 0);
+	/* The gross lock is taken a chunk at a time, so that gc and other
+	 * writers get in between the chunks of a large write.
+	 */
+	do {
+		nThis = dev->nDataBytesPerChunk -
+			(ipos + nWritten) % dev->nDataBytesPerChunk;
+		if (nThis > n - nWritten)
+			nThis = n - nWritten;
+
+		yaffs_GrossLock(dev);
+
+		written = yaffs_WriteDataToFile(obj, buf + nWritten,
+						ipos + nWritten, nThis, 0);
+		if (written > 0)
+			nWritten += written;
+		done = (written < nThis || nWritten >= n);
+
+		/* Time spent waiting for the lock counts too: that is where
+		 * a writer stalls behind someone else's garbage collection.
+		 */
+		if (done) {
+			bucket = fls((unsigned)ktime_us_delta(ktime_get(),
+							      start));
+			if (bucket >= YAFFS_WRITE_LATENCY_BUCKETS)
+				bucket = YAFFS_WRITE_LATENCY_BUCKETS - 1;
+			dev->writeLatency[bucket]++;
+		}
+
+		yaffs_GrossUnlock(dev);
+	} while (!done);
 
 	T(YAFFS_TRACE_OS,
 		("yaffs_file_write writing %zu bytes, %d written at %d\n",
@@ -1184,8 +1421,13 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 	if (nWritten > 0) {
 		ipos += nWritten;
 		*pos = ipos;
+
+		/* Under mapLock so that yaffs_getattr() sees size and blocks
+		 * change together.
+		 */
+		down_write(&obj->mapLock);
 		if (ipos > inode->i_size) {
-			inode->i_size = ipos;
+			i_size_write(inode, ipos);
 			inode->i_blocks = (ipos + 511) >> 9;
 
 			T(YAFFS_TRACE_OS,
@@ -1193,9 +1435,11 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 				"%d blocks\n",
 				ipos, (int)(inode->i_blocks)));
 		}
-
+		up_write(&obj->mapLock);
 	}
-	yaffs_GrossUnlock(dev);
+
+	yaffs_KickBackgroundThread(dev);
+
 	return (nWritten == 0) && (n > 0) ? -ENOSPC : nWritten;
 }
 
@@ -1389,7 +1633,7 @@ static int yaffs_mknod(struct inode *dir, struct dentry *dentry, int mode,
 
 	dev = parent->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_DirLock(dev);
 
 	switch (mode & S_IFMT) {
 	default:
@@ -1421,7 +1665,7 @@ static int yaffs_mknod(struct inode *dir, struct dentry *dentry, int mode,
 	}
 
 	/* Can not call yaffs_get_inode() with gross lock held */
-	yaffs_GrossUnlock(dev);
+	yaffs_DirUnlock(dev);
 
 	if (obj) {
 		inode = yaffs_get_inode(dir->i_sb, mode, rdev, obj);
@@ -1471,19 +1715,19 @@ static int yaffs_unlink(struct inode *dir, struct dentry *dentry)
 
 	dev = yaffs_InodeToObject(dir)->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_DirLock(dev);
 
 	retVal = yaffs_Unlink(yaffs_InodeToObject(dir), dentry->d_name.name);
 
 	if (retVal == YAFFS_OK) {
 		dentry->d_inode->i_nlink--;
 		dir->i_version++;
-		yaffs_GrossUnlock(dev);
+		yaffs_DirUnlock(dev);
 		mark_inode_dirty(dentry->d_inode);
 		update_dir_time(dir);
 		return 0;
 	}
-	yaffs_GrossUnlock(dev);
+	yaffs_DirUnlock(dev);
 	return -ENOTEMPTY;
 }
 
@@ -1503,7 +1747,7 @@ static int yaffs_link(struct dentry *old_dentry, struct inode *dir,
 	obj = yaffs_InodeToObject(inode);
 	dev = obj->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_DirLock(dev);
 
 	if (!S_ISDIR(inode->i_mode))		/* Don't link directories */
 		link = yaffs_Link(yaffs_InodeToObject(dir), dentry->d_name.name,
@@ -1519,7 +1763,7 @@ static int yaffs_link(struct dentry *old_dentry, struct inode *dir,
 			atomic_read(&old_dentry->d_inode->i_count)));
 	}
 
-	yaffs_GrossUnlock(dev);
+	yaffs_DirUnlock(dev);
 
 	if (link){
 		update_dir_time(dir);
@@ -1540,10 +1784,10 @@ static int yaffs_symlink(struct inode *dir, struct dentry *dentry,
 	T(YAFFS_TRACE_OS, ("yaffs_symlink\n"));
 
 	dev = yaffs_InodeToObject(dir)->myDev;
-	yaffs_GrossLock(dev);
+	yaffs_DirLock(dev);
 	obj = yaffs_MknodSymLink(yaffs_InodeToObject(dir), dentry->d_name.name,
 				S_IFLNK | S_IRWXUGO, uid, gid, symname);
-	yaffs_GrossUnlock(dev);
+	yaffs_DirUnlock(dev);
 
 	if (obj) {
 		struct inode *inode;
@@ -1593,7 +1837,7 @@ static int yaffs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	T(YAFFS_TRACE_OS, ("yaffs_rename\n"));
 	dev = yaffs_InodeToObject(old_dir)->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_DirLock(dev);
 
 	/* Check if the target is an existing directory that is not empty. */
 	target = yaffs_FindObjectByName(yaffs_InodeToObject(new_dir),
@@ -1616,7 +1860,7 @@ static int yaffs_rename(struct inode *old_dir, struct dentry *old_dentry,
 				yaffs_InodeToObject(new_dir),
 				new_dentry->d_name.name);
 	}
-	yaffs_GrossUnlock(dev);
+	yaffs_DirUnlock(dev);
 
 	if (retVal == YAFFS_OK) {
 		if (target) {
@@ -1660,6 +1904,22 @@ static int yaffs_setattr(struct dentry *dentry, struct iattr *attr)
 	return error;
 }
 
+/* Needs no gross lock, just the object's mapLock so that a write can't be
+ * half way through updating the size.
+ */
+static int yaffs_getattr(struct vfsmount *mnt, struct dentry *dentry,
+			struct kstat *stat)
+{
+	struct inode *inode = dentry->d_inode;
+	yaffs_Object *obj = yaffs_InodeToObject(inode);
+
+	down_read(&obj->mapLock);
+	generic_fillattr(inode, stat);
+	up_read(&obj->mapLock);
+
+	return 0;
+}
+
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
 static int yaffs_statfs(struct dentry *dentry, struct kstatfs *buf)
 {
@@ -1753,6 +2013,129 @@ static int yaffs_do_sync_fs(struct super_block *sb)
 }
 
 
+/* Background checkpoint writer and garbage collector.
+ * Foreground activity is noticed as page writes the thread did not do
+ * itself. Once the file system has been idle for a short while dirty blocks
+ * are collected a few chunks at a time, so that writers find erased blocks
+ * instead of doing the copies themselves; with a charger attached the gc
+ * is one level more aggressive. The checkpoint is rewritten once the gc
+ * is done if yaffs_bg_checkpoint_blocks blocks have been allocated since
+ * the last one, or else once it has been idle for a whole checkpoint
+ * interval, so that only the blocks written after it have to be replayed
+ * when mounting after an unclean shutdown. A checkpoint takes a few blocks
+ * of its own, so a handful of small writes is left to the replay.
+ */
+#define YAFFS_BG_IDLE_MS	500
+#define YAFFS_BG_GC_STEP_MS	20
+
+static int yaffs_BackgroundPowered(void)
+{
+#if defined(CONFIG_POWER_SUPPLY) || \
+	(defined(CONFIG_POWER_SUPPLY_MODULE) && defined(MODULE))
+	return power_supply_is_system_supplied() > 0;
+#else
+	return 0;
+#endif
+}
+
+static int yaffs_BackgroundThread(void *data)
+{
+	yaffs_Device *dev = (yaffs_Device *)data;
+	struct super_block *sb = (struct super_block *)dev->superBlock;
+	unsigned lastWrites = dev->nPageWrites;
+	unsigned long lastActive = jiffies;
+	unsigned interval;
+	unsigned blocks;
+	unsigned level;
+	long timeout;
+	int idle;
+	int moreGC;
+
+	T(YAFFS_TRACE_OS, ("yaffs_BackgroundThread started\n"));
+
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		interval = yaffs_bg_checkpoint_interval;
+		blocks = yaffs_bg_checkpoint_blocks;
+		level = yaffs_bg_gc_level;
+		if (level > 3)
+			level = 3;
+		if (level && level < 3 && yaffs_BackgroundPowered())
+			level++;
+		moreGC = 0;
+
+		yaffs_GrossLock(dev);
+		if (dev->nPageWrites != lastWrites)
+			lastActive = jiffies;
+		idle = time_after_eq(jiffies,
+				lastActive + msecs_to_jiffies(YAFFS_BG_IDLE_MS));
+
+		if (idle && !(sb->s_flags & MS_RDONLY)) {
+			if (level)
+				moreGC = yaffs_BackgroundGarbageCollect(dev,
+									level);
+			if (!moreGC && !dev->isCheckpointed &&
+			    ((blocks && dev->sequenceNumber -
+			      dev->checkpointSequence >= blocks) ||
+			     (interval && time_after_eq(jiffies,
+					lastActive + interval * HZ)))) {
+				T(YAFFS_TRACE_OS,
+					("yaffs background checkpoint\n"));
+				yaffs_FlushEntireDeviceCache(dev);
+				yaffs_CheckpointSave(dev);
+			}
+		}
+		lastWrites = dev->nPageWrites;
+		yaffs_GrossUnlock(dev);
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (moreGC)
+			timeout = msecs_to_jiffies(YAFFS_BG_GC_STEP_MS);
+		else if (!idle)
+			timeout = msecs_to_jiffies(YAFFS_BG_IDLE_MS);
+		else {
+			/* Nothing to do until the next write kicks us */
+			dev->bgKicked = 0;
+			timeout = round_jiffies_relative(
+					(interval ? interval : 60) * HZ);
+		}
+		if (!kthread_should_stop())
+			schedule_timeout(timeout);
+		__set_current_state(TASK_RUNNING);
+		try_to_freeze();
+	}
+
+	return 0;
+}
+
+/* Called after a foreground write so the thread starts collecting as
+ * soon as the writer goes quiet.
+ */
+static void yaffs_KickBackgroundThread(yaffs_Device *dev)
+{
+	if (dev->bgThread && !dev->bgKicked) {
+		dev->bgKicked = 1;
+		wake_up_process(dev->bgThread);
+	}
+}
+
+static void yaffs_StartBackgroundThread(yaffs_Device *dev, int index)
+{
+	struct task_struct *tsk;
+
+	tsk = kthread_run(yaffs_BackgroundThread, dev, "yaffs-bg-%d", index);
+	dev->bgThread = IS_ERR(tsk) ? NULL : tsk;
+}
+
+static void yaffs_StopBackgroundThread(yaffs_Device *dev)
+{
+	if (dev->bgThread) {
+		kthread_stop(dev->bgThread);
+		dev->bgThread = NULL;
+	}
+}
+
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
 static void yaffs_write_super(struct super_block *sb)
 #else
@@ -1881,6 +2264,8 @@ static void yaffs_put_super(struct super_block *sb)
 
 	T(YAFFS_TRACE_OS, ("yaffs_put_super\n"));
 
+	yaffs_StopBackgroundThread(dev);
+
 	yaffs_GrossLock(dev);
 
 	yaffs_FlushEntireDeviceCache(dev);
@@ -1996,6 +2381,7 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	yaffs_Device *dev = 0;
 	char devname_buf[BDEVNAME_SIZE + 1];
 	struct mtd_info *mtd;
+	ktime_t mountStart;
 	int err;
 	char *data_str = (char *)data;
 
@@ -2187,7 +2573,7 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	dev->nChunksPerBlock = YAFFS_CHUNKS_PER_BLOCK;
 	dev->totalBytesPerChunk = YAFFS_BYTES_PER_CHUNK;
 	dev->nReservedBlocks = 5;
-	dev->nShortOpCaches = (options.no_cache) ? 0 : 10;
+	dev->nShortOpCaches = (options.no_cache) ? 0 : CONFIG_YAFFS_SHORT_OP_CACHES;
 	dev->inbandTags = options.inband_tags;
 
 	/* ... and the functions. */
@@ -2198,8 +2584,13 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 		    nandmtd2_ReadChunkWithTagsFromNAND;
 		dev->markNANDBlockBad = nandmtd2_MarkNANDBlockBad;
 		dev->queryNANDBlock = nandmtd2_QueryNANDBlock;
+		dev->readChunksFromNAND = nandmtd2_ReadChunksFromNAND;
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
+		dev->readBlockTagsFromNAND = nandmtd2_ReadBlockTagsFromNAND;
+#endif
 		dev->spareBuffer = YMALLOC(mtd->oobsize);
 		dev->isYaffs2 = 1;
+		dev->separateHotCold = yaffs_hot_cold ? 1 : 0;
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
 		dev->totalBytesPerChunk = mtd->writesize;
 		dev->nChunksPerBlock = mtd->erasesize / mtd->writesize;
@@ -2255,15 +2646,40 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
         dev->removeObjectCallback = yaffs_RemoveObjectCallback;
 
 	init_MUTEX(&dev->grossLock);
+	init_rwsem(&dev->dirLock);
 
 	yaffs_GrossLock(dev);
 
+	mountStart = ktime_get();
+
+	/* The scan reads the oob of a whole block at a time, or the block
+	 * itself with inband tags.
+	 */
+	if (dev->readBlockTagsFromNAND)
+		dev->blockSpareBuffer = YMALLOC(dev->nChunksPerBlock *
+				(dev->inbandTags ? dev->totalBytesPerChunk :
+				 mtd->oobavail));
+
 	err = yaffs_GutsInitialise(dev);
 
+	if (dev->blockSpareBuffer) {
+		YFREE(dev->blockSpareBuffer);
+		dev->blockSpareBuffer = NULL;
+	}
+
 	T(YAFFS_TRACE_OS,
 	  ("yaffs_read_super: guts initialised %s\n",
 	   (err == YAFFS_OK) ? "OK" : "FAILED"));
 
+	if (err == YAFFS_OK) {
+		dev->mountTimeMs = (int)ktime_us_delta(ktime_get(),
+						       mountStart) / 1000;
+		printk(KERN_INFO "yaffs: %s mounted in %d ms from %s, "
+		       "%d chunk reads\n", dev->name, dev->mountTimeMs,
+		       dev->mountRestored ? "checkpoint" : "scan",
+		       dev->mountPageReads);
+	}
+
 	/* Release lock before yaffs_get_inode() */
 	yaffs_GrossUnlock(dev);
 
@@ -2293,6 +2709,9 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	T(YAFFS_TRACE_ALWAYS,
 	  ("yaffs_read_super: isCheckpointed %d\n", dev->isCheckpointed));
 
+	if (dev->isYaffs2)
+		yaffs_StartBackgroundThread(dev, mtd->index);
+
 	T(YAFFS_TRACE_OS, ("yaffs_read_super: done\n"));
 	return sb;
 }
@@ -2394,6 +2813,39 @@ static DECLARE_FSTYPE(yaffs2_fs_type, "yaffs2", yaffs2_read_super,
 
 static struct proc_dir_entry *my_proc_entry;
 
+/* Upper bound of the histogram bucket holding the 99th percentile */
+static unsigned yaffs_WriteLatencyP99(yaffs_Device *dev)
+{
+	unsigned long long total = 0;
+	unsigned long long sum = 0;
+	int i;
+
+	for (i = 0; i < YAFFS_WRITE_LATENCY_BUCKETS; i++)
+		total += dev->writeLatency[i];
+	if (!total)
+		return 0;
+
+	for (i = 0; i < YAFFS_WRITE_LATENCY_BUCKETS; i++) {
+		sum += dev->writeLatency[i];
+		if (sum * 100 >= total * 99)
+			break;
+	}
+	return 1U << i;
+}
+
+/* GC copies per MiB of data written by the file system's users */
+static unsigned yaffs_GCCopiesPerMB(yaffs_Device *dev)
+{
+	__u64 copies = (__u64)dev->nGCCopies << 20;
+	int written = dev->nPageWrites - dev->nGCCopies;
+
+	if (written <= 0 || !dev->nDataBytesPerChunk)
+		return 0;
+	do_div(copies, dev->nDataBytesPerChunk);
+	do_div(copies, written);
+	return (unsigned)copies;
+}
+
 static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 {
 	buf += sprintf(buf, "startBlock......... %d\n", dev->startBlock);
@@ -2409,14 +2861,36 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "nFreeTnodes........ %d\n", dev->nFreeTnodes);
 	buf += sprintf(buf, "nObjectsCreated.... %d\n", dev->nObjectsCreated);
 	buf += sprintf(buf, "nFreeObjects....... %d\n", dev->nFreeObjects);
+	buf += sprintf(buf, "tnodeMemory........ %d kB\n",
+		    (dev->nTnodesCreated * yaffs_TnodeSize(dev)) >> 10);
+	buf += sprintf(buf, "tnodeMemoryUsed.... %d kB\n",
+		    ((dev->nTnodesCreated - dev->nFreeTnodes) *
+		     yaffs_TnodeSize(dev)) >> 10);
+	buf += sprintf(buf, "objectMemory....... %d kB\n",
+		    (int)(dev->nObjectsCreated * sizeof(yaffs_Object)) >> 10);
+	buf += sprintf(buf, "memoryReleased..... %lu kB\n",
+		    dev->memoryReleased >> 10);
+	buf += sprintf(buf, "extentMemory....... %lu kB\n",
+		    dev->extentMemory >> 10);
+	buf += sprintf(buf, "nExtents........... %d\n", dev->nExtents);
+	buf += sprintf(buf, "nExtentChunks...... %d\n", dev->nExtentChunks);
+	buf += sprintf(buf, "nDroppedMaps....... %d\n", dev->nDroppedMaps);
+	buf += sprintf(buf, "nDroppedChunks..... %d\n", dev->nDroppedChunks);
+	buf += sprintf(buf, "nMapRebuilds....... %d\n", dev->nMapRebuilds);
+	buf += sprintf(buf, "nTnodeMaps......... %d\n", dev->nTnodeMaps);
 	buf += sprintf(buf, "nFreeChunks........ %d\n", dev->nFreeChunks);
 	buf += sprintf(buf, "nPageWrites........ %d\n", dev->nPageWrites);
 	buf += sprintf(buf, "nPageReads......... %d\n", dev->nPageReads);
 	buf += sprintf(buf, "nBlockErasures..... %d\n", dev->nBlockErasures);
 	buf += sprintf(buf, "nGCCopies.......... %d\n", dev->nGCCopies);
+	buf += sprintf(buf, "gcCopiesPerMB...... %u\n", yaffs_GCCopiesPerMB(dev));
+	buf += sprintf(buf, "nHotChunkWrites.... %d\n", dev->nHotChunkWrites);
+	buf += sprintf(buf, "nColdChunkWrites... %d\n", dev->nColdChunkWrites);
 	buf += sprintf(buf, "garbageCollections. %d\n", dev->garbageCollections);
 	buf += sprintf(buf, "passiveGCs......... %d\n",
 		    dev->passiveGarbageCollections);
+	buf += sprintf(buf, "backgroundGCs...... %d\n",
+		    dev->backgroundGarbageCollections);
 	buf += sprintf(buf, "nRetriedWrites..... %d\n", dev->nRetriedWrites);
 	buf += sprintf(buf, "nShortOpCaches..... %d\n", dev->nShortOpCaches);
 	buf += sprintf(buf, "nRetireBlocks...... %d\n", dev->nRetiredBlocks);
@@ -2425,6 +2899,9 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "tagsEccFixed....... %d\n", dev->tagsEccFixed);
 	buf += sprintf(buf, "tagsEccUnfixed..... %d\n", dev->tagsEccUnfixed);
 	buf += sprintf(buf, "cacheHits.......... %d\n", dev->cacheHits);
+	buf += sprintf(buf, "cacheMisses........ %d\n", dev->cacheMisses);
+	buf += sprintf(buf, "nUnlockedReads..... %d\n",
+			atomic_read(&dev->nUnlockedReads));
 	buf += sprintf(buf, "nDeletedFiles...... %d\n", dev->nDeletedFiles);
 	buf += sprintf(buf, "nUnlinkedFiles..... %d\n", dev->nUnlinkedFiles);
 	buf +=
@@ -2432,6 +2909,9 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "useNANDECC......... %d\n", dev->useNANDECC);
 	buf += sprintf(buf, "isYaffs2........... %d\n", dev->isYaffs2);
 	buf += sprintf(buf, "inbandTags......... %d\n", dev->inbandTags);
+	buf += sprintf(buf, "mountTimeMs........ %d\n", dev->mountTimeMs);
+	buf += sprintf(buf, "writeLatencyP99us.. %u\n",
+		    yaffs_WriteLatencyP99(dev));
 
 	return buf;
 }
@@ -2510,6 +2990,7 @@ static struct {
 	{"verify", YAFFS_TRACE_VERIFY},
 	{"verify_nand", YAFFS_TRACE_VERIFY_NAND},
 	{"verify_full", YAFFS_TRACE_VERIFY_FULL},
+	{"verify_replay", YAFFS_TRACE_VERIFY_REPLAY},
 	{"verify_all", YAFFS_TRACE_VERIFY_ALL},
 
 	{"write", YAFFS_TRACE_WRITE},
@@ -2612,6 +3093,51 @@ static int yaffs_proc_write(struct file *file, const char *buf,
 }
 
 /* Stuff to handle installation of file systems */
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 22))
+/*
+ * Memory pressure callback. Free tnodes and objects are kept on per-device
+ * free lists and normally only go back to the system at unmount; this
+ * drops the tnode trees of files nobody has open and then gives back the
+ * allocation groups that have become entirely free. It counts and scans
+ * files with tnode trees, the unit of yaffs_DropIdleFileMaps(). Devices
+ * that are busy are skipped rather than waited for.
+ */
+static int yaffs_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct ylist_head *item;
+	yaffs_Device *dev;
+	int freeable = 0;
+
+	if (nr_to_scan && !(gfp_mask & __GFP_FS))
+		return -1;
+
+	/* hold lock_kernel while traversing yaffs_dev_list */
+	lock_kernel();
+	ylist_for_each(item, &yaffs_dev_list) {
+		dev = ylist_entry(item, yaffs_Device, devList);
+		if (down_trylock(&dev->grossLock))
+			continue;
+
+		if (nr_to_scan) {
+			yaffs_DropIdleFileMaps(dev, nr_to_scan);
+			yaffs_ReleaseFreeMemory(dev);
+		}
+
+		freeable += dev->nTnodeMaps;
+
+		up(&dev->grossLock);
+	}
+	unlock_kernel();
+
+	return freeable;
+}
+
+static struct shrinker yaffs_shrinker = {
+	.shrink = yaffs_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+#endif
+
 struct file_system_to_install {
 	struct file_system_type *fst;
 	int installed;
@@ -2643,6 +3169,10 @@ static int __init init_yaffs_fs(void)
 	} else
 		return -ENOMEM;
 
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 22))
+	register_shrinker(&yaffs_shrinker);
+#endif
+
 	/* Now add the file system entries */
 
 	fsinst = fs_to_install;
@@ -2680,6 +3210,10 @@ static void __exit exit_yaffs_fs(void)
 
 	remove_proc_entry("yaffs", YPROC_ROOT);
 
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 22))
+	unregister_shrinker(&yaffs_shrinker);
+#endif
+
 	fsinst = fs_to_install;
 
 	while (fsinst->fst) {
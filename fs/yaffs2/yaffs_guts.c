@@ -22,9 +22,7 @@ const char *yaffs_guts_c_version =
 #include "yaffs_getblockinfo.h"
 
 #include "yaffs_tagscompat.h"
-#ifndef CONFIG_YAFFS_USE_OWN_SORT
 #include "yaffs_qsort.h"
-#endif
 #include "yaffs_nand.h"
 
 #include "yaffs_checkptrw.h"
@@ -58,7 +56,7 @@ static void yaffs_HardlinkFixup(yaffs_Device *dev, yaffs_Object *hardList);
 static int yaffs_WriteNewChunkWithTagsToNAND(yaffs_Device *dev,
 					const __u8 *buffer,
 					yaffs_ExtendedTags *tags,
-					int useReserve);
+					int useReserve, yaffs_Object *in);
 static int yaffs_PutChunkIntoFile(yaffs_Object *in, int chunkInInode,
 				int chunkInNAND, int inScan);
 
@@ -69,6 +67,9 @@ static void yaffs_AddObjectToDirectory(yaffs_Object *directory,
 static int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name,
 				int force, int isShrink, int shadows);
 static void yaffs_RemoveObjectFromDirectory(yaffs_Object *obj);
+static void yaffs_NameHashInsert(yaffs_Object *directory, yaffs_Object *obj);
+static void yaffs_NameHashRemove(yaffs_Object *obj);
+static void yaffs_NameHashFree(yaffs_Object *directory);
 static int yaffs_CheckStructures(void);
 static int yaffs_DeleteWorker(yaffs_Object *in, yaffs_Tnode *tn, __u32 level,
 			int chunkOffset, int *limit);
@@ -85,10 +86,14 @@ static int yaffs_UnlinkWorker(yaffs_Object *obj);
 static int yaffs_TagsMatch(const yaffs_ExtendedTags *tags, int objectId,
 			int chunkInObject);
 
-static int yaffs_AllocateChunk(yaffs_Device *dev, int useReserve,
+static int yaffs_AllocateChunk(yaffs_Device *dev, int useReserve, int cold,
 				yaffs_BlockInfo **blockUsedPtr);
+static int yaffs_ChooseColdAllocation(yaffs_Device *dev, yaffs_Object *in,
+				const yaffs_ExtendedTags *tags);
+static void yaffs_CloseAllocationBlock(yaffs_Device *dev, int cold);
 
 static void yaffs_VerifyFreeChunks(yaffs_Device *dev);
+static int yaffs_CountFreeChunks(yaffs_Device *dev);
 
 static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in);
 
@@ -109,9 +114,9 @@ static int yaffs_FindChunkInFile(yaffs_Object *in, int chunkInInode,
 
 static __u32 yaffs_GetChunkGroupBase(yaffs_Device *dev, yaffs_Tnode *tn,
 		unsigned pos);
-static yaffs_Tnode *yaffs_FindLevel0Tnode(yaffs_Device *dev,
-					yaffs_FileStructure *fStruct,
-					__u32 chunkId);
+static __u32 yaffs_GetFileChunkBase(yaffs_Device *dev,
+				yaffs_FileStructure *fStruct, __u32 chunkId);
+static int yaffs_FileMapDropped(yaffs_Object *obj);
 
 /* Function to calculate chunk and offset */
 
@@ -510,7 +515,8 @@ static void yaffs_VerifyBlocks(yaffs_Device *dev)
 	T(YAFFS_TRACE_VERIFY, (TSTR("Block summary"TENDSTR)));
 
 	T(YAFFS_TRACE_VERIFY, (TSTR("%d blocks have illegal states"TENDSTR), nIllegalBlockStates));
-	if (nBlocksPerState[YAFFS_BLOCK_STATE_ALLOCATING] > 1)
+	if (nBlocksPerState[YAFFS_BLOCK_STATE_ALLOCATING] >
+	    (dev->separateHotCold ? 2 : 1))
 		T(YAFFS_TRACE_VERIFY, (TSTR("Too many allocating blocks"TENDSTR)));
 
 	for (i = 0; i < YAFFS_NUMBER_OF_BLOCK_STATES; i++)
@@ -652,13 +658,12 @@ static void yaffs_VerifyFile(yaffs_Object *obj)
 	__u32 i;
 	yaffs_Device *dev;
 	yaffs_ExtendedTags tags;
-	yaffs_Tnode *tn;
 	__u32 objectId;
 
 	if (!obj)
 		return;
 
-	if (yaffs_SkipVerification(obj->myDev))
+	if (yaffs_SkipVerification(obj->myDev) || yaffs_FileMapDropped(obj))
 		return;
 
 	dev = obj->myDev;
@@ -675,7 +680,7 @@ static void yaffs_VerifyFile(yaffs_Object *obj)
 
 	actualTallness = obj->variant.fileVariant.topLevel;
 
-	if (requiredTallness > actualTallness)
+	if (obj->variant.fileVariant.top && requiredTallness > actualTallness)
 		T(YAFFS_TRACE_VERIFY,
 		(TSTR("Obj %d had tnode tallness %d, needs to be %d"TENDSTR),
 		 obj->objectId, actualTallness, requiredTallness));
@@ -690,18 +695,15 @@ static void yaffs_VerifyFile(yaffs_Object *obj)
 		return;
 
 	for (i = 1; i <= lastChunk; i++) {
-		tn = yaffs_FindLevel0Tnode(dev, &obj->variant.fileVariant, i);
-
-		if (tn) {
-			__u32 theChunk = yaffs_GetChunkGroupBase(dev, tn, i);
-			if (theChunk > 0) {
-				/* T(~0,(TSTR("verifying (%d:%d) %d"TENDSTR),objectId,i,theChunk)); */
-				yaffs_ReadChunkWithTagsFromNAND(dev, theChunk, NULL, &tags);
-				if (tags.objectId != objectId || tags.chunkId != i) {
-					T(~0, (TSTR("Object %d chunkId %d NAND mismatch chunk %d tags (%d:%d)"TENDSTR),
-						objectId, i, theChunk,
-						tags.objectId, tags.chunkId));
-				}
+		__u32 theChunk = yaffs_GetFileChunkBase(dev,
+					&obj->variant.fileVariant, i);
+		if (theChunk > 0) {
+			/* T(~0,(TSTR("verifying (%d:%d) %d"TENDSTR),objectId,i,theChunk)); */
+			yaffs_ReadChunkWithTagsFromNAND(dev, theChunk, NULL, &tags);
+			if (tags.objectId != objectId || tags.chunkId != i) {
+				T(~0, (TSTR("Object %d chunkId %d NAND mismatch chunk %d tags (%d:%d)"TENDSTR),
+					objectId, i, theChunk,
+					tags.objectId, tags.chunkId));
 			}
 		}
 	}
@@ -921,11 +923,12 @@ static int yaffs_CheckChunkErased(struct yaffs_DeviceStruct *dev,
 static int yaffs_WriteNewChunkWithTagsToNAND(struct yaffs_DeviceStruct *dev,
 					const __u8 *data,
 					yaffs_ExtendedTags *tags,
-					int useReserve)
+					int useReserve, yaffs_Object *in)
 {
 	int attempts = 0;
 	int writeOk = 0;
 	int chunk;
+	int cold = 0;
 
 	yaffs_InvalidateCheckpoint(dev);
 
@@ -933,7 +936,8 @@ static int yaffs_WriteNewChunkWithTagsToNAND(struct yaffs_DeviceStruct *dev,
 		yaffs_BlockInfo *bi = 0;
 		int erasedOk = 0;
 
-		chunk = yaffs_AllocateChunk(dev, useReserve, &bi);
+		cold = yaffs_ChooseColdAllocation(dev, in, tags);
+		chunk = yaffs_AllocateChunk(dev, useReserve, cold, &bi);
 		if (chunk < 0) {
 			/* no space */
 			break;
@@ -994,6 +998,13 @@ static int yaffs_WriteNewChunkWithTagsToNAND(struct yaffs_DeviceStruct *dev,
 		/* Copy the data into the robustification buffer */
 		yaffs_HandleWriteChunkOk(dev, chunk, data, tags);
 
+		if (in)
+			in->lastWriteSeq = bi->sequenceNumber;
+		if (cold)
+			dev->nColdChunkWrites++;
+		else
+			dev->nHotChunkWrites++;
+
 	} while (writeOk != YAFFS_OK &&
 		(yaffs_wr_attempts <= 0 || attempts <= yaffs_wr_attempts));
 
@@ -1135,7 +1146,12 @@ static void yaffs_SetObjectName(yaffs_Object *obj, const YCHAR *name)
 	else
 		obj->shortName[0] = _Y('\0');
 #endif
-	obj->sum = yaffs_CalcNameSum(name);
+	if (obj->nameHashed) {
+		yaffs_NameHashRemove(obj);
+		obj->sum = yaffs_CalcNameSum(name);
+		yaffs_NameHashInsert(obj->parent, obj);
+	} else
+		obj->sum = yaffs_CalcNameSum(name);
 }
 
 /*-------------------- TNODES -------------------
@@ -1145,6 +1161,19 @@ static void yaffs_SetObjectName(yaffs_Object *obj, const YCHAR *name)
  * in the tnode.
  */
 
+/* Size in bytes of one tnode, allowing for variable width tnode support.
+ * Must be a multiple of 32-bits.
+ */
+int yaffs_TnodeSize(yaffs_Device *dev)
+{
+	int tnodeSize = (dev->tnodeWidth * YAFFS_NTNODES_LEVEL0)/8;
+
+	if (tnodeSize < sizeof(yaffs_Tnode))
+		tnodeSize = sizeof(yaffs_Tnode);
+
+	return tnodeSize;
+}
+
 /* yaffs_CreateTnodes creates a bunch more tnodes and
  * adds them to the tnode free list.
  * Don't use this function directly
@@ -1163,12 +1192,7 @@ static int yaffs_CreateTnodes(yaffs_Device *dev, int nTnodes)
 	if (nTnodes < 1)
 		return YAFFS_OK;
 
-	/* Calculate the tnode size in bytes for variable width tnode support.
-	 * Must be a multiple of 32-bits  */
-	tnodeSize = (dev->tnodeWidth * YAFFS_NTNODES_LEVEL0)/8;
-
-	if (tnodeSize < sizeof(yaffs_Tnode))
-		tnodeSize = sizeof(yaffs_Tnode);
+	tnodeSize = yaffs_TnodeSize(dev);
 
 	/* make these things */
 
@@ -1266,13 +1290,9 @@ static yaffs_Tnode *yaffs_GetTnodeRaw(yaffs_Device *dev)
 static yaffs_Tnode *yaffs_GetTnode(yaffs_Device *dev)
 {
 	yaffs_Tnode *tn = yaffs_GetTnodeRaw(dev);
-	int tnodeSize = (dev->tnodeWidth * YAFFS_NTNODES_LEVEL0)/8;
-
-	if (tnodeSize < sizeof(yaffs_Tnode))
-		tnodeSize = sizeof(yaffs_Tnode);
 
 	if (tn)
-		memset(tn, 0, tnodeSize);
+		memset(tn, 0, yaffs_TnodeSize(dev));
 
 	return tn;
 }
@@ -1320,6 +1340,7 @@ static void yaffs_InitialiseTnodes(yaffs_Device *dev)
 	dev->freeTnodes = NULL;
 	dev->nFreeTnodes = 0;
 	dev->nTnodesCreated = 0;
+	dev->nTnodeMaps = 0;
 }
 
 
@@ -1462,6 +1483,15 @@ static yaffs_Tnode *yaffs_AddOrFindLevel0Tnode(yaffs_Device *dev,
 	if (chunkId > YAFFS_MAX_CHUNK_ID)
 		return NULL;
 
+	/* An empty file has no tree yet */
+	if (!fStruct->top) {
+		fStruct->top = yaffs_GetTnode(dev);
+		fStruct->topLevel = 0;
+		if (!fStruct->top)
+			return NULL;
+		dev->nTnodeMaps++;
+	}
+
 	/* First check we're tall enough (ie enough topLevel) */
 
 	x = chunkId >> YAFFS_TNODES_LEVEL0_BITS;
@@ -1527,7 +1557,7 @@ static yaffs_Tnode *yaffs_AddOrFindLevel0Tnode(yaffs_Device *dev,
 	} else {
 		/* top is level 0 */
 		if (passedTn) {
-			memcpy(tn, passedTn, (dev->tnodeWidth * YAFFS_NTNODES_LEVEL0)/8);
+			memcpy(tn, passedTn, yaffs_TnodeSize(dev));
 			yaffs_FreeTnode(dev, passedTn);
 		}
 	}
@@ -1562,246 +1592,1042 @@ static int yaffs_FindChunkInGroup(yaffs_Device *dev, int theChunk,
 }
 
 
-/* DeleteWorker scans backwards through the tnode tree and deletes all the
- * chunks and tnodes in the file
- * Returns 1 if the tree was deleted.
- * Returns 0 if it stopped early due to hitting the limit and the delete is incomplete.
+/* Everything that changes the map of a file holds its mapLock for writing,
+ * on top of the gross lock, so that yaffs_MapFileChunks() can run with just
+ * the mapLock held for reading. Nothing takes the gross lock with the mapLock
+ * held.
  */
+static void yaffs_LockFileMap(yaffs_Object *obj)
+{
+#ifdef __KERNEL__
+	down_write(&obj->mapLock);
+#endif
+}
 
-static int yaffs_DeleteWorker(yaffs_Object *in, yaffs_Tnode *tn, __u32 level,
-			      int chunkOffset, int *limit)
+static void yaffs_UnlockFileMap(yaffs_Object *obj)
 {
-	int i;
-	int chunkInInode;
-	int theChunk;
-	yaffs_ExtendedTags tags;
-	int foundChunk;
-	yaffs_Device *dev = in->myDev;
+#ifdef __KERNEL__
+	up_write(&obj->mapLock);
+#endif
+}
 
-	int allDone = 1;
+/*------------------------- Extent maps -----------------------------------
+ * Most files are written in order and end up in a handful of runs of
+ * consecutive NAND chunks. Such a file is mapped by a short sorted array of
+ * extents instead of a tnode tree, and is only given a tree once it needs
+ * more than YAFFS_MAX_EXTENTS runs. Extents hold exact chunk numbers, so
+ * they are not used with chunk groups. While mounting, maps are always
+ * built as trees; yaffs_CompactFileMaps() converts them once that is done.
+ *
+ * An empty file has neither a tree nor extents.
+ */
 
-	if (tn) {
-		if (level > 0) {
-			for (i = YAFFS_NTNODES_INTERNAL - 1; allDone && i >= 0;
-			     i--) {
-				if (tn->internal[i]) {
-					if (limit && (*limit) < 0) {
-						allDone = 0;
-					} else {
-						allDone =
-							yaffs_DeleteWorker(in,
-								tn->
-								internal
-								[i],
-								level -
-								1,
-								(chunkOffset
-									<<
-									YAFFS_TNODES_INTERNAL_BITS)
-								+ i,
-								limit);
-					}
-					if (allDone) {
-						yaffs_FreeTnode(dev,
-								tn->
-								internal[i]);
-						tn->internal[i] = NULL;
-					}
-				}
-			}
-			return (allDone) ? 1 : 0;
-		} else if (level == 0) {
-			int hitLimit = 0;
+#define YAFFS_EXTENT_MAP_SIZE(n) \
+	(sizeof(yaffs_ExtentMap) + ((n) - 1) * sizeof(yaffs_Extent))
 
-			for (i = YAFFS_NTNODES_LEVEL0 - 1; i >= 0 && !hitLimit;
-					i--) {
-				theChunk = yaffs_GetChunkGroupBase(dev, tn, i);
-				if (theChunk) {
+static yaffs_ExtentMap *yaffs_AllocateExtentMap(yaffs_Device *dev, int n)
+{
+	yaffs_ExtentMap *map = YMALLOC(YAFFS_EXTENT_MAP_SIZE(n));
 
-					chunkInInode = (chunkOffset <<
-						YAFFS_TNODES_LEVEL0_BITS) + i;
+	if (map) {
+		map->nExtents = 0;
+		map->maxExtents = n;
+		dev->extentMemory += YAFFS_EXTENT_MAP_SIZE(n);
+	}
 
-					foundChunk =
-						yaffs_FindChunkInGroup(dev,
-								theChunk,
-								&tags,
-								in->objectId,
-								chunkInInode);
+	return map;
+}
 
-					if (foundChunk > 0) {
-						yaffs_DeleteChunk(dev,
-								  foundChunk, 1,
-								  __LINE__);
-						in->nDataChunks--;
-						if (limit) {
-							*limit = *limit - 1;
-							if (*limit <= 0)
-								hitLimit = 1;
-						}
+static void yaffs_FreeExtentMap(yaffs_Device *dev, yaffs_ExtentMap *map)
+{
+	int i;
 
-					}
+	if (!map)
+		return;
 
-					yaffs_PutLevel0Tnode(dev, tn, i, 0);
-				}
+	for (i = 0; i < map->nExtents; i++)
+		dev->nExtentChunks -= map->extent[i].nChunks;
+	dev->nExtents -= map->nExtents;
+	dev->extentMemory -= YAFFS_EXTENT_MAP_SIZE(map->maxExtents);
+	YFREE(map);
 
-			}
-			return (i < 0) ? 1 : 0;
+	dev->nCheckpointBlocksRequired = 0; /* force recalculation*/
+}
 
-		}
+static int yaffs_ResizeExtentMap(yaffs_Device *dev, yaffs_ExtentMap **mapPtr,
+				int n)
+{
+	yaffs_ExtentMap *old = *mapPtr;
+	yaffs_ExtentMap *map = yaffs_AllocateExtentMap(dev, n);
 
-	}
+	if (!map)
+		return YAFFS_FAIL;
 
-	return 1;
+	map->nExtents = old->nExtents;
+	memcpy(map->extent, old->extent, old->nExtents * sizeof(yaffs_Extent));
+	dev->extentMemory -= YAFFS_EXTENT_MAP_SIZE(old->maxExtents);
+	YFREE(old);
+	*mapPtr = map;
 
+	return YAFFS_OK;
 }
 
-static void yaffs_SoftDeleteChunk(yaffs_Device *dev, int chunk)
+/* Returns the last extent starting at or before chunkId, or -1 */
+static int yaffs_FindExtent(const yaffs_ExtentMap *map, __u32 chunkId)
 {
-	yaffs_BlockInfo *theBlock;
-
-	T(YAFFS_TRACE_DELETION, (TSTR("soft delete chunk %d" TENDSTR), chunk));
+	int lo = 0;
+	int hi = map->nExtents - 1;
+	int mid;
+	int found = -1;
 
-	theBlock = yaffs_GetBlockInfo(dev, chunk / dev->nChunksPerBlock);
-	if (theBlock) {
-		theBlock->softDeletions++;
-		dev->nFreeChunks++;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (map->extent[mid].chunkId <= chunkId) {
+			found = mid;
+			lo = mid + 1;
+		} else
+			hi = mid - 1;
 	}
-}
 
-/* SoftDeleteWorker scans backwards through the tnode tree and soft deletes all the chunks in the file.
- * All soft deleting does is increment the block's softdelete count and pulls the chunk out
- * of the tnode.
- * Thus, essentially this is the same as DeleteWorker except that the chunks are soft deleted.
- */
+	return found;
+}
 
-static int yaffs_SoftDeleteWorker(yaffs_Object *in, yaffs_Tnode *tn,
-				  __u32 level, int chunkOffset)
+static __u32 yaffs_GetExtentChunk(const yaffs_ExtentMap *map, __u32 chunkId)
 {
-	int i;
-	int theChunk;
-	int allDone = 1;
-	yaffs_Device *dev = in->myDev;
-
-	if (tn) {
-		if (level > 0) {
-
-			for (i = YAFFS_NTNODES_INTERNAL - 1; allDone && i >= 0;
-			     i--) {
-				if (tn->internal[i]) {
-					allDone =
-					    yaffs_SoftDeleteWorker(in,
-								   tn->
-								   internal[i],
-								   level - 1,
-								   (chunkOffset
-								    <<
-								    YAFFS_TNODES_INTERNAL_BITS)
-								   + i);
-					if (allDone) {
-						yaffs_FreeTnode(dev,
-								tn->
-								internal[i]);
-						tn->internal[i] = NULL;
-					} else {
-						/* Hoosterman... how could this happen? */
-					}
-				}
-			}
-			return (allDone) ? 1 : 0;
-		} else if (level == 0) {
-
-			for (i = YAFFS_NTNODES_LEVEL0 - 1; i >= 0; i--) {
-				theChunk = yaffs_GetChunkGroupBase(dev, tn, i);
-				if (theChunk) {
-					/* Note this does not find the real chunk, only the chunk group.
-					 * We make an assumption that a chunk group is not larger than
-					 * a block.
-					 */
-					yaffs_SoftDeleteChunk(dev, theChunk);
-					yaffs_PutLevel0Tnode(dev, tn, i, 0);
-				}
-
-			}
-			return 1;
+	int i = yaffs_FindExtent(map, chunkId);
+	const yaffs_Extent *e;
 
-		}
+	if (i < 0)
+		return 0;
 
-	}
+	e = &map->extent[i];
+	if (chunkId - e->chunkId >= e->nChunks)
+		return 0;
 
-	return 1;
+	return e->chunk + (chunkId - e->chunkId);
+}
 
+static void yaffs_InsertExtent(yaffs_ExtentMap *map, int i, __u32 chunkId,
+				__u32 chunk, __u32 nChunks)
+{
+	memmove(&map->extent[i + 1], &map->extent[i],
+		(map->nExtents - i) * sizeof(yaffs_Extent));
+	map->extent[i].chunkId = chunkId;
+	map->extent[i].chunk = chunk;
+	map->extent[i].nChunks = nChunks;
+	map->nExtents++;
 }
 
-static void yaffs_SoftDeleteFile(yaffs_Object *obj)
+static void yaffs_RemoveExtent(yaffs_ExtentMap *map, int i)
 {
-	if (obj->deleted &&
-	    obj->variantType == YAFFS_OBJECT_TYPE_FILE && !obj->softDeleted) {
-		if (obj->nDataChunks <= 0) {
-			/* Empty file with no duplicate object headers, just delete it immediately */
-			yaffs_FreeTnode(obj->myDev,
-					obj->variant.fileVariant.top);
-			obj->variant.fileVariant.top = NULL;
-			T(YAFFS_TRACE_TRACING,
-			  (TSTR("yaffs: Deleting empty file %d" TENDSTR),
-			   obj->objectId));
-			yaffs_DoGenericObjectDeletion(obj);
-		} else {
-			yaffs_SoftDeleteWorker(obj,
-					       obj->variant.fileVariant.top,
-					       obj->variant.fileVariant.
-					       topLevel, 0);
-			obj->softDeleted = 1;
-		}
-	}
+	map->nExtents--;
+	memmove(&map->extent[i], &map->extent[i + 1],
+		(map->nExtents - i) * sizeof(yaffs_Extent));
 }
 
-/* Pruning removes any part of the file structure tree that is beyond the
- * bounds of the file (ie that does not point to chunks).
- *
- * A file should only get pruned when its size is reduced.
- *
- * Before pruning, the chunks must be pulled from the tree and the
- * level 0 tnode entries must be zeroed out.
- * Could also use this for file deletion, but that's probably better handled
- * by a special case.
+/* Maps chunkId to chunk, or unmaps it if chunk is 0. This can take two more
+ * extents than the map has, yaffs_ReserveFileChunk() makes sure there is
+ * room for them.
  */
-
-static yaffs_Tnode *yaffs_PruneWorker(yaffs_Device *dev, yaffs_Tnode *tn,
-				__u32 level, int del0)
+static void yaffs_SetExtentChunk(yaffs_Device *dev, yaffs_ExtentMap *map,
+				__u32 chunkId, __u32 chunk)
 {
+	int nExtents = map->nExtents;
+	yaffs_Extent *e;
+	yaffs_Extent *next;
+	__u32 offset;
 	int i;
-	int hasData;
-
-	if (tn) {
-		hasData = 0;
-
-		for (i = 0; i < YAFFS_NTNODES_INTERNAL; i++) {
-			if (tn->internal[i] && level > 0) {
-				tn->internal[i] =
-				    yaffs_PruneWorker(dev, tn->internal[i],
-						      level - 1,
-						      (i == 0) ? del0 : 1);
-			}
 
-			if (tn->internal[i])
-				hasData++;
-		}
-
-		if (hasData == 0 && del0) {
-			/* Free and return NULL */
-
-			yaffs_FreeTnode(dev, tn);
-			tn = NULL;
+	/* Take out the old mapping, splitting its extent if need be */
+	i = yaffs_FindExtent(map, chunkId);
+	if (i >= 0 && chunkId - map->extent[i].chunkId < map->extent[i].nChunks) {
+		e = &map->extent[i];
+		offset = chunkId - e->chunkId;
+
+		if (e->nChunks == 1)
+			yaffs_RemoveExtent(map, i);
+		else if (offset == 0) {
+			e->chunkId++;
+			e->chunk++;
+			e->nChunks--;
+		} else if (offset == e->nChunks - 1)
+			e->nChunks--;
+		else {
+			yaffs_InsertExtent(map, i + 1, chunkId + 1,
+					e->chunk + offset + 1,
+					e->nChunks - offset - 1);
+			map->extent[i].nChunks = offset;
 		}
-
+		dev->nExtentChunks--;
+	}
+
+	if (chunk) {
+		/* Grow a neighbour if the chunk follows on from it */
+		i = yaffs_FindExtent(map, chunkId);
+		e = (i >= 0) ? &map->extent[i] : NULL;
+		next = (i + 1 < map->nExtents) ? &map->extent[i + 1] : NULL;
+
+		if (e && (e->chunkId + e->nChunks != chunkId ||
+			  e->chunk + e->nChunks != chunk))
+			e = NULL;
+		if (next && (next->chunkId != chunkId + 1 ||
+			     next->chunk != chunk + 1))
+			next = NULL;
+
+		if (e && next) {
+			e->nChunks += 1 + next->nChunks;
+			yaffs_RemoveExtent(map, i + 1);
+		} else if (e)
+			e->nChunks++;
+		else if (next) {
+			next->chunkId--;
+			next->chunk--;
+			next->nChunks++;
+		} else
+			yaffs_InsertExtent(map, i + 1, chunkId, chunk, 1);
+		dev->nExtentChunks++;
 	}
 
-	return tn;
-
+	dev->nExtents += map->nExtents - nExtents;
+	dev->nCheckpointBlocksRequired = 0; /* force recalculation*/
 }
 
-static int yaffs_PruneFileStructure(yaffs_Device *dev,
-				yaffs_FileStructure *fStruct)
+static int yaffs_FreeTnodeWorker(yaffs_Device *dev, yaffs_Tnode *tn,
+				__u32 level)
+{
+	int i;
+	int nFreed = 1;
+
+	if (!tn)
+		return 0;
+
+	if (level > 0) {
+		for (i = 0; i < YAFFS_NTNODES_INTERNAL; i++)
+			nFreed += yaffs_FreeTnodeWorker(dev, tn->internal[i],
+							level - 1);
+	}
+	yaffs_FreeTnode(dev, tn);
+
+	return nFreed;
+}
+
+/* Frees the whole tnode tree of a file. Returns the number of tnodes freed */
+static int yaffs_FreeTnodeTree(yaffs_Device *dev, yaffs_FileStructure *fStruct)
+{
+	int nFreed = yaffs_FreeTnodeWorker(dev, fStruct->top, fStruct->topLevel);
+
+	if (fStruct->top)
+		dev->nTnodeMaps--;
+	fStruct->top = NULL;
+	fStruct->topLevel = 0;
+
+	return nFreed;
+}
+
+/* Converts an extent map that has run out of extents into a tnode tree */
+static int yaffs_ExpandExtentMap(yaffs_Device *dev,
+				yaffs_FileStructure *fStruct)
+{
+	yaffs_ExtentMap *map = fStruct->extents;
+	yaffs_Extent *e;
+	yaffs_Tnode *tn;
+	__u32 k;
+	int i;
+
+	fStruct->extents = NULL;
+
+	for (i = 0; i < map->nExtents; i++) {
+		e = &map->extent[i];
+		for (k = 0; k < e->nChunks; k++) {
+			tn = yaffs_AddOrFindLevel0Tnode(dev, fStruct,
+							e->chunkId + k, NULL);
+			if (!tn) {
+				yaffs_FreeTnodeTree(dev, fStruct);
+				fStruct->extents = map;
+				return YAFFS_FAIL;
+			}
+			yaffs_PutLevel0Tnode(dev, tn, e->chunkId + k,
+					e->chunk + k);
+		}
+	}
+
+	yaffs_FreeExtentMap(dev, map);
+
+	return YAFFS_OK;
+}
+
+static int yaffs_CompactWorker(yaffs_Device *dev, yaffs_ExtentMap *map,
+				yaffs_Tnode *tn, __u32 level, __u32 chunkOffset)
+{
+	yaffs_Extent *e;
+	__u32 chunkId;
+	__u32 chunk;
+	int i;
+
+	if (!tn)
+		return 1;
+
+	if (level > 0) {
+		for (i = 0; i < YAFFS_NTNODES_INTERNAL; i++) {
+			if (!yaffs_CompactWorker(dev, map, tn->internal[i],
+					level - 1,
+					(chunkOffset << YAFFS_TNODES_INTERNAL_BITS) + i))
+				return 0;
+		}
+		return 1;
+	}
+
+	for (i = 0; i < YAFFS_NTNODES_LEVEL0; i++) {
+		chunk = yaffs_GetChunkGroupBase(dev, tn, i);
+		if (!chunk)
+			continue;
+
+		chunkId = (chunkOffset << YAFFS_TNODES_LEVEL0_BITS) + i;
+		e = map->nExtents ? &map->extent[map->nExtents - 1] : NULL;
+
+		if (e && e->chunkId + e->nChunks == chunkId &&
+		    e->chunk + e->nChunks == chunk)
+			e->nChunks++;
+		else if (map->nExtents < map->maxExtents)
+			yaffs_InsertExtent(map, map->nExtents, chunkId, chunk, 1);
+		else
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Replaces the tnode tree of a file by extents if it has few enough runs */
+static void yaffs_CompactFileMap(yaffs_Device *dev,
+				yaffs_FileStructure *fStruct)
+{
+	yaffs_ExtentMap *map;
+	int i;
+
+	if (!fStruct->top || !dev->fileMapsReady || dev->chunkGroupBits)
+		return;
+
+	map = yaffs_AllocateExtentMap(dev, YAFFS_MAX_EXTENTS);
+	if (!map)
+		return;
+
+	if (!yaffs_CompactWorker(dev, map, fStruct->top, fStruct->topLevel, 0)) {
+		map->nExtents = 0;
+		yaffs_FreeExtentMap(dev, map);
+		return;
+	}
+
+	yaffs_FreeTnodeTree(dev, fStruct);
+
+	dev->nExtents += map->nExtents;
+	for (i = 0; i < map->nExtents; i++)
+		dev->nExtentChunks += map->extent[i].nChunks;
+
+	if (map->nExtents)
+		fStruct->extents = map;
+	else
+		yaffs_FreeExtentMap(dev, map);
+}
+
+static void yaffs_CompactFileMaps(yaffs_Device *dev)
+{
+	yaffs_Object *obj;
+	struct ylist_head *lh;
+	int i;
+
+	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
+		ylist_for_each(lh, &dev->objectBucket[i].list) {
+			obj = ylist_entry(lh, yaffs_Object, hashLink);
+			if (obj->variantType == YAFFS_OBJECT_TYPE_FILE) {
+				yaffs_LockFileMap(obj);
+				yaffs_CompactFileMap(dev,
+						&obj->variant.fileVariant);
+				yaffs_UnlockFileMap(obj);
+			}
+		}
+	}
+}
+
+/* Returns the chunk (group) a file chunk is mapped to, or 0 */
+static __u32 yaffs_GetFileChunkBase(yaffs_Device *dev,
+				yaffs_FileStructure *fStruct, __u32 chunkId)
+{
+	yaffs_Tnode *tn;
+
+	if (fStruct->extents)
+		return yaffs_GetExtentChunk(fStruct->extents, chunkId);
+
+	tn = yaffs_FindLevel0Tnode(dev, fStruct, chunkId);
+
+	return tn ? yaffs_GetChunkGroupBase(dev, tn, chunkId) : 0;
+}
+
+static int yaffs_DoReserveFileChunk(yaffs_Device *dev,
+				yaffs_FileStructure *fStruct, __u32 chunkId)
+{
+	yaffs_ExtentMap *map = fStruct->extents;
+	int n;
+
+	if (!map && !fStruct->top && dev->fileMapsReady &&
+	    !dev->chunkGroupBits) {
+		map = yaffs_AllocateExtentMap(dev, 2);
+		fStruct->extents = map;
+	}
+
+	if (map) {
+		if (map->nExtents + 2 <= map->maxExtents)
+			return YAFFS_OK;
+
+		if (map->nExtents < YAFFS_MAX_EXTENTS) {
+			n = map->maxExtents * 2;
+			if (n > YAFFS_MAX_EXTENTS + 1)
+				n = YAFFS_MAX_EXTENTS + 1;
+			return yaffs_ResizeExtentMap(dev, &fStruct->extents, n);
+		}
+
+		if (yaffs_ExpandExtentMap(dev, fStruct) != YAFFS_OK)
+			return YAFFS_FAIL;
+	}
+
+	return yaffs_AddOrFindLevel0Tnode(dev, fStruct, chunkId, NULL) ?
+		YAFFS_OK : YAFFS_FAIL;
+}
+
+/* Makes sure the next yaffs_SetFileChunkBase() for chunkId can't fail for
+ * want of memory.
+ */
+static int yaffs_ReserveFileChunk(yaffs_Object *in, __u32 chunkId)
+{
+	int retVal;
+
+	if (chunkId > YAFFS_MAX_CHUNK_ID)
+		return YAFFS_FAIL;
+
+	yaffs_LockFileMap(in);
+	retVal = yaffs_DoReserveFileChunk(in->myDev, &in->variant.fileVariant,
+					chunkId);
+	yaffs_UnlockFileMap(in);
+
+	return retVal;
+}
+
+static void yaffs_SetFileChunkBase(yaffs_Object *in, __u32 chunkId,
+				__u32 chunk)
+{
+	yaffs_Device *dev = in->myDev;
+	yaffs_FileStructure *fStruct = &in->variant.fileVariant;
+	yaffs_Tnode *tn;
+
+	yaffs_LockFileMap(in);
+
+	if (fStruct->extents) {
+		yaffs_SetExtentChunk(dev, fStruct->extents, chunkId, chunk);
+	} else {
+		tn = yaffs_FindLevel0Tnode(dev, fStruct, chunkId);
+		if (tn)
+			yaffs_PutLevel0Tnode(dev, tn, chunkId, chunk);
+	}
+
+	yaffs_UnlockFileMap(in);
+}
+
+/*------------------------- Dropped maps ----------------------------------
+ * Under memory pressure the tnode trees of files that nobody has open are
+ * dropped. All that is kept is the list of blocks the file's chunks were in.
+ * Chunks that gc later moves out of those blocks are added to the list while
+ * it has room, otherwise their new block is flagged with hasDroppedChunks.
+ * The map is rebuilt from the tags of those blocks when it is next needed.
+ */
+
+#define YAFFS_DROPPED_MAP_SIZE(n) \
+	(sizeof(yaffs_DroppedMap) + ((n) - 1) * sizeof(int))
+
+static int yaffs_FileMapDropped(yaffs_Object *obj)
+{
+	return obj->variantType == YAFFS_OBJECT_TYPE_FILE &&
+		obj->variant.fileVariant.dropped;
+}
+
+static yaffs_DroppedMap *yaffs_AllocateDroppedMap(yaffs_Device *dev, int n)
+{
+	yaffs_DroppedMap *map = YMALLOC(YAFFS_DROPPED_MAP_SIZE(n));
+
+	if (map) {
+		map->nChunks = 0;
+		map->nBlocks = 0;
+		map->maxBlocks = n;
+		dev->extentMemory += YAFFS_DROPPED_MAP_SIZE(n);
+	}
+
+	return map;
+}
+
+static void yaffs_FreeDroppedMap(yaffs_Object *obj)
+{
+	yaffs_Device *dev = obj->myDev;
+	yaffs_DroppedMap *map = obj->variant.fileVariant.dropped;
+
+	if (!map)
+		return;
+
+	obj->variant.fileVariant.dropped = NULL;
+	dev->nDroppedMaps--;
+	dev->nDroppedChunks -= map->nChunks;
+	dev->extentMemory -= YAFFS_DROPPED_MAP_SIZE(map->maxBlocks);
+	YFREE(map);
+
+	dev->nCheckpointBlocksRequired = 0; /* force recalculation*/
+}
+
+static int yaffs_FindDroppedBlock(const yaffs_DroppedMap *map, int blk,
+				int *pos)
+{
+	int lo = 0;
+	int hi = map->nBlocks - 1;
+	int mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (map->block[mid] == blk) {
+			*pos = mid;
+			return 1;
+		} else if (map->block[mid] < blk)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	*pos = lo;
+
+	return 0;
+}
+
+/* Adds blk to the block list, growing it if allowed. Fails if the list is
+ * full and may not grow.
+ */
+static int yaffs_AddDroppedBlock(yaffs_Device *dev, yaffs_DroppedMap **mapPtr,
+				int blk, int grow)
+{
+	yaffs_DroppedMap *map = *mapPtr;
+	yaffs_DroppedMap *bigger;
+	int pos;
+
+	if (yaffs_FindDroppedBlock(map, blk, &pos))
+		return YAFFS_OK;
+
+	if (map->nBlocks >= map->maxBlocks) {
+		if (!grow)
+			return YAFFS_FAIL;
+
+		bigger = yaffs_AllocateDroppedMap(dev, map->maxBlocks * 2);
+		if (!bigger)
+			return YAFFS_FAIL;
+
+		bigger->nBlocks = map->nBlocks;
+		memcpy(bigger->block, map->block, map->nBlocks * sizeof(int));
+		dev->extentMemory -= YAFFS_DROPPED_MAP_SIZE(map->maxBlocks);
+		YFREE(map);
+		*mapPtr = map = bigger;
+	}
+
+	memmove(&map->block[pos + 1], &map->block[pos],
+		(map->nBlocks - pos) * sizeof(int));
+	map->block[pos] = blk;
+	map->nBlocks++;
+
+	return YAFFS_OK;
+}
+
+static int yaffs_DropWorker(yaffs_Device *dev, yaffs_DroppedMap **mapPtr,
+				yaffs_Tnode *tn, __u32 level)
+{
+	__u32 chunk;
+	int i;
+
+	if (!tn)
+		return YAFFS_OK;
+
+	if (level > 0) {
+		for (i = 0; i < YAFFS_NTNODES_INTERNAL; i++) {
+			if (!yaffs_DropWorker(dev, mapPtr, tn->internal[i],
+					level - 1))
+				return YAFFS_FAIL;
+		}
+		return YAFFS_OK;
+	}
+
+	for (i = 0; i < YAFFS_NTNODES_LEVEL0; i++) {
+		/* A chunk group is never larger than a block */
+		chunk = yaffs_GetChunkGroupBase(dev, tn, i);
+		if (chunk && !yaffs_AddDroppedBlock(dev, mapPtr,
+					chunk / dev->nChunksPerBlock, 1))
+			return YAFFS_FAIL;
+	}
+
+	return YAFFS_OK;
+}
+
+/* Returns the number of tnodes freed */
+static int yaffs_DropFileMap(yaffs_Object *obj)
+{
+	yaffs_Device *dev = obj->myDev;
+	yaffs_FileStructure *fStruct = &obj->variant.fileVariant;
+	yaffs_DroppedMap *map;
+	int nFreed;
+	int i;
+
+	map = yaffs_AllocateDroppedMap(dev, 4);
+	if (!map)
+		return 0;
+
+	if (!yaffs_DropWorker(dev, &map, fStruct->top, fStruct->topLevel)) {
+		dev->extentMemory -= YAFFS_DROPPED_MAP_SIZE(map->maxBlocks);
+		YFREE(map);
+		return 0;
+	}
+
+	if (!dev->nDroppedMaps) {
+		/* Left over from maps that have all been rebuilt */
+		for (i = dev->internalStartBlock; i <= dev->internalEndBlock; i++)
+			yaffs_GetBlockInfo(dev, i)->hasDroppedChunks = 0;
+	}
+
+	map->nChunks = obj->nDataChunks;
+	dev->nDroppedMaps++;
+	dev->nDroppedChunks += map->nChunks;
+
+	yaffs_LockFileMap(obj);
+	fStruct->dropped = map;
+	nFreed = yaffs_FreeTnodeTree(dev, fStruct);
+	yaffs_UnlockFileMap(obj);
+
+	return nFreed;
+}
+
+/* Called by gc when it has copied a chunk of a file with a dropped map */
+static void yaffs_DroppedChunkMoved(yaffs_Object *obj, int chunk)
+{
+	yaffs_Device *dev = obj->myDev;
+	int blk = chunk / dev->nChunksPerBlock;
+
+	if (!yaffs_AddDroppedBlock(dev, &obj->variant.fileVariant.dropped,
+				blk, 0))
+		yaffs_GetBlockInfo(dev, blk)->hasDroppedChunks = 1;
+}
+
+/* Reads the tags of the blocks a dropped map may have chunks in. With
+ * chunkId 0 the map is rebuilt from them, otherwise it just looks for that
+ * chunk of the file and returns it (or -1).
+ */
+static int yaffs_ScanDroppedMap(yaffs_Object *in, __u32 chunkId)
+{
+	yaffs_Device *dev = in->myDev;
+	yaffs_FileStructure *fStruct = &in->variant.fileVariant;
+	yaffs_DroppedMap *map = fStruct->dropped;
+	yaffs_ExtendedTags tags;
+	yaffs_BlockInfo *bi;
+	int blk;
+	int c;
+	int chunk;
+	int pos;
+	int nChunks = 0;
+
+	for (blk = dev->internalStartBlock; blk <= dev->internalEndBlock; blk++) {
+		bi = yaffs_GetBlockInfo(dev, blk);
+		if (!bi->hasDroppedChunks &&
+		    !yaffs_FindDroppedBlock(map, blk, &pos))
+			continue;
+
+		for (c = 0; c < dev->nChunksPerBlock; c++) {
+			if (!yaffs_CheckChunkBit(dev, blk, c))
+				continue;
+
+			chunk = blk * dev->nChunksPerBlock + c;
+			yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL, &tags);
+			if (tags.objectId != in->objectId ||
+			    tags.chunkId == 0 || tags.chunkDeleted)
+				continue;
+
+			if (chunkId) {
+				if (tags.chunkId == chunkId)
+					return chunk;
+				continue;
+			}
+
+			if (!yaffs_ReserveFileChunk(in, tags.chunkId)) {
+				yaffs_LockFileMap(in);
+				yaffs_FreeTnodeTree(dev, fStruct);
+				yaffs_FreeExtentMap(dev, fStruct->extents);
+				fStruct->extents = NULL;
+				yaffs_UnlockFileMap(in);
+				return YAFFS_FAIL;
+			}
+			yaffs_SetFileChunkBase(in, tags.chunkId, chunk);
+			nChunks++;
+		}
+	}
+
+	if (chunkId)
+		return -1;
+
+	if (nChunks != in->nDataChunks)
+		T(YAFFS_TRACE_ERROR,
+		  (TSTR("yaffs: rebuilt map of %d has %d chunks, not %d"
+			TENDSTR), in->objectId, nChunks, in->nDataChunks));
+
+	return YAFFS_OK;
+}
+
+/* Rebuilds the map of a file if it has been dropped */
+static int yaffs_LoadFileMap(yaffs_Object *in)
+{
+	yaffs_Device *dev = in->myDev;
+
+	if (!yaffs_FileMapDropped(in))
+		return YAFFS_OK;
+
+	if (yaffs_ScanDroppedMap(in, 0) != YAFFS_OK) {
+		T(YAFFS_TRACE_ERROR,
+		  (TSTR("yaffs: could not rebuild map of %d" TENDSTR),
+		   in->objectId));
+		return YAFFS_FAIL;
+	}
+
+	yaffs_LockFileMap(in);
+	yaffs_FreeDroppedMap(in);
+	yaffs_UnlockFileMap(in);
+	dev->nMapRebuilds++;
+
+	return YAFFS_OK;
+}
+
+/* Frees all of a file's map, whichever form it is in */
+static void yaffs_FreeFileMap(yaffs_Object *obj)
+{
+	yaffs_Device *dev = obj->myDev;
+	yaffs_FileStructure *fStruct = &obj->variant.fileVariant;
+
+	yaffs_LockFileMap(obj);
+	yaffs_FreeTnodeTree(dev, fStruct);
+	yaffs_FreeExtentMap(dev, fStruct->extents);
+	fStruct->extents = NULL;
+	yaffs_FreeDroppedMap(obj);
+	yaffs_UnlockFileMap(obj);
+}
+
+static int yaffs_FileMapIdle(yaffs_Object *obj)
+{
+	if (obj->variantType != YAFFS_OBJECT_TYPE_FILE ||
+	    !obj->variant.fileVariant.top ||
+	    obj->deleted || obj->softDeleted || obj->unlinked ||
+	    obj->deferedFree || obj->beingCreated)
+		return 0;
+
+#ifdef __KERNEL__
+	if (obj->myInode)
+		return 0;
+#else
+	if (obj->inUse > 0)
+		return 0;
+#endif
+
+	return !obj->nCachedChunks;
+}
+
+/* Drops the tnode trees of up to nToScan files that are not in use, going
+ * on from where the last call stopped. Must be called with the device
+ * locked. Returns the number of tnodes freed.
+ */
+int yaffs_DropIdleFileMaps(yaffs_Device *dev, int nToScan)
+{
+	yaffs_Object *obj;
+	struct ylist_head *lh;
+	int nFreed = 0;
+	int bucket;
+	int i;
+
+	if (!dev->fileMapsReady)
+		return 0;
+
+	for (i = 0; i < YAFFS_NOBJECT_BUCKETS && nToScan > 0; i++) {
+		bucket = dev->mapDropBucket;
+		dev->mapDropBucket = (bucket + 1) % YAFFS_NOBJECT_BUCKETS;
+
+		ylist_for_each(lh, &dev->objectBucket[bucket].list) {
+			obj = ylist_entry(lh, yaffs_Object, hashLink);
+			if (nToScan > 0 && yaffs_FileMapIdle(obj)) {
+				nFreed += yaffs_DropFileMap(obj);
+				nToScan--;
+			}
+		}
+	}
+
+	if (nFreed)
+		T(YAFFS_TRACE_ALLOCATE,
+		  (TSTR("yaffs: dropped file maps, %d tnodes freed" TENDSTR),
+		   nFreed));
+
+	return nFreed;
+}
+
+/* DeleteWorker scans backwards through the tnode tree and deletes all the
+ * chunks and tnodes in the file
+ * Returns 1 if the tree was deleted.
+ * Returns 0 if it stopped early due to hitting the limit and the delete is incomplete.
+ */
+
+static int yaffs_DeleteWorker(yaffs_Object *in, yaffs_Tnode *tn, __u32 level,
+			      int chunkOffset, int *limit)
+{
+	int i;
+	int chunkInInode;
+	int theChunk;
+	yaffs_ExtendedTags tags;
+	int foundChunk;
+	yaffs_Device *dev = in->myDev;
+
+	int allDone = 1;
+
+	if (tn) {
+		if (level > 0) {
+			for (i = YAFFS_NTNODES_INTERNAL - 1; allDone && i >= 0;
+			     i--) {
+				if (tn->internal[i]) {
+					if (limit && (*limit) < 0) {
+						allDone = 0;
+					} else {
+						allDone =
+							yaffs_DeleteWorker(in,
+								tn->
+								internal
+								[i],
+								level -
+								1,
+								(chunkOffset
+									<<
+									YAFFS_TNODES_INTERNAL_BITS)
+								+ i,
+								limit);
+					}
+					if (allDone) {
+						yaffs_FreeTnode(dev,
+								tn->
+								internal[i]);
+						tn->internal[i] = NULL;
+					}
+				}
+			}
+			return (allDone) ? 1 : 0;
+		} else if (level == 0) {
+			int hitLimit = 0;
+
+			for (i = YAFFS_NTNODES_LEVEL0 - 1; i >= 0 && !hitLimit;
+					i--) {
+				theChunk = yaffs_GetChunkGroupBase(dev, tn, i);
+				if (theChunk) {
+
+					chunkInInode = (chunkOffset <<
+						YAFFS_TNODES_LEVEL0_BITS) + i;
+
+					foundChunk =
+						yaffs_FindChunkInGroup(dev,
+								theChunk,
+								&tags,
+								in->objectId,
+								chunkInInode);
+
+					if (foundChunk > 0) {
+						yaffs_DeleteChunk(dev,
+								  foundChunk, 1,
+								  __LINE__);
+						in->nDataChunks--;
+						if (limit) {
+							*limit = *limit - 1;
+							if (*limit <= 0)
+								hitLimit = 1;
+						}
+
+					}
+
+					yaffs_PutLevel0Tnode(dev, tn, i, 0);
+				}
+
+			}
+			return (i < 0) ? 1 : 0;
+
+		}
+
+	}
+
+	return 1;
+
+}
+
+static void yaffs_SoftDeleteChunk(yaffs_Device *dev, int chunk)
+{
+	yaffs_BlockInfo *theBlock;
+
+	T(YAFFS_TRACE_DELETION, (TSTR("soft delete chunk %d" TENDSTR), chunk));
+
+	theBlock = yaffs_GetBlockInfo(dev, chunk / dev->nChunksPerBlock);
+	if (theBlock) {
+		theBlock->softDeletions++;
+		dev->nFreeChunks++;
+	}
+}
+
+/* SoftDeleteWorker scans backwards through the tnode tree and soft deletes all the chunks in the file.
+ * All soft deleting does is increment the block's softdelete count and pulls the chunk out
+ * of the tnode.
+ * Thus, essentially this is the same as DeleteWorker except that the chunks are soft deleted.
+ */
+
+static int yaffs_SoftDeleteWorker(yaffs_Object *in, yaffs_Tnode *tn,
+				  __u32 level, int chunkOffset)
+{
+	int i;
+	int theChunk;
+	int allDone = 1;
+	yaffs_Device *dev = in->myDev;
+
+	if (tn) {
+		if (level > 0) {
+
+			for (i = YAFFS_NTNODES_INTERNAL - 1; allDone && i >= 0;
+			     i--) {
+				if (tn->internal[i]) {
+					allDone =
+					    yaffs_SoftDeleteWorker(in,
+								   tn->
+								   internal[i],
+								   level - 1,
+								   (chunkOffset
+								    <<
+								    YAFFS_TNODES_INTERNAL_BITS)
+								   + i);
+					if (allDone) {
+						yaffs_FreeTnode(dev,
+								tn->
+								internal[i]);
+						tn->internal[i] = NULL;
+					} else {
+						/* Hoosterman... how could this happen? */
+					}
+				}
+			}
+			return (allDone) ? 1 : 0;
+		} else if (level == 0) {
+
+			for (i = YAFFS_NTNODES_LEVEL0 - 1; i >= 0; i--) {
+				theChunk = yaffs_GetChunkGroupBase(dev, tn, i);
+				if (theChunk) {
+					/* Note this does not find the real chunk, only the chunk group.
+					 * We make an assumption that a chunk group is not larger than
+					 * a block.
+					 */
+					yaffs_SoftDeleteChunk(dev, theChunk);
+					yaffs_PutLevel0Tnode(dev, tn, i, 0);
+				}
+
+			}
+			return 1;
+
+		}
+
+	}
+
+	return 1;
+
+}
+
+static void yaffs_SoftDeleteExtents(yaffs_Object *obj)
+{
+	yaffs_Device *dev = obj->myDev;
+	yaffs_ExtentMap *map = obj->variant.fileVariant.extents;
+	__u32 k;
+	int i;
+
+	for (i = 0; i < map->nExtents; i++) {
+		for (k = 0; k < map->extent[i].nChunks; k++)
+			yaffs_SoftDeleteChunk(dev, map->extent[i].chunk + k);
+	}
+
+	yaffs_FreeExtentMap(dev, map);
+	obj->variant.fileVariant.extents = NULL;
+}
+
+static void yaffs_SoftDeleteFile(yaffs_Object *obj)
+{
+	if (obj->deleted &&
+	    obj->variantType == YAFFS_OBJECT_TYPE_FILE && !obj->softDeleted) {
+		if (obj->nDataChunks <= 0) {
+			/* Empty file with no duplicate object headers, just delete it immediately */
+			yaffs_FreeFileMap(obj);
+			T(YAFFS_TRACE_TRACING,
+			  (TSTR("yaffs: Deleting empty file %d" TENDSTR),
+			   obj->objectId));
+			yaffs_DoGenericObjectDeletion(obj);
+		} else if (yaffs_LoadFileMap(obj) == YAFFS_OK) {
+			yaffs_LockFileMap(obj);
+			if (obj->variant.fileVariant.extents)
+				yaffs_SoftDeleteExtents(obj);
+			else
+				yaffs_SoftDeleteWorker(obj,
+					       obj->variant.fileVariant.top,
+					       obj->variant.fileVariant.
+					       topLevel, 0);
+			yaffs_UnlockFileMap(obj);
+			obj->softDeleted = 1;
+		}
+	}
+}
+
+/* Pruning removes any part of the file structure tree that is beyond the
+ * bounds of the file (ie that does not point to chunks).
+ *
+ * A file should only get pruned when its size is reduced.
+ *
+ * Before pruning, the chunks must be pulled from the tree and the
+ * level 0 tnode entries must be zeroed out.
+ * Could also use this for file deletion, but that's probably better handled
+ * by a special case.
+ */
+
+static yaffs_Tnode *yaffs_PruneWorker(yaffs_Device *dev, yaffs_Tnode *tn,
+				__u32 level, int del0)
+{
+	int i;
+	int hasData;
+
+	if (tn) {
+		hasData = 0;
+
+		for (i = 0; i < YAFFS_NTNODES_INTERNAL; i++) {
+			if (tn->internal[i] && level > 0) {
+				tn->internal[i] =
+				    yaffs_PruneWorker(dev, tn->internal[i],
+						      level - 1,
+						      (i == 0) ? del0 : 1);
+			}
+
+			if (tn->internal[i])
+				hasData++;
+		}
+
+		if (hasData == 0 && del0) {
+			/* Free and return NULL */
+
+			yaffs_FreeTnode(dev, tn);
+			tn = NULL;
+		}
+
+	}
+
+	return tn;
+
+}
+
+static int yaffs_PruneFileStructure(yaffs_Device *dev,
+				yaffs_FileStructure *fStruct)
 {
 	int i;
 	int hasData;
@@ -1921,6 +2747,10 @@ static yaffs_Object *yaffs_AllocateEmptyObject(yaffs_Device *dev)
 		YINIT_LIST_HEAD(&(tn->hardLinks));
 		YINIT_LIST_HEAD(&(tn->hashLink));
 		YINIT_LIST_HEAD(&tn->siblings);
+		YINIT_LIST_HEAD(&tn->cachedChunks);
+#ifdef __KERNEL__
+		init_rwsem(&tn->mapLock);
+#endif
 
 
 		/* Now make the directory sane */
@@ -2005,6 +2835,11 @@ static void yaffs_FreeObject(yaffs_Object *tn)
 
 	yaffs_UnhashObject(tn);
 
+	if (tn->variantType == YAFFS_OBJECT_TYPE_DIRECTORY)
+		yaffs_NameHashFree(tn);
+	else if (tn->variantType == YAFFS_OBJECT_TYPE_FILE)
+		yaffs_FreeFileMap(tn);
+
 #ifdef VALGRIND_TEST
 	YFREE(tn);
 #else
@@ -2031,6 +2866,24 @@ static void yaffs_DeinitialiseObjects(yaffs_Device *dev)
 	/* Free the list of allocated Objects */
 
 	yaffs_ObjectList *tmp;
+	struct ylist_head *i;
+	yaffs_Object *obj;
+	int b;
+
+	for (b = 0; b < YAFFS_NOBJECT_BUCKETS; b++) {
+		ylist_for_each(i, &dev->objectBucket[b].list) {
+			obj = ylist_entry(i, yaffs_Object, hashLink);
+			if (obj->variantType == YAFFS_OBJECT_TYPE_DIRECTORY)
+				yaffs_NameHashFree(obj);
+			else if (obj->variantType == YAFFS_OBJECT_TYPE_FILE) {
+				/* The tnodes have already gone */
+				yaffs_FreeExtentMap(dev,
+					obj->variant.fileVariant.extents);
+				obj->variant.fileVariant.extents = NULL;
+				yaffs_FreeDroppedMap(obj);
+			}
+		}
+	}
 
 	while (dev->allocatedObjectList) {
 		tmp = dev->allocatedObjectList->next;
@@ -2058,6 +2911,221 @@ static void yaffs_InitialiseObjects(yaffs_Device *dev)
 	}
 }
 
+/*------------------------ Releasing free memory ---------------------------
+ * Tnodes and objects are allocated in groups and a group is only returned
+ * to the system at unmount. After a big tree has been deleted most of
+ * those groups can sit entirely on the free lists. The functions below
+ * find groups where every entry is free, unhook those entries from the
+ * free list and free the group.
+ */
+
+typedef struct {
+	__u8 *mem;
+	int nFree;
+} yaffs_MemGroup;
+
+#define YAFFS_FREE_LINK(p, offset) (*(void **)((__u8 *)(p) + (offset)))
+
+static int yaffs_MemGroupCompare(const void *a, const void *b)
+{
+	const __u8 *ma = ((const yaffs_MemGroup *)a)->mem;
+	const __u8 *mb = ((const yaffs_MemGroup *)b)->mem;
+
+	if (ma < mb)
+		return -1;
+	return ma > mb ? 1 : 0;
+}
+
+/* Binary search for the group holding p. Groups are sorted by address. */
+static yaffs_MemGroup *yaffs_FindMemGroup(yaffs_MemGroup *groups, int nGroups,
+					int groupBytes, const void *p)
+{
+	const __u8 *addr = p;
+	int lo = 0;
+	int hi = nGroups - 1;
+	int mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (addr < groups[mid].mem)
+			hi = mid - 1;
+		else if (addr >= groups[mid].mem + groupBytes)
+			lo = mid + 1;
+		else
+			return &groups[mid];
+	}
+	return NULL;
+}
+
+/* Counts the free entries in each group then drops the entries of fully
+ * free groups from the free list. The free list is linked through a
+ * pointer at linkOffset within each entry.
+ * Returns the number of fully free groups.
+ */
+static int yaffs_PruneFreeList(void **freeList, int linkOffset,
+				yaffs_MemGroup *groups, int nGroups,
+				int groupBytes, int perGroup)
+{
+	yaffs_MemGroup *g;
+	void **link;
+	void *p;
+	int nFull = 0;
+	int i;
+
+	yaffs_qsort(groups, nGroups, sizeof(yaffs_MemGroup),
+		    yaffs_MemGroupCompare);
+
+	for (p = *freeList; p; p = YAFFS_FREE_LINK(p, linkOffset)) {
+		g = yaffs_FindMemGroup(groups, nGroups, groupBytes, p);
+		if (g)
+			g->nFree++;
+	}
+
+	for (i = 0; i < nGroups; i++)
+		if (groups[i].nFree == perGroup)
+			nFull++;
+
+	if (!nFull)
+		return 0;
+
+	link = freeList;
+	while (*link) {
+		g = yaffs_FindMemGroup(groups, nGroups, groupBytes, *link);
+		if (g && g->nFree == perGroup)
+			*link = YAFFS_FREE_LINK(*link, linkOffset);
+		else
+			link = &YAFFS_FREE_LINK(*link, linkOffset);
+	}
+
+	return nFull;
+}
+
+static unsigned long yaffs_ReleaseFreeTnodes(yaffs_Device *dev)
+{
+	int tnodeSize = yaffs_TnodeSize(dev);
+	int groupBytes = tnodeSize * YAFFS_ALLOCATION_NTNODES;
+	yaffs_TnodeList **tnl;
+	yaffs_TnodeList *tmp;
+	yaffs_MemGroup *groups;
+	yaffs_MemGroup *g;
+	int nGroups = 0;
+	unsigned long released = 0;
+
+	if (dev->nFreeTnodes < YAFFS_ALLOCATION_NTNODES)
+		return 0;
+
+	for (tmp = dev->allocatedTnodeList; tmp; tmp = tmp->next)
+		nGroups++;
+
+	groups = YMALLOC_ALT(nGroups * sizeof(yaffs_MemGroup));
+	if (!groups)
+		return 0;
+
+	nGroups = 0;
+	for (tmp = dev->allocatedTnodeList; tmp; tmp = tmp->next) {
+		groups[nGroups].mem = (__u8 *)tmp->tnodes;
+		groups[nGroups].nFree = 0;
+		nGroups++;
+	}
+
+	if (yaffs_PruneFreeList((void **)&dev->freeTnodes, 0, groups, nGroups,
+				groupBytes, YAFFS_ALLOCATION_NTNODES)) {
+		tnl = &dev->allocatedTnodeList;
+		while (*tnl) {
+			g = yaffs_FindMemGroup(groups, nGroups, groupBytes,
+						(*tnl)->tnodes);
+			if (g->nFree == YAFFS_ALLOCATION_NTNODES) {
+				tmp = *tnl;
+				*tnl = tmp->next;
+				YFREE(tmp->tnodes);
+				YFREE(tmp);
+				dev->nTnodesCreated -= YAFFS_ALLOCATION_NTNODES;
+				dev->nFreeTnodes -= YAFFS_ALLOCATION_NTNODES;
+				released += groupBytes;
+			} else
+				tnl = &(*tnl)->next;
+		}
+	}
+
+	YFREE_ALT(groups);
+
+	return released;
+}
+
+static unsigned long yaffs_ReleaseFreeObjects(yaffs_Device *dev)
+{
+	int groupBytes = sizeof(yaffs_Object) * YAFFS_ALLOCATION_NOBJECTS;
+	yaffs_ObjectList **list;
+	yaffs_ObjectList *tmp;
+	yaffs_MemGroup *groups;
+	yaffs_MemGroup *g;
+	int nGroups = 0;
+	unsigned long released = 0;
+
+	if (dev->nFreeObjects < YAFFS_ALLOCATION_NOBJECTS)
+		return 0;
+
+	for (tmp = dev->allocatedObjectList; tmp; tmp = tmp->next)
+		nGroups++;
+
+	groups = YMALLOC_ALT(nGroups * sizeof(yaffs_MemGroup));
+	if (!groups)
+		return 0;
+
+	nGroups = 0;
+	for (tmp = dev->allocatedObjectList; tmp; tmp = tmp->next) {
+		groups[nGroups].mem = (__u8 *)tmp->objects;
+		groups[nGroups].nFree = 0;
+		nGroups++;
+	}
+
+	if (yaffs_PruneFreeList((void **)&dev->freeObjects,
+				offsetof(yaffs_Object, siblings.next),
+				groups, nGroups, groupBytes,
+				YAFFS_ALLOCATION_NOBJECTS)) {
+		list = &dev->allocatedObjectList;
+		while (*list) {
+			g = yaffs_FindMemGroup(groups, nGroups, groupBytes,
+						(*list)->objects);
+			if (g->nFree == YAFFS_ALLOCATION_NOBJECTS) {
+				tmp = *list;
+				*list = tmp->next;
+				YFREE(tmp->objects);
+				YFREE(tmp);
+				dev->nObjectsCreated -= YAFFS_ALLOCATION_NOBJECTS;
+				dev->nFreeObjects -= YAFFS_ALLOCATION_NOBJECTS;
+				released += groupBytes;
+			} else
+				list = &(*list)->next;
+		}
+	}
+
+	YFREE_ALT(groups);
+
+	return released;
+}
+
+/* Returns fully free tnode and object groups to the system.
+ * Must be called with the device locked. Returns the number of bytes freed.
+ */
+unsigned long yaffs_ReleaseFreeMemory(yaffs_Device *dev)
+{
+	unsigned long released;
+
+	released = yaffs_ReleaseFreeTnodes(dev);
+	released += yaffs_ReleaseFreeObjects(dev);
+
+	if (released) {
+		dev->nCheckpointBlocksRequired = 0; /* force recalculation */
+		dev->memoryReleased += released;
+		T(YAFFS_TRACE_ALLOCATE,
+		  (TSTR("yaffs: released %lu bytes of free tnodes/objects"
+			TENDSTR), released));
+	}
+
+	return released;
+}
+
 static int yaffs_FindNiceObjectBucket(yaffs_Device *dev)
 {
 	static int x;
@@ -2164,7 +3232,6 @@ yaffs_Object *yaffs_CreateNewObject(yaffs_Device *dev, int number,
 				    yaffs_ObjectType type)
 {
 	yaffs_Object *theObject;
-	yaffs_Tnode *tn = NULL;
 
 	if (number < 0)
 		number = yaffs_CreateNewObjectNumber(dev);
@@ -2173,14 +3240,6 @@ yaffs_Object *yaffs_CreateNewObject(yaffs_Device *dev, int number,
 	if (!theObject)
 		return NULL;
 
-	if (type == YAFFS_OBJECT_TYPE_FILE) {
-		tn = yaffs_GetTnode(dev);
-		if (!tn) {
-			yaffs_FreeObject(theObject);
-			return NULL;
-		}
-	}
-
 	if (theObject) {
 		theObject->fake = 0;
 		theObject->renameAllowed = 1;
@@ -2206,7 +3265,7 @@ yaffs_Object *yaffs_CreateNewObject(yaffs_Device *dev, int number,
 			theObject->variant.fileVariant.scannedFileSize = 0;
 			theObject->variant.fileVariant.shrinkSize = 0xFFFFFFFF;	/* max __u32 */
 			theObject->variant.fileVariant.topLevel = 0;
-			theObject->variant.fileVariant.top = tn;
+			theObject->variant.fileVariant.top = NULL;
 			break;
 		case YAFFS_OBJECT_TYPE_DIRECTORY:
 			YINIT_LIST_HEAD(&theObject->variant.directoryVariant.
@@ -2302,6 +3361,15 @@ static yaffs_Object *yaffs_MknodObject(yaffs_ObjectType type,
 		in->valid = 1;
 		in->variantType = type;
 
+		/* New files start hot, short lived ones stay that way */
+		in->heat = YAFFS_HEAT_HOT;
+		in->heatClock = dev->heatClock;
+
+		/* The object number may have belonged to a deleted object, so
+		 * the first write must be newer than anything on flash.
+		 */
+		in->lastWriteSeq = dev->sequenceNumber;
+
 		in->yst_mode = mode;
 
 #ifdef CONFIG_YAFFS_WINCE
@@ -2537,6 +3605,7 @@ static int yaffs_InitialiseBlocks(yaffs_Device *dev)
 	dev->chunkBits = NULL;
 
 	dev->allocationBlock = -1;	/* force it to get a new one */
+	dev->coldAllocationBlock = -1;
 
 	/* If the first allocation strategy fails, thry the alternate one */
 	dev->blockInfo = YMALLOC(nBlocks * sizeof(yaffs_BlockInfo));
@@ -2589,6 +3658,8 @@ static int yaffs_BlockNotDisqualifiedFromGC(yaffs_Device *dev,
 					yaffs_BlockInfo *bi)
 {
 	int i;
+	int block;
+	int nWritten;
 	__u32 seq;
 	yaffs_BlockInfo *b;
 
@@ -2598,6 +3669,24 @@ static int yaffs_BlockNotDisqualifiedFromGC(yaffs_Device *dev,
 	if (!bi->hasShrinkHeader)
 		return 1;	/* can gc */
 
+	/* An allocation head older than this block that has discarded pages
+	 * holds chunks this block's shrink header made obsolete. The cold
+	 * head can stay open for a long time, so close it: it then counts as
+	 * dirty below and can be collected itself.
+	 */
+	for (i = 0; i < 2; i++) {
+		block = i ? dev->coldAllocationBlock : dev->allocationBlock;
+		if (block < 0)
+			continue;
+		b = yaffs_GetBlockInfo(dev, block);
+		nWritten = i ? dev->coldAllocationPage : dev->allocationPage;
+		if (b->sequenceNumber < bi->sequenceNumber &&
+		    (b->pagesInUse - b->softDeletions) < nWritten) {
+			yaffs_CloseAllocationBlock(dev, i);
+			dev->oldestDirtySequence = 0;
+		}
+	}
+
 	/* Find the oldest dirty sequence number if we don't know it and save it
 	 * so we don't have to keep recomputing it.
 	 */
@@ -2774,6 +3863,7 @@ static void yaffs_BlockBecameDirty(yaffs_Device *dev, int blockNo)
 		bi->hasShrinkHeader = 0;
 		bi->skipErasedCheck = 1;  /* This is clean, so no need to check */
 		bi->gcPrioritise = 0;
+		bi->hasDroppedChunks = 0;
 		yaffs_ClearChunkBits(dev, blockNo);
 
 		T(YAFFS_TRACE_ERASE,
@@ -2845,12 +3935,13 @@ static int yaffs_CalcCheckpointBlocksRequired(yaffs_Device *dev)
 		int nBytes = 0;
 		int nBlocks;
 		int devBlocks = (dev->endBlock - dev->startBlock + 1);
-		int tnodeSize;
-
-		tnodeSize = (dev->tnodeWidth * YAFFS_NTNODES_LEVEL0)/8;
+		int tnodeSize = yaffs_TnodeSize(dev);
+		int nMapTnodes;
 
-		if (tnodeSize < sizeof(yaffs_Tnode))
-			tnodeSize = sizeof(yaffs_Tnode);
+		/* Extent and dropped maps are written as level 0 tnodes */
+		nMapTnodes = (dev->nExtentChunks + dev->nDroppedChunks) /
+				YAFFS_NTNODES_LEVEL0 +
+			     2 * dev->nExtents + dev->nDroppedMaps;
 
 		nBytes += sizeof(yaffs_CheckpointValidity);
 		nBytes += sizeof(yaffs_CheckpointDevice);
@@ -2858,6 +3949,7 @@ static int yaffs_CalcCheckpointBlocksRequired(yaffs_Device *dev)
 		nBytes += devBlocks * dev->chunkBitmapStride;
 		nBytes += (sizeof(yaffs_CheckpointObject) + sizeof(__u32)) * (dev->nObjectsCreated - dev->nFreeObjects);
 		nBytes += (tnodeSize + sizeof(__u32)) * (dev->nTnodesCreated - dev->nFreeTnodes);
+		nBytes += (tnodeSize + sizeof(__u32)) * nMapTnodes;
 		nBytes += sizeof(yaffs_CheckpointValidity);
 		nBytes += sizeof(__u32); /* checksum*/
 
@@ -2895,16 +3987,130 @@ static int yaffs_CheckSpaceForAllocation(yaffs_Device *dev)
 	return (dev->nFreeChunks > reservedChunks);
 }
 
-static int yaffs_AllocateChunk(yaffs_Device *dev, int useReserve,
+/*
+ * Hot and cold allocation.
+ * Chunks of files that keep getting overwritten are allocated off
+ * dev->allocationBlock, everything else off dev->coldAllocationBlock, so
+ * that GC does not keep copying static data out of blocks made dirty by
+ * databases and their journals.
+ *
+ * The backwards scan takes the first copy of a chunk it sees, going from
+ * the highest sequence number down, so a new copy of an object's chunk
+ * must never land in a block older than one holding an earlier copy.
+ * in->lastWriteSeq tracks the newest block an object has been written to
+ * (the highest sequence at mount if it has not been written since) and
+ * an object only goes to its own head if that is at least as new.
+ * Otherwise its head is closed and a fresh block started, so that cold
+ * data stays out of hot blocks. Only when erased blocks run short is the
+ * other head used instead. Headers that shadow another object must be
+ * newer than anything on the device.
+ */
+
+static int yaffs_ObjectHeat(yaffs_Object *in)
+{
+	__u32 halfLives = (in->myDev->heatClock - in->heatClock) /
+				YAFFS_HEAT_HALF_LIFE;
+
+	return (halfLives >= 8) ? 0 : (in->heat >> halfLives);
+}
+
+static void yaffs_WarmObject(yaffs_Object *in)
+{
+	int heat = yaffs_ObjectHeat(in);
+
+	in->heat = (heat < 255) ? heat + 1 : heat;
+	in->heatClock = in->myDev->heatClock;
+}
+
+static __u32 yaffs_AllocationHeadSequence(yaffs_Device *dev, int cold)
+{
+	int block = cold ? dev->coldAllocationBlock : dev->allocationBlock;
+
+	if (block < 0)
+		return 0;
+	return yaffs_GetBlockInfo(dev, block)->sequenceNumber;
+}
+
+/* Closes an allocation head early. Its unwritten chunks stay free and
+ * come back when the block is collected.
+ */
+static void yaffs_CloseAllocationBlock(yaffs_Device *dev, int cold)
+{
+	yaffs_BlockInfo *bi;
+	int *allocationBlock = cold ? &dev->coldAllocationBlock :
+					&dev->allocationBlock;
+	int block = *allocationBlock;
+
+	if (block < 0)
+		return;
+
+	bi = yaffs_GetBlockInfo(dev, block);
+	bi->blockState = YAFFS_BLOCK_STATE_FULL;
+	*allocationBlock = -1;
+
+	T(YAFFS_TRACE_ALLOCATE,
+	  (TSTR("Closed %s allocation block %d early" TENDSTR),
+	   cold ? "cold" : "hot", block));
+
+	if (bi->pagesInUse == 0 && !bi->hasShrinkHeader)
+		yaffs_BlockBecameDirty(dev, block);
+}
+
+static int yaffs_ChooseColdAllocation(yaffs_Device *dev, yaffs_Object *in,
+				const yaffs_ExtendedTags *tags)
+{
+	int cold = 0;
+	__u32 minSeq = dev->sequenceNumber;
+	__u32 headSeq;
+	__u32 otherSeq;
+
+	if (!dev->separateHotCold)
+		return 0;
+
+	if (in && !tags->extraShadows) {
+		cold = (yaffs_ObjectHeat(in) < YAFFS_HEAT_HOT);
+		minSeq = in->lastWriteSeq ? in->lastWriteSeq :
+				dev->mountSequence;
+	}
+
+	headSeq = yaffs_AllocationHeadSequence(dev, cold);
+	if (headSeq && headSeq >= minSeq)
+		return cold;
+
+	if (dev->nErasedBlocks > dev->nReservedBlocks + 1) {
+		/* A fresh block gets the highest sequence number */
+		yaffs_CloseAllocationBlock(dev, cold);
+		return cold;
+	}
+
+	/* The other head, which holds the newest block if that is open */
+	otherSeq = yaffs_AllocationHeadSequence(dev, !cold);
+	if (otherSeq && otherSeq >= minSeq)
+		return !cold;
+
+	/* Neither will do, so start a fresh block */
+	if (!headSeq)
+		return cold;
+	if (!otherSeq)
+		return !cold;
+	yaffs_CloseAllocationBlock(dev, cold);
+	return cold;
+}
+
+static int yaffs_AllocateChunk(yaffs_Device *dev, int useReserve, int cold,
 		yaffs_BlockInfo **blockUsedPtr)
 {
 	int retVal;
 	yaffs_BlockInfo *bi;
+	int *allocationBlock = cold ? &dev->coldAllocationBlock :
+					&dev->allocationBlock;
+	__u32 *allocationPage = cold ? &dev->coldAllocationPage :
+					&dev->allocationPage;
 
-	if (dev->allocationBlock < 0) {
+	if (*allocationBlock < 0) {
 		/* Get next block to allocate off */
-		dev->allocationBlock = yaffs_FindBlockForAllocation(dev);
-		dev->allocationPage = 0;
+		*allocationBlock = yaffs_FindBlockForAllocation(dev);
+		*allocationPage = 0;
 	}
 
 	if (!useReserve && !yaffs_CheckSpaceForAllocation(dev)) {
@@ -2913,28 +4119,28 @@ static int yaffs_AllocateChunk(yaffs_Device *dev, int useReserve,
 	}
 
 	if (dev->nErasedBlocks < dev->nReservedBlocks
-			&& dev->allocationPage == 0) {
+			&& *allocationPage == 0) {
 		T(YAFFS_TRACE_ALLOCATE, (TSTR("Allocating reserve" TENDSTR)));
 	}
 
 	/* Next page please.... */
-	if (dev->allocationBlock >= 0) {
-		bi = yaffs_GetBlockInfo(dev, dev->allocationBlock);
+	if (*allocationBlock >= 0) {
+		bi = yaffs_GetBlockInfo(dev, *allocationBlock);
 
-		retVal = (dev->allocationBlock * dev->nChunksPerBlock) +
-			dev->allocationPage;
+		retVal = (*allocationBlock * dev->nChunksPerBlock) +
+			*allocationPage;
 		bi->pagesInUse++;
-		yaffs_SetChunkBit(dev, dev->allocationBlock,
-				dev->allocationPage);
+		yaffs_SetChunkBit(dev, *allocationBlock,
+				*allocationPage);
 
-		dev->allocationPage++;
+		(*allocationPage)++;
 
 		dev->nFreeChunks--;
 
 		/* If the block is full set the state to full */
-		if (dev->allocationPage >= dev->nChunksPerBlock) {
+		if (*allocationPage >= dev->nChunksPerBlock) {
 			bi->blockState = YAFFS_BLOCK_STATE_FULL;
-			dev->allocationBlock = -1;
+			*allocationBlock = -1;
 		}
 
 		if (blockUsedPtr)
@@ -2957,6 +4163,8 @@ static int yaffs_GetErasedChunks(yaffs_Device *dev)
 
 	if (dev->allocationBlock > 0)
 		n += (dev->nChunksPerBlock - dev->allocationPage);
+	if (dev->coldAllocationBlock > 0)
+		n += (dev->nChunksPerBlock - dev->coldAllocationPage);
 
 	return n;
 
@@ -3057,7 +4265,8 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 				if (object && !yaffs_SkipVerification(dev)) {
 					if (tags.chunkId == 0)
 						matchingChunk = object->hdrChunk;
-					else if (object->softDeleted)
+					else if (object->softDeleted ||
+						 yaffs_FileMapDropped(object))
 						matchingChunk = oldChunk; /* Defeat the test */
 					else
 						matchingChunk = yaffs_FindChunkInFile(object, tags.chunkId, NULL);
@@ -3102,10 +4311,7 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 					 * Can be discarded and the file deleted.
 					 */
 					object->hdrChunk = 0;
-					yaffs_FreeTnode(object->myDev,
-							object->variant.
-							fileVariant.top);
-					object->variant.fileVariant.top = NULL;
+					yaffs_FreeFileMap(object);
 					yaffs_DoGenericObjectDeletion(object);
 
 				} else if (object) {
@@ -3137,8 +4343,16 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 						yaffs_VerifyObjectHeader(object, oh, &tags, 1);
 					}
 
-					newChunk =
-					    yaffs_WriteNewChunkWithTagsToNAND(dev, buffer, &tags, 1);
+					if (tags.chunkId != 0 &&
+					    object->variantType == YAFFS_OBJECT_TYPE_FILE &&
+					    !yaffs_FileMapDropped(object) &&
+					    yaffs_ReserveFileChunk(object,
+							tags.chunkId) != YAFFS_OK)
+						newChunk = -1; /* Can't map the copy, keep the original */
+					else
+						newChunk =
+						    yaffs_WriteNewChunkWithTagsToNAND(dev, buffer, &tags, 1,
+										object);
 
 					if (newChunk < 0) {
 						retVal = YAFFS_FAIL;
@@ -3150,6 +4364,10 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 							/* It's a header */
 							object->hdrChunk =  newChunk;
 							object->serial =   tags.serialNumber;
+						} else if (yaffs_FileMapDropped(object)) {
+							/* Data chunk, the map is rebuilt later */
+							yaffs_DroppedChunkMoved(object,
+									newChunk);
 						} else {
 							/* It's a data chunk */
 							yaffs_PutChunkIntoFile
@@ -3176,10 +4394,7 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 			    yaffs_FindObjectByNumber(dev,
 						     dev->gcCleanupList[i]);
 			if (object) {
-				yaffs_FreeTnode(dev,
-						object->variant.fileVariant.
-						top);
-				object->variant.fileVariant.top = NULL;
+				yaffs_FreeFileMap(object);
 				T(YAFFS_TRACE_GC,
 				  (TSTR
 				   ("yaffs: About to finally delete object %d"
@@ -3288,6 +4503,69 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 	return aggressive ? gcOk : YAFFS_OK;
 }
 
+/* Background garbage collection.
+ * Called by the OS glue while the file system is idle. Level 1 keeps a few
+ * blocks beyond the aggressive threshold erased and only picks blocks that
+ * are at least half dirty, level 2 keeps more blocks erased and accepts
+ * fuller blocks, level 3 collects every block that has any garbage.
+ * A call copies at most a handful of chunks so the caller can drop the lock
+ * between calls. Returns 1 if there is more work to do.
+ */
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev, int level)
+{
+	int checkpointBlockAdjust;
+	int minErased;
+	int maxLive;
+	int block;
+	yaffs_BlockInfo *bi;
+
+	if (dev->isDoingGC || level <= 0)
+		return 0;
+
+	if (dev->gcBlock <= 0) {
+		checkpointBlockAdjust = yaffs_CalcCheckpointBlocksRequired(dev) - dev->blocksInCheckpoint;
+		if (checkpointBlockAdjust < 0)
+			checkpointBlockAdjust = 0;
+
+		minErased = dev->nReservedBlocks + checkpointBlockAdjust + 2;
+		if (level == 1) {
+			minErased += 4;
+			maxLive = dev->nChunksPerBlock / 2;
+		} else if (level == 2) {
+			minErased += 16;
+			maxLive = (dev->nChunksPerBlock * 3) / 4;
+		} else {
+			minErased = dev->internalEndBlock - dev->internalStartBlock + 1;
+			maxLive = dev->nChunksPerBlock - 1;
+		}
+
+		if (dev->nErasedBlocks >= minErased)
+			return 0;
+
+		block = yaffs_FindBlockForGarbageCollection(dev, 1);
+		if (block <= 0)
+			return 0;
+
+		bi = yaffs_GetBlockInfo(dev, block);
+		if (!bi->gcPrioritise &&
+		    bi->pagesInUse - bi->softDeletions > maxLive)
+			return 0;
+
+		dev->gcBlock = block;
+		dev->gcChunk = 0;
+	}
+
+	T(YAFFS_TRACE_GC,
+	  (TSTR("yaffs: background GC block %d chunk %d erasedBlocks %d"
+		TENDSTR), dev->gcBlock, dev->gcChunk, dev->nErasedBlocks));
+
+	dev->garbageCollections++;
+	dev->backgroundGarbageCollections++;
+	yaffs_GarbageCollectBlock(dev, dev->gcBlock, 0);
+
+	return 1;
+}
+
 /*-------------------------  TAGS --------------------------------*/
 
 static int yaffs_TagsMatch(const yaffs_ExtendedTags *tags, int objectId,
@@ -3304,11 +4582,10 @@ static int yaffs_TagsMatch(const yaffs_ExtendedTags *tags, int objectId,
 static int yaffs_FindChunkInFile(yaffs_Object *in, int chunkInInode,
 				 yaffs_ExtendedTags *tags)
 {
-	/*Get the Tnode, then get the level 0 offset chunk offset */
-	yaffs_Tnode *tn;
-	int theChunk = -1;
+	/* Get the chunk group from the map, then find the chunk in it */
+	int theChunk;
 	yaffs_ExtendedTags localTags;
-	int retVal = -1;
+	int retVal;
 
 	yaffs_Device *dev = in->myDev;
 
@@ -3317,47 +4594,61 @@ static int yaffs_FindChunkInFile(yaffs_Object *in, int chunkInInode,
 		tags = &localTags;
 	}
 
-	tn = yaffs_FindLevel0Tnode(dev, &in->variant.fileVariant, chunkInInode);
+	if (yaffs_LoadFileMap(in) != YAFFS_OK) {
+		/* No memory to rebuild the map, look for just this chunk */
+		retVal = yaffs_ScanDroppedMap(in, chunkInInode);
+		if (retVal > 0)
+			yaffs_ReadChunkWithTagsFromNAND(dev, retVal, NULL, tags);
+		return retVal;
+	}
+
+	theChunk = yaffs_GetFileChunkBase(dev, &in->variant.fileVariant,
+					chunkInInode);
 
-	if (tn) {
-		theChunk = yaffs_GetChunkGroupBase(dev, tn, chunkInInode);
+	retVal = yaffs_FindChunkInGroup(dev, theChunk, tags, in->objectId,
+					chunkInInode);
 
-		retVal =
-		    yaffs_FindChunkInGroup(dev, theChunk, tags, in->objectId,
-					   chunkInInode);
-	}
 	return retVal;
 }
 
 static int yaffs_FindAndDeleteChunkInFile(yaffs_Object *in, int chunkInInode,
 					  yaffs_ExtendedTags *tags)
 {
-	/* Get the Tnode, then get the level 0 offset chunk offset */
-	yaffs_Tnode *tn;
-	int theChunk = -1;
+	/* Get the chunk group from the map, then find the chunk in it */
+	int theChunk;
 	yaffs_ExtendedTags localTags;
 
 	yaffs_Device *dev = in->myDev;
-	int retVal = -1;
+	yaffs_FileStructure *fStruct = &in->variant.fileVariant;
+	int retVal;
 
 	if (!tags) {
 		/* Passed a NULL, so use our own tags space */
 		tags = &localTags;
 	}
 
-	tn = yaffs_FindLevel0Tnode(dev, &in->variant.fileVariant, chunkInInode);
-
-	if (tn) {
+	if (yaffs_LoadFileMap(in) != YAFFS_OK) {
+		/* A dropped map has no entry to delete */
+		return yaffs_ScanDroppedMap(in, chunkInInode);
+	}
 
-		theChunk = yaffs_GetChunkGroupBase(dev, tn, chunkInInode);
+	theChunk = yaffs_GetFileChunkBase(dev, fStruct, chunkInInode);
 
-		retVal =
-		    yaffs_FindChunkInGroup(dev, theChunk, tags, in->objectId,
-					   chunkInInode);
+	retVal = yaffs_FindChunkInGroup(dev, theChunk, tags, in->objectId,
+					chunkInInode);
 
-		/* Delete the entry in the filestructure (if found) */
-		if (retVal != -1)
-			yaffs_PutLevel0Tnode(dev, tn, chunkInInode, 0);
+	/* Delete the entry in the filestructure (if found).
+	 * Taking a chunk out of the middle of an extent splits it.
+	 */
+	if (retVal != -1) {
+		if (fStruct->extents &&
+		    yaffs_ReserveFileChunk(in, chunkInInode) != YAFFS_OK) {
+			T(YAFFS_TRACE_ERROR,
+			  (TSTR("yaffs: no memory to unmap chunk %d of %d"
+				TENDSTR), chunkInInode, in->objectId));
+			return -1;
+		}
+		yaffs_SetFileChunkBase(in, chunkInInode, 0);
 	}
 
 	return retVal;
@@ -3429,8 +4720,8 @@ static int yaffs_PutChunkIntoFile(yaffs_Object *in, int chunkInInode,
 	 * for backward scanning inScan is < 0
 	 */
 
-	yaffs_Tnode *tn;
 	yaffs_Device *dev = in->myDev;
+	yaffs_FileStructure *fStruct = &in->variant.fileVariant;
 	int existingChunk;
 	yaffs_ExtendedTags existingTags;
 	yaffs_ExtendedTags newTags;
@@ -3452,14 +4743,11 @@ static int yaffs_PutChunkIntoFile(yaffs_Object *in, int chunkInInode,
 		return YAFFS_OK;
 	}
 
-	tn = yaffs_AddOrFindLevel0Tnode(dev,
-					&in->variant.fileVariant,
-					chunkInInode,
-					NULL);
-	if (!tn)
+	if (yaffs_LoadFileMap(in) != YAFFS_OK ||
+	    yaffs_ReserveFileChunk(in, chunkInInode) != YAFFS_OK)
 		return YAFFS_FAIL;
 
-	existingChunk = yaffs_GetChunkGroupBase(dev, tn, chunkInInode);
+	existingChunk = yaffs_GetFileChunkBase(dev, fStruct, chunkInInode);
 
 	if (inScan != 0) {
 		/* If we're scanning then we need to test for duplicates
@@ -3539,7 +4827,7 @@ static int yaffs_PutChunkIntoFile(yaffs_Object *in, int chunkInInode,
 	if (existingChunk == 0)
 		in->nDataChunks++;
 
-	yaffs_PutLevel0Tnode(dev, tn, chunkInInode, chunkInNAND);
+	yaffs_SetFileChunkBase(in, chunkInInode, chunkInNAND);
 
 	return YAFFS_OK;
 }
@@ -3644,9 +4932,19 @@ static int yaffs_WriteChunkDataToObject(yaffs_Object *in, int chunkInInode,
 
 	yaffs_CheckGarbageCollection(dev);
 
+	/* Make sure the new chunk can be mapped before writing it */
+	if (yaffs_LoadFileMap(in) != YAFFS_OK ||
+	    yaffs_ReserveFileChunk(in, chunkInInode) != YAFFS_OK)
+		return -1;
+
 	/* Get the previous chunk at this location in the file if it exists */
 	prevChunkId = yaffs_FindChunkInFile(in, chunkInInode, &prevTags);
 
+	/* Overwrites make a file hot */
+	dev->heatClock++;
+	if (prevChunkId > 0)
+		yaffs_WarmObject(in);
+
 	/* Set up new tags */
 	yaffs_InitialiseTags(&newTags);
 
@@ -3664,7 +4962,7 @@ static int yaffs_WriteChunkDataToObject(yaffs_Object *in, int chunkInInode,
 
 	newChunkId =
 	    yaffs_WriteNewChunkWithTagsToNAND(dev, buffer, &newTags,
-					      useReserve);
+					      useReserve, in);
 
 	if (newChunkId >= 0) {
 		yaffs_PutChunkIntoFile(in, chunkInInode, newChunkId, 0);
@@ -3813,7 +5111,8 @@ int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name, int force,
 		/* Create new chunk in NAND */
 		newChunkId =
 		    yaffs_WriteNewChunkWithTagsToNAND(dev, buffer, &newTags,
-						      (prevChunkId > 0) ? 1 : 0);
+						      (prevChunkId > 0) ? 1 : 0,
+						      in);
 
 		if (newChunkId >= 0) {
 
@@ -3855,21 +5154,42 @@ int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name, int force,
  *   In Linux, the page cache provides read buffering aand the short op cache provides write
  *   buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   Cached chunks are found through a hash on (object, chunkId) and kept on a
+ *   list in order of use, most recent first and unused entries last, so that
+ *   looking up and replacing a chunk does not depend on the size of the cache.
+ *   Each object also keeps its own entries in chunkId order, so flushing or
+ *   invalidating a file only looks at the chunks it has cached.
  */
 
+static int yaffs_ChunkCacheBucket(yaffs_Device *dev, const yaffs_Object *obj,
+				  int chunkId)
+{
+	return (obj->objectId * 7 + chunkId) & dev->srCacheHashMask;
+}
+
+/* Drop what an entry holds and make it the first to be reused */
+static void yaffs_ReleaseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache)
+{
+	if (cache->object) {
+		ylist_del_init(&cache->hashLink);
+		ylist_del_init(&cache->objectLink);
+		cache->object->nCachedChunks--;
+		cache->object = NULL;
+	}
+	cache->dirty = 0;
+
+	ylist_del(&cache->lruLink);
+	ylist_add_tail(&cache->lruLink, &dev->srCacheLru);
+}
+
 static int yaffs_ObjectHasCachedWriteData(yaffs_Object *obj)
 {
-	yaffs_Device *dev = obj->myDev;
-	int i;
+	struct ylist_head *i;
 	yaffs_ChunkCache *cache;
-	int nCaches = obj->myDev->nShortOpCaches;
 
-	for (i = 0; i < nCaches; i++) {
-		cache = &dev->srCache[i];
-		if (cache->object == obj &&
-		    cache->dirty)
+	ylist_for_each(i, &obj->cachedChunks) {
+		cache = ylist_entry(i, yaffs_ChunkCache, objectLink);
+		if (cache->dirty)
 			return 1;
 	}
 
@@ -3877,53 +5197,41 @@ static int yaffs_ObjectHasCachedWriteData(yaffs_Object *obj)
 }
 
 
+/* Write out the object's dirty chunks in chunkId order */
 static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
-	int lowest = -99;	/* Stop compiler whining. */
-	int i;
-	yaffs_ChunkCache *cache;
-	int chunkWritten = 0;
-	int nCaches = obj->myDev->nShortOpCaches;
+	struct ylist_head *i;
+	struct ylist_head *n;
+	yaffs_ChunkCache *cache = NULL;
+	int chunkWritten;
 
-	if (nCaches > 0) {
-		do {
+	ylist_for_each_safe(i, n, &obj->cachedChunks) {
+		cache = ylist_entry(i, yaffs_ChunkCache, objectLink);
+		if (!cache->dirty) {
 			cache = NULL;
+			continue;
+		}
+		if (cache->locked)
+			break;
 
-			/* Find the dirty cache for this object with the lowest chunk id. */
-			for (i = 0; i < nCaches; i++) {
-				if (dev->srCache[i].object == obj &&
-				    dev->srCache[i].dirty) {
-					if (!cache
-					    || dev->srCache[i].chunkId <
-					    lowest) {
-						cache = &dev->srCache[i];
-						lowest = cache->chunkId;
-					}
-				}
-			}
-
-			if (cache && !cache->locked) {
-				/* Write it out and free it up */
-
-				chunkWritten =
-				    yaffs_WriteChunkDataToObject(cache->object,
-								 cache->chunkId,
-								 cache->data,
-								 cache->nBytes,
-								 1);
-				cache->dirty = 0;
-				cache->object = NULL;
-			}
-
-		} while (cache && chunkWritten > 0);
+		/* Write it out and free it up */
+		chunkWritten = yaffs_WriteChunkDataToObject(obj,
+							    cache->chunkId,
+							    cache->data,
+							    cache->nBytes,
+							    1);
+		yaffs_ReleaseChunkCache(dev, cache);
+		if (chunkWritten <= 0)
+			break;
+		cache = NULL;
+	}
 
-		if (cache) {
-			/* Hoosterman, disk full while writing cache out. */
-			T(YAFFS_TRACE_ERROR,
-			  (TSTR("yaffs tragedy: no space during cache write" TENDSTR)));
+	if (cache) {
+		/* Hoosterman, disk full while writing cache out. */
+		T(YAFFS_TRACE_ERROR,
+		  (TSTR("yaffs tragedy: no space during cache write" TENDSTR)));
 
-		}
 	}
 
 }
@@ -3958,74 +5266,54 @@ void yaffs_FlushEntireDeviceCache(yaffs_Device *dev)
 }
 
 
-/* Grab us a cache chunk for use.
- * First look for an empty one.
- * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
+/* Grab us a cache chunk for use and assign it to the object's chunk.
+ * Unused entries are at the end of the use list, after them comes the least
+ * recently used one. If that is dirty its object's cache is flushed, which
+ * frees up entries at the end of the list.
  */
-static yaffs_ChunkCache *yaffs_GrabChunkCacheWorker(yaffs_Device *dev)
-{
-	int i;
-
-	if (dev->nShortOpCaches > 0) {
-		for (i = 0; i < dev->nShortOpCaches; i++) {
-			if (!dev->srCache[i].object)
-				return &dev->srCache[i];
-		}
-	}
-
-	return NULL;
-}
-
-static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
+static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Object *obj, int chunkId)
 {
-	yaffs_ChunkCache *cache;
-	yaffs_Object *theObj;
-	int usage;
-	int i;
-	int pushout;
-
-	if (dev->nShortOpCaches > 0) {
-		/* Try find a non-dirty one... */
-
-		cache = yaffs_GrabChunkCacheWorker(dev);
+	yaffs_Device *dev = obj->myDev;
+	yaffs_ChunkCache *cache = NULL;
+	struct ylist_head *i;
 
-		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
-			 * NB what's here is not very accurate, we actually flush the object
-			 * the last recently used page.
-			 */
+	if (dev->nShortOpCaches <= 0)
+		return NULL;
 
-			/* With locking we can't assume we can use entry zero */
+	/* With locking we can't assume we can use the last entry */
+	for (i = dev->srCacheLru.prev; i != &dev->srCacheLru; i = i->prev) {
+		cache = ylist_entry(i, yaffs_ChunkCache, lruLink);
+		if (!cache->locked)
+			break;
+		cache = NULL;
+	}
 
-			theObj = NULL;
-			usage = -1;
+	if (cache && cache->dirty) {
+		/* Flush and try again */
+		yaffs_FlushFilesChunkCache(cache->object);
+		cache = ylist_entry(dev->srCacheLru.prev,
+				    yaffs_ChunkCache, lruLink);
+		if (cache->object)
 			cache = NULL;
-			pushout = -1;
-
-			for (i = 0; i < dev->nShortOpCaches; i++) {
-				if (dev->srCache[i].object &&
-				    !dev->srCache[i].locked &&
-				    (dev->srCache[i].lastUse < usage || !cache)) {
-					usage = dev->srCache[i].lastUse;
-					theObj = dev->srCache[i].object;
-					cache = &dev->srCache[i];
-					pushout = i;
-				}
-			}
+	}
 
-			if (!cache || cache->dirty) {
-				/* Flush and try again */
-				yaffs_FlushFilesChunkCache(theObj);
-				cache = yaffs_GrabChunkCacheWorker(dev);
-			}
+	if (cache) {
+		yaffs_ReleaseChunkCache(dev, cache);
+		cache->object = obj;
+		obj->nCachedChunks++;
+		cache->chunkId = chunkId;
+		ylist_add(&cache->hashLink,
+			  &dev->srCacheHash[yaffs_ChunkCacheBucket(dev, obj, chunkId)]);
 
+		/* Keep the object's entries sorted, new chunks usually go last */
+		for (i = obj->cachedChunks.prev; i != &obj->cachedChunks; i = i->prev) {
+			if (ylist_entry(i, yaffs_ChunkCache, objectLink)->chunkId < chunkId)
+				break;
 		}
-		return cache;
-	} else
-		return NULL;
+		ylist_add(&cache->objectLink, i);
+	}
 
+	return cache;
 }
 
 /* Find a cached chunk */
@@ -4033,15 +5321,15 @@ static yaffs_ChunkCache *yaffs_FindChunkCache(const yaffs_Object *obj,
 					      int chunkId)
 {
 	yaffs_Device *dev = obj->myDev;
-	int i;
-	if (dev->nShortOpCaches > 0) {
-		for (i = 0; i < dev->nShortOpCaches; i++) {
-			if (dev->srCache[i].object == obj &&
-			    dev->srCache[i].chunkId == chunkId) {
-				dev->cacheHits++;
+	yaffs_ChunkCache *cache;
+	struct ylist_head *i;
 
-				return &dev->srCache[i];
-			}
+	if (dev->nShortOpCaches > 0) {
+		ylist_for_each(i, &dev->srCacheHash[yaffs_ChunkCacheBucket(dev, obj, chunkId)]) {
+			cache = ylist_entry(i, yaffs_ChunkCache, hashLink);
+			if (cache->object == obj &&
+			    cache->chunkId == chunkId)
+				return cache;
 		}
 	}
 	return NULL;
@@ -4053,18 +5341,8 @@ static void yaffs_UseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
 {
 
 	if (dev->nShortOpCaches > 0) {
-		if (dev->srLastUse < 0 || dev->srLastUse > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->nShortOpCaches; i++)
-				dev->srCache[i].lastUse = 0;
-
-			dev->srLastUse = 0;
-		}
-
-		dev->srLastUse++;
-
-		cache->lastUse = dev->srLastUse;
+		ylist_del(&cache->lruLink);
+		ylist_add(&cache->lruLink, &dev->srCacheLru);
 
 		if (isAWrite)
 			cache->dirty = 1;
@@ -4081,7 +5359,7 @@ static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
 		yaffs_ChunkCache *cache = yaffs_FindChunkCache(object, chunkId);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_ReleaseChunkCache(object->myDev, cache);
 	}
 }
 
@@ -4090,16 +5368,12 @@ static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
  */
 static void yaffs_InvalidateWholeChunkCache(yaffs_Object *in)
 {
-	int i;
 	yaffs_Device *dev = in->myDev;
 
-	if (dev->nShortOpCaches > 0) {
-		/* Invalidate it. */
-		for (i = 0; i < dev->nShortOpCaches; i++) {
-			if (dev->srCache[i].object == in)
-				dev->srCache[i].object = NULL;
-		}
-	}
+	while (!ylist_empty(&in->cachedChunks))
+		yaffs_ReleaseChunkCache(dev, ylist_entry(in->cachedChunks.next,
+							 yaffs_ChunkCache,
+							 objectLink));
 }
 
 /*--------------------- Checkpointing --------------------*/
@@ -4141,6 +5415,8 @@ static void yaffs_DeviceToCheckpointDevice(yaffs_CheckpointDevice *cp,
 	cp->nErasedBlocks = dev->nErasedBlocks;
 	cp->allocationBlock = dev->allocationBlock;
 	cp->allocationPage = dev->allocationPage;
+	cp->coldAllocationBlock = dev->coldAllocationBlock;
+	cp->coldAllocationPage = dev->coldAllocationPage;
 	cp->nFreeChunks = dev->nFreeChunks;
 
 	cp->nDeletedFiles = dev->nDeletedFiles;
@@ -4157,6 +5433,8 @@ static void yaffs_CheckpointDeviceToDevice(yaffs_Device *dev,
 	dev->nErasedBlocks = cp->nErasedBlocks;
 	dev->allocationBlock = cp->allocationBlock;
 	dev->allocationPage = cp->allocationPage;
+	dev->coldAllocationBlock = cp->coldAllocationBlock;
+	dev->coldAllocationPage = cp->coldAllocationPage;
 	dev->nFreeChunks = cp->nFreeChunks;
 
 	dev->nDeletedFiles = cp->nDeletedFiles;
@@ -4308,17 +5586,21 @@ static int yaffs_CheckpointObjectToObject(yaffs_Object *obj, yaffs_CheckpointObj
 
 
 
+static int yaffs_CheckpointLevel0Tnode(yaffs_Device *dev, __u32 baseOffset,
+					yaffs_Tnode *tn)
+{
+	int tnodeSize = yaffs_TnodeSize(dev);
+
+	return yaffs_CheckpointWrite(dev, &baseOffset, sizeof(baseOffset)) == sizeof(baseOffset) &&
+		yaffs_CheckpointWrite(dev, tn, tnodeSize) == tnodeSize;
+}
+
 static int yaffs_CheckpointTnodeWorker(yaffs_Object *in, yaffs_Tnode *tn,
 					__u32 level, int chunkOffset)
 {
 	int i;
 	yaffs_Device *dev = in->myDev;
 	int ok = 1;
-	int tnodeSize = (dev->tnodeWidth * YAFFS_NTNODES_LEVEL0)/8;
-
-	if (tnodeSize < sizeof(yaffs_Tnode))
-		tnodeSize = sizeof(yaffs_Tnode);
-
 
 	if (tn) {
 		if (level > 0) {
@@ -4333,9 +5615,7 @@ static int yaffs_CheckpointTnodeWorker(yaffs_Object *in, yaffs_Tnode *tn,
 			}
 		} else if (level == 0) {
 			__u32 baseOffset = chunkOffset <<  YAFFS_TNODES_LEVEL0_BITS;
-			ok = (yaffs_CheckpointWrite(dev, &baseOffset, sizeof(baseOffset)) == sizeof(baseOffset));
-			if (ok)
-				ok = (yaffs_CheckpointWrite(dev, tn, tnodeSize) == tnodeSize);
+			ok = yaffs_CheckpointLevel0Tnode(dev, baseOffset, tn);
 		}
 	}
 
@@ -4343,13 +5623,60 @@ static int yaffs_CheckpointTnodeWorker(yaffs_Object *in, yaffs_Tnode *tn,
 
 }
 
+/* Extents are written the same way as a tree, one level 0 tnode for each
+ * YAFFS_NTNODES_LEVEL0 chunks that have any mapped.
+ */
+static int yaffs_CheckpointExtents(yaffs_Object *obj)
+{
+	yaffs_Device *dev = obj->myDev;
+	yaffs_ExtentMap *map = obj->variant.fileVariant.extents;
+	yaffs_Tnode *tn;
+	__u32 baseOffset = ~0;
+	__u32 chunkId;
+	__u32 k;
+	int i;
+	int ok = 1;
+
+	tn = yaffs_GetTnode(dev);
+	if (!tn)
+		return 0;
+
+	for (i = 0; ok && i < map->nExtents; i++) {
+		for (k = 0; ok && k < map->extent[i].nChunks; k++) {
+			chunkId = map->extent[i].chunkId + k;
+
+			if ((chunkId & ~YAFFS_TNODES_LEVEL0_MASK) != baseOffset) {
+				if (~baseOffset)
+					ok = yaffs_CheckpointLevel0Tnode(dev,
+							baseOffset, tn);
+				baseOffset = chunkId & ~YAFFS_TNODES_LEVEL0_MASK;
+				memset(tn, 0, yaffs_TnodeSize(dev));
+			}
+			yaffs_PutLevel0Tnode(dev, tn, chunkId,
+					map->extent[i].chunk + k);
+		}
+	}
+
+	if (ok && ~baseOffset)
+		ok = yaffs_CheckpointLevel0Tnode(dev, baseOffset, tn);
+
+	yaffs_FreeTnode(dev, tn);
+
+	return ok;
+}
+
 static int yaffs_WriteCheckpointTnodes(yaffs_Object *obj)
 {
 	__u32 endMarker = ~0;
 	int ok = 1;
 
 	if (obj->variantType == YAFFS_OBJECT_TYPE_FILE) {
-		ok = yaffs_CheckpointTnodeWorker(obj,
+		/* The checkpoint has no room for dropped maps */
+		ok = (yaffs_LoadFileMap(obj) == YAFFS_OK);
+		if (ok && obj->variant.fileVariant.extents)
+			ok = yaffs_CheckpointExtents(obj);
+		else if (ok)
+			ok = yaffs_CheckpointTnodeWorker(obj,
 					    obj->variant.fileVariant.top,
 					    obj->variant.fileVariant.topLevel,
 					    0);
@@ -4369,10 +5696,7 @@ static int yaffs_ReadCheckpointTnodes(yaffs_Object *obj)
 	yaffs_FileStructure *fileStructPtr = &obj->variant.fileVariant;
 	yaffs_Tnode *tn;
 	int nread = 0;
-	int tnodeSize = (dev->tnodeWidth * YAFFS_NTNODES_LEVEL0)/8;
-
-	if (tnodeSize < sizeof(yaffs_Tnode))
-		tnodeSize = sizeof(yaffs_Tnode);
+	int tnodeSize = yaffs_TnodeSize(dev);
 
 	ok = (yaffs_CheckpointRead(dev, &baseChunk, sizeof(baseChunk)) == sizeof(baseChunk));
 
@@ -4565,9 +5889,10 @@ static int yaffs_WriteCheckpointData(yaffs_Device *dev)
 	if (!yaffs_CheckpointClose(dev))
 		ok = 0;
 
-	if (ok)
+	if (ok) {
 		dev->isCheckpointed = 1;
-	else
+		dev->checkpointSequence = dev->sequenceNumber;
+	} else
 		dev->isCheckpointed = 0;
 
 	return dev->isCheckpointed;
@@ -4610,9 +5935,10 @@ static int yaffs_ReadCheckpointData(yaffs_Device *dev)
 	if (!yaffs_CheckpointClose(dev))
 		ok = 0;
 
-	if (ok)
+	if (ok) {
 		dev->isCheckpointed = 1;
-	else
+		dev->checkpointSequence = dev->sequenceNumber;
+	} else
 		dev->isCheckpointed = 0;
 
 	return ok ? 1 : 0;
@@ -4622,9 +5948,15 @@ static int yaffs_ReadCheckpointData(yaffs_Device *dev)
 static void yaffs_InvalidateCheckpoint(yaffs_Device *dev)
 {
 	if (dev->isCheckpointed ||
-			dev->blocksInCheckpoint > 0) {
+	   (dev->skipCheckpointWrite && dev->blocksInCheckpoint > 0)) {
 		dev->isCheckpointed = 0;
-		yaffs_CheckpointInvalidateStream(dev);
+		/* The stale checkpoint stays on flash so that the next mount
+		 * can replay the newer blocks on top of it, see
+		 * yaffs_ReplayCheckpointLog(). It is erased when the next
+		 * checkpoint is written, or now if there won't be one.
+		 */
+		if (dev->skipCheckpointWrite)
+			yaffs_CheckpointInvalidateStream(dev);
 		if (dev->superBlock && dev->markSuperBlockDirty)
 			dev->markSuperBlockDirty(dev->superBlock);
 	}
@@ -4708,6 +6040,8 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 			nToCopy = dev->nDataBytesPerChunk - start;
 
 		cache = yaffs_FindChunkCache(in, chunk);
+		if (cache)
+			dev->cacheHits++;
 
 		/* If the chunk is already in the cache or it is less than a whole chunk
 		 * or we're using inband tags then use the cache (if there is caching)
@@ -4719,9 +6053,8 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 				/* If we can't find the data in the cache, then load it up. */
 
 				if (!cache) {
-					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
+					dev->cacheMisses++;
+					cache = yaffs_GrabChunkCache(in, chunk);
 					cache->dirty = 0;
 					cache->locked = 0;
 					yaffs_ReadChunkDataFromObject(in, chunk,
@@ -4746,28 +6079,164 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 				yaffs_ReadChunkDataFromObject(in, chunk,
 							      localBuffer);
 
-				memcpy(buffer, &localBuffer[start], nToCopy);
+				memcpy(buffer, &localBuffer[start], nToCopy);
+
+
+				yaffs_ReleaseTempBuffer(dev, localBuffer,
+							__LINE__);
+			}
+
+		} else {
+
+			/* A full chunk. Read directly into the supplied buffer. */
+			yaffs_ReadChunkDataFromObject(in, chunk, buffer);
+
+		}
+
+		n -= nToCopy;
+		offset += nToCopy;
+		buffer += nToCopy;
+		nDone += nToCopy;
+
+	}
+
+	return nDone;
+}
+
+/* Reads without the device lock.
+ * yaffs_MapFileChunks() looks up where the chunks backing a range of a file
+ * are on NAND (-1 for holes) and where the range starts in the first one.
+ * It needs either the gross lock or the object's mapLock held for reading,
+ * since everything that changes the map holds that for writing. The level 0
+ * tnode is looked up once for each run of chunks it covers. The data is then
+ * fetched without any lock with yaffs_ReadChunksUnlocked().
+ * NAND chunks are never rewritten in place, so the data read is good unless
+ * a block was erased in between, which the caller detects by sampling
+ * nBlockErasures before and after. The mapping fails if the file has chunks
+ * in the short op cache, which may be newer than NAND, if its map has been
+ * dropped, and for chunk groups and devices that need the tags read to get
+ * the data.
+ */
+static int yaffs_CanReadUnlocked(yaffs_Device *dev)
+{
+	return dev->isYaffs2 &&
+		dev->readChunkWithTagsFromNAND && dev->chunkGroupSize == 1;
+}
+
+int yaffs_MapFileChunks(yaffs_Object *in, loff_t offset, int nBytes,
+			int *chunkMap, int maxChunks, __u32 *start)
+{
+	yaffs_Device *dev = in->myDev;
+	yaffs_Tnode *tn = NULL;
+	yaffs_ExtendedTags tags;
+	int chunk;
+	int nChunks;
+	int theChunk;
+	int i;
+
+	if (!yaffs_CanReadUnlocked(dev) || in->nCachedChunks ||
+	    yaffs_FileMapDropped(in) || nBytes <= 0)
+		return 0;
 
+	yaffs_AddrToChunk(dev, offset, &chunk, start);
 
-				yaffs_ReleaseTempBuffer(dev, localBuffer,
-							__LINE__);
-			}
+	nChunks = (*start + nBytes + dev->nDataBytesPerChunk - 1) /
+		dev->nDataBytesPerChunk;
+	if (nChunks > maxChunks)
+		return 0;
 
+	for (i = 0, chunk++; i < nChunks; i++, chunk++) {
+		if (in->variant.fileVariant.extents) {
+			theChunk = yaffs_GetExtentChunk(
+					in->variant.fileVariant.extents, chunk);
 		} else {
+			if (!tn || !(chunk & YAFFS_TNODES_LEVEL0_MASK))
+				tn = yaffs_FindLevel0Tnode(dev,
+						&in->variant.fileVariant,
+						chunk);
+			theChunk = tn ? yaffs_GetChunkGroupBase(dev, tn, chunk) : 0;
+		}
 
-			/* A full chunk. Read directly into the supplied buffer. */
-			yaffs_ReadChunkDataFromObject(in, chunk, buffer);
+		chunkMap[i] = yaffs_FindChunkInGroup(dev, theChunk, &tags,
+						in->objectId, chunk);
+	}
+
+	return nChunks;
+}
+
+/* Reads nBytes starting start bytes into the first chunk of the map.
+ * Chunks that are wanted whole are read straight into the buffer. The
+ * others, and all chunks with inband tags where the page holds more than
+ * the data, are read into the bounce buffer of nBounce whole NAND chunks
+ * and copied from there. Chunks that follow each other on NAND are read
+ * with a single call when the driver can do that.
+ */
+int yaffs_ReadChunksUnlocked(yaffs_Device *dev, const int *chunkMap,
+			     int start, int nBytes, __u8 *buffer,
+			     __u8 *bounce, int nBounce)
+{
+	int nData = dev->nDataBytesPerChunk;
+	int direct;
+	int nToCopy;
+	int result;
+	int i;
+	int j;
+	int n;
 
+	for (i = 0; nBytes > 0; i += n) {
+		n = 1;
+		if (chunkMap[i] < 0) {
+			nToCopy = nData - start;
+			if (nToCopy > nBytes)
+				nToCopy = nBytes;
+			memset(buffer, 0, nToCopy);
+			buffer += nToCopy;
+			nBytes -= nToCopy;
+			start = 0;
+			continue;
 		}
 
-		n -= nToCopy;
-		offset += nToCopy;
-		buffer += nToCopy;
-		nDone += nToCopy;
+		direct = !dev->inbandTags && !start && nBytes >= nData;
+		if (!direct && !bounce)
+			return YAFFS_FAIL;
+
+		if (dev->readChunksFromNAND) {
+			while ((direct ? (n + 1) * nData <= nBytes :
+				n < nBounce && n * nData - start < nBytes) &&
+			       chunkMap[i + n] == chunkMap[i] + n)
+				n++;
+		}
+
+		if (n > 1)
+			result = dev->readChunksFromNAND(dev,
+					chunkMap[i] - dev->chunkOffset,
+					n, direct ? buffer : bounce);
+		else
+			result = dev->readChunkWithTagsFromNAND(dev,
+					chunkMap[i] - dev->chunkOffset,
+					direct ? buffer : bounce, NULL);
+		if (result != YAFFS_OK)
+			return YAFFS_FAIL;
+
+		if (direct) {
+			buffer += n * nData;
+			nBytes -= n * nData;
+			continue;
+		}
 
+		for (j = 0; j < n; j++) {
+			nToCopy = nData - start;
+			if (nToCopy > nBytes)
+				nToCopy = nBytes;
+			memcpy(buffer, bounce + j * dev->totalBytesPerChunk + start,
+			       nToCopy);
+			buffer += nToCopy;
+			nBytes -= nToCopy;
+			start = 0;
+		}
 	}
 
-	return nDone;
+	return YAFFS_OK;
 }
 
 int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
@@ -4845,13 +6314,15 @@ int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 				yaffs_ChunkCache *cache;
 				/* If we can't find the data in the cache, then load the cache */
 				cache = yaffs_FindChunkCache(in, chunk);
+				if (cache)
+					dev->cacheHits++;
+				else
+					dev->cacheMisses++;
 
 				if (!cache
 				    && yaffs_CheckSpaceForAllocation(in->
 								     myDev)) {
-					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
+					cache = yaffs_GrabChunkCache(in, chunk);
 					cache->dirty = 0;
 					cache->locked = 0;
 					yaffs_ReadChunkDataFromObject(in, chunk,
@@ -5018,6 +6489,8 @@ int yaffs_ResizeFile(yaffs_Object *in, loff_t newSize)
 
 	if (newSize < oldFileSize) {
 
+		/* If this fails each chunk is looked for in the dropped map */
+		yaffs_LoadFileMap(in);
 		yaffs_PruneResizedChunks(in, newSize);
 
 		if (newSizeOfPartialChunk != 0) {
@@ -5040,7 +6513,9 @@ int yaffs_ResizeFile(yaffs_Object *in, loff_t newSize)
 
 		in->variant.fileVariant.fileSize = newSize;
 
+		yaffs_LockFileMap(in);
 		yaffs_PruneFileStructure(dev, &in->variant.fileVariant);
+		yaffs_UnlockFileMap(in);
 	} else {
 		/* newsSize > oldFileSize */
 		in->variant.fileVariant.fileSize = newSize;
@@ -5187,8 +6662,7 @@ int yaffs_DeleteFile(yaffs_Object *in)
 		return deleted ? YAFFS_OK : YAFFS_FAIL;
 	} else {
 		/* The file has no data chunks so we toss it immediately */
-		yaffs_FreeTnode(in->myDev, in->variant.fileVariant.top);
-		in->variant.fileVariant.top = NULL;
+		yaffs_FreeFileMap(in);
 		yaffs_DoGenericObjectDeletion(in);
 
 		return YAFFS_OK;
@@ -5293,6 +6767,7 @@ static int yaffs_UnlinkWorker(yaffs_Object *obj)
 		hl = ylist_entry(obj->hardLinks.next, yaffs_Object, hardLinks);
 
 		ylist_del_init(&hl->hardLinks);
+		yaffs_NameHashRemove(hl);
 		ylist_del_init(&hl->siblings);
 
 		yaffs_GetObjectName(hl, name, YAFFS_MAX_NAME_LENGTH + 1);
@@ -5434,6 +6909,27 @@ static int ybicmp(const void *a, const void *b)
 		return aseq - bseq;
 }
 
+static void yaffs_SortBlockIndex(yaffs_BlockIndex *blockIndex, int nBlocks)
+{
+#ifndef CONFIG_YAFFS_USE_OWN_SORT
+	/* Use qsort now. */
+	yaffs_qsort(blockIndex, nBlocks, sizeof(yaffs_BlockIndex), ybicmp);
+#else
+	/* Dungy old bubble sort... */
+
+	yaffs_BlockIndex temp;
+	int i;
+	int j;
+
+	for (i = 0; i < nBlocks; i++)
+		for (j = i + 1; j < nBlocks; j++)
+			if (blockIndex[i].seq > blockIndex[j].seq) {
+				temp = blockIndex[j];
+				blockIndex[j] = blockIndex[i];
+				blockIndex[i] = temp;
+			}
+#endif
+}
 
 struct yaffs_ShadowFixerStruct {
 	int objectId;
@@ -6036,6 +7532,7 @@ static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in)
 	yaffs_ExtendedTags tags;
 	int result;
 	int alloc_failed = 0;
+	int rehash;
 
 	if (!in)
 		return;
@@ -6049,7 +7546,6 @@ static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in)
 #endif
 
 	if (in->lazyLoaded && in->hdrChunk > 0) {
-		in->lazyLoaded = 0;
 		chunkData = yaffs_GetTempBuffer(dev, __LINE__);
 
 		result = yaffs_ReadChunkWithTagsFromNAND(dev, in->hdrChunk, chunkData, &tags);
@@ -6072,6 +7568,9 @@ static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in)
 		in->yst_rdev = oh->yst_rdev;
 
 #endif
+		/* Rehashed once loaded, insertion would load it again */
+		rehash = in->nameHashed;
+		yaffs_NameHashRemove(in);
 		yaffs_SetObjectName(in, oh->name);
 
 		if (in->variantType == YAFFS_OBJECT_TYPE_SYMLINK) {
@@ -6082,6 +7581,17 @@ static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in)
 		}
 
 		yaffs_ReleaseTempBuffer(dev, chunkData, __LINE__);
+
+		/* yaffs_FindObjectByNameUnlocked() trusts the details once
+		 * it sees the flag clear.
+		 */
+#ifdef __KERNEL__
+		smp_wmb();
+#endif
+		in->lazyLoaded = 0;
+
+		if (rehash)
+			yaffs_NameHashInsert(in->parent, in);
 	}
 }
 
@@ -6118,6 +7628,8 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 	yaffs_BlockIndex *blockIndex = NULL;
 	int altBlockIndex = 0;
+	yaffs_ExtendedTags *blockTags = NULL;
+	int blockTagsRead;
 
 	if (!dev->isYaffs2) {
 		T(YAFFS_TRACE_SCAN,
@@ -6150,6 +7662,11 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 	chunkData = yaffs_GetTempBuffer(dev, __LINE__);
 
+	/* Tags are read a whole block at a time where possible */
+	if (dev->readBlockTagsFromNAND)
+		blockTags = YMALLOC(dev->nChunksPerBlock *
+				    sizeof(yaffs_ExtendedTags));
+
 	/* Scan all the blocks to determine their state */
 	for (blk = dev->internalStartBlock; blk <= dev->internalEndBlock; blk++) {
 		bi = yaffs_GetBlockInfo(dev, blk);
@@ -6215,28 +7732,7 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	YYIELD();
 
 	/* Sort the blocks */
-#ifndef CONFIG_YAFFS_USE_OWN_SORT
-	{
-		/* Use qsort now. */
-		yaffs_qsort(blockIndex, nBlocksToScan, sizeof(yaffs_BlockIndex), ybicmp);
-	}
-#else
-	{
-		/* Dungy old bubble sort... */
-
-		yaffs_BlockIndex temp;
-		int i;
-		int j;
-
-		for (i = 0; i < nBlocksToScan; i++)
-			for (j = i + 1; j < nBlocksToScan; j++)
-				if (blockIndex[i].seq > blockIndex[j].seq) {
-					temp = blockIndex[j];
-					blockIndex[j] = blockIndex[i];
-					blockIndex[i] = temp;
-				}
-	}
-#endif
+	yaffs_SortBlockIndex(blockIndex, nBlocksToScan);
 
 	YYIELD();
 
@@ -6265,6 +7761,12 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 		deleted = 0;
 
+		blockTagsRead = 0;
+		if (blockTags && (state == YAFFS_BLOCK_STATE_NEEDS_SCANNING ||
+				  state == YAFFS_BLOCK_STATE_ALLOCATING))
+			blockTagsRead = (yaffs_ReadBlockTagsFromNAND(dev, blk,
+						blockTags) == YAFFS_OK);
+
 		/* For each chunk in each block that needs scanning.... */
 		foundChunksInBlock = 0;
 		for (c = dev->nChunksPerBlock - 1;
@@ -6277,8 +7779,11 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 			chunk = blk * dev->nChunksPerBlock + c;
 
-			result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL,
-							&tags);
+			if (blockTagsRead)
+				tags = blockTags[c];
+			else
+				result = yaffs_ReadChunkWithTagsFromNAND(dev,
+							chunk, NULL, &tags);
 
 			/* Let's have a good look at this chunk... */
 
@@ -6705,49 +8210,739 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 						break;
 					}
 
-				}
+				}
+
+			}
+
+		} /* End of scanning for each chunk */
+
+		if (state == YAFFS_BLOCK_STATE_NEEDS_SCANNING) {
+			/* If we got this far while scanning, then the block is fully allocated. */
+			state = YAFFS_BLOCK_STATE_FULL;
+		}
+
+		bi->blockState = state;
+
+		/* Now let's see if it was dirty */
+		if (bi->pagesInUse == 0 &&
+		    !bi->hasShrinkHeader &&
+		    bi->blockState == YAFFS_BLOCK_STATE_FULL) {
+			yaffs_BlockBecameDirty(dev, blk);
+		}
+
+	}
+
+	if (altBlockIndex)
+		YFREE_ALT(blockIndex);
+	else
+		YFREE(blockIndex);
+
+	if (blockTags)
+		YFREE(blockTags);
+
+	/* Ok, we've done all the scanning.
+	 * Fix up the hard link chains.
+	 * We should now have scanned all the objects, now it's time to add these
+	 * hardlinks.
+	 */
+	yaffs_HardlinkFixup(dev, hardList);
+
+
+	yaffs_ReleaseTempBuffer(dev, chunkData, __LINE__);
+
+	if (alloc_failed)
+		return YAFFS_FAIL;
+
+	T(YAFFS_TRACE_SCAN, (TSTR("yaffs_ScanBackwards ends" TENDSTR)));
+
+	return YAFFS_OK;
+}
+
+/*------------------------  Checkpoint replay ----------------------------
+ * A checkpoint is not erased when the file system changes after it has been
+ * written (see yaffs_InvalidateCheckpoint()). Every block allocated from then
+ * on gets a higher sequence number than the checkpoint, so those blocks are a
+ * log of the changes. yaffs_ReplayCheckpointLog() brings a restored checkpoint
+ * up to date: it forgets whatever lived in blocks that have since been erased
+ * or reused and then replays the newer blocks oldest first. Anything that does
+ * not fit this model makes it fail and the caller falls back to
+ * yaffs_ScanBackwards().
+ */
+
+static int yaffs_ReplayChunkChanged(yaffs_Device *dev, const __u8 *changed,
+				int chunk)
+{
+	int blk = chunk / dev->nChunksPerBlock;
+
+	return blk >= dev->internalStartBlock &&
+	       blk <= dev->internalEndBlock &&
+	       changed[blk - dev->internalStartBlock];
+}
+
+static void yaffs_ReplayDropWorker(yaffs_Object *in, yaffs_Tnode *tn,
+				__u32 level, const __u8 *changed)
+{
+	yaffs_Device *dev = in->myDev;
+	int i;
+	__u32 chunk;
+
+	if (!tn)
+		return;
+
+	if (level > 0) {
+		for (i = 0; i < YAFFS_NTNODES_INTERNAL; i++)
+			yaffs_ReplayDropWorker(in, tn->internal[i],
+					level - 1, changed);
+		return;
+	}
+
+	for (i = 0; i < YAFFS_NTNODES_LEVEL0; i++) {
+		chunk = yaffs_GetChunkGroupBase(dev, tn, i);
+		if (chunk > 0 && yaffs_ReplayChunkChanged(dev, changed, chunk)) {
+			yaffs_PutLevel0Tnode(dev, tn, i, 0);
+			in->nDataChunks--;
+		}
+	}
+}
+
+/* Forget data chunks and object headers that were in changed blocks.
+ * Objects that lose their header get hdrChunk -1 until a newer header is
+ * replayed for them.
+ */
+static void yaffs_ReplayDropChangedBlocks(yaffs_Device *dev,
+					const __u8 *changed)
+{
+	yaffs_Object *obj;
+	struct ylist_head *lh;
+	int i;
+
+	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
+		ylist_for_each(lh, &dev->objectBucket[i].list) {
+			obj = ylist_entry(lh, yaffs_Object, hashLink);
+
+			/* Maps are all tnode trees until the mount is done */
+			if (obj->variantType == YAFFS_OBJECT_TYPE_FILE) {
+				yaffs_ReplayDropWorker(obj,
+					obj->variant.fileVariant.top,
+					obj->variant.fileVariant.topLevel,
+					changed);
+				obj->variant.fileVariant.scannedFileSize =
+					obj->variant.fileVariant.fileSize;
+			}
+
+			if (obj->hdrChunk > 0 &&
+			    yaffs_ReplayChunkChanged(dev, changed, obj->hdrChunk))
+				obj->hdrChunk = obj->fake ? 0 : -1;
+		}
+	}
+}
+
+static int yaffs_ReplayObjectHeader(yaffs_Device *dev, int chunk,
+				yaffs_ExtendedTags *tags, yaffs_BlockInfo *bi,
+				yaffs_Object **hardList)
+{
+	__u8 *chunkData;
+	yaffs_ObjectHeader *oh;
+	yaffs_Object *in;
+	yaffs_Object *parent;
+	yaffs_Object *shadowed;
+	int wasUnlinked;
+	int itsUnlinked;
+	int isShrink;
+	__u32 fileSize;
+	int ok = 1;
+
+	chunkData = yaffs_GetTempBuffer(dev, __LINE__);
+	yaffs_ReadChunkWithTagsFromNAND(dev, chunk, chunkData, NULL);
+	oh = (yaffs_ObjectHeader *) chunkData;
+
+	if (dev->inbandTags) {
+		/* Fix up the header if they got corrupted by inband tags */
+		oh->shadowsObject = oh->inbandShadowsObject;
+		oh->isShrink = oh->inbandIsShrink;
+	}
+
+	/* inbandIsShrink is never written, the tags have the real flag */
+	if (tags->extraHeaderInfoAvailable)
+		isShrink = tags->extraIsShrinkHeader;
+	else
+		isShrink = oh->isShrink;
+
+	in = yaffs_FindOrCreateObjectByNumber(dev, tags->objectId, oh->type);
+
+	if (!in || in->variantType != oh->type) {
+		/* Out of memory or the object number has been reused */
+		T(YAFFS_TRACE_CHECKPOINT,
+		  (TSTR("replay: object %d type %d at chunk %d does not fit"
+		    TENDSTR), tags->objectId, oh->type, chunk));
+		ok = 0;
+		goto out;
+	}
+
+	/* The new header replaces the old one */
+	yaffs_DeleteChunk(dev, in->hdrChunk, 1, __LINE__);
+	in->hdrChunk = chunk;
+	in->dirty = 0;
+
+	/* Let the details (name, attributes, alias) load from the new header */
+	if (in->variantType == YAFFS_OBJECT_TYPE_SYMLINK &&
+	    !in->lazyLoaded) {
+		YFREE(in->variant.symLinkVariant.alias);
+		in->variant.symLinkVariant.alias = NULL;
+	}
+	in->lazyLoaded = 1;
+	yaffs_CheckObjectDetailsLoaded(in);
+
+	if (in->fake) {
+		/* Root and lost+found: don't fiddle with directory structure */
+		goto out;
+	}
+
+	if (oh->shadowsObject > 0) {
+		/* A rename replaced the shadowed object */
+		shadowed = yaffs_FindObjectByNumber(dev, oh->shadowsObject);
+		if (shadowed && shadowed != in && !shadowed->fake)
+			yaffs_AddObjectToDirectory(dev->deletedDir, shadowed);
+	}
+
+	parent = yaffs_FindOrCreateObjectByNumber(dev, oh->parentObjectId,
+						YAFFS_OBJECT_TYPE_DIRECTORY);
+	if (!parent) {
+		ok = 0;
+		goto out;
+	}
+	if (parent->variantType != YAFFS_OBJECT_TYPE_DIRECTORY)
+		parent = dev->lostNFoundDir;
+
+	wasUnlinked = (in->parent == dev->deletedDir) ||
+		      (in->parent == dev->unlinkedDir);
+	itsUnlinked = (parent == dev->deletedDir) ||
+		      (parent == dev->unlinkedDir);
+
+	if (wasUnlinked && !itsUnlinked) {
+		/* Deleted and then reused, too hard to sort out here */
+		ok = 0;
+		goto out;
+	}
+
+	if (in->parent != parent)
+		yaffs_AddObjectToDirectory(parent, in);
+
+	switch (in->variantType) {
+	case YAFFS_OBJECT_TYPE_FILE:
+		/* The header size wins over the data seen so far, but only
+		 * a shrink header drops data: gc copies old headers with the
+		 * shrink flag cleared, so a plain header may be older than
+		 * the data before it. Deleting a file is a shrink to zero.
+		 */
+		fileSize = itsUnlinked ? 0 : oh->fileSize;
+
+		if (in->variant.fileVariant.fileSize <
+		    in->variant.fileVariant.scannedFileSize)
+			in->variant.fileVariant.fileSize =
+				in->variant.fileVariant.scannedFileSize;
+
+		if ((isShrink || itsUnlinked) &&
+		    fileSize < in->variant.fileVariant.fileSize)
+			yaffs_PruneResizedChunks(in, fileSize);
+
+		/* scannedFileSize keeps the end of the data seen so far until
+		 * a shrink header prunes it, so that a later shrink still
+		 * reaches chunks beyond an out of order plain header.
+		 */
+		in->variant.fileVariant.fileSize = fileSize;
+		if (isShrink || itsUnlinked ||
+		    in->variant.fileVariant.scannedFileSize < fileSize)
+			in->variant.fileVariant.scannedFileSize = fileSize;
+
+		if (isShrink || itsUnlinked)
+			bi->hasShrinkHeader = 1;
+		break;
+	case YAFFS_OBJECT_TYPE_HARDLINK:
+		if (!itsUnlinked &&
+		    !in->variant.hardLinkVariant.equivalentObject) {
+			in->variant.hardLinkVariant.equivalentObjectId =
+				oh->equivalentObjectId;
+			in->hardLinks.next = (struct ylist_head *) *hardList;
+			*hardList = in;
+		}
+		break;
+	default:
+		break;
+	}
+
+out:
+	yaffs_ReleaseTempBuffer(dev, chunkData, __LINE__);
+	return ok;
+}
+
+/* Replays the chunks of a block from startChunk on. Returns the last chunk
+ * in use through lastUsed, -1 if there is none.
+ */
+static int yaffs_ReplayBlock(yaffs_Device *dev, int blk, int startChunk,
+			yaffs_Object **hardList, int *lastUsed)
+{
+	yaffs_BlockInfo *bi = yaffs_GetBlockInfo(dev, blk);
+	yaffs_ExtendedTags tags;
+	yaffs_Object *in;
+	__u32 endpos;
+	int chunk;
+	int c;
+
+	*lastUsed = startChunk - 1;
+
+	for (c = startChunk; c < dev->nChunksPerBlock; c++) {
+		chunk = blk * dev->nChunksPerBlock + c;
+
+		yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL, &tags);
+
+		if (!tags.chunkUsed)
+			continue;
+
+		*lastUsed = c;
+
+		if (tags.eccResult == YAFFS_ECC_RESULT_UNFIXED) {
+			T(YAFFS_TRACE_SCAN,
+			  (TSTR(" Unfixed ECC in chunk(%d:%d), chunk ignored"
+			    TENDSTR), blk, c));
+			continue;
+		}
+
+		yaffs_SetChunkBit(dev, blk, c);
+		bi->pagesInUse++;
+
+		if (tags.chunkId == 0) {
+			if (!yaffs_ReplayObjectHeader(dev, chunk, &tags, bi,
+						hardList))
+				return YAFFS_FAIL;
+			continue;
+		}
+
+		/* A data chunk: newer than anything in the file so far */
+		in = yaffs_FindOrCreateObjectByNumber(dev, tags.objectId,
+						YAFFS_OBJECT_TYPE_FILE);
+		if (!in || !yaffs_PutChunkIntoFile(in, tags.chunkId, chunk, 1))
+			return YAFFS_FAIL;
+
+		if (in->variantType != YAFFS_OBJECT_TYPE_FILE)
+			continue;
+
+		endpos = (tags.chunkId - 1) * dev->nDataBytesPerChunk +
+			 tags.byteCount;
+		if (in->variant.fileVariant.scannedFileSize < endpos)
+			in->variant.fileVariant.scannedFileSize = endpos;
+
+		/* Replay runs forward, so the data is newer than any header
+		 * seen so far; a later shrink header prunes it again.
+		 */
+		if (in->variant.fileVariant.fileSize < endpos)
+			in->variant.fileVariant.fileSize = endpos;
+	}
+
+	return YAFFS_OK;
+}
+
+/* Objects whose header was erased and not rewritten have been deleted. A
+ * directory that still has children is left unrooted instead, so that
+ * yaffs_FixHangingObjects() puts it in lost+found just as a full scan would.
+ */
+static void yaffs_ReplayForgetLostObjects(yaffs_Device *dev)
+{
+	yaffs_Object *obj;
+	struct ylist_head *lh;
+	int i;
+
+	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
+		ylist_for_each(lh, &dev->objectBucket[i].list) {
+			obj = ylist_entry(lh, yaffs_Object, hashLink);
+
+			if (obj->hdrChunk >= 0)
+				continue;
+
+			obj->hdrChunk = 0;
+			obj->lazyLoaded = 0;
+			if (obj->variantType == YAFFS_OBJECT_TYPE_DIRECTORY &&
+			    !ylist_empty(&obj->variant.directoryVariant.children))
+				yaffs_RemoveObjectFromDirectory(obj);
+			else
+				yaffs_AddObjectToDirectory(dev->deletedDir, obj);
+		}
+	}
+}
+
+static int yaffs_ReplayCheckpointLog(yaffs_Device *dev)
+{
+	int nBlocks = dev->internalEndBlock - dev->internalStartBlock + 1;
+	__u32 cpSequence = dev->sequenceNumber;
+	int cpAllocationBlock = dev->allocationBlock;
+	int cpAllocationPage = dev->allocationPage;
+	int cpColdAllocationBlock = dev->coldAllocationBlock;
+	int cpColdAllocationPage = dev->coldAllocationPage;
+	yaffs_BlockIndex *blockIndex = NULL;
+	int altBlockIndex = 0;
+	int nBlocksToReplay = 0;
+	int nReplayed = 0;
+	int nChanged = 0;
+	__u8 *changed;
+	yaffs_Object *hardList = NULL;
+	yaffs_BlockInfo *bi;
+	yaffs_BlockState state;
+	__u32 sequenceNumber;
+	int blk;
+	int i;
+	int startChunk;
+	int lastUsed;
+	int ok = 1;
+
+	/* Chunk groups must not straddle blocks for the tnode walk */
+	if (dev->nChunksPerBlock % dev->chunkGroupSize)
+		ok = 0;
+
+	changed = ok ? YMALLOC(nBlocks) : NULL;
+	if (changed) {
+		memset(changed, 0, nBlocks);
+		blockIndex = YMALLOC(nBlocks * sizeof(yaffs_BlockIndex));
+		if (!blockIndex) {
+			blockIndex = YMALLOC_ALT(nBlocks *
+						sizeof(yaffs_BlockIndex));
+			altBlockIndex = 1;
+		}
+	}
+	if (!blockIndex)
+		ok = 0;
+
+	/* Compare the block states on flash with the checkpoint */
+	for (blk = dev->internalStartBlock;
+	     ok && blk <= dev->internalEndBlock; blk++) {
+		bi = yaffs_GetBlockInfo(dev, blk);
+
+		if (bi->blockState == YAFFS_BLOCK_STATE_DEAD)
+			continue;
+
+		yaffs_QueryInitialBlockState(dev, blk, &state, &sequenceNumber);
+
+		if (sequenceNumber == YAFFS_SEQUENCE_CHECKPOINT_DATA) {
+			ok = (bi->blockState == YAFFS_BLOCK_STATE_CHECKPOINT);
+			continue;
+		}
 
+		if (bi->blockState == YAFFS_BLOCK_STATE_CHECKPOINT) {
+			ok = 0;
+		} else if (state == YAFFS_BLOCK_STATE_DEAD ||
+			   sequenceNumber == YAFFS_SEQUENCE_BAD_BLOCK) {
+			bi->blockState = YAFFS_BLOCK_STATE_DEAD;
+			changed[blk - dev->internalStartBlock] = 1;
+		} else if (state == YAFFS_BLOCK_STATE_EMPTY) {
+			if (bi->blockState != YAFFS_BLOCK_STATE_EMPTY) {
+				/* Erased since the checkpoint */
+				bi->blockState = YAFFS_BLOCK_STATE_EMPTY;
+				changed[blk - dev->internalStartBlock] = 1;
 			}
+		} else if (sequenceNumber < YAFFS_LOWEST_SEQUENCE_NUMBER ||
+			   sequenceNumber >= YAFFS_HIGHEST_SEQUENCE_NUMBER) {
+			ok = 0;
+		} else if (sequenceNumber > cpSequence) {
+			/* Allocated since the checkpoint */
+			bi->blockState = YAFFS_BLOCK_STATE_NEEDS_SCANNING;
+			bi->sequenceNumber = sequenceNumber;
+			changed[blk - dev->internalStartBlock] = 1;
+			blockIndex[nBlocksToReplay].seq = sequenceNumber;
+			blockIndex[nBlocksToReplay].block = blk;
+			nBlocksToReplay++;
+		} else if (bi->blockState == YAFFS_BLOCK_STATE_EMPTY ||
+			   bi->sequenceNumber != sequenceNumber) {
+			ok = 0;
+		} else if (blk == cpAllocationBlock ||
+			   blk == cpColdAllocationBlock) {
+			/* May have been written past the checkpoint's page */
+			bi->blockState = YAFFS_BLOCK_STATE_NEEDS_SCANNING;
+			blockIndex[nBlocksToReplay].seq = sequenceNumber;
+			blockIndex[nBlocksToReplay].block = blk;
+			nBlocksToReplay++;
+		}
 
-		} /* End of scanning for each chunk */
+		if (!ok)
+			T(YAFFS_TRACE_CHECKPOINT,
+			  (TSTR("replay: block %d state %d seq %d does not match"
+			    TCONT(" checkpoint state %d seq %d") TENDSTR),
+			   blk, state, sequenceNumber, bi->blockState,
+			   bi->sequenceNumber));
+	}
 
-		if (state == YAFFS_BLOCK_STATE_NEEDS_SCANNING) {
-			/* If we got this far while scanning, then the block is fully allocated. */
-			state = YAFFS_BLOCK_STATE_FULL;
+	if (ok) {
+		for (i = 0; i < nBlocks; i++) {
+			if (!changed[i])
+				continue;
+			blk = dev->internalStartBlock + i;
+			bi = yaffs_GetBlockInfo(dev, blk);
+			yaffs_ClearChunkBits(dev, blk);
+			bi->pagesInUse = 0;
+			bi->softDeletions = 0;
+			bi->hasShrinkHeader = 0;
+			bi->gcPrioritise = 0;
+			bi->needsRetiring = 0;
+			bi->skipErasedCheck = 0;
+			nChanged++;
 		}
 
-		bi->blockState = state;
+		if (nChanged)
+			yaffs_ReplayDropChangedBlocks(dev, changed);
 
-		/* Now let's see if it was dirty */
-		if (bi->pagesInUse == 0 &&
-		    !bi->hasShrinkHeader &&
-		    bi->blockState == YAFFS_BLOCK_STATE_FULL) {
-			yaffs_BlockBecameDirty(dev, blk);
+		yaffs_SortBlockIndex(blockIndex, nBlocksToReplay);
+		dev->allocationBlock = -1;
+		dev->allocationPage = 0;
+		dev->coldAllocationBlock = -1;
+		dev->coldAllocationPage = 0;
+	}
+
+	for (i = 0; ok && i < nBlocksToReplay; i++) {
+		YYIELD();
+
+		blk = blockIndex[i].block;
+		bi = yaffs_GetBlockInfo(dev, blk);
+
+		/* Blocks no newer than the checkpoint are only here if they
+		 * were one of its allocation heads.
+		 */
+		if (blockIndex[i].seq > cpSequence)
+			startChunk = 0;
+		else if (blk == cpAllocationBlock)
+			startChunk = cpAllocationPage;
+		else
+			startChunk = cpColdAllocationPage;
+
+		ok = yaffs_ReplayBlock(dev, blk, startChunk, &hardList,
+				&lastUsed);
+		if (!ok)
+			break;
+		if (lastUsed >= startChunk)
+			nReplayed++;
+
+		/* A checkpoint head may be older than the checkpoint */
+		if (blockIndex[i].seq > dev->sequenceNumber)
+			dev->sequenceNumber = blockIndex[i].seq;
+
+		if (lastUsed < dev->nChunksPerBlock - 1 &&
+		    i == nBlocksToReplay - 1) {
+			bi->blockState = YAFFS_BLOCK_STATE_ALLOCATING;
+			dev->allocationBlock = blk;
+			dev->allocationPage = lastUsed + 1;
+			dev->allocationBlockFinder = blk;
+		} else if (lastUsed < dev->nChunksPerBlock - 1 &&
+			   blockIndex[i].seq <= cpSequence &&
+			   dev->coldAllocationBlock < 0) {
+			/* The checkpoint's other head carries on as the cold
+			 * head. yaffs_ChooseColdAllocation() closes it if an
+			 * object needs a newer block.
+			 */
+			bi->blockState = YAFFS_BLOCK_STATE_ALLOCATING;
+			dev->coldAllocationBlock = blk;
+			dev->coldAllocationPage = lastUsed + 1;
+		} else {
+			/* A partially written block other than the last had a
+			 * write failure.
+			 */
+			if (lastUsed < dev->nChunksPerBlock - 1)
+				bi->gcPrioritise = 1;
+			bi->blockState = YAFFS_BLOCK_STATE_FULL;
+			if (bi->pagesInUse == 0 && !bi->hasShrinkHeader)
+				yaffs_BlockBecameDirty(dev, blk);
 		}
+	}
 
+	if (ok) {
+		yaffs_HardlinkFixup(dev, hardList);
+		yaffs_ReplayForgetLostObjects(dev);
+
+		dev->nErasedBlocks = 0;
+		for (blk = dev->internalStartBlock;
+		     blk <= dev->internalEndBlock; blk++)
+			if (yaffs_GetBlockInfo(dev, blk)->blockState ==
+			    YAFFS_BLOCK_STATE_EMPTY)
+				dev->nErasedBlocks++;
+		dev->nFreeChunks = yaffs_CountFreeChunks(dev);
+		dev->oldestDirtySequence = 0;
+
+		if (nChanged || nReplayed) {
+			/* The checkpoint on flash is stale */
+			dev->isCheckpointed = 0;
+			T(YAFFS_TRACE_ALWAYS,
+			  (TSTR("yaffs: replayed %d blocks, %d changed since checkpoint"
+			    TENDSTR), nReplayed, nChanged));
+		}
+	} else {
+		dev->isCheckpointed = 0;
+		T(YAFFS_TRACE_ALWAYS,
+		  (TSTR("yaffs: checkpoint replay failed, scanning" TENDSTR)));
 	}
 
 	if (altBlockIndex)
 		YFREE_ALT(blockIndex);
-	else
+	else if (blockIndex)
 		YFREE(blockIndex);
+	if (changed)
+		YFREE(changed);
 
-	/* Ok, we've done all the scanning.
-	 * Fix up the hard link chains.
-	 * We should now have scanned all the objects, now it's time to add these
-	 * hardlinks.
-	 */
-	yaffs_HardlinkFixup(dev, hardList);
+	return ok ? YAFFS_OK : YAFFS_FAIL;
+}
 
+/* With YAFFS_TRACE_VERIFY_REPLAY a mount that replayed the checkpoint log
+ * also scans the device and compares the two: the type, parent, header
+ * chunk, size and data chunks of every object that has not been deleted.
+ * The scan is what is mounted.
+ */
+typedef struct {
+	__u32 objectId;
+	__u32 parentId;
+	int variantType;
+	int hdrChunk;
+	__u32 fileSize;
+	int nDataChunks;
+	__u32 mapSum;
+} yaffs_ReplayRecord;
+
+static __u32 yaffs_ReplayMapSum(yaffs_Device *dev, yaffs_Tnode *tn,
+				__u32 level, __u32 baseChunkId)
+{
+	__u32 sum = 0;
+	__u32 chunkId;
+	__u32 chunk;
+	int i;
 
-	yaffs_ReleaseTempBuffer(dev, chunkData, __LINE__);
+	if (!tn)
+		return 0;
 
-	if (alloc_failed)
-		return YAFFS_FAIL;
+	if (level > 0) {
+		for (i = 0; i < YAFFS_NTNODES_INTERNAL; i++)
+			sum += yaffs_ReplayMapSum(dev, tn->internal[i],
+				level - 1,
+				(baseChunkId << YAFFS_TNODES_INTERNAL_BITS) + i);
+		return sum;
+	}
 
-	T(YAFFS_TRACE_SCAN, (TSTR("yaffs_ScanBackwards ends" TENDSTR)));
+	/* Order does not matter, so that the sum only depends on the map */
+	for (i = 0; i < YAFFS_NTNODES_LEVEL0; i++) {
+		chunk = yaffs_GetChunkGroupBase(dev, tn, i);
+		chunkId = (baseChunkId << YAFFS_TNODES_LEVEL0_BITS) + i;
+		if (chunk)
+			sum += (chunkId * 2654435761U) ^ chunk;
+	}
+	return sum;
+}
 
-	return YAFFS_OK;
+static int yaffs_ReplayRecordCmp(const void *a, const void *b)
+{
+	return ((yaffs_ReplayRecord *)a)->objectId -
+		((yaffs_ReplayRecord *)b)->objectId;
+}
+
+/* Returns the objects' records sorted by id, NULL if out of memory */
+static yaffs_ReplayRecord *yaffs_RecordObjects(yaffs_Device *dev,
+					int *nRecords)
+{
+	int n = dev->nObjectsCreated - dev->nFreeObjects;
+	yaffs_ReplayRecord *records;
+	yaffs_ReplayRecord *r;
+	yaffs_Object *obj;
+	struct ylist_head *lh;
+	int i;
+
+	records = YMALLOC_ALT((n + 1) * sizeof(yaffs_ReplayRecord));
+	if (!records)
+		return NULL;
+
+	r = records;
+	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
+		ylist_for_each(lh, &dev->objectBucket[i].list) {
+			obj = ylist_entry(lh, yaffs_Object, hashLink);
+			if (r - records >= n)
+				break;
+			/* Deleted objects are only stripped after the mount */
+			if (obj->parent == dev->deletedDir ||
+			    obj->parent == dev->unlinkedDir)
+				continue;
+			memset(r, 0, sizeof(yaffs_ReplayRecord));
+			r->objectId = obj->objectId;
+			r->parentId = obj->parent ? obj->parent->objectId : 0;
+			r->variantType = obj->variantType;
+			r->hdrChunk = obj->hdrChunk;
+			if (obj->variantType == YAFFS_OBJECT_TYPE_FILE) {
+				r->fileSize = obj->variant.fileVariant.fileSize;
+				r->nDataChunks = obj->nDataChunks;
+				r->mapSum = yaffs_ReplayMapSum(dev,
+					obj->variant.fileVariant.top,
+					obj->variant.fileVariant.topLevel, 0);
+			}
+			r++;
+		}
+	}
+
+	*nRecords = r - records;
+	yaffs_qsort(records, *nRecords, sizeof(yaffs_ReplayRecord),
+		    yaffs_ReplayRecordCmp);
+	return records;
+}
+
+/* Compares the replayed records with the scanned device. Returns the
+ * number of objects that differ.
+ */
+static int yaffs_VerifyReplay(yaffs_Device *dev, yaffs_ReplayRecord *replayed,
+			int nReplayed)
+{
+	yaffs_ReplayRecord *scanned;
+	yaffs_ReplayRecord *r;
+	yaffs_ReplayRecord *s;
+	int nScanned;
+	int nDiffer = 0;
+	int i = 0;
+	int j = 0;
+
+	scanned = yaffs_RecordObjects(dev, &nScanned);
+	if (!scanned)
+		return 0;
+
+	while (i < nReplayed || j < nScanned) {
+		r = (i < nReplayed) ? &replayed[i] : NULL;
+		s = (j < nScanned) ? &scanned[j] : NULL;
+
+		if (r && (!s || r->objectId < s->objectId)) {
+			T(YAFFS_TRACE_ALWAYS,
+			  (TSTR("yaffs: replay has object %d, scan has not"
+			    TENDSTR), r->objectId));
+			nDiffer++;
+			i++;
+		} else if (!r || s->objectId < r->objectId) {
+			T(YAFFS_TRACE_ALWAYS,
+			  (TSTR("yaffs: scan has object %d, replay has not"
+			    TENDSTR), s->objectId));
+			nDiffer++;
+			j++;
+		} else {
+			if (memcmp(r, s, sizeof(yaffs_ReplayRecord))) {
+				T(YAFFS_TRACE_ALWAYS,
+				  (TSTR("yaffs: object %d replay/scan: type %d/%d"
+				    TCONT(" parent %d/%d header %d/%d size %d/%d")
+				    TCONT(" chunks %d/%d map %08x/%08x")
+				    TENDSTR), r->objectId,
+				   r->variantType, s->variantType,
+				   r->parentId, s->parentId,
+				   r->hdrChunk, s->hdrChunk,
+				   r->fileSize, s->fileSize,
+				   r->nDataChunks, s->nDataChunks,
+				   r->mapSum, s->mapSum));
+				nDiffer++;
+			}
+			i++;
+			j++;
+		}
+	}
+
+	T(YAFFS_TRACE_ALWAYS,
+	  (TSTR("yaffs: replay verified against scan, %d objects, %d differ"
+	    TENDSTR), nScanned, nDiffer));
+
+	YFREE_ALT(scanned);
+	return nDiffer;
 }
 
 /*------------------------------  Directory Functions ----------------------------- */
@@ -6849,6 +9044,132 @@ static void yaffs_UpdateParent(yaffs_Object *obj)
 	yaffs_UpdateObjectHeader(obj,NULL,0,0,0);
 }
 
+/* Name hash for large directories.
+ * The first lookup in a directory with many children indexes them by name
+ * sum, so that further lookups only compare names within one bucket instead
+ * of walking the whole children list. The index follows the children as they
+ * are added, removed and renamed, and is resized as the directory grows.
+ * Objects without a header only have made up names, lookups of those and of
+ * lost+found skip the index.
+ */
+#define YAFFS_NAMEHASH_THRESHOLD	32
+#define YAFFS_NAMEHASH_MIN_BUCKETS	16
+#define YAFFS_NAMEHASH_MAX_BUCKETS	1024	/* one page of pointers */
+
+static int yaffs_NameHashBucket(yaffs_DirectoryStructure *dir, __u16 sum)
+{
+	return (sum ^ (sum >> 8)) & (dir->nameHashBuckets - 1);
+}
+
+static void yaffs_NameHashInsert(yaffs_Object *directory, yaffs_Object *obj)
+{
+	yaffs_DirectoryStructure *dir = &directory->variant.directoryVariant;
+	int b;
+
+	/* A lazy loaded object does not know its name sum yet */
+	yaffs_CheckObjectDetailsLoaded(obj);
+
+	b = yaffs_NameHashBucket(dir, obj->sum);
+	obj->nameHashNext = dir->nameHash[b];
+	dir->nameHash[b] = obj;
+	obj->nameHashed = 1;
+	dir->nameHashCount++;
+}
+
+static void yaffs_NameHashRemove(yaffs_Object *obj)
+{
+	yaffs_DirectoryStructure *dir;
+	yaffs_Object **link;
+
+	if (!obj->nameHashed)
+		return;
+
+	dir = &obj->parent->variant.directoryVariant;
+	link = &dir->nameHash[yaffs_NameHashBucket(dir, obj->sum)];
+	while (*link && *link != obj)
+		link = &(*link)->nameHashNext;
+
+	if (*link) {
+		*link = obj->nameHashNext;
+		dir->nameHashCount--;
+	} else {
+		T(YAFFS_TRACE_ERROR,
+		  (TSTR("yaffs: object %d missing from name hash" TENDSTR),
+		   obj->objectId));
+		YBUG();
+	}
+
+	obj->nameHashNext = NULL;
+	obj->nameHashed = 0;
+}
+
+static void yaffs_NameHashFree(yaffs_Object *directory)
+{
+	yaffs_DirectoryStructure *dir = &directory->variant.directoryVariant;
+	struct ylist_head *i;
+
+	if (!dir->nameHash)
+		return;
+
+	ylist_for_each(i, &dir->children) {
+		yaffs_Object *l = ylist_entry(i, yaffs_Object, siblings);
+		l->nameHashNext = NULL;
+		l->nameHashed = 0;
+	}
+
+	YFREE(dir->nameHash);
+	dir->nameHash = NULL;
+	dir->nameHashBuckets = 0;
+	dir->nameHashCount = 0;
+}
+
+/* Builds the index, or rebuilds it with more buckets once the chains get
+ * long. If there is no memory for it lookups just walk the list.
+ */
+static void yaffs_NameHashBuild(yaffs_Object *directory)
+{
+	yaffs_DirectoryStructure *dir = &directory->variant.directoryVariant;
+	struct ylist_head *i;
+	int nChildren = 0;
+	int nBuckets = YAFFS_NAMEHASH_MIN_BUCKETS;
+	yaffs_Object **table;
+
+	ylist_for_each(i, &dir->children) {
+		if (++nChildren >= YAFFS_NAMEHASH_THRESHOLD)
+			break;
+	}
+	if (nChildren < YAFFS_NAMEHASH_THRESHOLD)
+		return;
+
+	nChildren = 0;
+	ylist_for_each(i, &dir->children)
+		nChildren++;
+
+	while (nBuckets < nChildren / 2 &&
+	       nBuckets < YAFFS_NAMEHASH_MAX_BUCKETS)
+		nBuckets <<= 1;
+
+	if (nBuckets <= dir->nameHashBuckets)
+		return;
+
+	table = YMALLOC(nBuckets * sizeof(yaffs_Object *));
+	if (!table)
+		return;
+	memset(table, 0, nBuckets * sizeof(yaffs_Object *));
+
+	yaffs_NameHashFree(directory);
+	dir->nameHash = table;
+	dir->nameHashBuckets = nBuckets;
+
+	ylist_for_each(i, &dir->children)
+		yaffs_NameHashInsert(directory,
+				ylist_entry(i, yaffs_Object, siblings));
+
+	T(YAFFS_TRACE_OS,
+	  (TSTR("yaffs: name hash for directory %d, %d children %d buckets"
+		TENDSTR), directory->objectId, nChildren, nBuckets));
+}
+
 static void yaffs_RemoveObjectFromDirectory(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
@@ -6862,6 +9183,7 @@ static void yaffs_RemoveObjectFromDirectory(yaffs_Object *obj)
 	if (dev && dev->removeObjectCallback)
 		dev->removeObjectCallback(obj);
 
+	yaffs_NameHashRemove(obj);
 
 	ylist_del_init(&obj->siblings);
 	obj->parent = NULL;
@@ -6902,6 +9224,8 @@ static void yaffs_AddObjectToDirectory(yaffs_Object *directory,
 	/* Now add it */
 	ylist_add(&obj->siblings, &directory->variant.directoryVariant.children);
 	obj->parent = directory;
+	if (directory->variant.directoryVariant.nameHash)
+		yaffs_NameHashInsert(directory, obj);
 
 	if (directory == obj->myDev->unlinkedDir
 			|| directory == obj->myDev->deletedDir) {
@@ -6921,6 +9245,7 @@ yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
 
 	struct ylist_head *i;
 	YCHAR buffer[YAFFS_MAX_NAME_LENGTH + 1];
+	yaffs_DirectoryStructure *dir;
 
 	yaffs_Object *l;
 
@@ -6944,7 +9269,32 @@ yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
 
 	sum = yaffs_CalcNameSum(name);
 
-	ylist_for_each(i, &directory->variant.directoryVariant.children) {
+	dir = &directory->variant.directoryVariant;
+	if (!dir->nameHash ||
+	    (dir->nameHashCount > 2 * dir->nameHashBuckets &&
+	     dir->nameHashBuckets < YAFFS_NAMEHASH_MAX_BUCKETS))
+		yaffs_NameHashBuild(directory);
+
+	if (dir->nameHash &&
+	    yaffs_strcmp(name, YAFFS_LOSTNFOUND_NAME) != 0 &&
+	    yaffs_strncmp(name, YAFFS_LOSTNFOUND_PREFIX,
+			  yaffs_strlen(YAFFS_LOSTNFOUND_PREFIX)) != 0) {
+		l = dir->nameHash[yaffs_NameHashBucket(dir, sum)];
+		for (; l; l = l->nameHashNext) {
+			if (l->parent != directory)
+				YBUG();
+
+			if (yaffs_SumCompare(l->sum, sum) && l->hdrChunk > 0) {
+				yaffs_GetObjectName(l, buffer,
+						    YAFFS_MAX_NAME_LENGTH + 1);
+				if (yaffs_strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH) == 0)
+					return l;
+			}
+		}
+		return NULL;
+	}
+
+	ylist_for_each(i, &dir->children) {
 		if (i) {
 			l = ylist_entry(i, yaffs_Object, siblings);
 
@@ -6972,6 +9322,120 @@ yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
 	return NULL;
 }
 
+static int yaffs_MatchNameUnlocked(yaffs_Object *l, const YCHAR *name,
+				int sum, __u8 **buffer, int *retry)
+{
+	yaffs_Device *dev = l->myDev;
+	yaffs_ObjectHeader *oh;
+	int chunk;
+
+	if (l->lazyLoaded) {
+		*retry = 1;
+		return 0;
+	}
+#ifdef __KERNEL__
+	smp_rmb();
+#endif
+
+	if (l->objectId == YAFFS_OBJECTID_LOSTNFOUND)
+		return yaffs_strcmp(name, YAFFS_LOSTNFOUND_NAME) == 0;
+
+	chunk = l->hdrChunk;
+	if (chunk <= 0) {
+		/* Made up name */
+		if (yaffs_strncmp(name, YAFFS_LOSTNFOUND_PREFIX,
+				yaffs_strlen(YAFFS_LOSTNFOUND_PREFIX)) == 0)
+			*retry = 1;
+		return 0;
+	}
+
+	if (!yaffs_SumCompare(l->sum, sum))
+		return 0;
+
+#ifdef CONFIG_YAFFS_SHORT_NAMES_IN_RAM
+	if (l->shortName[0])
+		return yaffs_strncmp(name, l->shortName,
+				YAFFS_MAX_NAME_LENGTH) == 0;
+#endif
+
+	/* With inband tags the whole page is read */
+	if (!*buffer)
+		*buffer = YMALLOC(dev->totalBytesPerChunk);
+	if (!*buffer ||
+	    dev->readChunkWithTagsFromNAND(dev, chunk - dev->chunkOffset,
+					   *buffer, NULL) != YAFFS_OK) {
+		*retry = 1;
+		return 0;
+	}
+
+	oh = (yaffs_ObjectHeader *) *buffer;
+	return yaffs_strncmp(name, oh->name, YAFFS_MAX_NAME_LENGTH) == 0;
+}
+
+/* Looks a name up without the gross lock. The caller holds dev->dirLock
+ * for reading, which keeps the directory tree still, and samples
+ * nBlockErasures around the call as for yaffs_ReadChunksUnlocked(), since
+ * names that are not held in RAM are read from the object headers.
+ * Whatever needs the gross lock sets *retry and is left to
+ * yaffs_FindObjectByName(): a name hash still to be built, objects that are
+ * lazy loaded or have made up names, hard links and read errors.
+ */
+yaffs_Object *yaffs_FindObjectByNameUnlocked(yaffs_Object *directory,
+				const YCHAR *name, int *retry)
+{
+	yaffs_Device *dev = directory->myDev;
+	yaffs_DirectoryStructure *dir = &directory->variant.directoryVariant;
+	struct ylist_head *i;
+	yaffs_Object *l;
+	yaffs_Object *found = NULL;
+	__u8 *buffer = NULL;
+	int nChildren = 0;
+	int sum;
+
+	*retry = 0;
+	if (!name || directory->variantType != YAFFS_OBJECT_TYPE_DIRECTORY ||
+	    !yaffs_CanReadUnlocked(dev)) {
+		*retry = 1;
+		return NULL;
+	}
+
+	sum = yaffs_CalcNameSum(name);
+
+	if (dir->nameHash &&
+	    yaffs_strcmp(name, YAFFS_LOSTNFOUND_NAME) != 0 &&
+	    yaffs_strncmp(name, YAFFS_LOSTNFOUND_PREFIX,
+			  yaffs_strlen(YAFFS_LOSTNFOUND_PREFIX)) != 0) {
+		l = dir->nameHash[yaffs_NameHashBucket(dir, sum)];
+		for (; l && !*retry; l = l->nameHashNext) {
+			if (yaffs_MatchNameUnlocked(l, name, sum, &buffer,
+						retry)) {
+				found = l;
+				break;
+			}
+		}
+	} else {
+		ylist_for_each(i, &dir->children) {
+			l = ylist_entry(i, yaffs_Object, siblings);
+			if (!dir->nameHash &&
+			    ++nChildren >= YAFFS_NAMEHASH_THRESHOLD)
+				*retry = 1;	/* Let the lookup build the hash */
+			else if (yaffs_MatchNameUnlocked(l, name, sum, &buffer,
+						retry))
+				found = l;
+			if (found || *retry)
+				break;
+		}
+	}
+
+	if (buffer)
+		YFREE(buffer);
+
+	if (found && found->variantType == YAFFS_OBJECT_TYPE_HARDLINK)
+		*retry = 1;
+
+	return *retry ? NULL : found;
+}
+
 
 #if 0
 int yaffs_ApplyToDirectoryChildren(yaffs_Object *theDir,
@@ -7289,6 +9753,9 @@ static int yaffs_CreateInitialDirectories(yaffs_Device *dev)
 int yaffs_GutsInitialise(yaffs_Device *dev)
 {
 	int init_failed = 0;
+	int restored = 0;
+	yaffs_ReplayRecord *replayed = NULL;
+	int nReplayed = 0;
 	unsigned x;
 	int bits;
 
@@ -7438,6 +9905,16 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	/* More device initialisation */
 	dev->garbageCollections = 0;
 	dev->passiveGarbageCollections = 0;
+	dev->backgroundGarbageCollections = 0;
+	dev->memoryReleased = 0;
+	dev->extentMemory = 0;
+	dev->nExtents = 0;
+	dev->nExtentChunks = 0;
+	dev->nDroppedMaps = 0;
+	dev->nDroppedChunks = 0;
+	dev->nMapRebuilds = 0;
+	dev->fileMapsReady = 0;
+	dev->mapDropBucket = 0;
 	dev->currentDirtyChecker = 0;
 	dev->bufferedBlock = -1;
 	dev->doingBufferedBlockRewrite = 0;
@@ -7465,31 +9942,45 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	    dev->nShortOpCaches > 0) {
 		int i;
 		void *buf;
-		int srCacheBytes = dev->nShortOpCaches * sizeof(yaffs_ChunkCache);
+		int srCacheBytes;
+		int nBuckets = 1;
 
 		if (dev->nShortOpCaches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->nShortOpCaches = YAFFS_MAX_SHORT_OP_CACHES;
 
+		srCacheBytes = dev->nShortOpCaches * sizeof(yaffs_ChunkCache);
+		while (nBuckets < dev->nShortOpCaches)
+			nBuckets <<= 1;
+
 		dev->srCache =  YMALLOC(srCacheBytes);
+		dev->srCacheHash = YMALLOC(nBuckets * sizeof(struct ylist_head));
+		dev->srCacheHashMask = nBuckets - 1;
+		YINIT_LIST_HEAD(&dev->srCacheLru);
 
 		buf = (__u8 *) dev->srCache;
+		if (!dev->srCacheHash)
+			buf = NULL;
 
 		if (dev->srCache)
 			memset(dev->srCache, 0, srCacheBytes);
 
+		for (i = 0; i < nBuckets && buf; i++)
+			YINIT_LIST_HEAD(&dev->srCacheHash[i]);
+
 		for (i = 0; i < dev->nShortOpCaches && buf; i++) {
 			dev->srCache[i].object = NULL;
-			dev->srCache[i].lastUse = 0;
 			dev->srCache[i].dirty = 0;
+			YINIT_LIST_HEAD(&dev->srCache[i].hashLink);
+			YINIT_LIST_HEAD(&dev->srCache[i].objectLink);
+			ylist_add_tail(&dev->srCache[i].lruLink, &dev->srCacheLru);
 			dev->srCache[i].data = buf = YMALLOC_DMA(dev->totalBytesPerChunk);
 		}
 		if (!buf)
 			init_failed = 1;
-
-		dev->srLastUse = 0;
 	}
 
 	dev->cacheHits = 0;
+	dev->cacheMisses = 0;
 
 	if (!init_failed) {
 		dev->gcCleanupList = YMALLOC(dev->nChunksPerBlock * sizeof(__u32));
@@ -7513,11 +10004,19 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	if (!init_failed) {
 		/* Now scan the flash. */
 		if (dev->isYaffs2) {
-			if (yaffs_CheckpointRestore(dev)) {
+			if (yaffs_CheckpointRestore(dev) &&
+			    yaffs_ReplayCheckpointLog(dev)) {
+				restored = 1;
 				yaffs_CheckObjectDetailsLoaded(dev->rootDir);
 				T(YAFFS_TRACE_ALWAYS,
 				  (TSTR("yaffs: restored from checkpoint" TENDSTR)));
-			} else {
+				if (yaffs_traceMask & YAFFS_TRACE_VERIFY_REPLAY)
+					replayed = yaffs_RecordObjects(dev,
+								&nReplayed);
+			}
+
+			if (!restored || replayed) {
+				restored = 0;
 
 				/* Clean up the mess caused by an aborted checkpoint load
 				 * and scan backwards.
@@ -7531,6 +10030,8 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 				dev->nFreeChunks = 0;
 				dev->allocationBlock = -1;
 				dev->allocationPage = -1;
+				dev->coldAllocationBlock = -1;
+				dev->coldAllocationPage = 0;
 				dev->nDeletedFiles = 0;
 				dev->nUnlinkedFiles = 0;
 				dev->nBackgroundDeletions = 0;
@@ -7547,10 +10048,19 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 
 				if (!init_failed && !yaffs_ScanBackwards(dev))
 					init_failed = 1;
+
+				if (!init_failed && replayed)
+					yaffs_VerifyReplay(dev, replayed,
+							nReplayed);
 			}
 		} else if (!yaffs_Scan(dev))
 				init_failed = 1;
 
+		if (replayed)
+			YFREE_ALT(replayed);
+
+		dev->mountSequence = dev->sequenceNumber;
+
 		yaffs_StripDeletedObjects(dev);
 		yaffs_FixHangingObjects(dev);
 		if(dev->emptyLostAndFound)
@@ -7566,21 +10076,29 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 		return YAFFS_FAIL;
 	}
 
+	dev->mountRestored = restored;
+	dev->mountPageReads = dev->nPageReads;
+
+	dev->fileMapsReady = 1;
+	yaffs_CompactFileMaps(dev);
+
 	/* Zero out stats */
 	dev->nPageReads = 0;
 	dev->nPageWrites = 0;
 	dev->nBlockErasures = 0;
 	dev->nGCCopies = 0;
 	dev->nRetriedWrites = 0;
+	dev->nHotChunkWrites = 0;
+	dev->nColdChunkWrites = 0;
 
 	dev->nRetiredBlocks = 0;
 
 	yaffs_VerifyFreeChunks(dev);
 	yaffs_VerifyBlocks(dev);
 
-	/* Clean up any aborted checkpoint data */
-	if (!dev->isCheckpointed && dev->blocksInCheckpoint > 0)
-		yaffs_InvalidateCheckpoint(dev);
+	/* Clean up any aborted or unusable checkpoint data */
+	if (!restored && dev->blocksInCheckpoint > 0)
+		yaffs_CheckpointInvalidateStream(dev);
 
 	T(YAFFS_TRACE_TRACING,
 	  (TSTR("yaffs: yaffs_GutsInitialise() done.\n" TENDSTR)));
@@ -7608,6 +10126,10 @@ void yaffs_Deinitialise(yaffs_Device *dev)
 			YFREE(dev->srCache);
 			dev->srCache = NULL;
 		}
+		if (dev->srCacheHash) {
+			YFREE(dev->srCacheHash);
+			dev->srCacheHash = NULL;
+		}
 
 		YFREE(dev->gcCleanupList);
 
@@ -60,10 +60,22 @@
 
 #define YAFFS_NOBJECT_BUCKETS		256
 
+/* Object heat: overwrites of a file's chunks, halved every
+ * YAFFS_HEAT_HALF_LIFE data chunk writes on the device.
+ */
+#define YAFFS_HEAT_HALF_LIFE		256
+#define YAFFS_HEAT_HOT			4
+
+#define YAFFS_WRITE_LATENCY_BUCKETS	24
+
+/* A file mapped by more runs of chunks than this gets a tnode tree */
+#define YAFFS_MAX_EXTENTS		6
+
 
 #define YAFFS_OBJECT_SPACE		0x40000
 
-#define YAFFS_CHECKPOINT_VERSION 	3
+/* From version 4 on a checkpoint may be older than the blocks after it */
+#define YAFFS_CHECKPOINT_VERSION 	5
 
 #ifdef CONFIG_YAFFS_UNICODE
 #define YAFFS_MAX_NAME_LENGTH		127
@@ -88,7 +100,7 @@
 
 /* */
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	512
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
@@ -115,7 +127,9 @@
 typedef struct {
 	struct yaffs_ObjectStruct *object;
 	int chunkId;
-	int lastUse;
+	struct ylist_head hashLink;	/* Chain of the (object, chunkId) bucket */
+	struct ylist_head lruLink;	/* Most recently used first, free last */
+	struct ylist_head objectLink;	/* The object's entries, by chunkId */
 	int dirty;
 	int nBytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
@@ -286,6 +300,7 @@ typedef struct {
 	__u32 gcPrioritise:1; 	/* An ECC check or blank check has failed on this block.
 				   It should be prioritised for GC */
 	__u32 chunkErrorStrikes:3; /* How many times we've had ecc etc failures on this block and tried to reuse it */
+	__u32 hasDroppedChunks:1; /* GC moved chunks of a dropped map here */
 
 #ifdef CONFIG_YAFFS_YAFFS2
 	__u32 hasShrinkHeader:1; /* This block has at least one shrink object header */
@@ -369,6 +384,29 @@ struct yaffs_TnodeList_struct {
 
 typedef struct yaffs_TnodeList_struct yaffs_TnodeList;
 
+/*--------------------------- Extents -------------------------- */
+
+/* nChunks file chunks from chunkId on, in consecutive NAND chunks */
+typedef struct {
+	__u32 chunkId;
+	__u32 chunk;
+	__u32 nChunks;
+} yaffs_Extent;
+
+typedef struct {
+	int nExtents;
+	int maxExtents;
+	yaffs_Extent extent[1];
+} yaffs_ExtentMap;
+
+/* The blocks a file's chunks were in when its map was dropped */
+typedef struct {
+	int nChunks;		/* data chunks in the file when it was dropped */
+	int nBlocks;
+	int maxBlocks;
+	int block[1];		/* sorted */
+} yaffs_DroppedMap;
+
 /*------------------------  Object -----------------------------*/
 /* An object can be one of:
  * - a directory (no data, has children links
@@ -383,10 +421,15 @@ typedef struct {
 	__u32 shrinkSize;
 	int topLevel;
 	yaffs_Tnode *top;
+	yaffs_ExtentMap *extents;	/* Used instead of top if not NULL */
+	yaffs_DroppedMap *dropped;	/* Not NULL while the map is dropped */
 } yaffs_FileStructure;
 
 typedef struct {
 	struct ylist_head children;     /* list of child links */
+	struct yaffs_ObjectStruct **nameHash; /* children by name sum, or NULL */
+	int nameHashBuckets;
+	int nameHashCount;
 } yaffs_DirectoryStructure;
 
 typedef struct {
@@ -425,10 +468,15 @@ struct yaffs_ObjectStruct {
 				 */
 	__u8 beingCreated:1;	/* This object is still being created so skip some checks. */
 	__u8 isShadowed:1;      /* This object is shadowed on the way to being renamed. */
+	__u8 nameHashed:1;	/* Linked into the parent's name hash */
 
 	__u8 serial;		/* serial number of chunk in NAND. Cached here */
 	__u16 sum;		/* sum of the name to speed searching */
 
+	__u8 heat;		/* Decaying count of chunk overwrites */
+	__u32 heatClock;	/* dev->heatClock when heat was last updated */
+	__u32 lastWriteSeq;	/* Sequence number of the block last written */
+
 	struct yaffs_DeviceStruct *myDev;       /* The device I'm on */
 
 	struct ylist_head hashLink;     /* list of objects in this hash bucket */
@@ -439,11 +487,14 @@ struct yaffs_ObjectStruct {
 	/* also used for linking up the free list */
 	struct yaffs_ObjectStruct *parent;
 	struct ylist_head siblings;
+	struct yaffs_ObjectStruct *nameHashNext;
 
 	/* Where's my object header in NAND? */
 	int hdrChunk;
 
 	int nDataChunks;	/* Number of data chunks attached to the file. */
+	int nCachedChunks;	/* Short op cache entries holding its chunks */
+	struct ylist_head cachedChunks;	/* Those entries, lowest chunkId first */
 
 	__u32 objectId;		/* the object id value */
 
@@ -473,7 +524,10 @@ struct yaffs_ObjectStruct {
 
 #ifdef __KERNEL__
 	struct inode *myInode;
-
+	struct rw_semaphore mapLock;	/* Taken for writing, under the gross
+					 * lock, to change the file map or
+					 * size. Readers need only this.
+					 */
 #endif
 
 	yaffs_ObjectType variantType;
@@ -590,6 +644,13 @@ struct yaffs_DeviceStruct {
 	int (*markNANDBlockBad) (struct yaffs_DeviceStruct *dev, int blockNo);
 	int (*queryNANDBlock) (struct yaffs_DeviceStruct *dev, int blockNo,
 			       yaffs_BlockState *state, __u32 *sequenceNumber);
+	/* Optional: reads the pages of consecutive chunks, no spare area */
+	int (*readChunksFromNAND) (struct yaffs_DeviceStruct *dev,
+				   int chunkInNAND, int nChunks, __u8 *data);
+	/* Optional: reads the tags of every chunk in a block */
+	int (*readBlockTagsFromNAND) (struct yaffs_DeviceStruct *dev,
+				      int blockInNAND,
+				      yaffs_ExtendedTags *tags);
 #endif
 
 	int isYaffs2;
@@ -638,18 +699,26 @@ struct yaffs_DeviceStruct {
 	struct semaphore sem;	/* Semaphore for waiting on erasure.*/
 	struct semaphore grossLock;	/* Gross locking semaphore */
 	struct rw_semaphore dirLock; /* Lock the directory structure */
+	__u8 *blockSpareBuffer;	/* oob (inband: pages) of a whole block,
+				 * only while mounting */
 	__u8 *spareBuffer;	/* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
 
 				 */
 	void (*putSuperFunc) (struct super_block *sb);
         struct ylist_head searchContexts;
+	struct task_struct *bgThread;	/* Background checkpoint writer and gc */
+	int bgKicked;			/* Writes since the thread last slept */
+	atomic_t nUnlockedReads;	/* Pages read without the gross lock */
+	int mountTimeMs;		/* Time taken by yaffs_GutsInitialise */
+	__u32 writeLatency[YAFFS_WRITE_LATENCY_BUCKETS];	/* log2 of usecs */
 
 #endif
 
 	int isMounted;
 
 	int isCheckpointed;
+	__u32 checkpointSequence;	/* sequenceNumber of the last checkpoint */
 
 
 	/* Stuff to support block offsetting to support start block zero */
@@ -689,6 +758,11 @@ struct yaffs_DeviceStruct {
 	int allocationBlock;	/* Current block being allocated off */
 	__u32 allocationPage;
 	int allocationBlockFinder;	/* Used to search for next allocation block */
+	int coldAllocationBlock;	/* Block cold data is allocated off */
+	__u32 coldAllocationPage;
+	int separateHotCold;	/* Allocate hot and cold data from separate blocks */
+	__u32 heatClock;	/* Data chunks written, clock for object heat */
+	__u32 mountSequence;	/* Highest sequence number at mount */
 
 	/* Runtime state */
 	int nTnodesCreated;
@@ -725,6 +799,21 @@ struct yaffs_DeviceStruct {
 	int nGCCopies;
 	int garbageCollections;
 	int passiveGarbageCollections;
+	int backgroundGarbageCollections;
+	unsigned long memoryReleased;	/* bytes of free tnodes/objects given back */
+	unsigned long extentMemory;	/* bytes in extent maps and dropped maps */
+	int nExtents;		/* runs in all extent maps */
+	int nExtentChunks;	/* chunks mapped by them */
+	int nDroppedMaps;
+	int nDroppedChunks;	/* data chunks of files with dropped maps */
+	int nMapRebuilds;
+	int nTnodeMaps;		/* files whose map is a tnode tree */
+	int fileMapsReady;	/* mounted, maps may be extents or dropped */
+	int mapDropBucket;	/* where yaffs_DropIdleFileMaps() goes on */
+	int mountRestored;	/* mounted from a checkpoint, not a scan */
+	int mountPageReads;	/* chunk reads done by the mount */
+	int nHotChunkWrites;
+	int nColdChunkWrites;
 	int nRetriedWrites;
 	int nRetiredBlocks;
 	int eccFixed;
@@ -749,9 +838,12 @@ struct yaffs_DeviceStruct {
 	int doingBufferedBlockRewrite;
 
 	yaffs_ChunkCache *srCache;
-	int srLastUse;
+	struct ylist_head *srCacheHash;
+	int srCacheHashMask;
+	struct ylist_head srCacheLru;
 
 	int cacheHits;
+	int cacheMisses;
 
 	/* Stuff for background deletion and unlinked files.*/
 	yaffs_Object *unlinkedDir;	/* Directory where unlinked and deleted files live. */
@@ -796,6 +888,8 @@ typedef struct {
 	int nErasedBlocks;
 	int allocationBlock;	/* Current block being allocated off */
 	__u32 allocationPage;
+	int coldAllocationBlock;	/* Block cold data is allocated off */
+	__u32 coldAllocationPage;
 	int nFreeChunks;
 
 	int nDeletedFiles;		/* Count of files awaiting deletion;*/
@@ -842,6 +936,11 @@ int yaffs_GetAttributes(yaffs_Object *obj, struct iattr *attr);
 /* File operations */
 int yaffs_ReadDataFromFile(yaffs_Object *obj, __u8 *buffer, loff_t offset,
 				int nBytes);
+int yaffs_MapFileChunks(yaffs_Object *obj, loff_t offset, int nBytes,
+			int *chunkMap, int maxChunks, __u32 *start);
+int yaffs_ReadChunksUnlocked(yaffs_Device *dev, const int *chunkMap,
+			     int start, int nBytes, __u8 *buffer,
+			     __u8 *bounce, int nBounce);
 int yaffs_WriteDataToFile(yaffs_Object *obj, const __u8 *buffer, loff_t offset,
 				int nBytes, int writeThrough);
 int yaffs_ResizeFile(yaffs_Object *obj, loff_t newSize);
@@ -856,10 +955,20 @@ void yaffs_FlushEntireDeviceCache(yaffs_Device *dev);
 int yaffs_CheckpointSave(yaffs_Device *dev);
 int yaffs_CheckpointRestore(yaffs_Device *dev);
 
+/* Background garbage collection */
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev, int level);
+
+/* Memory accounting and release */
+int yaffs_TnodeSize(yaffs_Device *dev);
+unsigned long yaffs_ReleaseFreeMemory(yaffs_Device *dev);
+int yaffs_DropIdleFileMaps(yaffs_Device *dev, int nToScan);
+
 /* Directory operations */
 yaffs_Object *yaffs_MknodDirectory(yaffs_Object *parent, const YCHAR *name,
 				__u32 mode, __u32 uid, __u32 gid);
 yaffs_Object *yaffs_FindObjectByName(yaffs_Object *theDir, const YCHAR *name);
+yaffs_Object *yaffs_FindObjectByNameUnlocked(yaffs_Object *theDir,
+				const YCHAR *name, int *retry);
 int yaffs_ApplyToDirectoryChildren(yaffs_Object *theDir,
 				   int (*fn) (yaffs_Object *));
 
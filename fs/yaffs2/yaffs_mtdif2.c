@@ -187,6 +187,100 @@ int nandmtd2_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 		return YAFFS_FAIL;
 }
 
+/* Page read of consecutive chunks, lets the mtd layer stream the pages.
+ * With inband tags each page also holds the tags after the data.
+ */
+int nandmtd2_ReadChunksFromNAND(yaffs_Device *dev, int chunkInNAND,
+				int nChunks, __u8 *data)
+{
+	struct mtd_info *mtd = (struct mtd_info *)(dev->genericDevice);
+	loff_t addr = ((loff_t) chunkInNAND) * dev->totalBytesPerChunk;
+	size_t dummy;
+	int retval;
+
+	T(YAFFS_TRACE_MTD,
+	  (TSTR("nandmtd2_ReadChunksFromNAND chunk %d count %d" TENDSTR),
+	   chunkInNAND, nChunks));
+
+	retval = mtd->read(mtd, addr, nChunks * dev->totalBytesPerChunk,
+			   &dummy, data);
+
+	return (retval == 0) ? YAFFS_OK : YAFFS_FAIL;
+}
+
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
+/* Tags of every chunk in a block with one oob-only read, so the mtd layer
+ * can stream the spare areas instead of being called once per chunk.
+ * Inband tags live in the page data, so then the whole block is read and
+ * the tags are taken from the end of each page.
+ */
+int nandmtd2_ReadBlockTagsFromNAND(yaffs_Device *dev, int blockInNAND,
+				   yaffs_ExtendedTags *tags)
+{
+	struct mtd_info *mtd = (struct mtd_info *)(dev->genericDevice);
+	struct mtd_oob_ops ops;
+	yaffs_PackedTags2 pt;
+	yaffs_PackedTags2TagsPart *pt2tp;
+	loff_t addr;
+	__u8 *oob = dev->blockSpareBuffer;
+	size_t dummy;
+	int retval;
+	int i;
+
+	T(YAFFS_TRACE_MTD,
+	  (TSTR("nandmtd2_ReadBlockTagsFromNAND block %d" TENDSTR),
+	   blockInNAND));
+
+	if (!oob)
+		return YAFFS_FAIL;
+
+	addr = ((loff_t) blockInNAND) * dev->nChunksPerBlock *
+		dev->totalBytesPerChunk;
+
+	if (dev->inbandTags) {
+		retval = mtd->read(mtd, addr,
+				   dev->nChunksPerBlock * dev->totalBytesPerChunk,
+				   &dummy, oob);
+		if (retval != 0 ||
+		    dummy != dev->nChunksPerBlock * dev->totalBytesPerChunk)
+			return YAFFS_FAIL;
+
+		for (i = 0; i < dev->nChunksPerBlock; i++) {
+			pt2tp = (yaffs_PackedTags2TagsPart *)
+				&oob[i * dev->totalBytesPerChunk +
+				     dev->nDataBytesPerChunk];
+			yaffs_UnpackTags2TagsPart(&tags[i], pt2tp);
+		}
+
+		return YAFFS_OK;
+	}
+
+	if (mtd->oobavail < sizeof(pt))
+		return YAFFS_FAIL;
+
+	ops.mode = MTD_OOB_AUTO;
+	ops.ooblen = dev->nChunksPerBlock * mtd->oobavail;
+	ops.len = ops.ooblen;
+	ops.ooboffs = 0;
+	ops.datbuf = NULL;
+	ops.oobbuf = oob;
+	retval = mtd->read_oob(mtd, addr, &ops);
+
+	/* An ecc event can't be pinned on a chunk from here; the caller
+	 * falls back to chunk by chunk reads.
+	 */
+	if (retval != 0 || ops.oobretlen != ops.ooblen)
+		return YAFFS_FAIL;
+
+	for (i = 0; i < dev->nChunksPerBlock; i++) {
+		memcpy(&pt, &oob[i * mtd->oobavail], sizeof(pt));
+		yaffs_UnpackTags2(&tags[i], &pt);
+	}
+
+	return YAFFS_OK;
+}
+#endif
+
 int nandmtd2_MarkNANDBlockBad(struct yaffs_DeviceStruct *dev, int blockNo)
 {
 	struct mtd_info *mtd = (struct mtd_info *)(dev->genericDevice);
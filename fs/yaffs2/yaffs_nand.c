@@ -53,6 +53,29 @@ int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 	return result;
 }
 
+/* Reads the tags of every chunk in a block into tags[] in one go. Fails if
+ * the driver can't, and the caller then reads the chunks one at a time.
+ */
+int yaffs_ReadBlockTagsFromNAND(yaffs_Device *dev, int blockInNAND,
+				yaffs_ExtendedTags *tags)
+{
+	int i;
+
+	if (!dev->readBlockTagsFromNAND ||
+	    dev->readBlockTagsFromNAND(dev, blockInNAND - dev->blockOffset,
+				       tags) != YAFFS_OK)
+		return YAFFS_FAIL;
+
+	dev->nPageReads += dev->nChunksPerBlock;
+	for (i = 0; i < dev->nChunksPerBlock; i++) {
+		if (tags[i].eccResult > YAFFS_ECC_RESULT_NO_ERROR)
+			yaffs_HandleChunkError(dev,
+				yaffs_GetBlockInfo(dev, blockInNAND));
+	}
+
+	return YAFFS_OK;
+}
+
 int yaffs_WriteChunkWithTagsToNAND(yaffs_Device *dev,
 						   int chunkInNAND,
 						   const __u8 *buffer,
@@ -186,6 +186,7 @@ extern unsigned int yaffs_wr_attempts;
 #define YAFFS_TRACE_VERIFY		0x00010000
 #define YAFFS_TRACE_VERIFY_NAND		0x00020000
 #define YAFFS_TRACE_VERIFY_FULL		0x00040000
+#define YAFFS_TRACE_VERIFY_REPLAY	0x00080000
 #define YAFFS_TRACE_VERIFY_ALL		0x000F0000
 
 
@@ -25,7 +25,9 @@
  * control the order. They can be used to turn off the screen and input
  * devices that are not used for wakeup.
  * Suspend handlers are called in low to high level order, resume handlers are
- * called in the opposite order. If, when calling register_early_suspend,
+ * called in the opposite order. Handlers that share a level may be called
+ * concurrently, so a handler that depends on another one must use a higher
+ * level for suspend. If, when calling register_early_suspend,
  * the suspend handlers have already been called without a matching call to the
  * resume handlers, the suspend handler will be called directly from
  * register_early_suspend. This direct call can violate the normal level order.
@@ -2110,6 +2110,12 @@ extern int vfs_fsync_range(struct file *file, struct dentry *dentry,
 extern int vfs_fsync(struct file *file, struct dentry *dentry, int datasync);
 extern int generic_write_sync(struct file *file, loff_t pos, loff_t count);
 extern void sync_supers(void);
+enum {
+	SYNC_CLEAN,
+	SYNC_DIRTY_SUPERS,
+	SYNC_DIRTY_DATA,
+};
+extern int sync_dirty_state(void);
 extern void emergency_sync(void);
 extern void emergency_remount(void);
 #ifdef CONFIG_BLOCK
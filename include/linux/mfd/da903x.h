@@ -99,6 +99,12 @@ struct da9034_touch_pdata {
 /* DA9030 battery charger data */
 struct power_supply_info;
 
+/* point of the open circuit voltage curve, highest voltage first */
+struct da9030_ocv {
+	int mV;
+	int capacity;	/* percent */
+};
+
 struct da9030_battery_info {
 	/* battery parameters */
 	struct power_supply_info *battery_info;
@@ -128,6 +134,27 @@ struct da9030_battery_info {
 	/* battery monitor interval (seconds) */
 	unsigned int batmon_interval;
 
+	/* poll only with external power, otherwise rely on the VBATMON,
+	   TBAT and CHDET events and a deferrable refresh every
+	   batmon_idle_interval seconds (0 for events only) */
+	int event_driven;
+	unsigned int batmon_idle_interval;
+
+	/* software fuel gauge, used when capacity_mAh is set; otherwise
+	   capacity is a straight line between the design voltages */
+	unsigned int capacity_mAh;
+	int internal_mohm;
+	struct da9030_ocv *ocv_table;
+	int ocv_table_size;
+
+	/* discharge current model for the fuel gauge: base_mA with the
+	   CPU idle, per MHz of the current CPU clock, while suspended,
+	   and whatever the board can tell about its own consumers */
+	int load_base_mA;
+	int load_cpu_uA_per_MHz;
+	int load_sleep_mA;
+	int (*load_extra_mA)(void);
+
 	/* platform callbacks for battery low and critical events */
 	void (*battery_low)(void);
 	void (*battery_critical)(void);
@@ -142,6 +169,9 @@ struct da903x_subdev_info {
 struct da903x_platform_data {
 	int num_subdevs;
 	struct da903x_subdev_info *subdevs;
+
+	/* first of the nested IRQs, one per event bit; 0 for none */
+	unsigned int irq_base;
 };
 
 /* bit definitions for DA9030 events */
@@ -200,6 +230,7 @@ extern int da903x_register_notifier(struct device *dev,
 		struct notifier_block *nb, unsigned int events);
 extern int da903x_unregister_notifier(struct device *dev,
 		struct notifier_block *nb, unsigned int events);
+extern int da903x_event_irq(struct device *dev, unsigned int event);
 
 /* Status Query Interface */
 #define DA9030_STATUS_ONKEY		(1 << 0)
@@ -12,6 +12,7 @@
 
 #include <linux/leds.h>
 #include <linux/sched.h>
+#include <linux/ktime.h>
 
 #include <linux/mmc/core.h>
 
@@ -82,6 +83,16 @@ struct mmc_host_ops {
 	int (*enable)(struct mmc_host *host);
 	int (*disable)(struct mmc_host *host, int lazy);
 	void	(*request)(struct mmc_host *host, struct mmc_request *req);
+	/*
+	 * Optional. 'pre_req' may map and prepare the data of a request
+	 * while another request is still in progress, and marks it by
+	 * setting data->host_cookie. 'post_req' undoes that once the
+	 * request has completed, or when a prepared request is dropped.
+	 * Neither may touch the hardware.
+	 */
+	void	(*pre_req)(struct mmc_host *host, struct mmc_request *req);
+	void	(*post_req)(struct mmc_host *host, struct mmc_request *req,
+			    int err);
 	/*
 	 * Avoid calling these three functions too often or in a "fast path",
 	 * since underlaying controller might implement them in an expensive
@@ -106,6 +117,15 @@ struct mmc_host_ops {
 	int	(*get_ro)(struct mmc_host *host);
 	int	(*get_cd)(struct mmc_host *host);
 
+	/*
+	 * Optional. Raw state of the card detect line, only compared with
+	 * its value at suspend time, or negative if the host has none.
+	 * Hosts providing it keep removable cards over suspend and let
+	 * them stay powered down on resume until used, unless the line
+	 * changed meanwhile.
+	 */
+	int	(*get_cd_state)(struct mmc_host *host);
+
 	void	(*enable_sdio_irq)(struct mmc_host *host, int enable);
 };
 
@@ -199,6 +219,15 @@ struct mmc_host {
 #define MMC_BUSRESUME_MANUAL_RESUME	(1 << 0)
 #define MMC_BUSRESUME_NEEDS_RESUME	(1 << 1)
 
+	unsigned int		detect_events;	/* mmc_detect_change() calls */
+	unsigned int		suspend_detect_events;
+	int			suspend_cd_state; /* get_cd_state() at suspend */
+	ktime_t			resume_start;
+	unsigned int		resume_usable_ms; /* last resume to usable card */
+	unsigned int		resumes_deferred; /* card left off on resume */
+	unsigned int		resumes_late;	/* deferred, resumed later */
+	unsigned int		resumes_full;	/* card re-initialised on resume */
+
 	unsigned int		sdio_irqs;
 	struct task_struct	*sdio_irq_thread;
 	atomic_t		sdio_irq_thread_abort;
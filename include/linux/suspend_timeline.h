@@ -0,0 +1,75 @@
+/* include/linux/suspend_timeline.h
+ *
+ * Suspend/resume timeline recorder.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef _LINUX_SUSPEND_TIMELINE_H
+#define _LINUX_SUSPEND_TIMELINE_H
+
+#include <linux/types.h>
+#include <linux/hrtimer.h>
+
+/* Events stored in a suspend timeline record. The record id is the low 32
+ * bits of an address that can be resolved through /proc/kallsyms: the
+ * handler function for early suspend/late resume, the struct device_driver
+ * for device callbacks. STL_CYCLE starts a new opportunistic suspend
+ * attempt and carries the attempt number in id.
+ */
+enum {
+	STL_CYCLE,
+	STL_SYNC,
+	STL_EARLY_SUSPEND,
+	STL_LATE_RESUME,
+	STL_DEV_SUSPEND,
+	STL_DEV_SUSPEND_NOIRQ,
+	STL_DEV_RESUME_NOIRQ,
+	STL_DEV_RESUME,
+	STL_PLATFORM_SAVE,	/* pm_enter() up to the sleep instruction */
+	STL_FIRMWARE_RESUME,	/* wakeup to the first C code after sleep */
+	STL_PLATFORM_RESTORE,	/* rest of pm_enter() after wakeup */
+	STL_SUSPEND,		/* whole pm_suspend() call */
+	STL_EVENT_COUNT
+};
+
+/* Records are exported unchanged through debugfs "suspend_timeline". */
+struct suspend_timeline_record {
+	u32 start_us;		/* monotonic time, wraps after ~71 minutes */
+	u32 duration_us;
+	u32 id;
+	u16 event;
+	s16 error;
+};
+
+#ifdef CONFIG_SUSPEND_TIMELINE
+void suspend_timeline_begin(void);
+void suspend_timeline_end(int event, ktime_t start, const void *id, int error);
+void suspend_timeline_add(int event, u32 duration_us, const void *id);
+
+static inline ktime_t suspend_timeline_start(void)
+{
+	return ktime_get();
+}
+#else
+static inline void suspend_timeline_begin(void) {}
+static inline void suspend_timeline_end(int event, ktime_t start,
+					const void *id, int error) {}
+static inline void suspend_timeline_add(int event, u32 duration_us,
+					const void *id) {}
+
+static inline ktime_t suspend_timeline_start(void)
+{
+	return ktime_set(0, 0);
+}
+#endif
+
+#endif
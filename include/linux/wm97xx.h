@@ -13,6 +13,7 @@
 #include <linux/types.h>
 #include <linux/list.h>
 #include <linux/input.h>	/* Input device layer */
+#include <linux/ktime.h>
 #include <linux/platform_device.h>
 
 /*
@@ -267,6 +268,29 @@ struct wm97xx_mach_ops {
 	void (*post_sample) (int);  /* function to run after sampling */
 };
 
+/*
+ * Touch sample filter, applied to every sample before it is reported.
+ * Parameters are set through sysfs on the codec device.
+ */
+#define WM97XX_MEDIAN_MAX	7
+
+struct wm97xx_filter {
+	int median;		/* median window, 1 disables */
+	int pressure;		/* minimum pressure, 0 disables */
+	int iir;		/* new sample weight in 1/16ths, 16 disables */
+	int dejitter;		/* ignore smaller moves, 0 disables */
+
+	/* state, reset on pen up */
+	u16 hist_x[WM97XX_MEDIAN_MAX];
+	u16 hist_y[WM97XX_MEDIAN_MAX];
+	int hist_len;
+	int hist_head;
+	int iir_x, iir_y;	/* 28.4 fixed point */
+	int last_x, last_y;	/* last reported position */
+	unsigned iir_valid:1;
+	unsigned last_valid:1;
+};
+
 struct wm97xx {
 	u16 dig[3], id, gpio[6], misc;	/* Cached codec registers */
 	u16 dig_save[3];		/* saved during aux reading */
@@ -278,12 +302,18 @@ struct wm97xx {
 	struct platform_device *touch_dev;
 	struct wm97xx_mach_ops *mach_ops;
 	struct mutex codec_mutex;
-	struct delayed_work ts_reader;  /* Used to poll touchscreen */
+	struct delayed_work ts_reader;  /* Used to poll without pen IRQ */
 	unsigned long ts_reader_interval; /* Current interval for timer */
 	unsigned long ts_reader_min_interval; /* Minimum interval */
 	unsigned int pen_irq;		/* Pen IRQ number in use */
-	struct workqueue_struct *ts_workq;
-	struct work_struct pen_event_work;
+	int ts_stop;			/* closing or suspended, stop reading */
+	ktime_t pen_irq_time;		/* time of last pen down interrupt */
+	int latency_pending;		/* no sample reported since pen down */
+	u32 latency_last_us;		/* touch to input event latency */
+	u32 latency_max_us;
+	u32 latency_count;
+	u64 latency_total_us;
+	struct wm97xx_filter filter;	/* protected by codec_mutex */
 	u16 acc_slot;			/* AC97 slot used for acc touch data */
 	u16 acc_rate;			/* acc touch data rate */
 	unsigned pen_is_down:1;		/* Pen is down */
@@ -333,6 +363,9 @@ void wm97xx_reg_write(struct wm97xx *wm, u16 reg, u16 val);
 /* aux adc readback */
 int wm97xx_read_aux_adc(struct wm97xx *wm, u16 adcsel);
 
+/* filter and report a touch sample, called with codec_mutex held */
+void wm97xx_report_sample(struct wm97xx *wm, struct wm97xx_data *data);
+
 /* machine ops */
 int wm97xx_register_mach_ops(struct wm97xx *, struct wm97xx_mach_ops *);
 void wm97xx_unregister_mach_ops(struct wm97xx *);
@@ -296,6 +296,8 @@ int snd_soc_dapm_enable_pin(struct snd_soc_codec *codec, const char *pin);
 int snd_soc_dapm_disable_pin(struct snd_soc_codec *codec, const char *pin);
 int snd_soc_dapm_nc_pin(struct snd_soc_codec *codec, const char *pin);
 int snd_soc_dapm_get_pin_status(struct snd_soc_codec *codec, const char *pin);
+int snd_soc_dapm_ignore_suspend(struct snd_soc_codec *codec, const char *pin,
+				int ignore);
 int snd_soc_dapm_sync(struct snd_soc_codec *codec);
 
 /* dapm widget types */
@@ -379,6 +381,7 @@ struct snd_soc_dapm_widget {
 	unsigned char muted:1;			/* muted for pop reduction */
 	unsigned char suspend:1;		/* was active before suspend */
 	unsigned char pmdown:1;			/* waiting for timeout */
+	unsigned char ignore_suspend:1;		/* endpoint stays up in suspend */
 
 	int (*power_check)(struct snd_soc_dapm_widget *w);
 
@@ -399,14 +399,19 @@ struct snd_soc_codec {
 	void *reg_cache;
 	short reg_cache_size;
 	short reg_cache_step;
+	u32 hw_io;	/* bus transactions, counted by the codec driver */
 
 	/* dapm */
 	u32 pop_time;
+	u32 dapm_syncs;
+	u32 dapm_sync_io;	/* hw_io used by the last power sequence */
+	u32 dapm_sync_io_max;
 	struct list_head dapm_widgets;
 	struct list_head dapm_paths;
 	enum snd_soc_bias_level bias_level;
 	enum snd_soc_bias_level suspend_bias_level;
 	struct delayed_work delayed_work;
+	unsigned int suspended:1;	/* only ignore_suspend paths powered */
 
 	/* codec DAI's */
 	struct snd_soc_dai *dai;
@@ -416,6 +421,7 @@ struct snd_soc_codec {
 	struct dentry *debugfs_reg;
 	struct dentry *debugfs_pop_time;
 	struct dentry *debugfs_dapm;
+	struct dentry *debugfs_io;
 #endif
 };
 
@@ -13,10 +13,12 @@
  *
  */
 
+#include <linux/async.h>
 #include <linux/earlysuspend.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/rtc.h>
+#include <linux/suspend_timeline.h>
 #include <linux/syscalls.h> /* sys_sync */
 #include <linux/wakelock.h>
 #include <linux/workqueue.h>
@@ -26,10 +28,18 @@
 enum {
 	DEBUG_USER_STATE = 1U << 0,
 	DEBUG_SUSPEND = 1U << 2,
+	DEBUG_HANDLER_TIME = 1U << 3,
 };
 static int debug_mask = DEBUG_USER_STATE;
 module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 
+/* Run the handlers of one level concurrently. Levels are still processed
+ * strictly one after the other.
+ */
+static int parallel = 1;
+module_param_named(parallel, parallel, int, S_IRUGO | S_IWUSR | S_IWGRP);
+static LIST_HEAD(early_suspend_domain);
+
 static DEFINE_MUTEX(early_suspend_lock);
 static LIST_HEAD(early_suspend_handlers);
 static void early_suspend(struct work_struct *work);
@@ -70,9 +80,71 @@ void unregister_early_suspend(struct early_suspend *handler)
 }
 EXPORT_SYMBOL(unregister_early_suspend);
 
-static void early_suspend(struct work_struct *work)
+static void call_handler(struct early_suspend *handler, int resume)
+{
+	void (*func)(struct early_suspend *h);
+	ktime_t start = ktime_get();
+
+	func = resume ? handler->resume : handler->suspend;
+	func(handler);
+	suspend_timeline_end(resume ? STL_LATE_RESUME : STL_EARLY_SUSPEND,
+			     start, func, 0);
+	if (debug_mask & DEBUG_HANDLER_TIME)
+		pr_info("%s: %pf, level %d, %lld us\n",
+			resume ? "late_resume" : "early_suspend", func,
+			handler->level, ktime_us_delta(ktime_get(), start));
+}
+
+static void early_suspend_async(void *data, async_cookie_t cookie)
+{
+	call_handler(data, 0);
+}
+
+static void late_resume_async(void *data, async_cookie_t cookie)
+{
+	call_handler(data, 1);
+}
+
+static bool next_has_level(struct early_suspend *pos, struct list_head *next)
+{
+	return next != &early_suspend_handlers &&
+		list_entry(next, struct early_suspend, link)->level ==
+		pos->level;
+}
+
+/* Called with early_suspend_lock held. A handler that is alone on its level
+ * is called directly to avoid the async thread handoff.
+ */
+static void call_handlers(int resume)
 {
 	struct early_suspend *pos;
+	struct list_head *link, *next;
+	int pending = 0;
+
+	for (link = resume ? early_suspend_handlers.prev :
+	     early_suspend_handlers.next;
+	     link != &early_suspend_handlers; link = next) {
+		pos = list_entry(link, struct early_suspend, link);
+		next = resume ? link->prev : link->next;
+		if ((resume ? pos->resume : pos->suspend) != NULL) {
+			if (parallel && (pending || next_has_level(pos, next))) {
+				async_schedule_domain(resume ?
+					late_resume_async : early_suspend_async,
+					pos, &early_suspend_domain);
+				pending = 1;
+			} else {
+				call_handler(pos, resume);
+			}
+		}
+		if (pending && !next_has_level(pos, next)) {
+			async_synchronize_full_domain(&early_suspend_domain);
+			pending = 0;
+		}
+	}
+}
+
+static void early_suspend(struct work_struct *work)
+{
 	unsigned long irqflags;
 	int abort = 0;
 
@@ -93,10 +165,7 @@ static void early_suspend(struct work_struct *work)
 
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("early_suspend: call handlers\n");
-	list_for_each_entry(pos, &early_suspend_handlers, link) {
-		if (pos->suspend != NULL)
-			pos->suspend(pos);
-	}
+	call_handlers(0);
 	mutex_unlock(&early_suspend_lock);
 
 	if (debug_mask & DEBUG_SUSPEND)
@@ -112,7 +181,6 @@ abort:
 
 static void late_resume(struct work_struct *work)
 {
-	struct early_suspend *pos;
 	unsigned long irqflags;
 	int abort = 0;
 
@@ -131,9 +199,7 @@ static void late_resume(struct work_struct *work)
 	}
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: call handlers\n");
-	list_for_each_entry_reverse(pos, &early_suspend_handlers, link)
-		if (pos->resume != NULL)
-			pos->resume(pos);
+	call_handlers(1);
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: done\n");
 abort:
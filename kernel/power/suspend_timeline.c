@@ -0,0 +1,138 @@
+/* kernel/power/suspend_timeline.c
+ *
+ * Records where time goes across a suspend/resume cycle: early suspend and
+ * late resume handlers, device pm callbacks and the platform sleep path.
+ * Records are kept in a fixed size ring and exported as an array of
+ * struct suspend_timeline_record through debugfs.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/module.h>
+#include <linux/spinlock.h>
+#include <linux/suspend_timeline.h>
+#include <linux/vmalloc.h>
+
+#define STL_RECORDS	CONFIG_SUSPEND_TIMELINE_RECORDS
+
+/* Callbacks faster than this are not worth a record. Cycle markers and the
+ * platform path are always recorded.
+ */
+static int threshold_us = 100;
+module_param_named(threshold_us, threshold_us, int, S_IRUGO | S_IWUSR);
+
+static DEFINE_SPINLOCK(stl_lock);
+static struct suspend_timeline_record stl_ring[STL_RECORDS];
+static unsigned int stl_head;
+static unsigned int stl_count;
+static u32 stl_cursor_us;
+static u32 stl_cycle;
+
+static void stl_insert(int event, u32 start_us, u32 duration_us,
+		       const void *id, int error)
+{
+	struct suspend_timeline_record *rec;
+	unsigned long irqflags;
+
+	spin_lock_irqsave(&stl_lock, irqflags);
+	rec = &stl_ring[stl_head];
+	rec->start_us = start_us;
+	rec->duration_us = duration_us;
+	rec->id = (u32)(unsigned long)id;
+	rec->event = event;
+	rec->error = error;
+	stl_head = (stl_head + 1) % STL_RECORDS;
+	if (stl_count < STL_RECORDS)
+		stl_count++;
+	stl_cursor_us = start_us + duration_us;
+	spin_unlock_irqrestore(&stl_lock, irqflags);
+}
+
+void suspend_timeline_begin(void)
+{
+	stl_insert(STL_CYCLE, (u32)ktime_to_us(ktime_get()), 0,
+		   (void *)(unsigned long)++stl_cycle, 0);
+}
+
+void suspend_timeline_end(int event, ktime_t start, const void *id, int error)
+{
+	s64 duration = ktime_us_delta(ktime_get(), start);
+
+	if (duration < threshold_us && !error && event != STL_SUSPEND)
+		return;
+	stl_insert(event, (u32)ktime_to_us(start), (u32)duration, id, error);
+}
+
+/* Used by the platform code while timekeeping is suspended: the record
+ * is placed right after the previous one.
+ */
+void suspend_timeline_add(int event, u32 duration_us, const void *id)
+{
+	stl_insert(event, stl_cursor_us, duration_us, id, 0);
+}
+
+struct stl_snapshot {
+	size_t size;
+	struct suspend_timeline_record rec[0];
+};
+
+static int suspend_timeline_open(struct inode *inode, struct file *file)
+{
+	struct stl_snapshot *snap;
+	unsigned long irqflags;
+	unsigned int first, n;
+
+	snap = vmalloc(sizeof(*snap) + sizeof(stl_ring));
+	if (!snap)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&stl_lock, irqflags);
+	first = (stl_head + STL_RECORDS - stl_count) % STL_RECORDS;
+	for (n = 0; n < stl_count; n++)
+		snap->rec[n] = stl_ring[(first + n) % STL_RECORDS];
+	spin_unlock_irqrestore(&stl_lock, irqflags);
+
+	snap->size = n * sizeof(snap->rec[0]);
+	file->private_data = snap;
+	return 0;
+}
+
+static ssize_t suspend_timeline_read(struct file *file, char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	struct stl_snapshot *snap = file->private_data;
+
+	return simple_read_from_buffer(buf, count, ppos, snap->rec, snap->size);
+}
+
+static int suspend_timeline_release(struct inode *inode, struct file *file)
+{
+	vfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations suspend_timeline_fops = {
+	.owner = THIS_MODULE,
+	.open = suspend_timeline_open,
+	.read = suspend_timeline_read,
+	.release = suspend_timeline_release,
+};
+
+static int __init suspend_timeline_init(void)
+{
+	debugfs_create_file("suspend_timeline", S_IRUGO, NULL, NULL,
+			    &suspend_timeline_fops);
+	return 0;
+}
+
+late_initcall(suspend_timeline_init);
@@ -17,6 +17,7 @@
 #include <linux/platform_device.h>
 #include <linux/rtc.h>
 #include <linux/suspend.h>
+#include <linux/suspend_timeline.h>
 #include <linux/syscalls.h> /* sys_sync */
 #include <linux/wakelock.h>
 #ifdef CONFIG_WAKELOCK_STAT
@@ -40,6 +41,23 @@ module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 #define WAKE_LOCK_AUTO_EXPIRE            (1U << 10)
 #define WAKE_LOCK_PREVENTING_SUSPEND     (1U << 11)
 
+/* Skip sys_sync() on suspend attempts when nothing is dirty. The saved time
+ * is estimated from a running average of the full syncs that did run.
+ */
+static int sync_skip = 1;
+module_param_named(sync_skip, sync_skip, int, S_IRUGO | S_IWUSR | S_IWGRP);
+static unsigned int sync_full_count;
+module_param_named(sync_full_count, sync_full_count, uint, S_IRUGO);
+static unsigned int sync_short_count;
+module_param_named(sync_short_count, sync_short_count, uint, S_IRUGO);
+static unsigned int sync_skip_count;
+module_param_named(sync_skip_count, sync_skip_count, uint, S_IRUGO);
+static unsigned int sync_avg_us;
+module_param_named(sync_avg_us, sync_avg_us, uint, S_IRUGO);
+static unsigned int sync_saved_ms;
+module_param_named(sync_saved_ms, sync_saved_ms, uint, S_IRUGO);
+static unsigned int sync_saved_us_rem;
+
 static DEFINE_SPINLOCK(list_lock);
 static LIST_HEAD(inactive_locks);
 static struct list_head active_wake_locks[WAKE_LOCK_TYPE_COUNT];
@@ -259,10 +277,52 @@ long has_wake_lock(int type)
 	return ret;
 }
 
+static void suspend_sync_saved(void)
+{
+	sync_saved_us_rem += sync_avg_us;
+	sync_saved_ms += sync_saved_us_rem / USEC_PER_MSEC;
+	sync_saved_us_rem %= USEC_PER_MSEC;
+}
+
+static void suspend_sync(void)
+{
+	int dirty = sync_skip ? sync_dirty_state() : SYNC_DIRTY_DATA;
+	ktime_t start;
+	s64 elapsed;
+
+	if (dirty == SYNC_CLEAN) {
+		sync_skip_count++;
+		suspend_sync_saved();
+		if (debug_mask & DEBUG_SUSPEND)
+			pr_info("suspend: clean, skip sync\n");
+		return;
+	}
+
+	start = ktime_get();
+	if (dirty == SYNC_DIRTY_SUPERS) {
+		sync_supers();
+		sync_short_count++;
+		suspend_sync_saved();
+		suspend_timeline_end(STL_SYNC, start, sync_supers, 0);
+		return;
+	}
+
+	sys_sync();
+	elapsed = ktime_us_delta(ktime_get(), start);
+	sync_full_count++;
+	/* running average with a weight of 1/8 for the new sample */
+	if (sync_avg_us)
+		sync_avg_us = sync_avg_us - sync_avg_us / 8 + elapsed / 8;
+	else
+		sync_avg_us = elapsed;
+	suspend_timeline_end(STL_SYNC, start, sys_sync, 0);
+}
+
 static void suspend(struct work_struct *work)
 {
 	int ret;
 	int entry_event_num;
+	ktime_t start;
 
 	if (has_wake_lock(WAKE_LOCK_SUSPEND)) {
 		if (debug_mask & DEBUG_SUSPEND)
@@ -271,10 +331,13 @@ static void suspend(struct work_struct *work)
 	}
 
 	entry_event_num = current_event_num;
-	sys_sync();
+	suspend_timeline_begin();
+	suspend_sync();
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("suspend: enter suspend\n");
+	start = suspend_timeline_start();
 	ret = pm_suspend(requested_suspend_state);
+	suspend_timeline_end(STL_SUSPEND, start, NULL, ret);
 	if (debug_mask & DEBUG_EXIT_SUSPEND) {
 		struct timespec ts;
 		struct rtc_time tm;
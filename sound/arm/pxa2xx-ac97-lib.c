@@ -381,6 +381,8 @@ int __devinit pxa2xx_ac97_hw_probe(struct platform_device *dev)
 			dev_err(&dev->dev, "Invalid reset GPIO %d\n",
 				pdata->reset_gpio);
 		}
+		if (pdata->playback_buffer_kb)
+			pxa2xx_pcm_set_deep_buffer(pdata->playback_buffer_kb);
 	} else {
 		if (cpu_is_pxa27x())
 			reset_gpio = 113;
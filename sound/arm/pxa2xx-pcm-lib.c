@@ -6,6 +6,8 @@
 
 #include <linux/module.h>
 #include <linux/dma-mapping.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include <sound/core.h>
 #include <sound/pcm.h>
@@ -16,6 +18,37 @@
 
 #include "pxa2xx-pcm.h"
 
+/* largest burst aligned length a single descriptor can carry */
+#define PXA2XX_PCM_DESC_MAX	(8192 - 32)
+
+/*
+ * Every period needs at most one descriptor more than its length alone
+ * requires, so two pages cover periods_max periods of a deep buffer.
+ */
+#define PXA2XX_PCM_DESC_BYTES	(2 * PAGE_SIZE)
+#define PXA2XX_PCM_NR_DESC	(PXA2XX_PCM_DESC_BYTES / sizeof(pxa_dma_desc))
+#define PXA2XX_PCM_PERIODS_MAX	(PAGE_SIZE / sizeof(pxa_dma_desc))
+#define PXA2XX_PCM_DEEP_MAX	((PXA2XX_PCM_NR_DESC - PXA2XX_PCM_PERIODS_MAX \
+				  - 1) * PXA2XX_PCM_DESC_MAX)
+
+/*
+ * Playback buffer size, which bounds the longest deep-buffer period. The
+ * buffers come from the consistent DMA pool the frame buffer uses too, so
+ * only boards or users that want deep buffers ask for more than the
+ * default.
+ */
+static int deep_buffer_kb;
+module_param(deep_buffer_kb, int, S_IRUGO);
+MODULE_PARM_DESC(deep_buffer_kb, "Playback DMA buffer size in KiB "
+		 "(default 0: 128 KiB)");
+
+/* board opt-in, from the AC97 platform data; the parameter wins */
+void pxa2xx_pcm_set_deep_buffer(int kb)
+{
+	if (!deep_buffer_kb)
+		deep_buffer_kb = kb;
+}
+
 static const struct snd_pcm_hardware pxa2xx_pcm_hardware = {
 	.info			= SNDRV_PCM_INFO_MMAP |
 				  SNDRV_PCM_INFO_MMAP_VALID |
@@ -26,13 +59,49 @@ static const struct snd_pcm_hardware pxa2xx_pcm_hardware = {
 					SNDRV_PCM_FMTBIT_S24_LE |
 					SNDRV_PCM_FMTBIT_S32_LE,
 	.period_bytes_min	= 32,
-	.period_bytes_max	= 8192 - 32,
+	.period_bytes_max	= 128 * 1024,
 	.periods_min		= 1,
-	.periods_max		= PAGE_SIZE/sizeof(pxa_dma_desc),
+	.periods_max		= PXA2XX_PCM_PERIODS_MAX,
 	.buffer_bytes_max	= 128 * 1024,
 	.fifo_size		= 32,
 };
 
+struct pxa2xx_pcm_mode_stats {
+	unsigned long irqs;
+	unsigned long run_jiffies;
+};
+
+static DEFINE_SPINLOCK(pxa2xx_pcm_stats_lock);
+static LIST_HEAD(pxa2xx_pcm_streams);
+static struct pxa2xx_pcm_mode_stats pxa2xx_pcm_stats[PXA2XX_PCM_MODES];
+
+static void pxa2xx_pcm_run_start(struct pxa2xx_runtime_data *rtd)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&pxa2xx_pcm_stats_lock, flags);
+	if (!rtd->running) {
+		rtd->running = 1;
+		rtd->irqs = 0;
+		rtd->run_start = jiffies;
+	}
+	spin_unlock_irqrestore(&pxa2xx_pcm_stats_lock, flags);
+}
+
+static void pxa2xx_pcm_run_stop(struct pxa2xx_runtime_data *rtd)
+{
+	struct pxa2xx_pcm_mode_stats *stats = &pxa2xx_pcm_stats[rtd->mode];
+	unsigned long flags;
+
+	spin_lock_irqsave(&pxa2xx_pcm_stats_lock, flags);
+	if (rtd->running) {
+		rtd->running = 0;
+		stats->irqs += rtd->irqs;
+		stats->run_jiffies += jiffies - rtd->run_start;
+	}
+	spin_unlock_irqrestore(&pxa2xx_pcm_stats_lock, flags);
+}
+
 int __pxa2xx_pcm_hw_params(struct snd_pcm_substream *substream,
 				struct snd_pcm_hw_params *params)
 {
@@ -40,30 +109,42 @@ int __pxa2xx_pcm_hw_params(struct snd_pcm_substream *substream,
 	struct pxa2xx_runtime_data *rtd = runtime->private_data;
 	size_t totsize = params_buffer_bytes(params);
 	size_t period = params_period_bytes(params);
+	size_t left, len;
 	pxa_dma_desc *dma_desc;
 	dma_addr_t dma_buff_phys, next_desc_phys;
 
 	snd_pcm_set_runtime_buffer(substream, &substream->dma_buffer);
 	runtime->dma_bytes = totsize;
 
+	rtd->mode = period > PXA2XX_PCM_DESC_MAX ?
+		PXA2XX_PCM_DEEP_BUFFER : PXA2XX_PCM_LOW_LATENCY;
+
 	dma_desc = rtd->dma_desc_array;
 	next_desc_phys = rtd->dma_desc_array_phys;
 	dma_buff_phys = runtime->dma_addr;
 	do {
-		next_desc_phys += sizeof(pxa_dma_desc);
-		dma_desc->ddadr = next_desc_phys;
-		if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK) {
-			dma_desc->dsadr = dma_buff_phys;
-			dma_desc->dtadr = rtd->params->dev_addr;
-		} else {
-			dma_desc->dsadr = rtd->params->dev_addr;
-			dma_desc->dtadr = dma_buff_phys;
-		}
 		if (period > totsize)
 			period = totsize;
-		dma_desc->dcmd = rtd->params->dcmd | period | DCMD_ENDIRQEN;
-		dma_desc++;
-		dma_buff_phys += period;
+		/* split the period, interrupting only on its last part */
+		for (left = period; left; left -= len) {
+			if (dma_desc - rtd->dma_desc_array >= PXA2XX_PCM_NR_DESC)
+				return -EINVAL;
+			len = min_t(size_t, left, PXA2XX_PCM_DESC_MAX);
+			next_desc_phys += sizeof(pxa_dma_desc);
+			dma_desc->ddadr = next_desc_phys;
+			if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK) {
+				dma_desc->dsadr = dma_buff_phys;
+				dma_desc->dtadr = rtd->params->dev_addr;
+			} else {
+				dma_desc->dsadr = rtd->params->dev_addr;
+				dma_desc->dtadr = dma_buff_phys;
+			}
+			dma_desc->dcmd = rtd->params->dcmd | len;
+			if (len == left)
+				dma_desc->dcmd |= DCMD_ENDIRQEN;
+			dma_desc++;
+			dma_buff_phys += len;
+		}
 	} while (totsize -= period);
 	dma_desc[-1].ddadr = rtd->dma_desc_array_phys;
 
@@ -90,6 +171,7 @@ int pxa2xx_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 
 	switch (cmd) {
 	case SNDRV_PCM_TRIGGER_START:
+		pxa2xx_pcm_run_start(prtd);
 		DDADR(prtd->dma_ch) = prtd->dma_desc_array_phys;
 		DCSR(prtd->dma_ch) = DCSR_RUN;
 		break;
@@ -98,12 +180,15 @@ int pxa2xx_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 	case SNDRV_PCM_TRIGGER_SUSPEND:
 	case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
 		DCSR(prtd->dma_ch) &= ~DCSR_RUN;
+		pxa2xx_pcm_run_stop(prtd);
 		break;
 
 	case SNDRV_PCM_TRIGGER_RESUME:
+		pxa2xx_pcm_run_start(prtd);
 		DCSR(prtd->dma_ch) |= DCSR_RUN;
 		break;
 	case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
+		pxa2xx_pcm_run_start(prtd);
 		DDADR(prtd->dma_ch) = prtd->dma_desc_array_phys;
 		DCSR(prtd->dma_ch) |= DCSR_RUN;
 		break;
@@ -158,6 +243,7 @@ void pxa2xx_pcm_dma_irq(int dma_ch, void *dev_id)
 	DCSR(dma_ch) = dcsr & ~DCSR_STOPIRQEN;
 
 	if (dcsr & DCSR_ENDINTR) {
+		rtd->irqs++;
 		snd_pcm_period_elapsed(substream);
 	} else {
 		printk(KERN_ERR "%s: DMA error on channel %d (DCSR=%#x)\n",
@@ -174,6 +260,10 @@ int __pxa2xx_pcm_open(struct snd_pcm_substream *substream)
 	int ret;
 
 	runtime->hw = pxa2xx_pcm_hardware;
+	if (substream->dma_buffer.bytes) {
+		runtime->hw.buffer_bytes_max = substream->dma_buffer.bytes;
+		runtime->hw.period_bytes_max = substream->dma_buffer.bytes;
+	}
 
 	/*
 	 * For mysterious reasons (and despite what the manual says)
@@ -200,11 +290,17 @@ int __pxa2xx_pcm_open(struct snd_pcm_substream *substream)
 	if (!rtd)
 		goto out;
 	rtd->dma_desc_array =
-		dma_alloc_writecombine(substream->pcm->card->dev, PAGE_SIZE,
+		dma_alloc_writecombine(substream->pcm->card->dev,
+				       PXA2XX_PCM_DESC_BYTES,
 				       &rtd->dma_desc_array_phys, GFP_KERNEL);
 	if (!rtd->dma_desc_array)
 		goto err1;
 
+	rtd->substream = substream;
+	spin_lock_irq(&pxa2xx_pcm_stats_lock);
+	list_add_tail(&rtd->list, &pxa2xx_pcm_streams);
+	spin_unlock_irq(&pxa2xx_pcm_stats_lock);
+
 	runtime->private_data = rtd;
 	return 0;
 
@@ -220,7 +316,13 @@ int __pxa2xx_pcm_close(struct snd_pcm_substream *substream)
 	struct snd_pcm_runtime *runtime = substream->runtime;
 	struct pxa2xx_runtime_data *rtd = runtime->private_data;
 
-	dma_free_writecombine(substream->pcm->card->dev, PAGE_SIZE,
+	pxa2xx_pcm_run_stop(rtd);
+	spin_lock_irq(&pxa2xx_pcm_stats_lock);
+	list_del(&rtd->list);
+	spin_unlock_irq(&pxa2xx_pcm_stats_lock);
+
+	dma_free_writecombine(substream->pcm->card->dev,
+			      PXA2XX_PCM_DESC_BYTES,
 			      rtd->dma_desc_array, rtd->dma_desc_array_phys);
 	kfree(rtd);
 	return 0;
@@ -243,11 +345,22 @@ int pxa2xx_pcm_preallocate_dma_buffer(struct snd_pcm *pcm, int stream)
 	struct snd_pcm_substream *substream = pcm->streams[stream].substream;
 	struct snd_dma_buffer *buf = &substream->dma_buffer;
 	size_t size = pxa2xx_pcm_hardware.buffer_bytes_max;
+
+	if (stream == SNDRV_PCM_STREAM_PLAYBACK && deep_buffer_kb > 0)
+		size = min_t(size_t, PAGE_ALIGN(deep_buffer_kb * 1024),
+			     PXA2XX_PCM_DEEP_MAX & PAGE_MASK);
+
 	buf->dev.type = SNDRV_DMA_TYPE_DEV;
 	buf->dev.dev = pcm->card->dev;
 	buf->private_data = NULL;
 	buf->area = dma_alloc_writecombine(pcm->card->dev, size,
 					   &buf->addr, GFP_KERNEL);
+	if (!buf->area && size > pxa2xx_pcm_hardware.buffer_bytes_max) {
+		/* a deep buffer is not worth losing the PCM over */
+		size = pxa2xx_pcm_hardware.buffer_bytes_max;
+		buf->area = dma_alloc_writecombine(pcm->card->dev, size,
+						   &buf->addr, GFP_KERNEL);
+	}
 	if (!buf->area)
 		return -ENOMEM;
 	buf->bytes = size;
@@ -275,6 +388,88 @@ void pxa2xx_pcm_free_dma_buffers(struct snd_pcm *pcm)
 }
 EXPORT_SYMBOL(pxa2xx_pcm_free_dma_buffers);
 
+#ifdef CONFIG_DEBUG_FS
+static const char *pxa2xx_pcm_mode_names[PXA2XX_PCM_MODES] = {
+	[PXA2XX_PCM_LOW_LATENCY]	= "low-latency",
+	[PXA2XX_PCM_DEEP_BUFFER]	= "deep-buffer",
+};
+
+static void pxa2xx_pcm_show_rate(struct seq_file *s, unsigned long irqs,
+				 unsigned long run)
+{
+	unsigned long rate = run ? irqs * HZ * 10 / run : 0;
+
+	seq_printf(s, "%10lu %8lu %7lu.%lu\n", irqs, run / HZ,
+		   rate / 10, rate % 10);
+}
+
+static int pxa2xx_pcm_stats_show(struct seq_file *s, void *data)
+{
+	struct pxa2xx_pcm_mode_stats total[PXA2XX_PCM_MODES];
+	struct pxa2xx_runtime_data *rtd;
+	unsigned long now = jiffies;
+	int i;
+
+	spin_lock_irq(&pxa2xx_pcm_stats_lock);
+	memcpy(total, pxa2xx_pcm_stats, sizeof(total));
+
+	seq_printf(s, "%-24s %-11s %8s %10s %8s %9s\n", "stream", "mode",
+		   "period", "irqs", "seconds", "wakeups/s");
+	list_for_each_entry(rtd, &pxa2xx_pcm_streams, list) {
+		struct snd_pcm_runtime *runtime = rtd->substream->runtime;
+
+		if (!rtd->running)
+			continue;
+		total[rtd->mode].irqs += rtd->irqs;
+		total[rtd->mode].run_jiffies += now - rtd->run_start;
+
+		seq_printf(s, "%-24s %-11s %8u ",
+			   rtd->params ? rtd->params->name : "-",
+			   pxa2xx_pcm_mode_names[rtd->mode],
+			   (unsigned int)frames_to_bytes(runtime,
+							 runtime->period_size));
+		pxa2xx_pcm_show_rate(s, rtd->irqs, now - rtd->run_start);
+	}
+	spin_unlock_irq(&pxa2xx_pcm_stats_lock);
+
+	for (i = 0; i < PXA2XX_PCM_MODES; i++) {
+		seq_printf(s, "%-24s %-11s %8s ", "total",
+			   pxa2xx_pcm_mode_names[i], "-");
+		pxa2xx_pcm_show_rate(s, total[i].irqs, total[i].run_jiffies);
+	}
+	return 0;
+}
+
+static int pxa2xx_pcm_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pxa2xx_pcm_stats_show, NULL);
+}
+
+static const struct file_operations pxa2xx_pcm_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= pxa2xx_pcm_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static struct dentry *pxa2xx_pcm_debugfs;
+
+static int __init pxa2xx_pcm_lib_init(void)
+{
+	pxa2xx_pcm_debugfs = debugfs_create_file("pxa2xx-pcm", S_IRUGO, NULL,
+						 NULL, &pxa2xx_pcm_stats_fops);
+	return 0;
+}
+module_init(pxa2xx_pcm_lib_init);
+
+static void __exit pxa2xx_pcm_lib_exit(void)
+{
+	debugfs_remove(pxa2xx_pcm_debugfs);
+}
+module_exit(pxa2xx_pcm_lib_exit);
+#endif
+
 MODULE_AUTHOR("Nicolas Pitre");
 MODULE_DESCRIPTION("Intel PXA2xx sound library");
 MODULE_LICENSE("GPL");
@@ -11,11 +11,31 @@
  */
 #include <mach/dma.h>
 
+/*
+ * Low-latency streams use one descriptor per period, each raising an
+ * interrupt. Deep-buffer streams have periods longer than a descriptor
+ * can carry; they are chained over several descriptors and interrupt
+ * only at the end of each period.
+ */
+enum {
+	PXA2XX_PCM_LOW_LATENCY,
+	PXA2XX_PCM_DEEP_BUFFER,
+	PXA2XX_PCM_MODES
+};
+
 struct pxa2xx_runtime_data {
 	int dma_ch;
 	struct pxa2xx_pcm_dma_params *params;
 	pxa_dma_desc *dma_desc_array;
 	dma_addr_t dma_desc_array_phys;
+
+	/* wakeup accounting */
+	struct snd_pcm_substream *substream;
+	struct list_head list;
+	int mode;
+	int running;
+	unsigned long irqs;
+	unsigned long run_start;
 };
 
 struct pxa2xx_pcm_client {
@@ -629,16 +629,38 @@ static int wm9713_add_widgets(struct snd_soc_codec *codec)
 	return 0;
 }
 
+/*
+ * Registers that must be read back from the codec. The touch driver shares
+ * the extended modem power register, the GPIO block and the digitiser
+ * registers over its own AC97 path, and the PLL register is paged.
+ */
+static int wm9713_volatile_register(unsigned int reg)
+{
+	switch (reg) {
+	case AC97_RESET:
+	case AC97_CD:
+	case AC97_EXTENDED_MID:
+	case AC97_LINE1_LEVEL:
+	case AC97_GPIO_CFG ... AC97_MISC_AFE:
+	case 0x5a:
+	case 0x74 ... 0x7a:		/* digitiser */
+	case AC97_VENDOR_ID1:
+	case AC97_VENDOR_ID2:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
 static unsigned int ac97_read(struct snd_soc_codec *codec,
 	unsigned int reg)
 {
 	u16 *cache = codec->reg_cache;
 
-	if (reg == AC97_RESET || reg == AC97_GPIO_STATUS ||
-		reg == AC97_VENDOR_ID1 || reg == AC97_VENDOR_ID2 ||
-		reg == AC97_CD)
+	if (wm9713_volatile_register(reg)) {
+		codec->hw_io++;
 		return soc_ac97_ops.read(codec->ac97, reg);
-	else {
+	} else {
 		reg = reg >> 1;
 
 		if (reg >= (ARRAY_SIZE(wm9713_reg)))
@@ -652,8 +674,11 @@ static int ac97_write(struct snd_soc_codec *codec, unsigned int reg,
 	unsigned int val)
 {
 	u16 *cache = codec->reg_cache;
-	if (reg < 0x7c)
+
+	if (reg < 0x7c) {
+		codec->hw_io++;
 		soc_ac97_ops.write(codec->ac97, reg, val);
+	}
 	reg = reg >> 1;
 	if (reg < (ARRAY_SIZE(wm9713_reg)))
 		cache[reg] = val;
@@ -1133,6 +1158,15 @@ static int wm9713_soc_suspend(struct platform_device *pdev,
 	struct snd_soc_codec *codec = socdev->card->codec;
 	u16 reg;
 
+	/* An analogue path that ignores suspend (e.g. a voice call) is
+	 * still powered: only take the AC-link down, the warm reset on
+	 * resume brings it back. */
+	if (codec->bias_level == SND_SOC_BIAS_ON) {
+		reg = ac97_read(codec, AC97_POWERDOWN);
+		ac97_write(codec, AC97_POWERDOWN, reg | 0x1000);
+		return 0;
+	}
+
 	/* Disable everything except touchpanel - that will be handled
 	 * by the touch driver and left disabled if touch is not in
 	 * use. */
@@ -1171,6 +1205,7 @@ static int wm9713_soc_resume(struct platform_device *pdev)
 			if (i == AC97_POWERDOWN || i == AC97_EXTENDED_MID ||
 				i == AC97_EXTENDED_MSTATUS || i > 0x66)
 				continue;
+			codec->hw_io++;
 			soc_ac97_ops.write(codec->ac97, i, cache[i>>1]);
 		}
 	}
@@ -1216,6 +1251,7 @@ static int wm9713_soc_probe(struct platform_device *pdev)
 	codec->num_dai = ARRAY_SIZE(wm9713_dai);
 	codec->write = ac97_write;
 	codec->read = ac97_read;
+	codec->volatile_register = wm9713_volatile_register;
 	codec->set_bias_level = wm9713_set_bias_level;
 	INIT_LIST_HEAD(&codec->dapm_widgets);
 	INIT_LIST_HEAD(&codec->dapm_paths);
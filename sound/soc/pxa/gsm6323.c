@@ -56,6 +56,48 @@ static const struct snd_soc_dapm_route audio_map[] = {
 };
 
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 35)
+/*
+ * Call audio: the GSM module and the codec analogue paths between these
+ * pins stay powered over suspend, while the AC97 link and DMA go down.
+ */
+static const char *gsm6323_call_pins[] = {
+	"Front Speaker", "GSM Line In",
+	"MIC1", "MIC2A", "MIC2B", "LINEL", "LINER", "MONOIN",
+};
+
+static int gsm6323_call_audio;
+
+static int gsm6323_get_call_audio(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_value *ucontrol)
+{
+	ucontrol->value.integer.value[0] = gsm6323_call_audio;
+	return 0;
+}
+
+static int gsm6323_set_call_audio(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_value *ucontrol)
+{
+	struct snd_soc_codec *codec = snd_kcontrol_chip(kcontrol);
+	int on = !!ucontrol->value.integer.value[0];
+	int i;
+
+	if (on == gsm6323_call_audio)
+		return 0;
+
+	mutex_lock(&codec->mutex);
+	for (i = 0; i < ARRAY_SIZE(gsm6323_call_pins); i++)
+		snd_soc_dapm_ignore_suspend(codec, gsm6323_call_pins[i], on);
+	gsm6323_call_audio = on;
+	mutex_unlock(&codec->mutex);
+
+	return 1;
+}
+
+static const struct snd_kcontrol_new gsm6323_controls[] = {
+	SOC_SINGLE_BOOL_EXT("Call Audio Over Suspend", 0,
+		gsm6323_get_call_audio, gsm6323_set_call_audio),
+};
+
 static int gsm6323_wm9713_init(struct snd_soc_codec *codec)
 {
 	/* Add gsm6323 specific widgets */
@@ -64,6 +106,8 @@ static int gsm6323_wm9713_init(struct snd_soc_codec *codec)
 	/* Set up gsm6323 specific audio path audio_mapnects */
 	snd_soc_dapm_add_routes(codec, ARRAY_AND_SIZE(audio_map));
 
+	snd_soc_add_controls(codec, ARRAY_AND_SIZE(gsm6323_controls));
+
 	snd_soc_dapm_enable_pin(codec, "Front Speaker");
 	snd_soc_dapm_enable_pin(codec, "GSM Line In");
 	snd_soc_dapm_sync(codec);
@@ -671,6 +671,7 @@ static int soc_suspend(struct device *dev)
 	/* close any waiting streams and save state */
 	run_delayed_work(&card->delayed_work);
 	codec->suspend_bias_level = codec->bias_level;
+	codec->suspended = 1;
 
 	for (i = 0; i < codec->num_dai; i++) {
 		char *stream = codec->dai[i].playback.stream_name;
@@ -731,6 +732,7 @@ static void soc_resume_deferred(struct work_struct *work)
 	if (codec_dev->resume)
 		codec_dev->resume(pdev);
 
+	codec->suspended = 0;
 	for (i = 0; i < codec->num_dai; i++) {
 		char *stream = codec->dai[i].playback.stream_name;
 		if (stream != NULL)
@@ -1282,10 +1284,27 @@ static void soc_init_codec_debugfs(struct snd_soc_codec *codec)
 		       "Failed to create DAPM debugfs directory\n");
 
 	snd_soc_dapm_debugfs_init(codec);
+
+	codec->debugfs_io = debugfs_create_dir("codec_io", debugfs_root);
+	if (!codec->debugfs_io) {
+		printk(KERN_WARNING
+		       "Failed to create codec IO debugfs directory\n");
+		return;
+	}
+
+	debugfs_create_u32("transactions", 0644, codec->debugfs_io,
+			   &codec->hw_io);
+	debugfs_create_u32("dapm_syncs", 0644, codec->debugfs_io,
+			   &codec->dapm_syncs);
+	debugfs_create_u32("dapm_sync_last", 0644, codec->debugfs_io,
+			   &codec->dapm_sync_io);
+	debugfs_create_u32("dapm_sync_max", 0644, codec->debugfs_io,
+			   &codec->dapm_sync_io_max);
 }
 
 static void soc_cleanup_codec_debugfs(struct snd_soc_codec *codec)
 {
+	debugfs_remove_recursive(codec->debugfs_io);
 	debugfs_remove_recursive(codec->debugfs_dapm);
 	debugfs_remove(codec->debugfs_pop_time);
 	debugfs_remove(codec->debugfs_reg);
@@ -496,6 +496,15 @@ static inline void dapm_clear_walk(struct snd_soc_codec *codec)
 		p->walked = 0;
 }
 
+/*
+ * While the codec is suspended only endpoints marked with ignore_suspend
+ * count as connected, so just the paths between them keep their power.
+ */
+static int dapm_suspend_check(struct snd_soc_dapm_widget *widget)
+{
+	return !widget->codec->suspended || widget->ignore_suspend;
+}
+
 /*
  * Recursively check for a completed path to an active or physically connected
  * output widget. Returns number of complete paths.
@@ -512,7 +521,7 @@ static int is_connected_output_ep(struct snd_soc_dapm_widget *widget)
 	case snd_soc_dapm_adc:
 	case snd_soc_dapm_aif_out:
 		if (widget->active)
-			return 1;
+			return dapm_suspend_check(widget);
 	default:
 		break;
 	}
@@ -520,12 +529,12 @@ static int is_connected_output_ep(struct snd_soc_dapm_widget *widget)
 	if (widget->connected) {
 		/* connected pin ? */
 		if (widget->id == snd_soc_dapm_output && !widget->ext)
-			return 1;
+			return dapm_suspend_check(widget);
 
 		/* connected jack or spk ? */
 		if (widget->id == snd_soc_dapm_hp || widget->id == snd_soc_dapm_spk ||
 		    (widget->id == snd_soc_dapm_line && !list_empty(&widget->sources)))
-			return 1;
+			return dapm_suspend_check(widget);
 	}
 
 	list_for_each_entry(path, &widget->sinks, list_source) {
@@ -558,7 +567,7 @@ static int is_connected_input_ep(struct snd_soc_dapm_widget *widget)
 	case snd_soc_dapm_dac:
 	case snd_soc_dapm_aif_in:
 		if (widget->active)
-			return 1;
+			return dapm_suspend_check(widget);
 	default:
 		break;
 	}
@@ -566,16 +575,16 @@ static int is_connected_input_ep(struct snd_soc_dapm_widget *widget)
 	if (widget->connected) {
 		/* connected pin ? */
 		if (widget->id == snd_soc_dapm_input && !widget->ext)
-			return 1;
+			return dapm_suspend_check(widget);
 
 		/* connected VMID/Bias for lower pops */
 		if (widget->id == snd_soc_dapm_vmid)
-			return 1;
+			return dapm_suspend_check(widget);
 
 		/* connected jack ? */
 		if (widget->id == snd_soc_dapm_mic ||
 		    (widget->id == snd_soc_dapm_line && !list_empty(&widget->sinks)))
-			return 1;
+			return dapm_suspend_check(widget);
 	}
 
 	list_for_each_entry(path, &widget->sources, list_sink) {
@@ -956,6 +965,7 @@ static int dapm_power_widgets(struct snd_soc_codec *codec, int event)
 	int ret = 0;
 	int power;
 	int sys_power = 0;
+	u32 hw_io = codec->hw_io;
 
 	/* Check which widgets we need to power and store them in
 	 * lists indicating if they should be powered up or down.
@@ -973,11 +983,13 @@ static int dapm_power_widgets(struct snd_soc_codec *codec, int event)
 			if (!w->power_check)
 				continue;
 
-			/* If we're suspending then pull down all the 
-			 * power. */
+			/* If we're suspending then pull down all the
+			 * power, except on paths that ignore suspend. */
 			switch (event) {
 			case SND_SOC_DAPM_STREAM_SUSPEND:
-				power = 0;
+				power = codec->suspended && w->power_check(w);
+				if (power)
+					sys_power = 1;
 				break;
 
 			default:
@@ -1051,6 +1063,14 @@ static int dapm_power_widgets(struct snd_soc_codec *codec, int event)
 			pr_err("Failed to apply active bias: %d\n", ret);
 	}
 
+	/* Account the bus transactions this sequence cost; only codecs
+	 * that count hw_io report anything here.
+	 */
+	codec->dapm_syncs++;
+	codec->dapm_sync_io = codec->hw_io - hw_io;
+	if (codec->dapm_sync_io > codec->dapm_sync_io_max)
+		codec->dapm_sync_io_max = codec->dapm_sync_io;
+
 	pop_dbg(codec->pop_time, "DAPM sequencing finished, waiting %dms\n",
 		codec->pop_time);
 
@@ -2167,6 +2187,35 @@ int snd_soc_dapm_get_pin_status(struct snd_soc_codec *codec, const char *pin)
 }
 EXPORT_SYMBOL_GPL(snd_soc_dapm_get_pin_status);
 
+/**
+ * snd_soc_dapm_ignore_suspend - keep a pin powered over suspend
+ * @codec: audio codec
+ * @pin: audio signal pin endpoint (or start point)
+ * @ignore: 1 to keep paths through the pin powered, 0 for normal suspend
+ *
+ * Paths with both ends on pins that ignore suspend stay powered while
+ * the system is suspended, e.g. an analogue bypass for a voice call.
+ * The codec is then left with its bias on.
+ *
+ * Returns 0 on success, -EINVAL if the pin does not exist.
+ */
+int snd_soc_dapm_ignore_suspend(struct snd_soc_codec *codec, const char *pin,
+				int ignore)
+{
+	struct snd_soc_dapm_widget *w;
+
+	list_for_each_entry(w, &codec->dapm_widgets, list) {
+		if (!strcmp(w->name, pin)) {
+			w->ignore_suspend = !!ignore;
+			return 0;
+		}
+	}
+
+	pr_err("dapm: %s: unknown pin %s\n", codec->name, pin);
+	return -EINVAL;
+}
+EXPORT_SYMBOL_GPL(snd_soc_dapm_ignore_suspend);
+
 /**
  * snd_soc_dapm_free - free dapm resources
  * @socdev: SoC device